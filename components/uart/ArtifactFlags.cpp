@@ -0,0 +1,60 @@
+/*
+ * ArtifactFlags.cpp
+ *
+ * Per sample rail, step and lead-off flags, see ArtifactFlags.h
+ */
+
+#include <string.h>
+#include "ArtifactFlags.h"
+#include "LeadOff.h"
+
+#define ARTIFACT_RAIL_LEVEL (0x7fffff - ARTIFACT_RAIL_MARGIN)
+
+ArtifactFlags::ArtifactFlags()
+    : step(0), samples(0), numChannels(0), leadoffMask(0), haveLast(false)
+{
+    memset(last, 0, sizeof(last));
+}
+
+void ArtifactFlags::configure(uint8_t num_channels, uint8_t leadoff_mask, int32_t step_codes)
+{
+    numChannels = (num_channels > ARTIFACT_MAX_CHANNELS) ? ARTIFACT_MAX_CHANNELS : num_channels;
+    leadoffMask = leadoff_mask;
+    step = (step_codes > 0) ? step_codes : 0xffffffff;
+    samples = 0;
+    haveLast = false;
+}
+
+static inline int32_t code_at(const uint8_t *p)
+{
+    return ((int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8))) >> 8;
+}
+
+uint16_t ArtifactFlags::process(const uint8_t *frame)
+{
+    const uint8_t *p = &frame[ADS_STATUS_SZ];
+    if (!haveLast) // no step into the first sample
+    {
+        for (uint8_t ch = 0; ch < numChannels; ch++)
+            last[ch] = code_at(&p[3 * ch]);
+        haveLast = true;
+    }
+    uint16_t channels = 0;
+    uint8_t kinds = 0;
+    for (uint8_t ch = 0; ch < numChannels; ch++, p += 3)
+    {
+        const int32_t v = code_at(p);
+        const uint32_t mag = (v < 0) ? ~(uint32_t)v : (uint32_t)v; // -2^23 maps onto 2^23 - 1
+        const uint32_t jump = (v > last[ch]) ? (uint32_t)(v - last[ch]) : (uint32_t)(last[ch] - v);
+        last[ch] = v;
+        const uint8_t rail = mag >= ARTIFACT_RAIL_LEVEL;
+        const uint8_t moved = jump > step;
+        kinds |= rail | (moved << 1);
+        channels |= (uint16_t)(rail | moved) << ch;
+    }
+    if ((status_loff_statp(frame) | status_loff_statn(frame)) & leadoffMask)
+        kinds |= ARTIFACT_LEADOFF;
+    if (kinds)
+        samples++;
+    return (uint16_t)(channels << 8) | kinds;
+}
@@ -0,0 +1,53 @@
+/*
+ * ArtifactFlags.h
+ *
+ * Per sample quality flags for the sample frames ("artifacts 1"), so the
+ * host can skip or mark bad stretches without scanning the data again:
+ *
+ *   bits 0..7   ARTIFACT_* kinds found in this sample
+ *   bits 8..15  ADS channels (bit 0 = channel 1, as in LOFF_STATP) with
+ *               a rail or step flag
+ *
+ * The flags look at the raw codes, ahead of the montage: a rail is a
+ * property of an ADC input, and a derivation can hide it. With a montage
+ * the channel bits are therefore not the frame channels; the montage
+ * report lists the ADS inputs of every output.
+ *
+ * process() is one pass over the channel codes of an RDATAC frame: per
+ * channel a 24 bit load, a compare against the rails and one against
+ * the step threshold (|code - last code|). Lead-off comes from the
+ * status word, limited to the channels that are streamed.
+ *
+ * No ESP-IDF dependencies.
+ */
+
+#ifndef _ARTIFACT_FLAGS_H
+#define _ARTIFACT_FLAGS_H
+
+#include <stdint.h>
+
+#define ARTIFACT_MAX_CHANNELS 8
+#define ARTIFACT_RAIL 0x01    // a channel within ARTIFACT_RAIL_MARGIN codes of +-2^23
+#define ARTIFACT_STEP 0x02    // a channel moved more than the step threshold
+#define ARTIFACT_LEADOFF 0x04 // a LOFF_STATP/N bit set for a streamed channel
+#define ARTIFACT_RAIL_MARGIN 64
+#define ARTIFACT_DEFAULT_STEP (1 << 20) // codes
+
+class ArtifactFlags
+{
+public:
+    ArtifactFlags();
+    void configure(uint8_t num_channels, uint8_t leadoff_mask, int32_t step); // step 0 = no step flags
+    uint16_t process(const uint8_t *frame); // RDATAC frame: status + channels
+    uint32_t flagged() const { return samples; } // samples with any flag since configure()
+
+private:
+    int32_t last[ARTIFACT_MAX_CHANNELS];
+    uint32_t step;
+    uint32_t samples;
+    uint8_t numChannels;
+    uint8_t leadoffMask;
+    bool haveLast;
+};
+
+#endif // _ARTIFACT_FLAGS_H
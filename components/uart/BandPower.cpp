@@ -0,0 +1,199 @@
+/*
+ * BandPower.cpp
+ *
+ * Sliding window FFT band powers, see BandPower.h
+ */
+
+#include <string.h>
+#include <math.h>
+#include "BandPower.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define BP_TWIDDLE_SHIFT 30
+#define BP_HEADROOM_BITS 29 // block scaling target, keeps butterflies in range
+
+// delta, theta, alpha, beta, gamma
+const float BandPower::band_edges[BP_NUM_BANDS + 1] = {1.0f, 4.0f, 8.0f, 13.0f, 30.0f, 45.0f};
+
+BandPower::BandPower()
+    : writePos(0), hop(BP_WINDOW), sinceLast(0), filled(0), readyEnd(0), readySample(0),
+      numChannels(0), scale(0.0f)
+{
+    double s2 = 0.0;
+    for (int n = 0; n < BP_WINDOW; n++)
+    {
+        double w = 0.5 - 0.5 * cos(2 * M_PI * n / BP_WINDOW); // periodic Hann
+        hann[n] = (int16_t)lround(w * 32767.0);
+        s2 += (hann[n] / 32767.0) * (hann[n] / 32767.0);
+    }
+    scale = (float)(2.0 / (BP_WINDOW * s2));
+    for (int k = 0; k < BP_WINDOW / 2; k++)
+    {
+        twiddleCos[k] = (int32_t)lround(cos(2 * M_PI * k / BP_WINDOW) * (1L << BP_TWIDDLE_SHIFT));
+        twiddleSin[k] = (int32_t)lround(sin(2 * M_PI * k / BP_WINDOW) * (1L << BP_TWIDDLE_SHIFT));
+    }
+    memset(binLo, 0, sizeof(binLo));
+    memset(binHi, 0, sizeof(binHi));
+}
+
+/**
+ * Set up for a new stream. A window of BP_WINDOW samples becomes due every
+ * hop samples once the ring is filled; a hop longer than the window leaves
+ * the samples in between out. Bands above Nyquist stay empty.
+ */
+void BandPower::configure(int sample_rate, uint16_t hop_samples, uint8_t num_channels)
+{
+    numChannels = (num_channels > BP_MAX_CHANNELS) ? BP_MAX_CHANNELS : num_channels;
+    hop = (hop_samples < 1) ? 1 : hop_samples;
+    writePos = 0;
+    sinceLast = 0;
+    filled = 0;
+    for (int b = 0; b < BP_NUM_BANDS; b++)
+    {
+        int lo = 0, hi = 0;
+        if (sample_rate > 0)
+        {
+            lo = (int)ceil(band_edges[b] * BP_WINDOW / sample_rate);
+            hi = (int)ceil(band_edges[b + 1] * BP_WINDOW / sample_rate);
+        }
+        if (lo < 1)
+            lo = 1; // never DC
+        if (hi > BP_WINDOW / 2)
+            hi = BP_WINDOW / 2;
+        binLo[b] = lo;
+        binHi[b] = (hi > lo) ? hi : lo;
+    }
+}
+
+/**
+ * Store one frame of (processed) channel data. Cheap enough for the
+ * acquisition task, returns true when the consumer should run compute().
+ */
+bool BandPower::push(const int32_t *samples, uint32_t sample_number)
+{
+    for (uint8_t ch = 0; ch < numChannels; ch++)
+        ring[ch][writePos] = samples[ch];
+    if (++writePos == BP_RING)
+        writePos = 0;
+    if (filled < BP_WINDOW)
+        filled++;
+    if (++sinceLast < hop || filled < BP_WINDOW)
+        return false;
+    sinceLast = 0;
+    readySample = sample_number;
+    readyEnd = writePos;
+    return true;
+}
+
+/**
+ * In place radix-2 DIT FFT, every stage scales down by 2 so the result is
+ * X[k] / N. Inputs must stay below 2^BP_HEADROOM_BITS.
+ */
+void BandPower::fft(int32_t *re, int32_t *im)
+{
+    for (int i = 0, j = 0; i < BP_WINDOW; i++)
+    {
+        if (i < j)
+        {
+            int32_t t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+        int bit = BP_WINDOW >> 1;
+        while (j & bit)
+        {
+            j ^= bit;
+            bit >>= 1;
+        }
+        j |= bit;
+    }
+
+    for (int len = 2; len <= BP_WINDOW; len <<= 1)
+    {
+        const int half = len >> 1;
+        const int step = BP_WINDOW / len;
+        for (int i = 0; i < BP_WINDOW; i += len)
+        {
+            for (int j = 0; j < half; j++)
+            {
+                const int64_t wr = twiddleCos[j * step];
+                const int64_t wi = -twiddleSin[j * step];
+                int32_t *ar = &re[i + j], *ai = &im[i + j];
+                int32_t *br = &re[i + j + half], *bi = &im[i + j + half];
+                int32_t tr = (int32_t)((*br * wr - *bi * wi) >> BP_TWIDDLE_SHIFT);
+                int32_t ti = (int32_t)((*br * wi + *bi * wr) >> BP_TWIDDLE_SHIFT);
+                *br = (*ar - tr) >> 1;
+                *bi = (*ai - ti) >> 1;
+                *ar = (*ar + tr) >> 1;
+                *ai = (*ai + ti) >> 1;
+            }
+        }
+    }
+}
+
+/**
+ * Band powers of the window that push() announced last. The ring keeps a
+ * full window of slack, so the producer may carry on meanwhile.
+ */
+uint32_t BandPower::compute(float *powers)
+{
+    int32_t re[BP_WINDOW], im[BP_WINDOW];
+    const uint16_t end = readyEnd;
+    const uint32_t sample_number = readySample;
+    const uint16_t start = (end + BP_RING - BP_WINDOW) % BP_RING;
+
+    for (uint8_t ch = 0; ch < numChannels; ch++)
+    {
+        int64_t sum = 0;
+        for (int n = 0; n < BP_WINDOW; n++)
+        {
+            re[n] = ring[ch][(start + n) % BP_RING];
+            sum += re[n];
+        }
+        const int32_t mean = (int32_t)(sum / BP_WINDOW);
+
+        uint32_t max_abs = 0;
+        for (int n = 0; n < BP_WINDOW; n++)
+        {
+            re[n] = (int32_t)(((int64_t)(re[n] - mean) * hann[n]) >> 15);
+            im[n] = 0;
+            uint32_t a = (re[n] < 0) ? -re[n] : re[n];
+            if (a > max_abs)
+                max_abs = a;
+        }
+
+        // block scaling: bring the largest value just below the headroom
+        int shift = 0;
+        if (max_abs > 0)
+        {
+            while ((max_abs << shift) < (1UL << (BP_HEADROOM_BITS - 1)))
+                shift++;
+            while (shift > 0 && (max_abs << shift) >= (1UL << BP_HEADROOM_BITS))
+                shift--;
+            for (int n = 0; n < BP_WINDOW; n++)
+                re[n] <<= shift;
+        }
+
+        fft(re, im);
+
+        // X_true = X * N / 2^shift
+        const float norm = scale * ldexpf((float)BP_WINDOW * BP_WINDOW, -2 * shift);
+        for (int b = 0; b < BP_NUM_BANDS; b++)
+        {
+            float p = 0.0f;
+            for (int k = binLo[b]; k < binHi[b]; k++)
+            {
+                float xr = (float)re[k], xi = (float)im[k];
+                p += xr * xr + xi * xi;
+            }
+            powers[ch * BP_NUM_BANDS + b] = p * norm;
+        }
+    }
+    return sample_number;
+}
@@ -0,0 +1,64 @@
+/*
+ * BandPower.h
+ *
+ * Sliding window band power estimation (delta/theta/alpha/beta/gamma) for
+ * all active channels. The acquisition side only pushes samples into a
+ * ring buffer, the FFT work is done by compute(), which is meant to run
+ * in a task on the other core.
+ *
+ * Each window gets its mean removed, a Hann window and block scaling, then
+ * a radix-2 fixed-point FFT (int32 data, Q30 twiddles, 1 bit down scaling
+ * per stage). Band powers are the one sided PSD integrated over the band,
+ * in ADC codes^2.
+ *
+ * Frequency resolution is stream rate / BP_WINDOW, so for the EEG bands
+ * the stream should be decimated to 500 SPS or less.
+ *
+ * No ESP-IDF dependencies, the module builds on a host as well.
+ */
+
+#ifndef _BAND_POWER_H
+#define _BAND_POWER_H
+
+#include <stdint.h>
+
+#define BP_WINDOW 256 // FFT length, power of 2
+#define BP_LOG2_WINDOW 8
+#define BP_RING (2 * BP_WINDOW) // one window of slack for the consumer
+#define BP_MAX_CHANNELS 8
+#define BP_NUM_BANDS 5
+
+class BandPower
+{
+public:
+    BandPower();
+    void configure(int sample_rate, uint16_t hop, uint8_t num_channels); // a window every hop samples
+    bool push(const int32_t *samples, uint32_t sample_number); // true when a window is due
+    uint32_t compute(float *powers); // powers[ch * BP_NUM_BANDS + band], returns window end sample #
+    uint8_t channels() const { return numChannels; }
+    uint16_t hopSamples() const { return hop; }
+
+    static const float band_edges[BP_NUM_BANDS + 1]; // Hz
+
+private:
+    void fft(int32_t *re, int32_t *im);
+
+    int32_t ring[BP_MAX_CHANNELS][BP_RING];
+    uint16_t writePos;
+    uint16_t hop;
+    uint16_t sinceLast;
+    uint16_t filled;
+    volatile uint16_t readyEnd;    // ring position one past the due window
+    volatile uint32_t readySample; // sample number of its last sample
+    uint8_t numChannels;
+
+    uint16_t binLo[BP_NUM_BANDS]; // first FFT bin of each band
+    uint16_t binHi[BP_NUM_BANDS]; // one past the last bin
+    float scale;                  // 2 / (N * sum(w^2))
+
+    int16_t hann[BP_WINDOW];          // Q15
+    int32_t twiddleCos[BP_WINDOW / 2]; // Q30
+    int32_t twiddleSin[BP_WINDOW / 2];
+};
+
+#endif // _BAND_POWER_H
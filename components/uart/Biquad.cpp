@@ -0,0 +1,151 @@
+/*
+ * Biquad.cpp
+ *
+ * Fixed-point IIR filter bank, see Biquad.h
+ */
+
+#include <string.h>
+#include <math.h>
+#include "Biquad.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static int32_t to_q30(double c)
+{
+    double v = c * (double)(1L << BIQUAD_COEFF_SHIFT);
+    if (v >= 2147483647.0)
+        return INT32_MAX;
+    if (v <= -2147483648.0)
+        return INT32_MIN;
+    return (int32_t)lround(v);
+}
+
+static inline int32_t sat32(int64_t v)
+{
+    if (v > INT32_MAX)
+        return INT32_MAX;
+    if (v < INT32_MIN)
+        return INT32_MIN;
+    return (int32_t)v;
+}
+
+BiquadBank::BiquadBank()
+    : numStages(0)
+{
+    reset();
+}
+
+void BiquadBank::clear()
+{
+    numStages = 0;
+    reset();
+}
+
+void BiquadBank::reset()
+{
+    memset(state, 0, sizeof(state));
+}
+
+/**
+ * Add a stage given as b[0..2] / a[0..2]. The coefficients get normalised
+ * by a[0] and must fit into [-2, 2) afterwards.
+ */
+bool BiquadBank::addStage(const double *b, const double *a)
+{
+    if (numStages >= BIQUAD_MAX_STAGES || a[0] == 0.0)
+        return false;
+    double n[5] = {b[0] / a[0], b[1] / a[0], b[2] / a[0], a[1] / a[0], a[2] / a[0]};
+    for (int i = 0; i < 5; i++)
+    {
+        if (n[i] >= 2.0 || n[i] < -2.0)
+            return false;
+    }
+    biquad_coeffs &c = coeffs[numStages];
+    c.b0 = to_q30(n[0]);
+    c.b1 = to_q30(n[1]);
+    c.b2 = to_q30(n[2]);
+    c.a1 = to_q30(n[3]);
+    c.a2 = to_q30(n[4]);
+    // what Q30 misses of the feedback, poles near z = 1 depend on it
+    c.a1_lo = to_q30((n[3] - c.a1 / (double)(1L << BIQUAD_COEFF_SHIFT)) * (double)(1L << BIQUAD_COEFF_SHIFT));
+    c.a2_lo = to_q30((n[4] - c.a2 / (double)(1L << BIQUAD_COEFF_SHIFT)) * (double)(1L << BIQUAD_COEFF_SHIFT));
+    // a zero at DC (high-pass) must survive the rounding, otherwise the
+    // tiny residual gets amplified by the poles close to z = 1
+    if (fabs(n[0] + n[1] + n[2]) < 1e-12)
+        c.b1 = -(c.b0 + c.b2);
+    memset(&state[numStages], 0, sizeof(stage_state));
+    numStages++;
+    return true;
+}
+
+bool BiquadBank::addNotch(double f0, double q, double fs)
+{
+    if (f0 <= 0.0 || f0 >= fs / 2)
+        return false;
+    double w0 = 2 * M_PI * f0 / fs;
+    double alpha = sin(w0) / (2 * q);
+    double b[3] = {1.0, -2 * cos(w0), 1.0};
+    double a[3] = {1 + alpha, -2 * cos(w0), 1 - alpha};
+    return addStage(b, a);
+}
+
+bool BiquadBank::addHighpass(double fc, double fs)
+{
+    if (fc <= 0.0 || fc >= fs / 2)
+        return false;
+    double w0 = 2 * M_PI * fc / fs;
+    double alpha = sin(w0) / (2 * M_SQRT1_2); // Q = 1/sqrt(2)
+    double c = cos(w0);
+    double b[3] = {(1 + c) / 2, -(1 + c), (1 + c) / 2};
+    double a[3] = {1 + alpha, -2 * c, 1 - alpha};
+    return addStage(b, a);
+}
+
+/**
+ * Filter one sample frame in place. samples[] holds sign extended 24 bit
+ * codes for num_channels channels, the result is in the same scale.
+ * Stages are the outer loop so the coefficients stay in registers while
+ * the channels of one stage are walked linearly.
+ */
+void BiquadBank::process(int32_t *samples, uint8_t num_channels)
+{
+    if (num_channels > BIQUAD_MAX_CHANNELS)
+        num_channels = BIQUAD_MAX_CHANNELS;
+
+    int32_t buf[BIQUAD_MAX_CHANNELS];
+    for (uint8_t ch = 0; ch < num_channels; ch++)
+        buf[ch] = samples[ch] << BIQUAD_INPUT_SHIFT;
+
+    for (uint8_t s = 0; s < numStages; s++)
+    {
+        const int64_t b0 = coeffs[s].b0, b1 = coeffs[s].b1, b2 = coeffs[s].b2;
+        const int64_t a1 = coeffs[s].a1, a2 = coeffs[s].a2;
+        const int64_t a1_lo = coeffs[s].a1_lo, a2_lo = coeffs[s].a2_lo;
+        stage_state &st = state[s];
+        for (uint8_t ch = 0; ch < num_channels; ch++)
+        {
+            int32_t x = buf[ch];
+            // fraction saving: feeding the truncated bits of the last two
+            // results back in as 2 e[n-1] - e[n-2] puts a double zero at
+            // DC into the quantisation noise, where a double pole near
+            // z = 1 (low cut-off) would otherwise amplify it
+            int64_t acc = 2 * (int64_t)st.err[ch] - st.err2[ch];
+            acc += b0 * x + b1 * st.x1[ch] + b2 * st.x2[ch];
+            acc -= a1 * st.y1[ch] + a2 * st.y2[ch];
+            acc -= (a1_lo * st.y1[ch] + a2_lo * st.y2[ch]) >> BIQUAD_COEFF_SHIFT;
+            int32_t y = sat32(acc >> BIQUAD_COEFF_SHIFT);
+            st.err2[ch] = st.err[ch];
+            st.err[ch] = (int32_t)(acc & BIQUAD_FRACTION_MASK);
+            st.x2[ch] = st.x1[ch];
+            st.x1[ch] = x;
+            st.y2[ch] = st.y1[ch];
+            st.y1[ch] = y;
+            buf[ch] = y;
+        }
+    }
+
+    for (uint8_t ch = 0; ch < num_channels; ch++)
+        samples[ch] = buf[ch] >> BIQUAD_INPUT_SHIFT;
+}
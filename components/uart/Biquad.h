@@ -0,0 +1,68 @@
+/*
+ * Biquad.h
+ *
+ * Fixed-point IIR filter bank (cascade of biquads) applied to every
+ * sample frame in the streaming path.
+ *
+ * Coefficients are Q31 with a post shift of 1 (i.e. Q30, range [-2, 2)),
+ * samples are the sign extended 24 bit ADC codes scaled up to Q31 with one
+ * guard bit. Every stage runs direct form I with a 64 bit accumulator and
+ * second order error feedback. The feedback coefficients carry another 30
+ * bits (a1_lo, a2_lo): for a high-pass at 0.1 Hz and 16 kSPS 1 + a1 + a2
+ * is about 2^-29, Q30 alone would move the poles well off the design.
+ *
+ * The code only depends on the C library so it can be compiled and
+ * checked on a host against a double precision reference.
+ */
+
+#ifndef _BIQUAD_H
+#define _BIQUAD_H
+
+#include <stdint.h>
+
+#define BIQUAD_MAX_CHANNELS 8
+#define BIQUAD_MAX_STAGES 4
+#define BIQUAD_COEFF_SHIFT 30 // Q31 coefficients with post shift 1
+#define BIQUAD_INPUT_SHIFT 7  // 24 bit code -> Q31 with one guard bit
+#define BIQUAD_FRACTION_MASK ((1L << BIQUAD_COEFF_SHIFT) - 1)
+
+#define BIQUAD_NOTCH_Q 30.0 // ~1.7 Hz wide at 50 Hz
+
+struct biquad_coeffs
+{
+    int32_t b0, b1, b2; // feed forward
+    int32_t a1, a2;     // feed back (a0 normalised to 1)
+    int32_t a1_lo, a2_lo; // their Q30 rounding error, in units of 2^-60
+};
+
+class BiquadBank
+{
+public:
+    BiquadBank();
+    void clear();                                      // remove all stages
+    bool addStage(const double *b, const double *a);   // b[3], a[3] in double, a[0] != 0
+    bool addNotch(double f0, double q, double fs);     // RBJ notch at f0
+    bool addHighpass(double fc, double fs);            // 2nd order Butterworth high-pass
+    void reset();                                      // zero the delay lines
+    void process(int32_t *samples, uint8_t num_channels); // filter one frame in place
+    uint8_t stages() const { return numStages; }
+
+private:
+    // one block per stage, each delay line contiguous over channels so the
+    // inner loop walks memory linearly
+    struct stage_state
+    {
+        int32_t x1[BIQUAD_MAX_CHANNELS];
+        int32_t x2[BIQUAD_MAX_CHANNELS];
+        int32_t y1[BIQUAD_MAX_CHANNELS];
+        int32_t y2[BIQUAD_MAX_CHANNELS];
+        int32_t err[BIQUAD_MAX_CHANNELS]; // truncated accumulator bits
+        int32_t err2[BIQUAD_MAX_CHANNELS]; // the ones before
+    };
+
+    biquad_coeffs coeffs[BIQUAD_MAX_STAGES];
+    stage_state state[BIQUAD_MAX_STAGES];
+    uint8_t numStages;
+};
+
+#endif // _BIQUAD_H
@@ -0,0 +1,79 @@
+/*
+ * Capture.cpp
+ *
+ * RAM sample capture, see Capture.h
+ */
+
+#include <string.h>
+#include "Capture.h"
+
+void CaptureBuffer::attach(uint8_t *buffer, size_t bytes)
+{
+    mem = buffer;
+    cap = (buffer != 0) ? bytes / CAPTURE_RECORD_SZ : 0;
+    len = 0;
+    head = 0;
+    count = 0;
+    remaining = 0;
+}
+
+bool CaptureBuffer::start(uint32_t records)
+{
+    if (records < 1 || records > cap)
+        return false;
+    len = records;
+    head = 0;
+    count = 0;
+    remaining = records;
+    return true;
+}
+
+bool CaptureBuffer::startRing(uint32_t pre, uint32_t post_records)
+{
+    if (post_records < 1 || pre + post_records > cap)
+        return false;
+    len = pre + post_records;
+    post = post_records;
+    head = 0;
+    count = 0;
+    remaining = WAITING;
+    return true;
+}
+
+uint8_t *CaptureBuffer::next(uint32_t sample)
+{
+    uint8_t *rec = &mem[head * CAPTURE_RECORD_SZ];
+    if (remaining == 0)
+        return rec + 4; // complete, keep the caller safe but change nothing
+    memcpy(rec, &sample, 4);
+    if (++head == len)
+        head = 0;
+    if (count < len)
+        count++;
+    if (remaining != WAITING)
+        remaining--;
+    return rec + 4;
+}
+
+void CaptureBuffer::trigger()
+{
+    if (remaining == WAITING)
+        remaining = post - 1;
+}
+
+// nibble table, small enough for the device, fast enough for the drain
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+    }
+    return ~crc;
+}
@@ -0,0 +1,61 @@
+/*
+ * Capture.h
+ *
+ * RAM capture of raw samples for rates the UART can not keep up with.
+ * A record is the sample number (uint32, little endian) followed by the
+ * 27 bytes read from the ADS. The buffer is handed over once at startup,
+ * capture fills it without any transmission, afterwards it is drained in
+ * CRC protected chunks.
+ *
+ * Two ways of filling it:
+ *   start(n)            the next n samples (burst)
+ *   startRing(pre, post) keep the last pre + post samples in a ring until
+ *                        trigger(), then post - 1 more: pre samples before
+ *                        the trigger sample, the trigger sample, the rest
+ *
+ * No ESP-IDF dependencies, the host tools use it to decode the chunks.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPTURE_DATA_SZ 27
+#define CAPTURE_RECORD_SZ (4 + CAPTURE_DATA_SZ)
+
+class CaptureBuffer
+{
+public:
+    CaptureBuffer() : mem(0), cap(0), len(0), head(0), count(0), remaining(0), post(0) {}
+    void attach(uint8_t *buffer, size_t bytes);
+    uint32_t capacity() const { return cap; }
+
+    bool start(uint32_t records);             // false if more than capacity()
+    bool startRing(uint32_t pre, uint32_t post); // post >= 1, pre + post <= capacity()
+    uint8_t *next(uint32_t sample); // stores the sample #, returns where the data goes
+    void trigger();                 // the record just stored is the trigger sample
+    bool triggered() const { return remaining != WAITING; }
+    bool full() const { return remaining == 0; }
+    uint32_t size() const { return count; }
+    const uint8_t *record(uint32_t i) const // 0 = oldest
+    {
+        return &mem[((head + len - count + i) % len) * CAPTURE_RECORD_SZ];
+    }
+
+private:
+    static const uint32_t WAITING = 0xffffffff;
+
+    uint8_t *mem;
+    uint32_t cap;       // records that fit
+    uint32_t len;       // records in use
+    uint32_t head;      // next write position
+    uint32_t count;     // valid records
+    uint32_t remaining; // records still to capture, WAITING before the trigger
+    uint32_t post;      // records from the trigger sample on
+};
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len); // IEEE 802.3, start with 0
+
+#endif // _CAPTURE_H
@@ -0,0 +1,113 @@
+/*
+ * ChannelStats.cpp
+ *
+ * Windowed per channel statistics, see ChannelStats.h
+ */
+
+#include <string.h>
+#include <math.h>
+#include "ChannelStats.h"
+
+#define STATS_RAIL 0x7fffff
+
+ChannelStats::ChannelStats()
+    : latchedSample(0), sequence(0), length(0), count(0), completed(0), totalClipped(0), numChannels(0)
+{
+    memset(acc, 0, sizeof(acc));
+    memset(latched, 0, sizeof(latched));
+}
+
+void ChannelStats::configure(uint8_t num_channels, uint32_t window)
+{
+    numChannels = (num_channels > STATS_MAX_CHANNELS) ? STATS_MAX_CHANNELS : num_channels;
+    if (window < STATS_MIN_WINDOW)
+        window = STATS_MIN_WINDOW;
+    else if (window > STATS_MAX_WINDOW)
+        window = STATS_MAX_WINDOW;
+    length = window;
+    completed = 0;
+    totalClipped = 0;
+    sequence = 0; // nothing latched
+    start();
+}
+
+void ChannelStats::start()
+{
+    for (uint8_t ch = 0; ch < STATS_MAX_CHANNELS; ch++)
+    {
+        acc[ch].sum = 0;
+        acc[ch].squares = 0;
+        acc[ch].min = INT32_MAX;
+        acc[ch].max = INT32_MIN;
+        acc[ch].clipped = 0;
+    }
+    count = 0;
+}
+
+bool ChannelStats::push(const int32_t *codes, uint32_t sample_number)
+{
+    for (uint8_t ch = 0; ch < numChannels; ch++)
+    {
+        const int32_t v = codes[ch];
+        Sums &s = acc[ch];
+        s.sum += v;
+        s.squares += (uint64_t)((int64_t)v * v);
+        s.min = (v < s.min) ? v : s.min;
+        s.max = (v > s.max) ? v : s.max;
+        if (v >= STATS_RAIL - STATS_CLIP_MARGIN || v <= -STATS_RAIL - 1 + STATS_CLIP_MARGIN)
+            s.clipped++;
+    }
+    if (++count < length)
+        return false;
+
+    // seqlock: read() retries if the sequence was odd or moved meanwhile
+    sequence = sequence + 1;
+    __sync_synchronize();
+    memcpy(latched, acc, sizeof(latched));
+    latchedSample = sample_number;
+    __sync_synchronize();
+    sequence = sequence + 1;
+
+    for (uint8_t ch = 0; ch < numChannels; ch++)
+        totalClipped += acc[ch].clipped;
+    completed++;
+    start();
+    return true;
+}
+
+bool ChannelStats::read(ChannelStatsResult *results, uint32_t *end_sample) const
+{
+    Sums copy[STATS_MAX_CHANNELS];
+    uint32_t before, sample;
+    do
+    {
+        before = sequence;
+        __sync_synchronize();
+        memcpy(copy, latched, sizeof(copy));
+        sample = latchedSample;
+        __sync_synchronize();
+    } while ((before & 1) || before != sequence);
+    if (!before)
+        return false;
+
+    for (uint8_t ch = 0; ch < numChannels; ch++)
+    {
+        // squares about q = sum / n, exact modulo 2^64 and below it, so
+        // a large offset does not cancel the noise away
+        const int64_t q = copy[ch].sum / (int64_t)length;
+        const uint64_t about_q = copy[ch].squares - 2 * (uint64_t)q * (uint64_t)copy[ch].sum +
+                                 (uint64_t)length * (uint64_t)q * (uint64_t)q;
+        const double n = length;
+        const double mean = copy[ch].sum / n;
+        const double frac = (copy[ch].sum - q * (int64_t)length) / n;
+        const double var = about_q / n - frac * frac;
+        results[ch].mean = (float)mean;
+        results[ch].rms = (float)sqrt(var > 0 ? var : 0);
+        results[ch].min = copy[ch].min;
+        results[ch].max = copy[ch].max;
+        results[ch].clipped = copy[ch].clipped;
+    }
+    if (end_sample)
+        *end_sample = sample;
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+ * ChannelStats.h
+ *
+ * Running per channel statistics for checking the signal quality without
+ * streaming every sample: over windows of N samples the mean, the RMS
+ * about that mean (the noise, without the electrode offset), min / max,
+ * and the samples within STATS_CLIP_MARGIN codes of the 24 bit rails.
+ *
+ * push() is the per sample kernel: one add, one 32 x 32 -> 64 bit
+ * multiply-accumulate and three compares per channel, all in integers.
+ * At the end of a window the sums are latched, the float results are
+ * only worked out by read(), which may run in another task.
+ *
+ * No ESP-IDF dependencies.
+ */
+
+#ifndef _CHANNEL_STATS_H
+#define _CHANNEL_STATS_H
+
+#include <stdint.h>
+
+#define STATS_MAX_CHANNELS 8
+#define STATS_MIN_WINDOW 16
+#define STATS_MAX_WINDOW 262143 // 2^18 - 1, sum of squares of 2^23 stays below 2^64
+#define STATS_CLIP_MARGIN 64   // codes from +-2^23 that count as clipped
+
+struct ChannelStatsResult
+{
+    float mean;       // codes
+    float rms;        // about the mean, codes
+    int32_t min;
+    int32_t max;
+    uint32_t clipped; // samples at the rails in the window
+};
+
+class ChannelStats
+{
+public:
+    ChannelStats();
+    void configure(uint8_t num_channels, uint32_t window);
+    bool push(const int32_t *codes, uint32_t sample_number); // true when a window is complete
+    bool read(ChannelStatsResult *results, uint32_t *end_sample) const; // last complete window, false if none yet
+    uint8_t channels() const { return numChannels; }
+    uint32_t window() const { return length; }
+    uint32_t windows() const { return completed; }
+    uint32_t clipped() const { return totalClipped; } // all channels since configure()
+
+private:
+    struct Sums
+    {
+        int64_t sum;
+        uint64_t squares;
+        int32_t min;
+        int32_t max;
+        uint32_t clipped;
+    };
+    void start();
+
+    Sums acc[STATS_MAX_CHANNELS];
+    Sums latched[STATS_MAX_CHANNELS];
+    uint32_t latchedSample;
+    volatile uint32_t sequence; // odd while latching, see read()
+    uint32_t length;
+    uint32_t count;
+    uint32_t completed;
+    uint32_t totalClipped;
+    uint8_t numChannels;
+};
+
+#endif // _CHANNEL_STATS_H
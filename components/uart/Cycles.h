@@ -0,0 +1,33 @@
+/*
+ * Cycles.h
+ *
+ * Cheap cycle counter used to time the streaming hot path.
+ * On the ESP32 this reads the Xtensa CCOUNT register (240 MHz),
+ * on a host build it falls back to a monotonic nanosecond clock
+ * so the DSP code can be timed there as well.
+ */
+
+#ifndef _CYCLES_H
+#define _CYCLES_H
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "xtensa/core-macros.h"
+
+static inline uint32_t cycle_count()
+{
+    return XTHAL_GET_CCOUNT();
+}
+#else
+#include <time.h>
+
+static inline uint32_t cycle_count()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+#endif // _CYCLES_H
@@ -0,0 +1,234 @@
+/*
+ * Decimator.cpp
+ *
+ * CIC + polyphase FIR decimation, see Decimator.h
+ */
+
+#include <string.h>
+#include <math.h>
+#include "Decimator.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define DECIM_KAISER_BETA 8.0  // ~80 dB stop band
+#define DECIM_DESIGN_POINTS 128
+
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// magnitude of the CIC at f cycles per input sample
+static double cic_magnitude(double f, int ratio, int order)
+{
+    if (ratio <= 1 || f == 0.0)
+        return 1.0;
+    double m = fabs(sin(M_PI * f * ratio) / (ratio * sin(M_PI * f)));
+    return pow(m, order);
+}
+
+Decimator::Decimator()
+    : decimRatio(0), firPhases(2), cicRatio(1), cicOrder(DECIM_CIC_ORDER), cicShift(0), cicPre(0), cicCorr(1 << 15),
+      branchTaps(DECIM_MAX_TAPS / 2)
+{
+    memset(taps, 0, sizeof(taps));
+    reset();
+}
+
+void Decimator::reset()
+{
+    phase = 0;
+    cicPhase = 0;
+    firPhase = 0;
+    firPos = 0;
+    memset(integ, 0, sizeof(integ));
+    memset(comb, 0, sizeof(comb));
+    memset(lines, 0, sizeof(lines));
+}
+
+/**
+ * Set the total decimation ratio and design the compensation FIR.
+ * Only even ratios from 2 to 64 are supported: the FIR takes the last
+ * factor of 4 (or 2), the CIC the rest. Leaving the FIR a factor of 4
+ * keeps the pass band small compared to the CIC nulls, so the aliases
+ * folding into it are well below -70 dB. With a factor of 2 the pass band
+ * reaches 0.2 of the way to the first null, where a 4th order CIC only
+ * takes some 50 dB off, so it gets a 6th order one.
+ */
+bool Decimator::configure(uint8_t ratio)
+{
+    if (ratio < DECIM_MIN_RATIO || ratio > DECIM_MAX_RATIO || (ratio & 1))
+        return false;
+    if (ratio == decimRatio)
+    {
+        reset(); // already designed
+        return true;
+    }
+
+    decimRatio = ratio;
+    firPhases = (ratio % 4 == 0) ? 4 : 2;
+    branchTaps = DECIM_MAX_TAPS / firPhases;
+    cicRatio = ratio / firPhases;
+    cicOrder = (firPhases == 4) ? DECIM_CIC_ORDER : DECIM_CIC_MAX_ORDER;
+    double gain = pow(cicRatio, cicOrder);
+    cicShift = (uint8_t)ceil(log2(gain));
+    cicPre = (cicShift > 16) ? cicShift - 16 : 0; // < 2^40 before the Q15 correction
+    cicCorr = (int32_t)lround((double)(1 << 15) * pow(2.0, cicShift) / gain);
+
+    // windowed frequency sampling design of a low-pass at the output Nyquist
+    // frequency whose pass band is the inverse of the CIC droop
+    const int num_taps = DECIM_MAX_TAPS;
+    const double df = 0.5 / firPhases / DECIM_DESIGN_POINTS;
+    double weight[DECIM_DESIGN_POINTS];
+    for (int i = 0; i < DECIM_DESIGN_POINTS; i++)
+        weight[i] = 2.0 * df / cic_magnitude((i + 0.5) * df / cicRatio, cicRatio, cicOrder);
+
+    double h[DECIM_MAX_TAPS];
+    double sum = 0.0;
+    const double centre = (num_taps - 1) / 2.0;
+    for (int n = 0; n < num_taps; n++)
+    {
+        // cos((i + 0.5) * a) by recurrence, this runs on the device and
+        // double precision transcendentals are slow there
+        double a = 2 * M_PI * df * (n - centre);
+        double c2 = 2 * cos(a);
+        double prev = cos(-0.5 * a), cur = cos(0.5 * a);
+        double acc = 0.0;
+        for (int i = 0; i < DECIM_DESIGN_POINTS; i++)
+        {
+            acc += weight[i] * cur;
+            double next = c2 * cur - prev;
+            prev = cur;
+            cur = next;
+        }
+        double r = 2.0 * n / (num_taps - 1) - 1.0;
+        double w = bessel_i0(DECIM_KAISER_BETA * sqrt(1.0 - r * r)) / bessel_i0(DECIM_KAISER_BETA);
+        h[n] = acc * w;
+        sum += h[n];
+    }
+    for (int p = 0; p < firPhases; p++)
+    {
+        for (int k = 0; k < branchTaps; k++)
+            taps[p * branchTaps + k] = (int32_t)lround(h[firPhases * k + p] / sum * (1L << DECIM_TAP_SHIFT));
+    }
+    reset();
+    return true;
+}
+
+/**
+ * CIC integrate on every input, comb on every cicRatio-th one.
+ * Returns true when cicOut[] holds a new value (DECIM_GUARD_BITS above the
+ * input scale).
+ */
+bool Decimator::cicStep(const int32_t *samples, uint8_t num_channels)
+{
+    if (cicRatio == 1)
+    {
+        for (uint8_t ch = 0; ch < num_channels; ch++)
+            cicOut[ch] = samples[ch] << DECIM_GUARD_BITS;
+        return true;
+    }
+
+    for (uint8_t ch = 0; ch < num_channels; ch++)
+    {
+        uint64_t v = (uint64_t)(int64_t)samples[ch];
+        for (int k = 0; k < cicOrder; k++)
+        {
+            integ[k][ch] += v;
+            v = integ[k][ch];
+        }
+    }
+    if (++cicPhase < cicRatio)
+        return false;
+    cicPhase = 0;
+
+    const int shift = cicShift + 15 - DECIM_GUARD_BITS - cicPre;
+    for (uint8_t ch = 0; ch < num_channels; ch++)
+    {
+        uint64_t v = integ[cicOrder - 1][ch];
+        for (int k = 0; k < cicOrder; k++)
+        {
+            uint64_t d = v - comb[k][ch];
+            comb[k][ch] = v;
+            v = d;
+        }
+        cicOut[ch] = (int32_t)((((int64_t)v >> cicPre) * cicCorr) >> shift);
+    }
+    return true;
+}
+
+/**
+ * Feed one input frame. When an output is complete it replaces the first
+ * num_channels entries of samples[] (same scale as the input) and true is
+ * returned.
+ */
+bool Decimator::process(int32_t *samples, uint8_t num_channels)
+{
+    if (decimRatio == 0)
+        return true;
+    if (num_channels > DECIM_MAX_CHANNELS)
+        num_channels = DECIM_MAX_CHANNELS;
+
+    if (++phase == decimRatio)
+        phase = 0;
+    if (!cicStep(samples, num_channels))
+        return false;
+
+    // x[D*m - p] goes into branch p, so the inputs of one output fill the
+    // branches from D-1 down to 0
+    if (firPhase == 0)
+        firPos = (firPos == 0) ? branchTaps - 1 : firPos - 1;
+    const int at = 2 * (firPhases - 1 - firPhase) * branchTaps + firPos;
+    for (uint8_t ch = 0; ch < num_channels; ch++)
+    {
+        lines[ch][at] = cicOut[ch];
+        lines[ch][at + branchTaps] = cicOut[ch];
+    }
+    if (++firPhase < firPhases)
+        return false;
+    firPhase = 0;
+
+    for (uint8_t ch = 0; ch < num_channels; ch++)
+    {
+        int64_t acc = (int64_t)1 << (DECIM_TAP_SHIFT + DECIM_GUARD_BITS - 1); // rounding
+        for (int p = 0; p < firPhases; p++)
+        {
+            const int32_t *h = &taps[p * branchTaps];
+            const int32_t *x = &lines[ch][2 * p * branchTaps + firPos];
+            for (int k = 0; k < branchTaps; k++)
+                acc += (int64_t)h[k] * x[k];
+        }
+        samples[ch] = (int32_t)(acc >> (DECIM_TAP_SHIFT + DECIM_GUARD_BITS));
+    }
+    return true;
+}
+
+/**
+ * Magnitude response of the whole chain with the quantised taps, used to
+ * verify a design. f is in cycles per input sample (0 .. 0.5).
+ */
+double Decimator::response(double f) const
+{
+    if (decimRatio == 0)
+        return 1.0;
+    double fm = f * cicRatio; // at the FIR input rate
+    double re = 0.0, im = 0.0;
+    for (int p = 0; p < firPhases; p++)
+    {
+        for (int k = 0; k < branchTaps; k++)
+        {
+            double t = 2 * M_PI * fm * (firPhases * k + p);
+            re += taps[p * branchTaps + k] * cos(t);
+            im -= taps[p * branchTaps + k] * sin(t);
+        }
+    }
+    return cic_magnitude(f, cicRatio, cicOrder) * sqrt(re * re + im * im) / (1L << DECIM_TAP_SHIFT);
+}
@@ -0,0 +1,71 @@
+/*
+ * Decimator.h
+ *
+ * Two stage decimation for all active channels: a 4th order CIC followed by
+ * a polyphase FIR decimating by 4 (a 6th order CIC and a FIR decimating by
+ * 2 if the ratio is not a multiple of 4). The FIR is designed at configuration time (Kaiser windowed, with CIC
+ * droop compensation across the pass band) and runs with Q20 taps.
+ *
+ * This lets the ADS1299 sample at a high rate while only every ratio-th
+ * (filtered) sample gets encoded and sent over the UART.
+ *
+ * Like Biquad.h this only needs the C library, so it can be built and
+ * benchmarked on a host.
+ */
+
+#ifndef _DECIMATOR_H
+#define _DECIMATOR_H
+
+#include <stdint.h>
+
+#define DECIM_MAX_CHANNELS 8
+#define DECIM_MIN_RATIO 2
+#define DECIM_MAX_RATIO 64
+#define DECIM_CIC_ORDER 4     // ahead of a FIR decimating by 4
+#define DECIM_CIC_MAX_ORDER 6 // ahead of one decimating by 2, see configure()
+#define DECIM_MAX_PHASES 4   // FIR decimation factor, 2 or 4
+#define DECIM_MAX_TAPS 128   // FIR length, split into one branch per phase
+#define DECIM_TAP_SHIFT 20   // Q20 FIR taps
+#define DECIM_GUARD_BITS 6   // extra resolution between CIC and FIR
+
+class Decimator
+{
+public:
+    Decimator();
+    bool configure(uint8_t ratio); // even ratio 2..64, designs the FIR
+    void reset();                  // clear all delay lines
+    bool process(int32_t *samples, uint8_t num_channels); // true if samples[] now holds an output
+    bool outputDue() const { return phase + 1 == decimRatio; } // next input completes an output
+    uint8_t ratio() const { return decimRatio; }
+    double response(double f) const; // |H| of CIC + quantised FIR, f in cycles per input sample
+
+private:
+    bool cicStep(const int32_t *samples, uint8_t num_channels);
+
+    uint8_t decimRatio; // total ratio, 0 = not configured
+    uint8_t firPhases;  // FIR decimation factor
+    uint8_t cicRatio;   // ratio / firPhases
+    uint8_t cicOrder;
+    uint8_t cicShift;   // ceil(log2(cicRatio ^ order))
+    uint8_t cicPre;     // shift ahead of the gain correction, keeps it in 64 bits
+    int32_t cicCorr;    // Q15 gain correction 2^cicShift / cicRatio ^ order
+    uint8_t phase;      // input samples into the current output
+    uint8_t cicPhase;
+    uint8_t firPhase;   // CIC outputs into the current FIR output
+    uint8_t firPos;     // write position of the doubled delay lines
+    uint8_t branchTaps; // DECIM_MAX_TAPS / firPhases
+
+    // unsigned so the integrators may wrap, the combs undo it
+    uint64_t integ[DECIM_CIC_MAX_ORDER][DECIM_MAX_CHANNELS];
+    uint64_t comb[DECIM_CIC_MAX_ORDER][DECIM_MAX_CHANNELS];
+    int32_t cicOut[DECIM_MAX_CHANNELS];
+
+    // branch p (branchTaps from p * branchTaps on) holds h[p],
+    // h[p + firPhases], ... and sees every firPhases-th input, the newest
+    // one ends up in branch 0
+    int32_t taps[DECIM_MAX_TAPS];
+    // each branch's line is stored twice so a dot product never wraps
+    int32_t lines[DECIM_MAX_CHANNELS][2 * DECIM_MAX_TAPS];
+};
+
+#endif // _DECIMATOR_H
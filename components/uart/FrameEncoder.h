@@ -0,0 +1,386 @@
+/*
+ * FrameEncoder.h
+ *
+ * Compile time description of the sample frames sent while streaming.
+ * FrameLayout<channels, time bytes, status, encoding, sample bytes, flags> knows every
+ * size of its frame as a constant and generates an encoder without any run time
+ * decisions: payload packing, base64/hex and the fixed header and footer
+ * all have compile time lengths, so the loops unroll and the encoding
+ * switch folds away. The firmware picks one instantiation when rdatac
+ * starts (frame_encoder()) and calls it through a function pointer.
+ *
+ * Payload (little endian, as the ESP32 stores it):
+ *
+ *   time (TIME_BYTES) | sample # (4) | [flags (2)] | [status (3)] | CHANNELS x big endian values
+ *
+ * Values are the 24 bit codes, or int16 (SAMPLE_BYTES 2) in quantised
+ * mode, see Quantizer.h. The flags are the artifact bits of the sample,
+ * see ArtifactFlags.h.
+ *
+ * Encodings:
+ *   FRAME_MESSAGEPACK  {"C":200,"D":<bin8 payload>}
+ *   FRAME_JSONLINES    {"C":200,"D":"<base64 payload>"}\n
+ *   FRAME_BASE64       <base64 payload>\n
+ *   FRAME_HEX          <hex payload>\n
+ *
+ * decode() is generated from the same description, so host tools stay in
+ * step with the firmware. No ESP-IDF dependencies.
+ */
+
+#ifndef _FRAME_ENCODER_H
+#define _FRAME_ENCODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "LeadOff.h"
+
+#define FRAME_TIME_BYTES 4    // timestamp width on the wire, us
+#define FRAME_MAX_CHANNELS 8
+#define FRAME_RAW_SZ 27       // one RDATAC read: status + 8 channels
+#define FRAME_MAX_SZ 84       // largest frame of any layout (hex, 8 bytes time, flags)
+
+enum FrameEncoding
+{
+    FRAME_MESSAGEPACK,
+    FRAME_JSONLINES,
+    FRAME_BASE64,
+    FRAME_HEX
+};
+
+struct FrameSample
+{
+    uint64_t time;
+    uint32_t sample;
+    uint32_t status; // 24 bit status word, 0 if not sent
+    uint16_t flags;  // artifact flags, 0 if not sent
+    uint8_t channels;
+    int32_t channel[FRAME_MAX_CHANNELS];
+};
+
+// encodes raw (one RDATAC read) into out, returns the frame length;
+// flags are left out unless the layout has them
+typedef size_t (*FrameEncoderFn)(char *out, uint64_t time, uint32_t sample, const uint8_t *raw, uint16_t flags);
+// decodes one frame (newline optional), false if it does not match the layout
+typedef bool (*FrameDecoderFn)(const char *in, size_t len, FrameSample *s);
+
+namespace frame_detail
+{
+static const char mp_header[] = {(char)0x82, (char)0xa1, 0x43, (char)0xcc, (char)0xc8, (char)0xa1, 0x44, (char)0xc4};
+static const char json_header[] = "{\"C\":200,\"D\":\"";
+static const char json_footer[] = "\"}\n";
+static const char b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char hex_digits[] = "0123456789ABCDEF";
+
+enum
+{
+    MP_HEADER_LEN = sizeof(mp_header),
+    JSON_HEADER_LEN = sizeof(json_header) - 1,
+    JSON_FOOTER_LEN = sizeof(json_footer) - 1
+};
+
+template <int N>
+inline void put_le(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < N; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+template <int N>
+inline uint64_t get_le(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < N; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+template <int N>
+inline void base64(char *out, const uint8_t *in)
+{
+    for (int i = 0; i < N / 3; i++, in += 3)
+    {
+        uint32_t v = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+        *out++ = b64_alphabet[v >> 18];
+        *out++ = b64_alphabet[(v >> 12) & 0x3f];
+        *out++ = b64_alphabet[(v >> 6) & 0x3f];
+        *out++ = b64_alphabet[v & 0x3f];
+    }
+    if (N % 3)
+    {
+        uint32_t v = (uint32_t)in[0] << 16;
+        if (N % 3 == 2)
+            v |= (uint32_t)in[1] << 8;
+        *out++ = b64_alphabet[v >> 18];
+        *out++ = b64_alphabet[(v >> 12) & 0x3f];
+        *out++ = (N % 3 == 2) ? b64_alphabet[(v >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+}
+
+template <int N>
+inline void hex(char *out, const uint8_t *in)
+{
+    for (int i = 0; i < N; i++)
+    {
+        *out++ = hex_digits[in[i] >> 4];
+        *out++ = hex_digits[in[i] & 0x0f];
+    }
+}
+
+inline int b64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+// exactly n payload bytes from their base64 text
+inline bool unbase64(uint8_t *out, const char *in, int n)
+{
+    for (int i = 0; i < n; i += 3, in += 4)
+    {
+        uint32_t v = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            int d = (in[k] == '=') ? 0 : b64_value(in[k]);
+            if (d < 0)
+                return false;
+            v = (v << 6) | d;
+        }
+        for (int k = 0; k < 3 && i + k < n; k++)
+            out[i + k] = (uint8_t)(v >> (16 - 8 * k));
+    }
+    return true;
+}
+
+inline int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+inline bool unhex(uint8_t *out, const char *in, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        int hi = hex_value(in[2 * i]), lo = hex_value(in[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        out[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return true;
+}
+
+inline size_t strip_newline(const char *in, size_t len)
+{
+    while (len && (in[len - 1] == '\n' || in[len - 1] == '\r'))
+        len--;
+    return len;
+}
+} // namespace frame_detail
+
+template <uint8_t CHANNELS, uint8_t TIME_BYTES, bool STATUS, FrameEncoding ENCODING, uint8_t SAMPLE_BYTES = 3,
+          bool FLAGS = false>
+struct FrameLayout
+{
+    enum
+    {
+        FLAGS_BYTES = FLAGS ? 2 : 0,
+        STATUS_BYTES = STATUS ? ADS_STATUS_SZ : 0,
+        DATA_BYTES = STATUS_BYTES + SAMPLE_BYTES * CHANNELS,
+        HEAD_BYTES = TIME_BYTES + 4 + FLAGS_BYTES, // before the data
+        PAYLOAD_BYTES = HEAD_BYTES + DATA_BYTES,
+        BASE64_BYTES = (PAYLOAD_BYTES + 2) / 3 * 4,
+        TEXT_BYTES = (ENCODING == FRAME_HEX) ? 2 * PAYLOAD_BYTES : BASE64_BYTES,
+        FRAME_BYTES = (ENCODING == FRAME_MESSAGEPACK) ? frame_detail::MP_HEADER_LEN + 1 + PAYLOAD_BYTES
+                    : (ENCODING == FRAME_JSONLINES) ? frame_detail::JSON_HEADER_LEN + BASE64_BYTES + frame_detail::JSON_FOOTER_LEN
+                    : TEXT_BYTES + 1
+    };
+
+    static void pack(uint8_t *payload, uint64_t time, uint32_t sample, const uint8_t *raw, uint16_t flags)
+    {
+        frame_detail::put_le<TIME_BYTES>(payload, time);
+        frame_detail::put_le<4>(&payload[TIME_BYTES], sample);
+        frame_detail::put_le<FLAGS_BYTES>(&payload[TIME_BYTES + 4], flags);
+        memcpy(&payload[HEAD_BYTES], &raw[ADS_STATUS_SZ - STATUS_BYTES], DATA_BYTES);
+    }
+
+    static size_t encode(char *out, uint64_t time, uint32_t sample, const uint8_t *raw, uint16_t flags)
+    {
+        using namespace frame_detail;
+        if (ENCODING == FRAME_MESSAGEPACK) // payload straight into the frame
+        {
+            memcpy(out, mp_header, MP_HEADER_LEN);
+            out[MP_HEADER_LEN] = PAYLOAD_BYTES;
+            pack((uint8_t *)&out[MP_HEADER_LEN + 1], time, sample, raw, flags);
+            return FRAME_BYTES;
+        }
+        uint8_t payload[PAYLOAD_BYTES];
+        pack(payload, time, sample, raw, flags);
+        if (ENCODING == FRAME_JSONLINES)
+        {
+            memcpy(out, json_header, JSON_HEADER_LEN);
+            base64<PAYLOAD_BYTES>(&out[JSON_HEADER_LEN], payload);
+            memcpy(&out[JSON_HEADER_LEN + BASE64_BYTES], json_footer, JSON_FOOTER_LEN);
+        }
+        else
+        {
+            if (ENCODING == FRAME_HEX)
+                hex<PAYLOAD_BYTES>(out, payload);
+            else
+                base64<PAYLOAD_BYTES>(out, payload);
+            out[TEXT_BYTES] = '\n';
+        }
+        return FRAME_BYTES;
+    }
+
+    static bool unpack(const uint8_t *payload, FrameSample *s)
+    {
+        s->time = frame_detail::get_le<TIME_BYTES>(payload);
+        s->sample = (uint32_t)frame_detail::get_le<4>(&payload[TIME_BYTES]);
+        s->flags = (uint16_t)frame_detail::get_le<FLAGS_BYTES>(&payload[TIME_BYTES + 4]);
+        const uint8_t *p = &payload[HEAD_BYTES];
+        s->status = STATUS ? ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2] : 0;
+        p += STATUS_BYTES;
+        s->channels = CHANNELS;
+        for (int ch = 0; ch < CHANNELS; ch++, p += SAMPLE_BYTES)
+        {
+            if (SAMPLE_BYTES == 2)
+                s->channel[ch] = (int16_t)((p[0] << 8) | p[1]);
+            else
+                s->channel[ch] = ((int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8))) >> 8;
+        }
+        return !STATUS || status_valid(&payload[HEAD_BYTES]);
+    }
+
+    static bool decode(const char *in, size_t len, FrameSample *s)
+    {
+        using namespace frame_detail;
+        uint8_t payload[PAYLOAD_BYTES];
+        if (ENCODING == FRAME_MESSAGEPACK)
+        {
+            if (len < (size_t)FRAME_BYTES || memcmp(in, mp_header, MP_HEADER_LEN) != 0 ||
+                (uint8_t)in[MP_HEADER_LEN] != PAYLOAD_BYTES)
+                return false;
+            return unpack((const uint8_t *)&in[MP_HEADER_LEN + 1], s);
+        }
+        len = strip_newline(in, len);
+        if (ENCODING == FRAME_JSONLINES)
+        {
+            if (len != (size_t)(JSON_HEADER_LEN + BASE64_BYTES + JSON_FOOTER_LEN - 1) ||
+                memcmp(in, json_header, JSON_HEADER_LEN) != 0)
+                return false;
+            in += JSON_HEADER_LEN;
+        }
+        else if (len != (size_t)TEXT_BYTES)
+            return false;
+        bool ok = (ENCODING == FRAME_HEX) ? unhex(payload, in, PAYLOAD_BYTES)
+                                          : unbase64(payload, in, PAYLOAD_BYTES);
+        return ok && unpack(payload, s);
+    }
+};
+
+// run time selection, once per stream
+template <uint8_t CHANNELS, bool STATUS, uint8_t SAMPLE_BYTES, bool FLAGS>
+inline FrameEncoderFn frame_encoder_for(FrameEncoding encoding)
+{
+    switch (encoding)
+    {
+    case FRAME_MESSAGEPACK:
+        return &FrameLayout<CHANNELS, FRAME_TIME_BYTES, STATUS, FRAME_MESSAGEPACK, SAMPLE_BYTES, FLAGS>::encode;
+    case FRAME_JSONLINES:
+        return &FrameLayout<CHANNELS, FRAME_TIME_BYTES, STATUS, FRAME_JSONLINES, SAMPLE_BYTES, FLAGS>::encode;
+    case FRAME_BASE64:
+        return &FrameLayout<CHANNELS, FRAME_TIME_BYTES, STATUS, FRAME_BASE64, SAMPLE_BYTES, FLAGS>::encode;
+    default:
+        return &FrameLayout<CHANNELS, FRAME_TIME_BYTES, STATUS, FRAME_HEX, SAMPLE_BYTES, FLAGS>::encode;
+    }
+}
+
+template <uint8_t CHANNELS, bool STATUS, uint8_t SAMPLE_BYTES, bool FLAGS>
+inline FrameDecoderFn frame_decoder_for(FrameEncoding encoding)
+{
+    switch (encoding)
+    {
+    case FRAME_MESSAGEPACK:
+        return &FrameLayout<CHANNELS, FRAME_TIME_BYTES, STATUS, FRAME_MESSAGEPACK, SAMPLE_BYTES, FLAGS>::decode;
+    case FRAME_JSONLINES:
+        return &FrameLayout<CHANNELS, FRAME_TIME_BYTES, STATUS, FRAME_JSONLINES, SAMPLE_BYTES, FLAGS>::decode;
+    case FRAME_BASE64:
+        return &FrameLayout<CHANNELS, FRAME_TIME_BYTES, STATUS, FRAME_BASE64, SAMPLE_BYTES, FLAGS>::decode;
+    default:
+        return &FrameLayout<CHANNELS, FRAME_TIME_BYTES, STATUS, FRAME_HEX, SAMPLE_BYTES, FLAGS>::decode;
+    }
+}
+
+template <uint8_t CHANNELS, uint8_t SAMPLE_BYTES, bool FLAGS>
+inline FrameEncoderFn frame_encoder_for(bool status, FrameEncoding encoding)
+{
+    return status ? frame_encoder_for<CHANNELS, true, SAMPLE_BYTES, FLAGS>(encoding)
+                  : frame_encoder_for<CHANNELS, false, SAMPLE_BYTES, FLAGS>(encoding);
+}
+
+template <uint8_t CHANNELS, uint8_t SAMPLE_BYTES, bool FLAGS>
+inline FrameDecoderFn frame_decoder_for(bool status, FrameEncoding encoding)
+{
+    return status ? frame_decoder_for<CHANNELS, true, SAMPLE_BYTES, FLAGS>(encoding)
+                  : frame_decoder_for<CHANNELS, false, SAMPLE_BYTES, FLAGS>(encoding);
+}
+
+template <uint8_t SAMPLE_BYTES, bool FLAGS>
+inline FrameEncoderFn frame_encoder_for(uint8_t channels, bool status, FrameEncoding encoding)
+{
+    if (channels == 4)
+        return frame_encoder_for<4, SAMPLE_BYTES, FLAGS>(status, encoding);
+    if (channels == 6)
+        return frame_encoder_for<6, SAMPLE_BYTES, FLAGS>(status, encoding);
+    return frame_encoder_for<8, SAMPLE_BYTES, FLAGS>(status, encoding);
+}
+
+template <uint8_t SAMPLE_BYTES, bool FLAGS>
+inline FrameDecoderFn frame_decoder_for(uint8_t channels, bool status, FrameEncoding encoding)
+{
+    if (channels == 4)
+        return frame_decoder_for<4, SAMPLE_BYTES, FLAGS>(status, encoding);
+    if (channels == 6)
+        return frame_decoder_for<6, SAMPLE_BYTES, FLAGS>(status, encoding);
+    return frame_decoder_for<8, SAMPLE_BYTES, FLAGS>(status, encoding);
+}
+
+// channels as on the device (4, 6 or 8), everything else is sent as 8;
+// sample_bytes 3 for the codes, 2 when quantised; flags for "artifacts 1"
+inline FrameEncoderFn frame_encoder(uint8_t channels, bool status, FrameEncoding encoding, uint8_t sample_bytes = 3,
+                                    bool flags = false)
+{
+    if (flags)
+        return (sample_bytes == 2) ? frame_encoder_for<2, true>(channels, status, encoding)
+                                   : frame_encoder_for<3, true>(channels, status, encoding);
+    return (sample_bytes == 2) ? frame_encoder_for<2, false>(channels, status, encoding)
+                               : frame_encoder_for<3, false>(channels, status, encoding);
+}
+
+inline FrameDecoderFn frame_decoder(uint8_t channels, bool status, FrameEncoding encoding, uint8_t sample_bytes = 3,
+                                    bool flags = false)
+{
+    if (flags)
+        return (sample_bytes == 2) ? frame_decoder_for<2, true>(channels, status, encoding)
+                                   : frame_decoder_for<3, true>(channels, status, encoding);
+    return (sample_bytes == 2) ? frame_decoder_for<2, false>(channels, status, encoding)
+                               : frame_decoder_for<3, false>(channels, status, encoding);
+}
+
+#endif // _FRAME_ENCODER_H
@@ -0,0 +1,101 @@
+/*
+ * Impedance.cpp
+ *
+ * Goertzel detection of the lead-off excitation, see Impedance.h
+ */
+
+#include <string.h>
+#include <math.h>
+#include "Impedance.h"
+
+#define IMP_PI 3.14159265358979f
+
+ImpedanceMeter::ImpedanceMeter()
+    : coeff(0), cosine(1), sine(0), halfAngle(0), length(0), block(0), settleSamples(0), count(0), numChannels(0)
+{
+    memset(s1, 0, sizeof(s1));
+    memset(s2, 0, sizeof(s2));
+    memset(first, 0, sizeof(first));
+    memset(head, 0, sizeof(head));
+    memset(tail, 0, sizeof(tail));
+}
+
+void ImpedanceMeter::configure(uint8_t num_channels, float sample_rate, float frequency, float seconds, uint32_t settle)
+{
+    numChannels = (num_channels > IMP_MAX_CHANNELS) ? IMP_MAX_CHANNELS : num_channels;
+    uint32_t cycles = (uint32_t)(seconds * frequency);
+    if (cycles < 1)
+        cycles = 1;
+    length = (uint32_t)(cycles * sample_rate / frequency + 0.5f);
+    if (length < 2)
+        length = 2;
+    const float w = 2 * IMP_PI * cycles / length; // the bin nearest to frequency
+    cosine = cosf(w);
+    sine = sinf(w);
+    coeff = 2 * cosine;
+    halfAngle = w / 2;
+    block = (uint32_t)((uint64_t)length * (cycles / 2) / cycles);
+    settleSamples = settle;
+    count = 0;
+    memset(s1, 0, sizeof(s1));
+    memset(s2, 0, sizeof(s2));
+    memset(head, 0, sizeof(head));
+    memset(tail, 0, sizeof(tail));
+}
+
+bool ImpedanceMeter::push(const int32_t *codes)
+{
+    if (done())
+        return true;
+    if (count < settleSamples)
+    {
+        count++;
+        return false;
+    }
+    if (count == settleSamples)
+        memcpy(first, codes, numChannels * sizeof(int32_t)); // keeps the offset out of the float state
+    const uint32_t n = count - settleSamples;
+    for (uint8_t ch = 0; ch < numChannels; ch++)
+    {
+        const int32_t x = codes[ch] - first[ch];
+        float s = (float)x + coeff * s1[ch] - s2[ch];
+        s2[ch] = s1[ch];
+        s1[ch] = s;
+        if (n < block)
+            head[ch] += x;
+        if (n >= length - block)
+            tail[ch] += x;
+    }
+    count++;
+    return done();
+}
+
+float ImpedanceMeter::amplitude(uint8_t ch) const
+{
+    if (ch >= numChannels || !done())
+        return 0;
+    // X(k) = s[N-1] - e^(-jw) s[N-2], up to a phase factor
+    float re = s1[ch] - cosine * s2[ch];
+    float im = sine * s2[ch];
+    if (block)
+    {
+        // a ramp n * slope gives slope * N * (-1 / 2 - j cot(w / 2) / 2)
+        const float slope = (float)(tail[ch] - head[ch]) / block / (length - block);
+        re -= slope * length / 2;
+        im -= slope * length / (2 * tanf(halfAngle));
+    }
+    return 2 * sqrtf(re * re + im * im) / length;
+}
+
+float ImpedanceMeter::droop(float frequency, float sample_rate)
+{
+    const float x = IMP_PI * frequency / sample_rate;
+    const float g = (x > 0) ? sinf(x) / x : 1;
+    return g * g * g;
+}
+
+float ImpedanceMeter::ohms(float amplitude_volts, float current_amps, float frequency, float sample_rate)
+{
+    const float fundamental = 4 / IMP_PI * current_amps * droop(frequency, sample_rate);
+    return fundamental > 0 ? amplitude_volts / fundamental : 0;
+}
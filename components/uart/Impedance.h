@@ -0,0 +1,68 @@
+/*
+ * Impedance.h
+ *
+ * Electrode impedance from the AC lead-off excitation: the ADS drives a
+ * square wave current of +-I through each selected input, the voltage
+ * it causes across the electrode shows up in the channel data at the
+ * excitation frequency. A Goertzel filter per channel picks out that
+ * component:
+ *
+ *   s[n] = x[n] - x[0] + c * s[n-1] - s[n-2],  c = 2 cos(2 pi k / N)
+ *
+ * with N chosen to hold a whole number k of excitation cycles, so the
+ * electrode offset (and its remains after subtracting x[0]) falls
+ * exactly into a zero of the detector.
+ *
+ * A drifting offset does not: a ramp of slope a leaks a / sin(pi k / N)
+ * into the bin. The means of the first and the last floor(k / 2) cycles
+ * give the slope, amplitude() takes the ramp's known bin value
+ * (-N / (e^jw - 1) times the slope) out again.
+ *
+ * The fundamental of the square wave is 4 / pi * I, the ADS sinc^3
+ * decimation filter takes sinc(f / fs)^3 of it; ohms() undoes both.
+ * At fs / 4 the odd harmonics alias onto the bin as well and add
+ * about 1.5 %.
+ *
+ * No ESP-IDF dependencies.
+ */
+
+#ifndef _IMPEDANCE_H
+#define _IMPEDANCE_H
+
+#include <stdint.h>
+
+#define IMP_MAX_CHANNELS 8
+
+class ImpedanceMeter
+{
+public:
+    ImpedanceMeter();
+    // whole cycles of frequency in about seconds, after skipping settle samples
+    void configure(uint8_t num_channels, float sample_rate, float frequency, float seconds, uint32_t settle);
+    bool push(const int32_t *codes); // true once the last sample is in
+    bool done() const { return count >= settleSamples + length; }
+    uint32_t samples() const { return settleSamples + length; }
+    uint8_t channels() const { return numChannels; }
+    float amplitude(uint8_t ch) const; // peak, codes, at the excitation frequency
+
+    static float droop(float frequency, float sample_rate); // sinc^3 filter gain
+    static float ohms(float amplitude_volts, float current_amps, float frequency, float sample_rate);
+
+private:
+    float coeff;
+    float cosine;
+    float sine;
+    float s1[IMP_MAX_CHANNELS];
+    float s2[IMP_MAX_CHANNELS];
+    int32_t first[IMP_MAX_CHANNELS];
+    int64_t head[IMP_MAX_CHANNELS]; // sums over the first and the last block
+    int64_t tail[IMP_MAX_CHANNELS];
+    float halfAngle;
+    uint32_t length;
+    uint32_t block; // whole cycles, 0 if too short to take out a drift
+    uint32_t settleSamples;
+    uint32_t count;
+    uint8_t numChannels;
+};
+
+#endif // _IMPEDANCE_H
@@ -54,6 +54,7 @@ JsonCommand::JsonCommand()
       commandCount(0),
       defaultHandler(NULL),
       term('\n'), // default terminator for commands, newline character
+      numParameters(0),
       last(NULL)
 {
 
@@ -219,6 +220,7 @@ void JsonCommand::readSerial()
             cJSON_Delete(cj_root);
             ESP_LOGI(TAG, "Free Heap after del root %d", esp_get_free_heap_size());
             // Execute the stored handler function for the command
+            numParameters = (array_size > 0) ? array_size : 0;
             (*commandList[command_num].command_function)(register_number, register_value);
             clearBuffer();
         }
@@ -42,6 +42,7 @@
 #define RESPONSE_ERROR 500
 #define RESPONSE_NOT_IMPLEMENTED 501
 #define RESPONSE_NO_ACTIVE_CHANNELS 502
+#define RESPONSE_LINK_OVERLOAD 503
 
 
 extern const char *COMMAND_KEY;
@@ -66,6 +67,7 @@ extern const char *STATUS_TEXT_WRONG_REG_VAL;
 extern const char *STATUS_TEXT_ERROR;
 extern const char *STATUS_TEXT_NOT_IMPLEMENTED;
 extern const char *STATUS_TEXT_NO_ACTIVE_CHANNELS;
+extern const char *STATUS_TEXT_LINK_OVERLOAD;
 
 
 typedef void (*command_func)(unsigned char, unsigned char);
@@ -84,6 +86,7 @@ public:
     char * next();           // Returns pointer to next token found in command buffer (for getting arguments to commands).
     void sendJsonLinesResponse(int status_code, char *status_text);    // send a simple JSON Lines response
     void sendJsonLinesDocResponse(cJSON *doc);                  // send a JsonDocument as a JSON Lines response
+    uint8_t parameters() const { return numParameters; } // PARAMETERS given with the command being run, so handlers can tell a missing one from 0
     //void sendMessagePackResponse(int status_code, char *status_text);  // send a simple MessagePack response
     //void sendMessagePackDocResponse(JsonDocument &doc);                // send a JsonDocument as a MessagePack response
 
@@ -104,6 +107,7 @@ private:
 
     char buffer[JSONCOMMAND_BUFFER + 1]; // Buffer of stored characters while waiting for terminator character
     uint8_t bufPos;                      // Current position in the buffer
+    uint8_t numParameters;               // of the command being run
     char *last;                          // State variable used by strtok_r during processing
 
     int findCommand(const char *command);
@@ -0,0 +1,44 @@
+/*
+ * LeadOff.h
+ *
+ * Decoding of the 24 bit status word that precedes the channel data in
+ * every RDATAC/RDATA read (ADS1299 datasheet p.60):
+ *
+ *   1100 | LOFF_STATP[7:0] | LOFF_STATN[7:0] | GPIO[7:4]
+ *
+ * The LOFF_STATP/LOFF_STATN bits line up with the LOFF_STATP_bits and
+ * LOFF_STATN_bits enums in ads129x.h (IN1P_OFF = bit 0 ...).
+ */
+
+#ifndef _LEAD_OFF_H
+#define _LEAD_OFF_H
+
+#include <stdint.h>
+
+#define ADS_STATUS_SZ 3
+#define ADS_STATUS_PREFIX 0xC0
+#define ADS_STATUS_PREFIX_MASK 0xF0
+
+// true if the status word starts with the fixed 1100 pattern
+static inline bool status_valid(const uint8_t *status)
+{
+    return (status[0] & ADS_STATUS_PREFIX_MASK) == ADS_STATUS_PREFIX;
+}
+
+static inline uint8_t status_loff_statp(const uint8_t *status)
+{
+    return (uint8_t)((status[0] << 4) | (status[1] >> 4));
+}
+
+static inline uint8_t status_loff_statn(const uint8_t *status)
+{
+    return (uint8_t)((status[1] << 4) | (status[2] >> 4));
+}
+
+// LOFF_STATP in the high, LOFF_STATN in the low byte
+static inline uint16_t status_leadoff(const uint8_t *status)
+{
+    return (uint16_t)((status_loff_statp(status) << 8) | status_loff_statn(status));
+}
+
+#endif // _LEAD_OFF_H
@@ -0,0 +1,186 @@
+/*
+ * Montage.cpp
+ *
+ * Sparse integer re-referencing matrix, see Montage.h
+ */
+
+#include "Montage.h"
+#include "LeadOff.h"
+
+#define MONTAGE_AVERAGE_INDEX MONTAGE_MAX_CHANNELS // x[] slot of the average
+
+Montage::Montage()
+{
+    clear();
+}
+
+void Montage::clear()
+{
+    numTerms = 0;
+    numOutputs = 0;
+    numInputs = 0;
+    shiftBits = 0;
+    refMask = 0;
+    refCount = 0;
+}
+
+bool Montage::addTerm(uint8_t out, uint8_t in, int8_t weight)
+{
+    if (out >= MONTAGE_MAX_CHANNELS || (in >= MONTAGE_MAX_CHANNELS && in != MONTAGE_AVERAGE) || weight == 0 ||
+        numTerms >= MONTAGE_MAX_TERMS)
+        return false;
+    int gain = (weight < 0) ? -weight : weight;
+    uint8_t at = 0;
+    for (; at < numTerms && termOut[at] <= out; at++)
+    {
+        if (termOut[at] == out)
+            gain += (termWeight[at] < 0) ? -termWeight[at] : termWeight[at];
+    }
+    if (gain > MONTAGE_MAX_GAIN)
+        return false;
+    for (uint8_t i = numTerms; i > at; i--)
+    {
+        termOut[i] = termOut[i - 1];
+        termIn[i] = termIn[i - 1];
+        termWeight[i] = termWeight[i - 1];
+    }
+    termOut[at] = out;
+    termIn[at] = (in == MONTAGE_AVERAGE) ? MONTAGE_AVERAGE_INDEX : in;
+    termWeight[at] = weight;
+    numTerms++;
+    if (out >= numOutputs)
+        numOutputs = out + 1;
+    if (in != MONTAGE_AVERAGE && in >= numInputs)
+        numInputs = in + 1;
+    return true;
+}
+
+bool Montage::setShift(uint8_t shift)
+{
+    if (shift > MONTAGE_MAX_SHIFT)
+        return false;
+    shiftBits = shift;
+    return true;
+}
+
+void Montage::setReference(uint8_t mask)
+{
+    refMask = mask;
+    refCount = 0;
+    for (uint8_t ch = 0; ch < MONTAGE_MAX_CHANNELS; ch++)
+    {
+        if (mask & (1 << ch))
+        {
+            refCount++;
+            if (ch >= numInputs)
+                numInputs = ch + 1;
+        }
+    }
+}
+
+bool Montage::commonAverage(uint8_t mask)
+{
+    clear();
+    if (!mask)
+        return false;
+    setReference(mask);
+    uint8_t out = 0;
+    for (uint8_t ch = 0; ch < MONTAGE_MAX_CHANNELS; ch++)
+    {
+        if (mask & (1 << ch))
+        {
+            addTerm(out, ch, 1);
+            addTerm(out, MONTAGE_AVERAGE, -1);
+            out++;
+        }
+    }
+    return true;
+}
+
+bool Montage::bipolar(uint8_t a, uint8_t b)
+{
+    if (a == b || a >= MONTAGE_MAX_CHANNELS || b >= MONTAGE_MAX_CHANNELS || numOutputs >= MONTAGE_MAX_CHANNELS ||
+        numTerms + 2 > MONTAGE_MAX_TERMS)
+        return false;
+    const uint8_t out = numOutputs;
+    addTerm(out, a, 1);
+    addTerm(out, b, -1);
+    return true;
+}
+
+static inline int32_t code_at(const uint8_t *p)
+{
+    return ((int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8))) >> 8;
+}
+
+void Montage::apply(uint8_t *frame) const
+{
+    int32_t x[MONTAGE_MAX_CHANNELS + 1];
+    uint8_t *p = &frame[ADS_STATUS_SZ];
+    for (uint8_t ch = 0; ch < numInputs; ch++)
+        x[ch] = code_at(&p[3 * ch]);
+    if (refCount) // |sum| < 2^26, rounded half away from zero
+    {
+        int32_t sum = 0;
+        for (uint8_t ch = 0; ch < numInputs; ch++)
+        {
+            if (refMask & (1 << ch))
+                sum += x[ch];
+        }
+        const int32_t half = refCount / 2;
+        x[MONTAGE_AVERAGE_INDEX] = ((sum >= 0) ? sum + half : sum - half) / refCount;
+    }
+    const int32_t round = shiftBits ? 1 << (shiftBits - 1) : 0;
+    uint8_t t = 0;
+    for (uint8_t k = 0; k < numOutputs; k++, p += 3)
+    {
+        int32_t acc = round; // |acc| <= MONTAGE_MAX_GAIN * 2^23 < 2^31
+        for (; t < numTerms && termOut[t] == k; t++)
+            acc += termWeight[t] * x[termIn[t]];
+        acc >>= shiftBits;
+        if (acc > 0x7fffff)
+            acc = 0x7fffff;
+        else if (acc < -0x800000)
+            acc = -0x800000;
+        p[0] = acc >> 16;
+        p[1] = acc >> 8;
+        p[2] = acc;
+    }
+    for (uint8_t k = numOutputs; k < MONTAGE_MAX_CHANNELS; k++, p += 3)
+        p[0] = p[1] = p[2] = 0;
+}
+
+uint8_t Montage::wireChannels() const
+{
+    return (numOutputs <= 4) ? 4 : (numOutputs <= 6) ? 6 : 8;
+}
+
+int8_t Montage::term(uint8_t i, uint8_t *out, uint8_t *in) const
+{
+    if (i >= numTerms)
+        return 0;
+    *out = termOut[i];
+    *in = (termIn[i] == MONTAGE_AVERAGE_INDEX) ? MONTAGE_AVERAGE : termIn[i];
+    return termWeight[i];
+}
+
+bool Montage::usesAverage() const
+{
+    for (uint8_t i = 0; i < numTerms; i++)
+    {
+        if (termIn[i] == MONTAGE_AVERAGE_INDEX)
+            return true;
+    }
+    return false;
+}
+
+uint8_t Montage::inputs(uint8_t out) const
+{
+    uint8_t mask = 0;
+    for (uint8_t i = 0; i < numTerms; i++)
+    {
+        if (termOut[i] == out && termWeight[i])
+            mask |= (termIn[i] == MONTAGE_AVERAGE_INDEX) ? refMask : (uint8_t)(1 << termIn[i]);
+    }
+    return mask;
+}
@@ -0,0 +1,69 @@
+/*
+ * Montage.h
+ *
+ * Re-referencing on the device ("montage" command): a sparse integer
+ * matrix from the ADS channels to the channels that are sent,
+ *
+ *   out[k] = round(sum(weight * x[in]) / 2^shift)
+ *
+ * where in is an ADS channel or MONTAGE_AVERAGE, the common average of the
+ * reference channels (rounded to whole codes). Common average reference
+ * is out[k] = x[k] - average, a bipolar derivation out[k] = x[a] - x[b].
+ *
+ * apply() rewrites an RDATAC frame in place: the outputs go into the
+ * first channel slots, the slots after them are zeroed, so fewer outputs
+ * than inputs can go out in a smaller frame (wireChannels()).
+ *
+ * Weights are int8 and their magnitudes per output add up to at most
+ * MONTAGE_MAX_GAIN, so the sums fit 32 bits and the result is exact.
+ *
+ * No ESP-IDF dependencies.
+ */
+
+#ifndef _MONTAGE_H
+#define _MONTAGE_H
+
+#include <stdint.h>
+
+#define MONTAGE_MAX_CHANNELS 8
+#define MONTAGE_MAX_TERMS 32
+#define MONTAGE_MAX_SHIFT 7
+#define MONTAGE_MAX_GAIN 255   // sum of |weight| per output
+#define MONTAGE_AVERAGE 0xff   // input: average of the reference channels
+
+class Montage
+{
+public:
+    Montage();
+    void clear();
+    // ADS channels 0..7 or MONTAGE_AVERAGE; false if full or over MONTAGE_MAX_GAIN
+    bool addTerm(uint8_t out, uint8_t in, int8_t weight);
+    bool setShift(uint8_t shift); // weights in units of 2^-shift
+    void setReference(uint8_t mask); // channels of MONTAGE_AVERAGE, bit 0 = ADS channel 1
+    bool commonAverage(uint8_t mask); // out k = k-th channel of mask - average of mask
+    bool bipolar(uint8_t a, uint8_t b); // next output = x[a] - x[b]
+
+    void apply(uint8_t *frame) const; // RDATAC frame: status + channels
+
+    uint8_t outputs() const { return numOutputs; }
+    uint8_t wireChannels() const; // 4, 6 or 8 frame channels for the outputs
+    uint8_t terms() const { return numTerms; }
+    int8_t term(uint8_t i, uint8_t *out, uint8_t *in) const; // returns the weight
+    uint8_t shift() const { return shiftBits; }
+    uint8_t reference() const { return refMask; }
+    bool usesAverage() const;
+    uint8_t inputs(uint8_t out) const; // ADS channels output out depends on, bit 0 = channel 1
+
+private:
+    uint8_t termOut[MONTAGE_MAX_TERMS]; // sorted by output
+    uint8_t termIn[MONTAGE_MAX_TERMS];  // MONTAGE_MAX_CHANNELS for the average
+    int8_t termWeight[MONTAGE_MAX_TERMS];
+    uint8_t numTerms;
+    uint8_t numOutputs;
+    uint8_t numInputs; // highest ADS channel used + 1
+    uint8_t shiftBits;
+    uint8_t refMask;
+    uint8_t refCount;
+};
+
+#endif // _MONTAGE_H
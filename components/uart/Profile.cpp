@@ -0,0 +1,88 @@
+/*
+ * Profile.cpp
+ *
+ * NVS storage of streaming profiles, see Profile.h
+ */
+
+#include <string.h>
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include "Profile.h"
+
+#define TAG "profile"
+#define PROFILE_NAMESPACE "ads_profiles"
+#define PROFILE_AUTOSTART_KEY "~autostart" // not a valid profile name
+
+static bool valid_name(const char *name)
+{
+    return name != NULL && name[0] != 0 && name[0] != '~' && strlen(name) <= PROFILE_NAME_LEN;
+}
+
+bool profile_init()
+{
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    ESP_LOGI(TAG, "nvs init %d", err);
+    return err == ESP_OK;
+}
+
+bool profile_save(const char *name, const AdsProfile *profile)
+{
+    nvs_handle_t handle;
+    if (!valid_name(name) || nvs_open(PROFILE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return false;
+    bool ok = nvs_set_blob(handle, name, profile, sizeof(AdsProfile)) == ESP_OK && nvs_commit(handle) == ESP_OK;
+    nvs_close(handle);
+    return ok;
+}
+
+bool profile_load(const char *name, AdsProfile *profile)
+{
+    nvs_handle_t handle;
+    if (!valid_name(name) || nvs_open(PROFILE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return false;
+    size_t size = sizeof(AdsProfile);
+    bool ok = nvs_get_blob(handle, name, profile, &size) == ESP_OK && size == sizeof(AdsProfile) &&
+              profile->version == PROFILE_VERSION && profile->num_registers <= PROFILE_MAX_REGS &&
+              profile->montage_terms <= MONTAGE_MAX_TERMS;
+    nvs_close(handle);
+    return ok;
+}
+
+bool profile_erase(const char *name)
+{
+    nvs_handle_t handle;
+    if (!valid_name(name) || nvs_open(PROFILE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return false;
+    bool ok = nvs_erase_key(handle, name) == ESP_OK && nvs_commit(handle) == ESP_OK;
+    nvs_close(handle);
+    return ok;
+}
+
+bool profile_set_autostart(const char *name)
+{
+    nvs_handle_t handle;
+    if ((name != NULL && !valid_name(name)) || nvs_open(PROFILE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return false;
+    esp_err_t err = (name != NULL) ? nvs_set_str(handle, PROFILE_AUTOSTART_KEY, name)
+                                   : nvs_erase_key(handle, PROFILE_AUTOSTART_KEY);
+    bool ok = (err == ESP_OK || (name == NULL && err == ESP_ERR_NVS_NOT_FOUND)) && nvs_commit(handle) == ESP_OK;
+    nvs_close(handle);
+    return ok;
+}
+
+bool profile_get_autostart(char *name)
+{
+    nvs_handle_t handle;
+    if (nvs_open(PROFILE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return false; // namespace does not exist before the first save
+    size_t size = PROFILE_NAME_LEN + 1;
+    bool ok = nvs_get_str(handle, PROFILE_AUTOSTART_KEY, name, &size) == ESP_OK;
+    nvs_close(handle);
+    return ok;
+}
@@ -0,0 +1,65 @@
+/*
+ * Profile.h
+ *
+ * Named streaming profiles in NVS: the ADS register set plus the
+ * protocol and processing settings, so a session can be restored with one
+ * command, or without any host command at all via autostart.
+ *
+ * Saved: registers, protocol and encoding, filter, decimation, band
+ * power, stats, lead-off events and status word, heartbeat, quantize,
+ * artifacts, montage, link mode and pipeline. Not saved: trace, bench,
+ * burst and triggered captures, impedance and markers, which are set up
+ * for one session. Profiles of an older PROFILE_VERSION do not load.
+ */
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdint.h>
+#include "Montage.h"
+
+#define PROFILE_VERSION 2
+#define PROFILE_FIRST_REG 0x01   // CONFIG1
+#define PROFILE_MAX_REGS 25      // CONFIG1 .. WCT2 (ADS129x), the ADS1299 ends at CONFIG4
+#define PROFILE_NAME_LEN 15      // NVS key limit
+
+struct AdsProfile
+{
+    uint8_t version;
+    uint8_t num_registers;
+    uint8_t registers[PROFILE_MAX_REGS]; // from PROFILE_FIRST_REG on
+    uint8_t protocol_mode;
+    uint8_t base64_mode;
+    uint8_t channel_mask; // active channels when saved, bit 0 = channel 1
+    uint8_t filter_notch_hz;
+    uint8_t filter_highpass;
+    uint8_t decimate_ratio;
+    uint8_t bandpower_mode;
+    uint8_t bandpower_rate;
+    uint8_t leadoff_events;
+    uint8_t drop_status;
+    uint8_t heartbeat_seconds;
+    uint8_t stats_mode;
+    uint16_t stats_window_ms;
+    uint8_t quantize_enabled;
+    uint8_t quantize_shift;
+    uint8_t artifacts_enabled;
+    int32_t artifact_step;
+    uint8_t montage_terms; // the montage setting, terms as Montage::term() gives them
+    uint8_t montage_shift;
+    uint8_t montage_reference;
+    uint8_t montage_out[MONTAGE_MAX_TERMS];
+    uint8_t montage_in[MONTAGE_MAX_TERMS];
+    int8_t montage_weight[MONTAGE_MAX_TERMS];
+    uint8_t link_mode;
+    uint8_t pipeline_enabled;
+};
+
+bool profile_init();
+bool profile_save(const char *name, const AdsProfile *profile);
+bool profile_load(const char *name, AdsProfile *profile);
+bool profile_erase(const char *name);
+bool profile_set_autostart(const char *name); // NULL turns autostart off
+bool profile_get_autostart(char *name);       // name holds PROFILE_NAME_LEN + 1
+
+#endif // _PROFILE_H
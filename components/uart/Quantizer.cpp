@@ -0,0 +1,91 @@
+/*
+ * Quantizer.cpp
+ *
+ * 24 to 16 bit quantisation with adaptive shifts, see Quantizer.h
+ */
+
+#include <string.h>
+#include "Quantizer.h"
+#include "LeadOff.h"
+
+Quantizer::Quantizer()
+    : numChannels(0), adaptive(false), windowPos(0), clips(0)
+{
+    memset(shifts, 0, sizeof(shifts));
+    memset(peak, 0, sizeof(peak));
+}
+
+void Quantizer::configure(uint8_t num_channels, uint8_t shift)
+{
+    numChannels = (num_channels > QUANT_MAX_CHANNELS) ? QUANT_MAX_CHANNELS : num_channels;
+    adaptive = (shift == QUANT_AUTO);
+    if (!adaptive && shift > QUANT_MAX_SHIFT)
+        shift = QUANT_MAX_SHIFT;
+    memset(shifts, adaptive ? 0 : shift, sizeof(shifts));
+    memset(peak, 0, sizeof(peak));
+    windowPos = 0;
+    clips = 0;
+}
+
+int16_t Quantizer::quantize(int32_t code, uint8_t shift)
+{
+    int32_t v = shift ? (code + (1L << (shift - 1))) >> shift : code;
+    if (v > 32767)
+        return 32767;
+    if (v < -32768)
+        return -32768;
+    return (int16_t)v;
+}
+
+// smallest shift that leaves QUANT_HEADROOM_BITS above peak
+uint8_t Quantizer::required(uint32_t peak) const
+{
+    uint8_t s = 0;
+    while (s < QUANT_MAX_SHIFT && (peak >> s) >= (1UL << (15 - QUANT_HEADROOM_BITS)))
+        s++;
+    return s;
+}
+
+bool Quantizer::process(uint8_t *frame)
+{
+    bool changed = false;
+    uint8_t *in = &frame[ADS_STATUS_SZ];
+    uint8_t *out = &frame[ADS_STATUS_SZ];
+    bool window_end = adaptive && ++windowPos == QUANT_WINDOW;
+    if (window_end)
+        windowPos = 0;
+
+    // channel ch is read from 3 * ch before 2 * ch is written, so in place is safe
+    for (uint8_t ch = 0; ch < numChannels; ch++, in += 3, out += 2)
+    {
+        int32_t code = ((int32_t)(((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8))) >> 8;
+        if (adaptive)
+        {
+            uint32_t mag = (code < 0) ? -code : code;
+            if (mag > peak[ch])
+                peak[ch] = mag;
+            uint8_t need = required(mag);
+            if (need > shifts[ch])
+            {
+                shifts[ch] = need; // up right away, no clipping
+                changed = true;
+            }
+            if (window_end)
+            {
+                need = required(peak[ch]);
+                if (need < shifts[ch])
+                {
+                    shifts[ch] = need;
+                    changed = true;
+                }
+                peak[ch] = 0;
+            }
+        }
+        int16_t q = quantize(code, shifts[ch]);
+        if (q == 32767 || q == -32768)
+            clips++;
+        out[0] = (uint8_t)((uint16_t)q >> 8);
+        out[1] = (uint8_t)q;
+    }
+    return changed;
+}
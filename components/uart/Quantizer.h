@@ -0,0 +1,53 @@
+/*
+ * Quantizer.h
+ *
+ * 16 bit streaming of the 24 bit codes: every channel is sent as
+ * round(code / 2^shift), saturated to int16. The shift of a channel is
+ * either fixed or follows its signal: it goes up at once if a sample
+ * would not fit with QUANT_HEADROOM_BITS to spare, and down at the end of
+ * a window of QUANT_WINDOW samples whose peak allows a smaller one.
+ *
+ * process() works in place on an RDATAC frame: the channels behind the
+ * status word become big endian int16s, so the frame encoders just send
+ * 2 bytes per channel. The host gets code ~ value << shift, the error is
+ * at most 2^(shift - 1) codes unless the value was clipped.
+ *
+ * No ESP-IDF dependencies.
+ */
+
+#ifndef _QUANTIZER_H
+#define _QUANTIZER_H
+
+#include <stdint.h>
+
+#define QUANT_MAX_CHANNELS 8
+#define QUANT_MAX_SHIFT 8       // 24 -> 16 bits
+#define QUANT_AUTO 0xff         // shift chosen per channel
+#define QUANT_WINDOW 256        // samples before the shift may go down
+#define QUANT_HEADROOM_BITS 1   // room for the signal to double
+
+class Quantizer
+{
+public:
+    Quantizer();
+    void configure(uint8_t num_channels, uint8_t shift); // shift 0..QUANT_MAX_SHIFT or QUANT_AUTO
+    bool process(uint8_t *frame); // true if a shift changed with this sample
+    uint8_t shift(uint8_t ch) const { return shifts[ch]; }
+    uint8_t channels() const { return numChannels; }
+    uint32_t clipped() const { return clips; }
+
+    static int16_t quantize(int32_t code, uint8_t shift);
+    static int32_t reconstruct(int16_t value, uint8_t shift) { return (int32_t)value * (1L << shift); }
+
+private:
+    uint8_t required(uint32_t peak) const;
+
+    uint8_t numChannels;
+    bool adaptive;
+    uint16_t windowPos;
+    uint32_t clips; // values at the int16 limits
+    uint8_t shifts[QUANT_MAX_CHANNELS];
+    uint32_t peak[QUANT_MAX_CHANNELS]; // |code| maximum of the current window
+};
+
+#endif // _QUANTIZER_H
@@ -0,0 +1,64 @@
+/*
+ * SampleRing.h
+ *
+ * Lock-free single producer / single consumer ring for handing samples
+ * from the acquisition core to the processing core. The producer fills a
+ * slot in place (claim, write, publish), the consumer reads it in place
+ * (peek, read, release), so no sample is copied and neither side ever
+ * blocks or takes a lock. head and tail only ever grow and are each
+ * written by one side.
+ *
+ * No ESP-IDF dependencies.
+ */
+
+#ifndef _SAMPLE_RING_H
+#define _SAMPLE_RING_H
+
+#include <stdint.h>
+
+template <typename T, uint32_t N> // N must be a power of 2
+class SampleRing
+{
+public:
+    SampleRing() : head(0), tail(0), maxFill(0) {}
+
+    // only while neither side is running
+    void clear()
+    {
+        head = 0;
+        tail = 0;
+        maxFill = 0;
+    }
+
+    // producer
+    T *claim()
+    {
+        uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        uint32_t fill = head - t;
+        if (fill >= N)
+            return 0;
+        if (fill + 1 > maxFill)
+            maxFill = fill + 1;
+        return &slots[head & (N - 1)];
+    }
+    void publish() { __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE); }
+
+    // consumer
+    T *peek()
+    {
+        uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        return (h == tail) ? 0 : &slots[tail & (N - 1)];
+    }
+    void release() { __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE); }
+
+    uint32_t fill() const { return head - tail; } // approximate from the other side
+    uint32_t highWater() const { return maxFill; }
+
+private:
+    T slots[N];
+    volatile uint32_t head; // written by the producer only
+    volatile uint32_t tail; // written by the consumer only
+    uint32_t maxFill;       // producer side statistics
+};
+
+#endif // _SAMPLE_RING_H
@@ -0,0 +1,58 @@
+/*
+ * Synth.cpp
+ *
+ * Benchmark sample generator, see Synth.h
+ */
+
+#include "Synth.h"
+
+// 32 bit integer hash with good avalanche (lowbias32)
+static inline uint32_t hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+uint32_t SynthSource::value(uint32_t sample, uint8_t channel) const
+{
+    uint32_t n = (sample << 3) | channel;
+    if (pat == SYNTH_PRNG)
+        return hash32(seed + n) >> 8;
+    return n & 0xffffff;
+}
+
+void SynthSource::fill(uint8_t *data, uint32_t sample) const
+{
+    data[0] = 0xC0; // valid status word, no lead-off, GPIO 0
+    data[1] = 0;
+    data[2] = 0;
+    for (uint8_t ch = 0; ch < SYNTH_CHANNELS; ch++)
+    {
+        uint32_t v = value(sample, ch);
+        uint8_t *p = &data[3 + 3 * ch];
+        p[0] = v >> 16; // big endian like the ADS
+        p[1] = v >> 8;
+        p[2] = v;
+    }
+}
+
+uint32_t SynthSource::verify(const uint8_t *data, uint32_t sample) const
+{
+    uint8_t ref[SYNTH_FRAME_SZ];
+    fill(ref, sample);
+    uint32_t errors = 0;
+    for (int i = 0; i < SYNTH_FRAME_SZ; i++)
+    {
+        uint8_t x = data[i] ^ ref[i];
+        while (x)
+        {
+            errors += x & 1;
+            x >>= 1;
+        }
+    }
+    return errors;
+}
@@ -0,0 +1,47 @@
+/*
+ * Synth.h
+ *
+ * Deterministic sample generator for link benchmarking without an ADC.
+ * Fills a 27 byte RDATAC frame (status word + 8 x 24 bit channels) that
+ * depends only on the sample number, so the receiver can recompute every
+ * byte of every frame it gets, dropped frames do not throw it off.
+ *
+ * Patterns:
+ *   SYNTH_COUNTER  channel value = (sample << 3 | channel) & 0xffffff
+ *   SYNTH_PRNG     channel value = hash(seed + sample * 8 + channel) >> 8
+ *
+ * No ESP-IDF dependencies, host/hackeeg_synthcheck links the same file to
+ * check what it receives.
+ */
+
+#ifndef _SYNTH_H
+#define _SYNTH_H
+
+#include <stdint.h>
+
+#define SYNTH_COUNTER 0
+#define SYNTH_PRNG 1
+#define SYNTH_CHANNELS 8
+#define SYNTH_FRAME_SZ 27 // status word + SYNTH_CHANNELS x 3 bytes
+
+class SynthSource
+{
+public:
+    SynthSource() : pat(SYNTH_COUNTER), seed(0) {}
+    void configure(uint8_t pattern, uint32_t seed_value)
+    {
+        pat = (pattern == SYNTH_PRNG) ? SYNTH_PRNG : SYNTH_COUNTER;
+        seed = seed_value;
+    }
+    uint8_t pattern() const { return pat; }
+
+    uint32_t value(uint32_t sample, uint8_t channel) const; // 24 bit code
+    void fill(uint8_t *data, uint32_t sample) const;         // SYNTH_FRAME_SZ bytes
+    uint32_t verify(const uint8_t *data, uint32_t sample) const; // bit errors against fill()
+
+private:
+    uint8_t pat;
+    uint32_t seed;
+};
+
+#endif // _SYNTH_H
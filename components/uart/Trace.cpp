@@ -0,0 +1,67 @@
+/*
+ * Trace.cpp
+ *
+ * Hot path latency trace, see Trace.h
+ */
+
+#include <string.h>
+#include <algorithm>
+#include "Trace.h"
+
+TraceRing::TraceRing()
+    : active(false)
+{
+    clear();
+}
+
+void TraceRing::clear()
+{
+    head = 0;
+    count = 0;
+    begin(0, 0);
+}
+
+void TraceRing::commit()
+{
+    if (!active)
+        return;
+    ring[head] = cur;
+    if (++head == TRACE_RING)
+        head = 0;
+    if (count < TRACE_RING)
+        count++;
+}
+
+const TraceRecord &TraceRing::record(uint16_t i) const
+{
+    return ring[(head + TRACE_RING - count + i) % TRACE_RING];
+}
+
+/**
+ * Cycles from DRDY to the given stage over the records in the ring. The
+ * ring keeps being written while streaming, stop tracing first for a
+ * consistent snapshot.
+ */
+void TraceRing::stats(uint8_t stage, TraceStats &s) const
+{
+    uint32_t deltas[TRACE_RING];
+    uint16_t n = 0;
+    uint64_t sum = 0;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint32_t d = record(i).delta[stage];
+        if (d == TRACE_NONE)
+            continue;
+        deltas[n++] = d;
+        sum += d;
+    }
+    memset(&s, 0, sizeof(s));
+    s.count = n;
+    if (n == 0)
+        return;
+    std::sort(deltas, deltas + n);
+    s.min = deltas[0];
+    s.max = deltas[n - 1];
+    s.avg = (uint32_t)(sum / n);
+    s.p99 = deltas[(n * 99) / 100];
+}
@@ -0,0 +1,93 @@
+/*
+ * Trace.h
+ *
+ * Latency trace of the streaming hot path. For every sample the cycle
+ * counter (see Cycles.h) is taken at DRDY in the ISR and at each stage of
+ * the acquisition task, the stages are stored relative to DRDY in a RAM
+ * ring of the last TRACE_RING samples.
+ *
+ * Replaces probing LED_PIN with a scope: the stats give min/avg/p99/max
+ * per stage, the raw records can be dumped to the host.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include "Cycles.h"
+
+#define TRACE_RING 256
+#define TRACE_NONE 0xffffffff // stage not reached, e.g. sample dropped by decimation
+
+enum TraceStage
+{
+    TRACE_WAKE = 0, // acquisition task running
+    TRACE_SPI,      // sample read
+    TRACE_ENCODE,   // processed and encoded
+    TRACE_QUEUED,   // written to the UART
+    TRACE_NUM_STAGES
+};
+
+struct TraceRecord
+{
+    uint32_t sample;                  // sample #
+    uint32_t drdy;                    // cycle count at DRDY
+    uint32_t delta[TRACE_NUM_STAGES]; // cycles since DRDY
+};
+
+struct TraceStats
+{
+    uint16_t count; // records that reached the stage
+    uint32_t min;
+    uint32_t avg;
+    uint32_t p99;
+    uint32_t max;
+};
+
+class TraceRing
+{
+public:
+    TraceRing();
+    void clear();
+    void enable(bool on) { active = on; }
+    bool enabled() const { return active; }
+
+    // hot path, all cheap
+    void begin(uint32_t sample, uint32_t drdy)
+    {
+        cur.sample = sample;
+        cur.drdy = drdy;
+        base = drdy;
+        for (int s = 0; s < TRACE_NUM_STAGES; s++)
+            cur.delta[s] = TRACE_NONE;
+    }
+    void mark(uint8_t stage)
+    {
+        if (active)
+            cur.delta[stage] = cycle_count() - base;
+    }
+    void stamp(uint8_t stage, uint32_t cycles) // stage taken earlier on the core of DRDY
+    {
+        if (active)
+            cur.delta[stage] = cycles - cur.drdy;
+    }
+    void handover(uint32_t elapsed) // now on another core, elapsed cycles since DRDY
+    {
+        base = cycle_count() - elapsed;
+    }
+    void commit();
+
+    uint16_t size() const { return count; }
+    const TraceRecord &record(uint16_t i) const; // 0 = oldest
+    void stats(uint8_t stage, TraceStats &s) const;
+
+private:
+    volatile bool active;
+    TraceRecord cur;
+    uint32_t base; // DRDY in this core's cycle count
+    TraceRecord ring[TRACE_RING];
+    uint16_t head;  // next write position
+    uint16_t count; // valid records
+};
+
+#endif // _TRACE_H
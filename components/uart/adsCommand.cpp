@@ -20,9 +20,14 @@
 #include "string.h"
 #include "adsCommand.h"
 #include "ads129x.h"
+#include "Cycles.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
+#include "driver/timer.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ipc.h"
+#include "sdkconfig.h"
 
 #define TAG "adsCmd"
 #define SPI_TRANSFER_SZ 64
@@ -34,24 +39,45 @@ SemaphoreHandle_t xSemaphore = NULL;
 
 volatile bool is_rdatac = false;
 volatile bool is_rdata = false;
+volatile bool is_bench = false; // timer instead of DRDY, see bench_start
 volatile uint32_t current_sample = 0;
 volatile bool handling_data = false;
+volatile uint32_t drdy_cycles = 0; // cycle count at the last DRDY, for the latency trace
+volatile uint32_t drdy_collisions = 0; // DRDYs while the last sample was still being handled
+volatile bool trigger_pending = false;  // edge on TRIGGER_PIN, taken by the next sample
+volatile uint32_t sample_seq = 0;       // odd while the ISR updates current_sample and sample_us
+volatile uint32_t sample_us = 0;        // esp_timer at every DRDY, for marker offsets
+QueueHandle_t marker_queue = NULL;      // MarkerEvents for the rdatac task
+volatile bool marker_waiting = false;   // saves the rdatac task a queue check per sample
 TaskHandle_t rdatac_task_handle = NULL;
 TaskHandle_t read_task_handle = NULL;
+static BaseType_t drdy_core = 0;        // where the GPIO ISRs run, the bench timer ISR goes there too
 
 
 uint8_t tx_data_NOP[SPI_TRANSFER_SZ] = {0}; //NOPs for receiving data
 
+// next sample and when it came, as one pair for marker_stamp on either core
+static inline void IRAM_ATTR publish_sample()
+{
+    sample_seq++;
+    __sync_synchronize();
+    current_sample++;
+    sample_us = esp_timer_get_time();
+    __sync_synchronize();
+    sample_seq++;
+}
+
 static void IRAM_ATTR drdy_interrupt(void *arg)
 {
     static BaseType_t xHigherPriorityTaskWoken;
     xHigherPriorityTaskWoken = pdFALSE;
-    if ((is_rdatac) | (is_rdata))//get ino ISR only in rdatac or rdata mode
+    if (((is_rdatac) | (is_rdata)) && !is_bench)//get ino ISR only in rdatac or rdata mode
     {
         //spi_data_available++;
-        current_sample++; // increment even if there is a collison
+        publish_sample(); // increment even if there is a collison
         if (!handling_data) // means we have sent the last data
         {
+            drdy_cycles = cycle_count();
             /*gpio_set_level(LED_PIN, 1);
             ets_delay_us(1);   // signal on scope
             gpio_set_level(LED_PIN, 0);*/
@@ -62,6 +88,7 @@ static void IRAM_ATTR drdy_interrupt(void *arg)
         }
         else
         {
+            drdy_collisions++;
             gpio_set_level(LED_PIN, 1);
             //ets_delay_us(1);   // signal collison on scope
             gpio_set_level(LED_PIN, 0);
@@ -76,6 +103,129 @@ static void IRAM_ATTR drdy_interrupt(void *arg)
     }
 }
 
+// stands in for DRDY in bench mode, same hand-over to the rdatac task
+static bool IRAM_ATTR bench_timer_isr(void *arg)
+{
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    publish_sample();
+    if (!handling_data)
+    {
+        drdy_cycles = cycle_count();
+        vTaskNotifyGiveFromISR(rdatac_task_handle, &xHigherPriorityTaskWoken);
+        handling_data = true;
+    }
+    else
+    {
+        drdy_collisions++;
+    }
+    return xHigherPriorityTaskWoken == pdTRUE;
+}
+
+// timer interrupts are allocated on the core that asks for them, and
+// freed there; drdy_cycles must be the CCOUNT of the DRDY core
+static void on_drdy_core(esp_ipc_func_t func, void *arg)
+{
+    if (xPortGetCoreID() == drdy_core)
+        func(arg);
+    else
+        esp_ipc_call_blocking(drdy_core, func, arg);
+}
+
+static void bench_timer_attach(void *arg)
+{
+    timer_enable_intr(TIMER_GROUP_0, TIMER_0);
+    timer_isr_callback_add(TIMER_GROUP_0, TIMER_0, bench_timer_isr, NULL, 0);
+    timer_start(TIMER_GROUP_0, TIMER_0);
+}
+
+static void bench_timer_detach(void *arg)
+{
+    timer_pause(TIMER_GROUP_0, TIMER_0);
+    timer_disable_intr(TIMER_GROUP_0, TIMER_0);
+    timer_isr_callback_remove(TIMER_GROUP_0, TIMER_0);
+}
+
+/** Start a hardware timer that fires at rate (up to BENCH_MAX_RATE) in
+ * place of DRDY, its interrupt on the core DRDY is serviced on. Returns
+ * the rate actually achieved by the timer divider.
+ */
+uint32_t bench_start(uint32_t rate)
+{
+    if (rate < 1)
+        rate = 1;
+    if (rate > BENCH_MAX_RATE)
+        rate = BENCH_MAX_RATE;
+    uint32_t ticks = BENCH_TIMER_HZ / rate;
+
+    timer_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.divider = 80000000 / BENCH_TIMER_HZ;
+    config.counter_dir = TIMER_COUNT_UP;
+    config.counter_en = TIMER_PAUSE;
+    config.alarm_en = TIMER_ALARM_EN;
+    config.auto_reload = TIMER_AUTORELOAD_EN;
+    timer_init(TIMER_GROUP_0, TIMER_0, &config);
+    timer_set_counter_value(TIMER_GROUP_0, TIMER_0, 0);
+    timer_set_alarm_value(TIMER_GROUP_0, TIMER_0, ticks);
+    is_bench = true;
+    on_drdy_core(bench_timer_attach, NULL);
+    ESP_LOGI(TAG, "bench timer %u ticks on core %d", ticks, drdy_core);
+    return BENCH_TIMER_HZ / ticks;
+}
+
+void bench_stop()
+{
+    if (!is_bench)
+        return;
+    on_drdy_core(bench_timer_detach, NULL);
+    is_bench = false;
+}
+
+static void IRAM_ATTR trigger_interrupt(void *arg)
+{
+    if (is_rdatac)
+        trigger_pending = true;
+}
+
+/** Stamp a marker with the sample it belongs to and how far into that
+ * sample period it came, the host gets sub-sample timing this way.
+ * Runs on either core, so esp_timer rather than the per core CCOUNT;
+ * retries if a DRDY comes in while reading. Not to be called from an
+ * interrupt that can preempt the DRDY ISR.
+ */
+void IRAM_ATTR marker_stamp(MarkerEvent *marker)
+{
+    uint32_t seq, sample, at, now;
+    do
+    {
+        seq = sample_seq;
+        __sync_synchronize();
+        sample = current_sample;
+        at = sample_us;
+        now = esp_timer_get_time();
+        __sync_synchronize();
+    } while ((seq & 1) || seq != sample_seq);
+    uint32_t since = now - at;
+    marker->sample = sample;
+    marker->offset_us = (since > 0xffff) ? 0xffff : since; // only before the first DRDY
+}
+
+static void IRAM_ATTR marker_interrupt(void *arg)
+{
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    if (is_rdatac)
+    {
+        MarkerEvent marker;
+        marker_stamp(&marker);
+        marker.code = 0;
+        marker.source = MARKER_SOURCE_GPIO;
+        if (xQueueSendFromISR(marker_queue, &marker, &xHigherPriorityTaskWoken) == pdTRUE)
+            marker_waiting = true;
+    }
+    if (xHigherPriorityTaskWoken != pdFALSE)
+        portYIELD_FROM_ISR();
+}
+
 spi_transaction_t Rec_t;
 
 void spi_init() //probably need to re-init when transfering data at hign speed
@@ -128,9 +278,21 @@ void spi_init() //probably need to re-init when transfering data at hign speed
     gpio_config(&gp);
     ESP_LOGI(TAG, "DRDY_PIN init done");
 
+    gp.intr_type = GPIO_INTR_POSEDGE;
+    gp.pull_up_en = GPIO_PULLUP_DISABLE;
+    gp.pull_down_en = GPIO_PULLDOWN_ENABLE;
+    gp.pin_bit_mask = (1ULL << TRIGGER_PIN) | (1ULL << MARKER_PIN);
+    gpio_config(&gp);
+    ESP_LOGI(TAG, "TRIGGER_PIN MARKER_PIN init done");
+
+    marker_queue = xQueueCreate(MARKER_QUEUE_LEN, sizeof(MarkerEvent));
+
+    drdy_core = xPortGetCoreID();
     gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
     gpio_isr_handler_add(DRDY_PIN, drdy_interrupt, (void *)DRDY_PIN);
     ESP_LOGI(TAG, "DRDY_PIN ISR Installed");
+    gpio_isr_handler_add(TRIGGER_PIN, trigger_interrupt, (void *)TRIGGER_PIN);
+    gpio_isr_handler_add(MARKER_PIN, marker_interrupt, (void *)MARKER_PIN);
 
     //startup p.62
     gpio_set_level(LED_PIN, 0); // LED off
@@ -140,7 +302,11 @@ void spi_init() //probably need to re-init when transfering data at hign speed
 
     gpio_set_level(RESET_PIN, 1); // RESET H
 
-    vTaskDelay(130 / portTICK_PERIOD_MS); // now wait 2^18 tCLK = 128ms
+    // now wait 2^18 tCLK = 128ms after power up; the ADS powers up with us and
+    // the boot so far counts, so only wait for what is left
+    int64_t por_wait_us = ADS_POR_US - esp_timer_get_time();
+    if (por_wait_us > 0)
+        vTaskDelay(por_wait_us / 1000 / portTICK_PERIOD_MS + 1);
     gpio_set_level(RESET_PIN, 0);         // RESET !
     ets_delay_us(10);                     // >2 tCLK = 0.9 us
     gpio_set_level(RESET_PIN, 1);         // done
@@ -221,6 +387,19 @@ void spiSend(uint8_t *buf, uint8_t len)
     spi_device_polling_transmit(spi, &t); //Transmit!
 }
 
+/** Reset the ADS serial interface after a misaligned read.
+ * Taking CS high clears the bit counter of the ADS (p.38), RDATAC stays
+ * active, so the next read after DRDY starts on a byte boundary again.
+ * Takes a few us, well within one sample period.
+ */
+void spiResync()
+{
+    gpio_set_level(CS_PIN, 1);
+    ets_delay_us(2); // tCSH >= 2 tCLK
+    gpio_set_level(CS_PIN, 0);
+    ets_delay_us(1); // tCSSC
+}
+
 void adcSendCommand(uint8_t cmd)
 {
     spi_transaction_t t;
@@ -252,6 +431,31 @@ void adcWreg(uint8_t reg, uint8_t val)
     */
 }
 
+/** Write n consecutive registers with one WREG command. Bytes go out as
+ * separate transfers like in adcWreg, which gives the ADS the decode time
+ * it needs between bytes at SCLK > 4 MHz.
+ */
+void adcWregBurst(uint8_t reg, const uint8_t *vals, uint8_t n)
+{
+    if (n < 1)
+        return;
+    spiSend(ADS129x::WREG | reg);
+    spiSend(n - 1);
+    for (uint8_t i = 0; i < n; i++)
+        spiSend(vals[i]);
+}
+
+/** Read n consecutive registers with one RREG command. */
+void adcRregBurst(uint8_t reg, uint8_t *vals, uint8_t n)
+{
+    if (n < 1)
+        return;
+    spiSend(ADS129x::RREG | reg);
+    spiSend(n - 1);
+    for (uint8_t i = 0; i < n; i++)
+        vals[i] = spiRec();
+}
+
 uint8_t adcRreg(uint8_t reg)
 {
     ESP_LOGI(TAG, "adcRreg");
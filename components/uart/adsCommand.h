@@ -31,19 +31,46 @@
 #define CLKSEL_PIN GPIO_NUM_16 //OUTPUT def L using ext clock
 #define START_PIN GPIO_NUM_25 //OUTPUT def L to use commands
 #define LED_PIN GPIO_NUM_33 //OUTPUT def L = LED off
+#define TRIGGER_PIN GPIO_NUM_26 //INPUT with ISR rising edge, external capture trigger
+#define MARKER_PIN GPIO_NUM_27 //INPUT with ISR rising edge, event marker
+
+#define MARKER_QUEUE_LEN 16
+#define MARKER_SOURCE_COMMAND 0
+#define MARKER_SOURCE_GPIO 1
+
+#define ADS_POR_US 130000 // 2^18 tCLK power-on reset time, counted from boot
+
+#define BENCH_TIMER_HZ 40000000 // APB 80 MHz / 2
+#define BENCH_MAX_RATE 50000    // SPS
 
 #include <stdint.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 
 extern SemaphoreHandle_t xSemaphore;
 
 //extern volatile uint8_t spi_data_available;
 extern volatile bool is_rdatac;
 extern volatile bool is_rdata;
+extern volatile bool is_bench;
 extern volatile uint32_t current_sample;
 extern volatile bool handling_data;
+extern volatile uint32_t drdy_cycles;
+extern volatile uint32_t drdy_collisions;
+extern volatile bool trigger_pending;
+
+struct __attribute__((packed)) MarkerEvent
+{
+    uint32_t sample;    // current_sample when the marker came in
+    uint16_t offset_us; // time since that sample's DRDY
+    uint8_t code;       // marker command argument, 0 for the GPIO
+    uint8_t source;     // MARKER_SOURCE_*
+};
+
+extern QueueHandle_t marker_queue;
+extern volatile bool marker_waiting;
 extern TaskHandle_t rdatac_task_handle;
 extern TaskHandle_t read_task_handle;
 
@@ -53,10 +80,17 @@ uint8_t spiRec();
 uint8_t spiRec(uint8_t *buf, uint8_t len);
 void spiSend(uint8_t b);
 void spiSend(uint8_t *buf, uint8_t len);
+void spiResync();
+void marker_stamp(MarkerEvent *marker);
+
+uint32_t bench_start(uint32_t rate);
+void bench_stop();
 
 void adcSendCommand(uint8_t cmd);
 //void adcSendCommandLeaveCsActive(int cmd);
 void adcWreg(uint8_t reg, uint8_t val);
 uint8_t adcRreg(uint8_t reg);
+void adcWregBurst(uint8_t reg, const uint8_t *vals, uint8_t n);
+void adcRregBurst(uint8_t reg, uint8_t *vals, uint8_t n);
 
 #endif // _ADS_COMMAND_H
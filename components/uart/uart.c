@@ -8,6 +8,8 @@
 #include "esp_log.h"
 #include "inttypes.h"
 #include "uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 
@@ -16,23 +18,42 @@
 //setup UART
 const int uart_buffer_size = (1024 * 2); //less would possibly be OK
 
+volatile uint32_t uart_tx_drops = 0;   // frames uart_write dropped for lack of FIFO space
+volatile uint8_t uart_tx_fifo_max = 0; // highest TX FIFO level seen by uart_write
+static QueueHandle_t uart_events = NULL; // RX events of the driver, see uart_wait_rx
+
 void uart_init()
 {
 	uart_config_t uart_config = {
 		//.baud_rate = 115200,
 		//.baud_rate = 921600,
 		//.baud_rate = 2000000,
-		.baud_rate = 3000000,
+		.baud_rate = UART_BAUD_RATE,
 		.data_bits = UART_DATA_8_BITS,
 		.parity = UART_PARITY_DISABLE,
 		.stop_bits = UART_STOP_BITS_1,
 		.flow_ctrl = UART_HW_FLOWCTRL_DISABLE};
 	uart_param_config(UART_NUM_0, &uart_config);
 	uart_set_pin(UART_NUM_0, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-	uart_driver_install(UART_NUM_0, uart_buffer_size, 0, 0, NULL, 0); //no TX buffer??																	  //uart_driver_install(UART_NUM_0, uart_buffer_size, uart_buffer_size, 0, NULL, 0); //with TX buffer??
+	uart_driver_install(UART_NUM_0, uart_buffer_size, 0, UART_EVENT_QUEUE_LEN, &uart_events, 0); //no TX buffer??																	  //uart_driver_install(UART_NUM_0, uart_buffer_size, uart_buffer_size, 0, NULL, 0); //with TX buffer??
 																	  //uart_driver_install(UART_NUM_0, uart_buffer_size, uart_buffer_size, 0, NULL, 0); //no TX buffer??																	  //uart_driver_install(UART_NUM_0, uart_buffer_size, uart_buffer_size, 0, NULL, 0); //with TX buffer??
 }
 
+// Waits until the driver reports received bytes, at most timeout_ms.
+// The RX timeout interrupt fires a few character times after the last
+// byte, so a command is read as it arrives rather than on a tick.
+void uart_wait_rx(uint32_t timeout_ms)
+{
+	uart_event_t event;
+	if (uart_events == NULL || xQueueReceive(uart_events, &event, timeout_ms / portTICK_PERIOD_MS) != pdTRUE)
+		return;
+	if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL)
+	{
+		uart_flush_input(UART_NUM_0); // what is left of the line is garbage anyway
+		xQueueReset(uart_events);
+	}
+}
+
 // Hmm uart_tx_chars works with and without tx buffer ... I guess ESP_LOG is dangerous
 // as a combination ....
 
@@ -55,6 +76,8 @@ void uart_write(char *data, size_t len)
     //UART0.conf0.txfifo_rst = 1; //clear TX_FIFO...
 
 	uint8_t tx_fifo_cnt = UART0.status.txfifo_cnt;
+	if (tx_fifo_cnt > uart_tx_fifo_max)
+		uart_tx_fifo_max = tx_fifo_cnt;
 	tx_remain_fifo_cnt = (UART_FIFO_LEN - tx_fifo_cnt);
 	if (tx_remain_fifo_cnt >= len) //only transmit if space permits 
 	{
@@ -62,6 +85,7 @@ void uart_write(char *data, size_t len)
 	}
 	else
 	{
+		uart_tx_drops++;
 		gpio_set_level(GPIO_NUM_33, 1);
 		//ets_delay_us(len-tx_remain_fifo_cnt);
 		gpio_set_level(GPIO_NUM_33, 0); //to scope
@@ -107,3 +131,11 @@ buffer...
         ESP_LOGI(TAG, "UART Comm Failed");
     }*/
 }
+
+// Blocking write for occasional frames that may exceed the free FIFO space
+// (feature frames, events). Without a TX buffer installed this returns once
+// everything has been pushed into the FIFO.
+void uart_write_blocking(char *data, size_t len)
+{
+	uart_write_bytes(UART_NUM_0, data, len);
+}
@@ -20,13 +20,23 @@
 #ifndef _UART_H_
 #define _UART_H_
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" 
 {
 #endif
 
+#define UART_BAUD_RATE 3000000 // 8N1, 10 bits per byte on the wire
+#define UART_EVENT_QUEUE_LEN 16
+
+extern volatile uint32_t uart_tx_drops;
+extern volatile uint8_t uart_tx_fifo_max;
+
 void uart_init();
 void uart_write(char *data, size_t len);
+void uart_write_blocking(char *data, size_t len);
+void uart_wait_rx(uint32_t timeout_ms);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,410 @@
+/*
+ * Aggregator.cpp
+ *
+ * Multi-device stream merging, see Aggregator.h
+ */
+
+#include <string.h>
+#include <math.h>
+#include "Aggregator.h"
+
+void DeviceClock::reset()
+{
+    haveWindow = false;
+    points = 0;
+    next = 0;
+    anchorDev = 0;
+    anchorOff = 0;
+    slope = 0;
+}
+
+void DeviceClock::add(uint64_t device_us, uint64_t arrival_ns)
+{
+    const double dev = (double)device_us;
+    const double off = (double)arrival_ns - dev * 1000;
+    if (!haveWindow)
+    {
+        haveWindow = true;
+        winStart = dev;
+        winDev = dev;
+        winOff = off;
+        if (!points)
+        {
+            anchorDev = dev;
+            anchorOff = off;
+        }
+        return;
+    }
+    if (off < winOff)
+    {
+        winDev = dev;
+        winOff = off;
+        if (!points) // until the first window is complete
+        {
+            anchorDev = dev;
+            anchorOff = off;
+        }
+    }
+    if (dev - winStart >= AGG_CLOCK_WINDOW_US)
+    {
+        pointDev[next] = winDev;
+        pointOff[next] = winOff;
+        next = (next + 1) % AGG_CLOCK_POINTS;
+        if (points < AGG_CLOCK_POINTS)
+            points++;
+        fit();
+        winStart = dev;
+        winDev = dev;
+        winOff = off;
+    }
+}
+
+void DeviceClock::fit()
+{
+    const int last = (next + AGG_CLOCK_POINTS - 1) % AGG_CLOCK_POINTS;
+    if (points < 2)
+    {
+        slope = 0;
+        anchorDev = pointDev[last];
+        anchorOff = pointOff[last];
+        return;
+    }
+    double mx = 0, my = 0;
+    for (int i = 0; i < points; i++)
+    {
+        mx += pointDev[i];
+        my += pointOff[i];
+    }
+    mx /= points;
+    my /= points;
+    double sxx = 0, sxy = 0;
+    for (int i = 0; i < points; i++)
+    {
+        sxx += (pointDev[i] - mx) * (pointDev[i] - mx);
+        sxy += (pointDev[i] - mx) * (pointOff[i] - my);
+    }
+    slope = (sxx > 0) ? sxy / sxx : 0;
+    anchorDev = pointDev[last];
+    anchorOff = my + slope * (anchorDev - mx);
+}
+
+double DeviceClock::toHost(double device_us) const
+{
+    return device_us * 1000 + anchorOff + slope * (device_us - anchorDev);
+}
+
+double DeviceClock::toDevice(double host_ns) const
+{
+    return (host_ns - anchorOff + slope * anchorDev) / (1000 + slope);
+}
+
+Aggregator::Aggregator(uint64_t latency_ns)
+    : total(0), latency(latency_ns), settled(false), mergedFlags(0)
+{
+}
+
+Aggregator::~Aggregator()
+{
+    for (size_t i = 0; i < devs.size(); i++)
+        delete devs[i];
+}
+
+int Aggregator::addDevice(const StreamConfig &config)
+{
+    if (devs.size() >= AGG_MAX_DEVICES || total + config.channels > SHM_MAX_CHANNELS)
+        return -1;
+    Device *d = new Device(config);
+    d->firstChannel = total;
+    d->haveTime = false;
+    d->lastTime = 0;
+    d->timeHigh = 0;
+    d->arrival = 0;
+    d->lastArrival = 0;
+    d->closed = false;
+    d->haveCurrent = false;
+    d->period = 0;
+    d->haveUsed = false;
+    d->lastUsed = 0;
+    d->gapRun = 0;
+    memset(&d->stats, 0, sizeof(d->stats));
+    devs.push_back(d);
+    total += config.channels;
+    merged.resize(total);
+    return (int)devs.size() - 1;
+}
+
+void Aggregator::queueEvent(void *context, const StreamEvent &ev)
+{
+    Device &d = *(Device *)context;
+    AggItem *item = d.queue.claim();
+    if (!item)
+    {
+        if (ev.kind == STREAM_SAMPLE)
+            d.stats.overflows++;
+        return;
+    }
+    item->arrival = d.arrival;
+    if (ev.kind == STREAM_SAMPLE)
+    {
+        uint32_t t = (uint32_t)ev.sample.time;
+        if (d.haveTime && t < d.lastTime && d.lastTime - t > 0x80000000u)
+            d.timeHigh += 1ULL << 32; // esp_timer wrapped in the 32 bit frame field
+        d.haveTime = true;
+        d.lastTime = t;
+        item->kind = SHM_SAMPLE;
+        item->time = d.timeHigh | t;
+        item->sample = ev.sample.sample;
+        item->status = ev.sample.status;
+        item->flags = ev.sample.flags;
+        const uint8_t channels = d.parser.config().channels;
+        for (uint8_t ch = 0; ch < channels; ch++)
+            item->value[ch] = (ch < ev.sample.channels) ? ev.sample.channel[ch] : 0;
+        d.stats.samples++;
+    }
+    else
+    {
+        if (!shm_event(ev.key, ev.payload, ev.len, &item->kind, &item->sample, item->value))
+            return; // B, H, Q, ...
+        item->time = 0;
+        item->status = 0;
+        item->flags = 0;
+    }
+    d.queue.publish();
+}
+
+void Aggregator::feed(int device, const char *data, size_t len, uint64_t arrival_ns)
+{
+    Device &d = *devs[device];
+    d.arrival = arrival_ns;
+    d.parser.feed(data, len, queueEvent, &d);
+    __atomic_store_n(&d.lastArrival, arrival_ns, __ATOMIC_RELEASE);
+}
+
+void Aggregator::close(int device)
+{
+    __atomic_store_n(&devs[device]->closed, true, __ATOMIC_RELEASE);
+}
+
+uint32_t Aggregator::backlog(int device) const
+{
+    return devs[device]->queue.fill();
+}
+
+bool Aggregator::done() const
+{
+    Device &ref = *devs[0];
+    return __atomic_load_n(&ref.closed, __ATOMIC_ACQUIRE) && !ref.queue.peek();
+}
+
+// nothing queued and nothing more to expect for a while
+bool Aggregator::stalled(Device &d, uint64_t newest)
+{
+    if (d.queue.peek())
+        return false;
+    uint64_t last = __atomic_load_n(&d.lastArrival, __ATOMIC_ACQUIRE); // may be newer than newest by now
+    return __atomic_load_n(&d.closed, __ATOMIC_ACQUIRE) || (last < newest && newest - last > latency);
+}
+
+void Aggregator::take(Device &d, const AggItem &item)
+{
+    d.clock.add(item.time, item.arrival);
+    if (d.haveCurrent && item.sample != d.current.sample && item.time > d.current.time)
+    {
+        double p = (double)(item.time - d.current.time) / (uint32_t)(item.sample - d.current.sample);
+        d.period = d.period ? d.period * 0.99 + p * 0.01 : p;
+    }
+    d.current = item;
+    d.haveCurrent = true;
+}
+
+void Aggregator::passEvent(int device, const AggItem &item, MergeHandler handler, void *context)
+{
+    Device &d = *devs[device];
+    Device &ref = *devs[0];
+    uint32_t sample = item.sample;
+    if (device != 0)
+    {
+        // device sample # -> device time -> host time -> device 0 time -> merged #
+        sample = ref.haveCurrent ? ref.current.sample : 0;
+        if (d.haveCurrent && d.period > 0 && ref.haveCurrent && ref.period > 0)
+        {
+            double t = d.current.time + (double)(int32_t)(item.sample - d.current.sample) * d.period;
+            double t0 = ref.clock.toDevice(d.clock.toHost(t));
+            sample = ref.current.sample + (int32_t)lround((t0 - ref.current.time) / ref.period);
+        }
+    }
+    MergedRecord rec;
+    rec.kind = item.kind;
+    rec.device = device;
+    rec.sample = sample;
+    rec.time = 0;
+    rec.status = 0;
+    rec.flags = 0;
+    rec.value = item.value;
+    handler(context, rec);
+}
+
+// takes everything up to the host instant from the queue, true once the
+// sample right after it is there too (or the device is stalled)
+bool Aggregator::advance(int device, double host_ns, uint64_t newest, MergeHandler handler, void *context)
+{
+    Device &d = *devs[device];
+    for (;;)
+    {
+        AggItem *head = d.queue.peek();
+        if (!head)
+            return stalled(d, newest);
+        if (head->kind != SHM_SAMPLE)
+        {
+            passEvent(device, *head, handler, context);
+            d.queue.release();
+            continue;
+        }
+        if (!d.clock.valid())
+            d.clock.add(head->time, head->arrival);
+        if (head->time > d.clock.toDevice(host_ns))
+            return true;
+        take(d, *head);
+        d.queue.release();
+    }
+}
+
+void Aggregator::choose(int device, double host_ns, uint32_t merged_sample, MergeHandler handler, void *context)
+{
+    Device &d = *devs[device];
+    const uint8_t channels = d.parser.config().channels;
+    int32_t *out = &merged[d.firstChannel];
+    const AggItem *best = 0;
+    double distance = 0;
+    if (d.clock.settled()) // a device that comes late is merged after its first window
+    {
+        const double target = d.clock.toDevice(host_ns);
+        if (d.haveCurrent)
+        {
+            best = &d.current;
+            distance = fabs(target - d.current.time);
+        }
+        const AggItem *head = d.queue.peek();
+        if (head && head->kind == SHM_SAMPLE && (!best || fabs(head->time - target) < distance))
+        {
+            best = head;
+            distance = fabs(head->time - target);
+        }
+        // stay with the next sample in line while it is close enough, so
+        // a phase near half a period does not flip between neighbours
+        if (d.haveUsed && d.period > 0 && best && best->sample != d.lastUsed + 1)
+        {
+            const AggItem *other = (best == head) ? (d.haveCurrent ? &d.current : 0) : head;
+            if (other && other->sample == d.lastUsed + 1 && fabs(other->time - target) <= 0.75 * d.period)
+            {
+                best = other;
+                distance = fabs(other->time - target);
+            }
+        }
+    }
+    if (!best || (d.period > 0 && distance > 0.75 * d.period))
+    {
+        memset(out, 0, channels * sizeof(int32_t));
+        d.gapRun++;
+        d.stats.missing++;
+        d.haveUsed = false; // what the device lost is not a skip
+        return;
+    }
+    if (d.gapRun)
+    {
+        int32_t value[3] = {(int32_t)d.gapRun, 0, 0};
+        MergedRecord rec = {SHM_GAP, (uint8_t)device, merged_sample, 0, 0, 0, value};
+        handler(context, rec);
+        d.stats.gaps++;
+        d.gapRun = 0;
+    }
+    memcpy(out, best->value, channels * sizeof(int32_t));
+    mergedFlags |= best->flags & 0xff; // the channel mask is device 0 only
+    if (d.haveUsed)
+    {
+        uint32_t step = best->sample - d.lastUsed;
+        if (step == 0)
+            d.stats.repeats++;
+        else if (step > 1 && step < 0x80000000u)
+            d.stats.skips += step - 1;
+    }
+    d.haveUsed = true;
+    d.lastUsed = best->sample;
+    d.stats.used++;
+}
+
+size_t Aggregator::merge(MergeHandler handler, void *context)
+{
+    if (devs.empty())
+        return 0;
+    uint64_t newest = 0;
+    for (size_t i = 0; i < devs.size(); i++)
+    {
+        uint64_t a = __atomic_load_n(&devs[i]->lastArrival, __ATOMIC_ACQUIRE);
+        if (a > newest)
+            newest = a;
+    }
+
+    Device &ref = *devs[0];
+    const uint8_t ref_channels = ref.parser.config().channels;
+    size_t n = 0;
+    for (;;)
+    {
+        AggItem *item = ref.queue.peek();
+        if (!item)
+            break;
+        if (item->kind != SHM_SAMPLE)
+        {
+            passEvent(0, *item, handler, context);
+            ref.queue.release();
+            continue;
+        }
+        ref.clock.add(item->time, item->arrival); // adding it again later changes nothing
+        const double host = ref.clock.toHost(item->time);
+        for (size_t i = 1; i < devs.size(); i++)
+        {
+            if (!advance(i, host, newest, handler, context))
+                return n; // wait for that device
+        }
+
+        if (!settled)
+        {
+            settled = ref.clock.settled();
+            for (size_t i = 1; i < devs.size() && settled; i++)
+                settled = devs[i]->clock.settled() || stalled(*devs[i], newest);
+            if (!settled)
+            {
+                ref.stats.settling++;
+                take(ref, *item);
+                ref.queue.release();
+                continue;
+            }
+        }
+        if (ref.haveCurrent && item->sample - ref.current.sample > 1 && item->sample - ref.current.sample < 0x80000000u)
+        {
+            int32_t value[3] = {(int32_t)(item->sample - ref.current.sample - 1), 0, 0};
+            MergedRecord gap = {SHM_GAP, 0, item->sample, 0, 0, 0, value};
+            handler(context, gap);
+            ref.stats.gaps++;
+            ref.stats.missing += value[0];
+        }
+        memcpy(&merged[0], item->value, ref_channels * sizeof(int32_t));
+        mergedFlags = item->flags;
+        for (size_t i = 1; i < devs.size(); i++)
+            choose(i, host, item->sample, handler, context);
+        MergedRecord rec = {SHM_SAMPLE, 0, item->sample, item->time, item->status, mergedFlags, &merged[0]};
+        handler(context, rec);
+        ref.stats.used++;
+        take(ref, *item);
+        ref.queue.release();
+        n++;
+    }
+
+    for (size_t i = 0; i < devs.size(); i++)
+    {
+        Device &d = *devs[i];
+        d.stats.skewPpm = d.clock.skew() * 1e6;
+        d.stats.offsetUs = d.clock.offset() / 1000;
+    }
+    return n;
+}
@@ -0,0 +1,172 @@
+/*
+ * Aggregator.h
+ *
+ * Merges the streams of several boards into one. Every board counts its
+ * own samples and stamps them with its own esp_timer, so neither the
+ * sample numbers nor the times of two boards can be compared directly.
+ *
+ * Each device is fed by its own reader thread (feed()), which decodes the
+ * bytes and queues samples and events with their host arrival time. The
+ * merging thread (merge()) keeps a clock model per device, mapping device
+ * time to host time:
+ *
+ *   offset  the smallest arrival - device time seen, i.e. the transfer
+ *           with the least USB / scheduling delay, per AGG_CLOCK_WINDOW_US
+ *   drift   least squares slope of those window minima, so crystals a few
+ *           ppm apart stay aligned over hours
+ *
+ * Device 0 sets the pace: every one of its samples becomes one merged
+ * sample with the same sample # and time. For the other devices the
+ * sample closest to the same host instant is taken; drift shows up as an
+ * occasional repeated or skipped sample (counted). A device with nothing
+ * within a sample period (dropped samples, stalled or unplugged) is
+ * filled with zeros and reported by a SHM_GAP record once it is back.
+ * The first AGG_CLOCK_WINDOW_US are not merged (a device that comes late
+ * is filled in until it has had its own): before a full window the offset
+ * is off by up to a read batch.
+ *
+ * Events (markers, lead-off, resync) are passed on with the device they
+ * came from and their sample # translated to the merged numbering.
+ */
+
+#ifndef _AGGREGATOR_H
+#define _AGGREGATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "StreamParser.h"
+#include "ShmRing.h"
+#include "SampleRing.h"
+
+#define AGG_MAX_DEVICES 16
+#define AGG_QUEUE 32768                // samples per device (2 s at 16 kSPS), power of 2
+#define AGG_CLOCK_WINDOW_US 1000000    // offset minimum per window
+#define AGG_CLOCK_POINTS 32            // windows in the drift fit
+#define AGG_DEFAULT_LATENCY_NS 200000000ULL
+
+struct MergedRecord
+{
+    uint8_t kind;         // ShmRecordKind
+    uint8_t device;       // events and gaps: where from
+    uint32_t sample;      // merged (device 0) sample #
+    uint64_t time;        // device 0 time, us
+    uint32_t status;      // device 0 status word
+    uint16_t flags;       // device 0 artifact flags, with the kinds of the other devices
+    const int32_t *value; // SHM_SAMPLE: channels() values, device after device; else 3
+};
+
+typedef void (*MergeHandler)(void *context, const MergedRecord &record);
+
+struct AggDeviceStats
+{
+    uint64_t samples;   // queued by the reader
+    uint64_t overflows; // lost because the queue was full
+    uint64_t used;      // samples taken into the merged stream
+    uint64_t repeats;   // the same sample taken twice (device slower)
+    uint64_t skips;     // samples passed over (device faster)
+    uint64_t gaps;      // gap runs
+    uint64_t missing;   // merged samples filled with zeros
+    uint64_t settling;  // device 0: samples dropped until all clocks had a window
+    double skewPpm;     // device clock against the host clock
+    double offsetUs;    // host - device time at the last window
+};
+
+struct AggItem
+{
+    uint64_t arrival; // host ns
+    uint64_t time;    // device us, unwrapped
+    uint32_t sample;
+    uint32_t status;
+    uint16_t flags;
+    uint8_t kind;     // SHM_SAMPLE or the event kind
+    int32_t value[FRAME_MAX_CHANNELS];
+};
+
+// device time -> host time
+class DeviceClock
+{
+public:
+    DeviceClock() { reset(); }
+    void reset();
+    void add(uint64_t device_us, uint64_t arrival_ns);
+    bool valid() const { return points > 0 || haveWindow; }
+    bool settled() const { return points > 0; } // one full window seen
+    double toHost(double device_us) const;   // ns
+    double toDevice(double host_ns) const;   // us
+    double skew() const { return -slope / (1000 + slope); } // device rate / host rate - 1
+    double offset() const { return anchorOff; }
+
+private:
+    void fit();
+
+    bool haveWindow;
+    double winStart, winDev, winOff; // current window and its minimum
+    double pointDev[AGG_CLOCK_POINTS], pointOff[AGG_CLOCK_POINTS];
+    int points, next;
+    double anchorDev, anchorOff; // host ns - device us * 1000 at anchorDev
+    double slope;                // of that offset, ns per device us
+};
+
+class Aggregator
+{
+public:
+    Aggregator(uint64_t latency_ns = AGG_DEFAULT_LATENCY_NS);
+    ~Aggregator();
+    int addDevice(const StreamConfig &config); // before any feed(), returns the device #, -1 if full
+    size_t devices() const { return devs.size(); }
+    uint16_t channels() const { return total; }
+
+    // reader thread of the device
+    void feed(int device, const char *data, size_t len, uint64_t arrival_ns);
+    void close(int device); // no more data, e.g. end of file
+    uint32_t backlog(int device) const;
+
+    // merging thread: hands every merged sample and event that is ready to
+    // the handler, returns how many samples were merged
+    size_t merge(MergeHandler handler, void *context);
+    bool done() const; // device 0 closed and drained, nothing more to merge
+
+    const AggDeviceStats &stats(int device) const { return devs[device]->stats; }
+    const StreamStats &streamStats(int device) const { return devs[device]->parser.stats(); }
+
+private:
+    struct Device
+    {
+        Device(const StreamConfig &config) : parser(config) {}
+        StreamParser parser;
+        SampleRing<AggItem, AGG_QUEUE> queue;
+        uint16_t firstChannel;
+        // reader side
+        bool haveTime;
+        uint32_t lastTime;
+        uint64_t timeHigh;
+        uint64_t arrival;  // of the bytes being fed
+        volatile uint64_t lastArrival;
+        volatile bool closed;
+        // merger side
+        DeviceClock clock;
+        AggItem current; // last sample taken from the queue
+        bool haveCurrent;
+        double period;   // us per sample
+        bool haveUsed;
+        uint32_t lastUsed;
+        uint64_t gapRun;
+        AggDeviceStats stats;
+    };
+    static void queueEvent(void *context, const StreamEvent &ev);
+    void take(Device &d, const AggItem &item);
+    bool advance(int device, double host_ns, uint64_t newest, MergeHandler handler, void *context);
+    void choose(int device, double host_ns, uint32_t merged_sample, MergeHandler handler, void *context);
+    void passEvent(int device, const AggItem &item, MergeHandler handler, void *context);
+    bool stalled(Device &d, uint64_t newest);
+
+    std::vector<Device *> devs;
+    uint16_t total;
+    uint64_t latency;
+    bool settled;
+    std::vector<int32_t> merged;
+    uint16_t mergedFlags;
+};
+
+#endif // _AGGREGATOR_H
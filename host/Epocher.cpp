@@ -0,0 +1,192 @@
+/*
+ * Epocher.cpp
+ *
+ * Marker locked epoching, see Epocher.h
+ */
+
+#include <string.h>
+#include "Epocher.h"
+
+Epocher::Epocher()
+    : handler(0), context(0), capacity(0), haveSample(false), newest(0), contiguousFrom(0)
+{
+    memset(&cfg, 0, sizeof(cfg));
+    memset(&counters, 0, sizeof(counters));
+}
+
+void Epocher::defaults(EpochConfig *config, uint16_t channels, uint32_t pre, uint32_t post)
+{
+    memset(config, 0, sizeof(*config));
+    config->channels = channels;
+    config->pre = pre;
+    config->post = post;
+    config->baselineFrom = -(int32_t)pre;
+    config->baselineTo = 0;
+    config->lag = (pre + post) / 2;
+    config->maxPending = EPOCH_DEFAULT_PENDING;
+    memset(config->codes, 0xff, sizeof(config->codes));
+}
+
+bool Epocher::configure(const EpochConfig &config, EpochHandler epoch_handler, void *handler_context)
+{
+    const int64_t length = (int64_t)config.pre + config.post;
+    if (!config.channels || config.channels > EPOCH_MAX_CHANNELS || length < 1 || !config.maxPending ||
+        config.baselineFrom < -(int32_t)config.pre || config.baselineTo > (int32_t)config.post ||
+        config.baselineFrom > config.baselineTo || length + config.lag > (1u << 30))
+        return false;
+    cfg = config;
+    handler = epoch_handler;
+    context = handler_context;
+    capacity = 1;
+    while (capacity < length + cfg.lag)
+        capacity <<= 1;
+    ring.assign((size_t)capacity * cfg.channels, 0);
+    out.resize((size_t)length * cfg.channels);
+    sums.resize(cfg.channels);
+    lo.resize(cfg.channels);
+    hi.resize(cfg.channels);
+    pending.reserve(cfg.maxPending);
+    reset();
+    return true;
+}
+
+void Epocher::reset()
+{
+    haveSample = false;
+    newest = 0;
+    contiguousFrom = 0;
+    pending.clear();
+    memset(&counters, 0, sizeof(counters));
+}
+
+size_t Epocher::memory() const
+{
+    return ring.capacity() * sizeof(int32_t) + out.capacity() * sizeof(float) +
+           pending.capacity() * sizeof(Pending) + sums.capacity() * sizeof(int64_t) +
+           (lo.capacity() + hi.capacity()) * sizeof(int32_t);
+}
+
+void Epocher::marker(uint32_t sample, uint8_t code, uint8_t source)
+{
+    if (!(cfg.codes[code >> 3] & (1 << (code & 7))))
+        return;
+    counters.markers++;
+    const uint32_t first = sample - cfg.pre;
+    if (haveSample && (int32_t)(newest - first) >= (int32_t)capacity)
+    {
+        counters.late++;
+        return;
+    }
+    if (haveSample && (int32_t)(first - contiguousFrom) < 0)
+    {
+        counters.gaps++;
+        return;
+    }
+    if (pending.size() >= cfg.maxPending)
+    {
+        counters.overflows++;
+        return;
+    }
+    Pending p = {sample, code, source};
+    // markers come in order as a rule, keep the list sorted anyway
+    size_t i = pending.size();
+    while (i > 0 && (int32_t)(pending[i - 1].sample - sample) > 0)
+        i--;
+    pending.insert(pending.begin() + i, p);
+    // a late marker may already be complete
+    while (haveSample && !pending.empty() && (int32_t)(newest - (pending[0].sample + cfg.post - 1)) >= 0)
+    {
+        Pending q = pending[0];
+        pending.erase(pending.begin());
+        complete(q);
+    }
+}
+
+void Epocher::sample(uint32_t sample, const int32_t *values)
+{
+    if (!haveSample || sample != newest + 1)
+        contiguousFrom = sample; // first sample or a gap
+    haveSample = true;
+    newest = sample;
+    counters.samples++;
+    memcpy(&ring[(size_t)(sample & (capacity - 1)) * cfg.channels], values, cfg.channels * sizeof(int32_t));
+
+    size_t done = 0;
+    while (done < pending.size() && (int32_t)(sample - (pending[done].sample + cfg.post - 1)) >= 0)
+    {
+        complete(pending[done]);
+        done++;
+    }
+    if (done)
+        pending.erase(pending.begin(), pending.begin() + done);
+}
+
+void Epocher::complete(const Pending &p)
+{
+    const uint32_t first = p.sample - cfg.pre;
+    const uint32_t length = cfg.pre + cfg.post;
+    const uint16_t channels = cfg.channels;
+    if ((int32_t)(first - contiguousFrom) < 0)
+    {
+        counters.gaps++;
+        return;
+    }
+    if ((int32_t)(newest - first) >= (int32_t)capacity)
+    {
+        counters.late++;
+        return;
+    }
+
+    // baseline means
+    const int32_t base_len = cfg.baselineTo - cfg.baselineFrom;
+    for (uint16_t ch = 0; ch < channels; ch++)
+        sums[ch] = 0;
+    for (int32_t i = cfg.baselineFrom; i < cfg.baselineTo; i++)
+    {
+        const int32_t *row = &ring[(size_t)((p.sample + i) & (capacity - 1)) * channels];
+        for (uint16_t ch = 0; ch < channels; ch++)
+            sums[ch] += row[ch];
+    }
+    float base[EPOCH_MAX_CHANNELS];
+    for (uint16_t ch = 0; ch < channels; ch++)
+        base[ch] = base_len ? (float)((double)sums[ch] / base_len) : 0.0f;
+
+    // corrected copy and peak to peak
+    const int32_t *row0 = &ring[(size_t)(first & (capacity - 1)) * channels];
+    for (uint16_t ch = 0; ch < channels; ch++)
+        lo[ch] = hi[ch] = row0[ch];
+    float *dst = &out[0];
+    for (uint32_t i = 0; i < length; i++)
+    {
+        const int32_t *row = &ring[(size_t)((first + i) & (capacity - 1)) * channels];
+        for (uint16_t ch = 0; ch < channels; ch++)
+        {
+            const int32_t v = row[ch];
+            lo[ch] = (v < lo[ch]) ? v : lo[ch];
+            hi[ch] = (v > hi[ch]) ? v : hi[ch];
+            dst[ch] = (float)v - base[ch];
+        }
+        dst += channels;
+    }
+    uint64_t mask = 0;
+    for (uint16_t ch = 0; ch < channels; ch++)
+    {
+        if (cfg.reject[ch] && (int64_t)hi[ch] - lo[ch] > cfg.reject[ch])
+            mask |= 1ULL << ch;
+    }
+
+    Epoch e;
+    e.sample = p.sample;
+    e.code = p.code;
+    e.source = p.source;
+    e.length = length;
+    e.channels = channels;
+    e.data = &out[0];
+    e.rejected = mask != 0;
+    e.rejectMask = mask;
+    counters.epochs++;
+    if (mask)
+        counters.rejected++;
+    if (handler)
+        handler(context, e);
+}
@@ -0,0 +1,108 @@
+/*
+ * Epocher.h
+ *
+ * Cuts epochs (fixed windows around markers) out of the continuous stream
+ * while it comes in, e.g. for ERPs:
+ *
+ *   samples  in order, by device sample # (FrameSample, ShmRecord)
+ *   markers  code and the sample # they belong to, usually a little after
+ *            that sample has been seen
+ *
+ * An epoch is handed out as soon as its last sample is there: pre samples
+ * before the marker and post samples from it on, baseline corrected (mean
+ * of the baseline window subtracted per channel, as float) and checked
+ * against per-channel peak to peak limits.
+ *
+ * Memory is bounded: the history is a ring indexed by sample #, large
+ * enough for pre + post + the marker lag, plus at most maxPending open
+ * markers. Epochs that would reach over a gap in the sample # or into
+ * history that is already gone are dropped and counted.
+ */
+
+#ifndef _EPOCHER_H
+#define _EPOCHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define EPOCH_MAX_CHANNELS 64
+#define EPOCH_DEFAULT_PENDING 64
+
+struct EpochConfig
+{
+    uint16_t channels;
+    uint32_t pre;          // samples before the marker
+    uint32_t post;         // samples from the marker on
+    int32_t baselineFrom;  // baseline window relative to the marker, samples,
+    int32_t baselineTo;    // [from, to), e.g. [-pre, 0); empty for none
+    uint32_t lag;          // how late markers may come, samples
+    uint32_t maxPending;   // open epochs at most
+    int32_t reject[EPOCH_MAX_CHANNELS]; // peak to peak limit in codes, 0 = none
+    uint8_t codes[32];     // marker codes to cut epochs for, bit per code
+};
+
+struct Epoch
+{
+    uint32_t sample;   // of the marker
+    uint8_t code;
+    uint8_t source;
+    uint32_t length;   // pre + post
+    uint16_t channels;
+    const float *data; // length x channels, sample after sample, valid in the handler only
+    bool rejected;
+    uint64_t rejectMask; // channels over their limit
+};
+
+struct EpochStats
+{
+    uint64_t samples;
+    uint64_t markers;   // with a selected code
+    uint64_t epochs;    // handed out
+    uint64_t rejected;  // of those, over a limit
+    uint64_t gaps;      // dropped, a gap in the window
+    uint64_t late;      // dropped, history already gone
+    uint64_t overflows; // dropped, too many open
+};
+
+typedef void (*EpochHandler)(void *context, const Epoch &epoch);
+
+class Epocher
+{
+public:
+    Epocher();
+    static void defaults(EpochConfig *config, uint16_t channels, uint32_t pre, uint32_t post);
+    bool configure(const EpochConfig &config, EpochHandler handler, void *context);
+
+    void sample(uint32_t sample, const int32_t *values);
+    void marker(uint32_t sample, uint8_t code, uint8_t source);
+    void reset(); // forget history and open markers, e.g. on a new session
+
+    const EpochStats &stats() const { return counters; }
+    size_t memory() const; // bytes held
+
+private:
+    struct Pending
+    {
+        uint32_t sample;
+        uint8_t code;
+        uint8_t source;
+    };
+    void complete(const Pending &p);
+
+    EpochConfig cfg;
+    EpochHandler handler;
+    void *context;
+    std::vector<int32_t> ring; // capacity x channels
+    uint32_t capacity;         // power of 2
+    bool haveSample;
+    uint32_t newest;           // last sample #
+    uint32_t contiguousFrom;   // first sample # since the last gap
+    std::vector<Pending> pending; // ordered by the sample they end on
+    std::vector<float> out;
+    std::vector<int64_t> sums;
+    std::vector<int32_t> lo, hi;
+    EpochStats counters;
+};
+
+#endif // _EPOCHER_H
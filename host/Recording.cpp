@@ -0,0 +1,429 @@
+/*
+ * Recording.cpp
+ *
+ * Chunked recording format, see Recording.h
+ */
+
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Recording.h"
+#include "Capture.h"
+
+#define REC_VERSION 1
+
+static inline size_t pad8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+// payload layout: samples (uint32), times (uint64), events, values;
+// each part padded to 8 bytes
+static inline size_t times_offset(size_t records)
+{
+    return pad8(records * 4);
+}
+
+static inline size_t events_offset(size_t records)
+{
+    return times_offset(records) + records * 8;
+}
+
+static inline size_t values_offset(size_t records, size_t events)
+{
+    return events_offset(records) + pad8(events * sizeof(RecEvent));
+}
+
+static inline void put_varint(std::vector<uint8_t> &out, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+static inline const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t r = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7)
+    {
+        uint8_t b = *p++;
+        r |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *v = r;
+            return p;
+        }
+    }
+    return 0;
+}
+
+RecordingWriter::RecordingWriter()
+    : file(0), total(0), offset(0)
+{
+    memset(&header, 0, sizeof(header));
+}
+
+RecordingWriter::~RecordingWriter()
+{
+    close();
+}
+
+bool RecordingWriter::open(const char *path, uint16_t channels, uint32_t rate, RecCodec codec,
+                           const uint8_t *registers, uint8_t num_registers, const char *note)
+{
+    if (channels == 0 || channels > REC_MAX_CHANNELS || num_registers > REC_MAX_REGISTERS)
+        return false;
+    file = fopen(path, "wb");
+    if (!file)
+        return false;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REC_MAGIC, 8);
+    header.version = REC_VERSION;
+    header.channels = channels;
+    header.rate = rate;
+    header.codec = codec;
+    header.num_registers = num_registers;
+    header.chunk_records = REC_CHUNK_RECORDS;
+    header.created = time(0);
+    if (registers)
+        memcpy(header.registers, registers, num_registers);
+    if (note)
+        strncpy(header.note, note, sizeof(header.note) - 1);
+    uint8_t block[REC_HEADER_SZ];
+    memset(block, 0, sizeof(block));
+    memcpy(block, &header, sizeof(header));
+    if (fwrite(block, 1, sizeof(block), file) != sizeof(block))
+        return false;
+    offset = REC_HEADER_SZ;
+    total = 0;
+    samples.clear();
+    times.clear();
+    values.clear();
+    events.clear();
+    index.clear();
+    samples.reserve(REC_CHUNK_RECORDS);
+    times.reserve(REC_CHUNK_RECORDS);
+    values.reserve((size_t)REC_CHUNK_RECORDS * channels);
+    return true;
+}
+
+void RecordingWriter::append(uint32_t sample, uint64_t time, const int32_t *v)
+{
+    samples.push_back(sample);
+    times.push_back(time);
+    values.insert(values.end(), v, v + header.channels);
+    if (samples.size() == header.chunk_records)
+        flush();
+}
+
+void RecordingWriter::event(const RecEvent &ev)
+{
+    events.push_back(ev);
+}
+
+bool RecordingWriter::flush()
+{
+    if (samples.empty() && events.empty())
+        return true;
+    const size_t n = samples.size();
+    payload.clear();
+    payload.resize(values_offset(n, events.size()));
+    memcpy(&payload[0], samples.data(), n * 4);
+    memcpy(&payload[times_offset(n)], times.data(), n * 8);
+    if (!events.empty())
+        memcpy(&payload[events_offset(n)], events.data(), events.size() * sizeof(RecEvent));
+    if (header.codec == REC_DELTA)
+    {
+        std::vector<int32_t> prev(header.channels, 0);
+        for (size_t r = 0; r < n; r++)
+        {
+            for (int ch = 0; ch < header.channels; ch++)
+            {
+                int32_t v = values[r * header.channels + ch];
+                uint32_t d = (uint32_t)v - (uint32_t)prev[ch];
+                put_varint(payload, (d << 1) ^ (uint32_t)((int32_t)d >> 31)); // zigzag
+                prev[ch] = v;
+            }
+        }
+    }
+    else
+    {
+        size_t at = payload.size();
+        payload.resize(at + values.size() * 4);
+        memcpy(&payload[at], values.data(), values.size() * 4);
+    }
+    payload.resize(pad8(payload.size())); // keeps the next chunk aligned
+
+    RecChunkHeader ch;
+    memset(&ch, 0, sizeof(ch));
+    ch.magic = REC_CHUNK_MAGIC;
+    ch.records = n;
+    ch.events = events.size();
+    ch.bytes = payload.size();
+    ch.first_record = total;
+    ch.crc = crc32_update(0, payload.data(), payload.size());
+
+    RecIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.offset = offset;
+    entry.first_record = total;
+    entry.first_sample = n ? samples[0] : 0;
+    entry.records = n;
+    entry.events = events.size();
+    index.push_back(entry);
+
+    bool ok = fwrite(&ch, 1, sizeof(ch), file) == sizeof(ch) &&
+              fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+    fflush(file); // a reader may follow the file while it grows
+    offset += sizeof(ch) + payload.size();
+    total += n;
+    samples.clear();
+    times.clear();
+    values.clear();
+    events.clear();
+    return ok;
+}
+
+bool RecordingWriter::close()
+{
+    if (!file)
+        return false;
+    bool ok = flush();
+    RecTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.index_offset = offset;
+    trailer.chunks = index.size();
+    trailer.records = total;
+    memcpy(trailer.magic, REC_TRAILER_MAGIC, 8);
+    if (!index.empty())
+        ok &= fwrite(index.data(), sizeof(RecIndexEntry), index.size(), file) == index.size();
+    ok &= fwrite(&trailer, 1, sizeof(trailer), file) == sizeof(trailer);
+    ok &= fclose(file) == 0;
+    file = 0;
+    return ok;
+}
+
+RecordingReader::RecordingReader()
+    : fd(-1), map(0), size(0), hdr(0), total(0), rebuilt(false), cached(-1)
+{
+}
+
+RecordingReader::~RecordingReader()
+{
+    close();
+}
+
+bool RecordingReader::open(const char *path)
+{
+    close();
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < REC_HEADER_SZ)
+    {
+        close();
+        return false;
+    }
+    size = st.st_size;
+    void *mem = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        map = 0;
+        close();
+        return false;
+    }
+    map = (const uint8_t *)mem;
+    madvise(mem, size, MADV_SEQUENTIAL);
+    hdr = (const RecFileHeader *)map;
+    if (memcmp(hdr->magic, REC_MAGIC, 8) != 0 || hdr->channels == 0 || hdr->channels > REC_MAX_CHANNELS)
+    {
+        close();
+        return false;
+    }
+    rebuilt = !loadIndex();
+    if (rebuilt && !scanChunks())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void RecordingReader::close()
+{
+    if (map)
+        munmap((void *)map, size);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    map = 0;
+    hdr = 0;
+    index.clear();
+    total = 0;
+    cached = -1;
+}
+
+bool RecordingReader::loadIndex()
+{
+    if (size < REC_HEADER_SZ + sizeof(RecTrailer))
+        return false;
+    const RecTrailer *t = (const RecTrailer *)&map[size - sizeof(RecTrailer)];
+    if (memcmp(t->magic, REC_TRAILER_MAGIC, 8) != 0 ||
+        t->index_offset + t->chunks * sizeof(RecIndexEntry) + sizeof(RecTrailer) != size)
+        return false;
+    const RecIndexEntry *e = (const RecIndexEntry *)&map[t->index_offset];
+    index.assign(e, e + t->chunks);
+    total = t->records;
+    return true;
+}
+
+// no trailer: take every complete chunk with a good CRC
+bool RecordingReader::scanChunks()
+{
+    index.clear();
+    total = 0;
+    size_t at = REC_HEADER_SZ;
+    while (at + sizeof(RecChunkHeader) <= size)
+    {
+        const RecChunkHeader *ch = (const RecChunkHeader *)&map[at];
+        if (ch->magic != REC_CHUNK_MAGIC || at + sizeof(RecChunkHeader) + ch->bytes > size ||
+            crc32_update(0, &map[at + sizeof(RecChunkHeader)], ch->bytes) != ch->crc)
+            break;
+        RecIndexEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.offset = at;
+        entry.first_record = total;
+        entry.first_sample = ch->records ? *(const uint32_t *)&map[at + sizeof(RecChunkHeader)] : 0;
+        entry.records = ch->records;
+        entry.events = ch->events;
+        index.push_back(entry);
+        total += ch->records;
+        at += sizeof(RecChunkHeader) + ch->bytes;
+    }
+    return true;
+}
+
+const int32_t *RecordingReader::rawValues(size_t c) const
+{
+    if (hdr->codec != REC_RAW || c >= index.size())
+        return 0;
+    return (const int32_t *)&map[index[c].offset + sizeof(RecChunkHeader) + values_offset(index[c].records, index[c].events)];
+}
+
+bool RecordingReader::decodeChunk(size_t c)
+{
+    if (cached == (long)c)
+        return true;
+    const size_t n = index[c].records;
+    const uint16_t channels = hdr->channels;
+    const uint8_t *base = &map[index[c].offset + sizeof(RecChunkHeader)];
+    const uint8_t *end = base + chunk(c)->bytes;
+    const uint8_t *p = base + values_offset(n, index[c].events);
+    cacheValues.resize(n * channels);
+    std::vector<int32_t> prev(channels, 0);
+    for (size_t r = 0; r < n; r++)
+    {
+        for (int ch = 0; ch < channels; ch++)
+        {
+            uint32_t z;
+            p = get_varint(p, end, &z);
+            if (!p)
+            {
+                cached = -1;
+                return false;
+            }
+            prev[ch] += (int32_t)((z >> 1) ^ -(int32_t)(z & 1));
+            cacheValues[r * channels + ch] = prev[ch];
+        }
+    }
+    cached = c;
+    return true;
+}
+
+size_t RecordingReader::read(uint64_t first, size_t count, int32_t *values, uint32_t *samples, uint64_t *times)
+{
+    if (first >= total || index.empty())
+        return 0;
+    if (count > total - first)
+        count = total - first;
+    const uint16_t channels = hdr->channels;
+    const uint32_t per_chunk = hdr->chunk_records;
+    size_t done = 0;
+    while (done < count)
+    {
+        uint64_t rec = first + done;
+        size_t c = rec / per_chunk; // every chunk but the last is full
+        if (c >= index.size())
+            break;
+        size_t at = rec - index[c].first_record;
+        size_t n = index[c].records - at;
+        if (n > count - done)
+            n = count - done;
+        const size_t records = index[c].records;
+        const uint8_t *base = &map[index[c].offset + sizeof(RecChunkHeader)];
+        if (samples)
+            memcpy(&samples[done], base + at * 4, n * 4);
+        if (times)
+            memcpy(&times[done], base + times_offset(records) + at * 8, n * 8);
+        if (values)
+        {
+            const int32_t *src = rawValues(c);
+            if (!src)
+            {
+                if (!decodeChunk(c))
+                    break;
+                src = cacheValues.data();
+            }
+            memcpy(&values[done * channels], &src[at * channels], n * channels * 4);
+        }
+        done += n;
+    }
+    return done;
+}
+
+bool RecordingReader::find(uint32_t sample, uint64_t *record) const
+{
+    // last chunk starting at or before sample, sample #s only grow
+    size_t lo = 0, hi = index.size();
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (index[mid].records && index[mid].first_sample <= sample)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (index.empty() || !index[lo].records)
+        return false;
+    const uint32_t *s = (const uint32_t *)&map[index[lo].offset + sizeof(RecChunkHeader)];
+    const uint32_t *hit = std::lower_bound(s, s + index[lo].records, sample);
+    if (hit == s + index[lo].records || *hit != sample)
+        return false;
+    *record = index[lo].first_record + (hit - s);
+    return true;
+}
+
+size_t RecordingReader::events(uint64_t first, size_t count, std::vector<RecEvent> &out) const
+{
+    const uint32_t per_chunk = hdr->chunk_records;
+    size_t added = 0;
+    if (!count || index.empty())
+        return 0;
+    size_t c_last = (first + count - 1) / per_chunk;
+    for (size_t c = first / per_chunk; c <= c_last && c < index.size(); c++)
+    {
+        const uint8_t *base = &map[index[c].offset + sizeof(RecChunkHeader)];
+        const RecEvent *ev = (const RecEvent *)(base + events_offset(index[c].records));
+        out.insert(out.end(), ev, ev + index[c].events);
+        added += index[c].events;
+    }
+    return added;
+}
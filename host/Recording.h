@@ -0,0 +1,173 @@
+/*
+ * Recording.h
+ *
+ * Native recording format, written while streaming and read through mmap.
+ *
+ *   file header   magic, channels, rate, codec, records per chunk and the
+ *                 register snapshot (RREGS), REC_HEADER_SZ bytes
+ *   chunks        REC_CHUNK_RECORDS records each (the last one may be
+ *                 shorter), stored raw or delta compressed, then the
+ *                 events (markers, lead-off, resync, gaps) of the chunk
+ *   index         one RecIndexEntry per chunk
+ *   trailer       index offset and chunk count
+ *
+ * A record is a sample: device sample #, device time, channel codes.
+ * Records are numbered from 0 in the order they were written; as every
+ * chunk holds the same number of them, record i is in chunk
+ * i / records_per_chunk, found through the index in O(1). Raw chunks can
+ * be read in place, compressed chunks are decoded one chunk at a time.
+ *
+ * A file without a trailer (recorder killed) is opened by walking the
+ * chunk headers, every chunk carries a CRC-32.
+ */
+
+#ifndef _RECORDING_H
+#define _RECORDING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+#define REC_MAGIC "HEEGREC1"
+#define REC_TRAILER_MAGIC "HEEGIDX1"
+#define REC_HEADER_SZ 256
+#define REC_MAX_CHANNELS 64
+#define REC_MAX_REGISTERS 32
+#define REC_CHUNK_RECORDS 4096
+#define REC_CHUNK_MAGIC 0x4b4e4843 // "CHNK"
+
+enum RecCodec
+{
+    REC_RAW,   // int32 codes
+    REC_DELTA  // per channel delta to the previous record, zigzag varint
+};
+
+struct RecEvent
+{
+    uint32_t sample; // device sample # the event belongs to
+    uint8_t kind;    // ShmRecordKind
+    uint8_t reserved[3];
+    int32_t value[3];
+};
+
+#pragma pack(push, 1)
+struct RecFileHeader
+{
+    char magic[8];
+    uint16_t version;
+    uint16_t channels;
+    uint32_t rate;           // SPS, 0 if unknown
+    uint8_t codec;
+    uint8_t num_registers;
+    uint16_t reserved;
+    uint32_t chunk_records;  // records per chunk
+    int64_t created;         // unix time
+    uint8_t registers[REC_MAX_REGISTERS]; // ADS129x registers from 0x00
+    char note[64];
+};
+
+struct RecChunkHeader
+{
+    uint32_t magic;
+    uint32_t records;
+    uint32_t events;
+    uint32_t bytes;       // payload after this header
+    uint64_t first_record;
+    uint32_t crc;         // of the payload
+    uint32_t reserved;
+};
+
+struct RecIndexEntry
+{
+    uint64_t offset;       // of the chunk header
+    uint64_t first_record;
+    uint32_t first_sample; // device sample # of the first record
+    uint32_t records;
+    uint32_t events;
+    uint32_t reserved;
+};
+
+struct RecTrailer
+{
+    uint64_t index_offset;
+    uint64_t chunks;
+    uint64_t records;
+    char magic[8];
+};
+#pragma pack(pop)
+
+class RecordingWriter
+{
+public:
+    RecordingWriter();
+    ~RecordingWriter();
+    bool open(const char *path, uint16_t channels, uint32_t rate, RecCodec codec,
+              const uint8_t *registers = 0, uint8_t num_registers = 0, const char *note = 0);
+    void append(uint32_t sample, uint64_t time, const int32_t *values);
+    void event(const RecEvent &ev);
+    bool close(); // flushes the last chunk, writes index and trailer
+    uint64_t records() const { return total; }
+
+private:
+    bool flush();
+
+    FILE *file;
+    RecFileHeader header;
+    uint64_t total;
+    std::vector<uint32_t> samples;
+    std::vector<uint64_t> times;
+    std::vector<int32_t> values;
+    std::vector<RecEvent> events;
+    std::vector<RecIndexEntry> index;
+    std::vector<uint8_t> payload;
+    uint64_t offset;
+};
+
+class RecordingReader
+{
+public:
+    RecordingReader();
+    ~RecordingReader();
+    bool open(const char *path);
+    void close();
+
+    const RecFileHeader &header() const { return *hdr; }
+    uint16_t channels() const { return hdr->channels; }
+    uint64_t records() const { return total; }
+    size_t chunks() const { return index.size(); }
+    bool recovered() const { return rebuilt; } // no trailer, index rebuilt from the chunks
+
+    // count records from first on, any of the outputs may be 0
+    // values: count x channels, returns the records read
+    size_t read(uint64_t first, size_t count, int32_t *values, uint32_t *samples, uint64_t *times);
+    // record of a device sample #, false if it is not in the recording
+    bool find(uint32_t sample, uint64_t *record) const;
+    // events of the chunks holding records first .. first + count - 1
+    size_t events(uint64_t first, size_t count, std::vector<RecEvent> &out) const;
+
+    // in place access to a raw chunk's arrays, 0 for compressed chunks
+    const int32_t *rawValues(size_t chunk) const;
+
+private:
+    bool loadIndex();
+    bool scanChunks();
+    const RecChunkHeader *chunk(size_t c) const { return (const RecChunkHeader *)&map[index[c].offset]; }
+    bool decodeChunk(size_t c);
+
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    const RecFileHeader *hdr;
+    std::vector<RecIndexEntry> index;
+    uint64_t total;
+    bool rebuilt;
+
+    // last decoded compressed chunk
+    long cached;
+    std::vector<uint32_t> cacheSamples;
+    std::vector<uint64_t> cacheTimes;
+    std::vector<int32_t> cacheValues;
+};
+
+#endif // _RECORDING_H
@@ -0,0 +1,68 @@
+/*
+ * SerialPort.cpp
+ *
+ * Stream source setup, see SerialPort.h
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include "SerialPort.h"
+
+static speed_t baud_constant(long baud)
+{
+    switch (baud)
+    {
+    case 115200:
+        return B115200;
+    case 921600:
+        return B921600;
+    case 1000000:
+        return B1000000;
+    case 2000000:
+        return B2000000;
+    case 3000000:
+        return B3000000;
+    default:
+        return B0;
+    }
+}
+
+// raw mode if fd is a terminal, leaves pipes and files alone
+static bool setup_port(int fd, long baud)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+        return errno == ENOTTY || errno == EINVAL;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    speed_t speed = baud_constant(baud);
+    if (speed != B0)
+    {
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+    }
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+int open_port(const char *device, long baud)
+{
+    // a fifo opened for writing as well would never see the end of file
+    struct stat st;
+    bool port = stat(device, &st) == 0 && S_ISCHR(st.st_mode);
+    int fd = open(device, (port ? O_RDWR : O_RDONLY) | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+        return -1;
+    if (!setup_port(fd, baud))
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
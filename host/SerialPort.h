@@ -0,0 +1,14 @@
+/*
+ * SerialPort.h
+ *
+ * Opening the stream source of the host tools: a serial port (raw mode at
+ * the given baud rate), a pty (e.g. from hackeeg_replay), a fifo or a file.
+ */
+
+#ifndef _SERIAL_PORT_H
+#define _SERIAL_PORT_H
+
+// non-blocking fd, -1 on error (errno set); only ports and ptys are writable
+int open_port(const char *device, long baud);
+
+#endif // _SERIAL_PORT_H
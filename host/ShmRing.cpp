@@ -0,0 +1,295 @@
+/*
+ * ShmRing.cpp
+ *
+ * Shared memory sample ring, see ShmRing.h
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ShmRing.h"
+
+#define SHM_RECORDS_OFFSET ((sizeof(ShmHeader) + 63) & ~(size_t)63)
+#define SHM_WAIT_STEP_US 50
+
+size_t ShmRecord::stride(uint16_t channels)
+{
+    size_t bytes = offsetof(ShmRecord, value) + 4 * (channels ? channels : 1);
+    return (bytes + 7) & ~(size_t)7;
+}
+
+bool shm_event(char key, const uint8_t *p, size_t len, uint8_t *kind, uint32_t *sample, int32_t *value)
+{
+    switch (key)
+    {
+    case 'M': // MarkerEvent: uint32 sample, uint16 offset_us, code, source
+        if (len < 8)
+            return false;
+        *kind = SHM_MARKER;
+        value[0] = p[6];
+        value[1] = p[7];
+        value[2] = p[4] | (p[5] << 8);
+        break;
+    case 'L': // uint32 sample, LOFF_STATP, LOFF_STATN
+        if (len < 6)
+            return false;
+        *kind = SHM_LEADOFF;
+        value[0] = p[4];
+        value[1] = p[5];
+        value[2] = 0;
+        break;
+    case 'R': // uint32 sample, uint32 errors
+        if (len < 8)
+            return false;
+        *kind = SHM_RESYNC;
+        value[0] = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+        value[1] = 0;
+        value[2] = 0;
+        break;
+    default:
+        return false;
+    }
+    *sample = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    return true;
+}
+
+static inline ShmRecord *record_at(uint8_t *records, const ShmHeader *hdr, uint64_t seq)
+{
+    return (ShmRecord *)&records[(seq & (hdr->capacity - 1)) * hdr->stride];
+}
+
+// a reader slot whose process has gone away is free again
+static bool pid_alive(uint32_t pid)
+{
+    return pid && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+ShmWriter::ShmWriter()
+    : hdr(0), records(0), mapped(0), timeoutUs(100000), current(0)
+{
+    name[0] = 0;
+}
+
+ShmWriter::~ShmWriter()
+{
+    close();
+}
+
+bool ShmWriter::create(const char *shm_name, uint32_t capacity, uint16_t channels, uint16_t devices, uint32_t rate)
+{
+    if (capacity < 2 || (capacity & (capacity - 1)) || channels > SHM_MAX_CHANNELS)
+        return false;
+    strncpy(name, shm_name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    shm_unlink(name); // a stale ring from a crashed daemon
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return false;
+    size_t stride = ShmRecord::stride(channels);
+    mapped = SHM_RECORDS_OFFSET + (size_t)capacity * stride;
+    if (ftruncate(fd, mapped) != 0)
+    {
+        ::close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void *mem = mmap(0, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return false;
+    }
+    memset(mem, 0, SHM_RECORDS_OFFSET);
+    hdr = (ShmHeader *)mem;
+    records = (uint8_t *)mem + SHM_RECORDS_OFFSET;
+    for (uint32_t i = 0; i < capacity; i++)
+        ((ShmRecord *)&records[(size_t)i * stride])->seq = ~(uint64_t)0;
+    hdr->capacity = capacity;
+    hdr->stride = (uint32_t)stride;
+    hdr->channels = channels;
+    hdr->devices = devices;
+    hdr->rate = rate;
+    hdr->version = SHM_VERSION;
+    hdr->writer_pid = getpid();
+    __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE); // readers may attach now
+    return true;
+}
+
+void ShmWriter::close()
+{
+    if (!hdr)
+        return;
+    __atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+    munmap(hdr, mapped);
+    shm_unlink(name); // readers keep their mapping
+    hdr = 0;
+}
+
+// give backpressure readers that still need record oldest some time
+void ShmWriter::waitForReaders(uint64_t oldest)
+{
+    uint32_t waited = 0;
+    bool stalled = false;
+    for (int r = 0; r < SHM_MAX_READERS; r++)
+    {
+        ShmReaderSlot *slot = &hdr->readers[r];
+        while (slot->pid && slot->backpressure && __atomic_load_n(&slot->next, __ATOMIC_ACQUIRE) <= oldest)
+        {
+            if (!pid_alive(slot->pid))
+                break;
+            if (waited >= timeoutUs)
+            {
+                hdr->forced++; // the reader will find the record gone
+                break;
+            }
+            if (!stalled)
+            {
+                hdr->stalls++;
+                stalled = true;
+            }
+            usleep(SHM_WAIT_STEP_US);
+            waited += SHM_WAIT_STEP_US;
+        }
+    }
+}
+
+ShmRecord *ShmWriter::claim()
+{
+    uint64_t seq = hdr->write_seq;
+    if (seq >= hdr->capacity)
+        waitForReaders(seq - hdr->capacity);
+    current = record_at(records, hdr, seq);
+    __atomic_store_n(&current->seq, ~(uint64_t)0, __ATOMIC_RELAXED); // busy
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    current->device = 0;
+    current->status = 0;
+    current->flags = 0;
+    current->channels = hdr->channels;
+    return current;
+}
+
+void ShmWriter::publish()
+{
+    uint64_t seq = hdr->write_seq;
+    __atomic_store_n(&current->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->write_seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+ShmReader::ShmReader()
+    : hdr(0), records(0), mapped(0), slot(0), next(0)
+{
+}
+
+ShmReader::~ShmReader()
+{
+    detach();
+}
+
+bool ShmReader::attach(const char *name, bool backpressure)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < SHM_RECORDS_OFFSET)
+    {
+        ::close(fd);
+        return false;
+    }
+    mapped = st.st_size;
+    void *mem = mmap(0, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+        return false;
+    hdr = (ShmHeader *)mem;
+    records = (uint8_t *)mem + SHM_RECORDS_OFFSET;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || hdr->version != SHM_VERSION)
+    {
+        detach();
+        return false;
+    }
+
+    uint32_t pid = getpid();
+    for (int r = 0; r < SHM_MAX_READERS && !slot; r++)
+    {
+        ShmReaderSlot *s = &hdr->readers[r];
+        uint32_t owner = s->pid;
+        if (pid_alive(owner))
+            continue;
+        if (__atomic_compare_exchange_n(&s->pid, &owner, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            slot = s;
+    }
+    if (!slot)
+    {
+        detach();
+        return false;
+    }
+    next = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE); // from now on
+    slot->lost = 0;
+    __atomic_store_n(&slot->next, next, __ATOMIC_RELEASE);
+    slot->backpressure = backpressure;
+    return true;
+}
+
+void ShmReader::detach()
+{
+    if (!hdr)
+        return;
+    if (slot)
+    {
+        slot->backpressure = 0;
+        __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+        slot = 0;
+    }
+    munmap(hdr, mapped);
+    hdr = 0;
+}
+
+void ShmReader::skipTo(uint64_t seq)
+{
+    slot->lost += seq - next;
+    next = seq;
+    __atomic_store_n(&slot->next, next, __ATOMIC_RELEASE);
+}
+
+const ShmRecord *ShmReader::peek()
+{
+    uint64_t written = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+    if (next >= written)
+        return 0;
+    if (written - next > hdr->capacity)
+        skipTo(written - hdr->capacity); // lapped
+    const ShmRecord *rec = record_at(records, hdr, next);
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != next)
+    {
+        // overwritten meanwhile, start again from the oldest one that is safe
+        written = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+        skipTo(written - hdr->capacity + 1);
+        rec = record_at(records, hdr, next);
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != next)
+            return 0;
+    }
+    return rec;
+}
+
+bool ShmReader::release()
+{
+    const ShmRecord *rec = record_at(records, hdr, next);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    bool intact = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == next;
+    if (!intact)
+        slot->lost++;
+    next++;
+    __atomic_store_n(&slot->next, next, __ATOMIC_RELEASE);
+    return intact;
+}
+
+uint64_t ShmReader::lag() const
+{
+    return hdr ? __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE) - next : 0;
+}
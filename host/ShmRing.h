@@ -0,0 +1,136 @@
+/*
+ * ShmRing.h
+ *
+ * Shared memory fan-out of a decoded stream: one writer (hackeeg_capd)
+ * and up to SHM_MAX_READERS local readers, each mapping the same ring.
+ * Records are read in place, nothing is copied and nobody takes a lock.
+ *
+ * Every record carries its sequence number, which the writer stores last.
+ * A reader compares it before and after using the record, so it can tell
+ * when the writer lapped it. Readers that lag behind by more than the
+ * ring lose the oldest records and account them in their reader slot.
+ * A reader attached with backpressure makes the writer wait for it instead,
+ * up to a timeout, after which the writer moves on and the reader loses
+ * records like any other.
+ *
+ * Linux only (POSIX shared memory).
+ */
+
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHM_MAGIC 0x47454548 // "HEEG"
+#define SHM_VERSION 1
+#define SHM_MAX_READERS 16
+#define SHM_MAX_CHANNELS 64
+#define SHM_DEFAULT_NAME "/hackeeg"
+
+enum ShmRecordKind
+{
+    SHM_SAMPLE,
+    SHM_MARKER,  // value[0] code, value[1] source, value[2] offset in us
+    SHM_LEADOFF, // value[0] LOFF_STATP, value[1] LOFF_STATN
+    SHM_RESYNC,  // sample lost to a bad status word, value[0] errors so far
+    SHM_GAP      // samples missing before sample, value[0] how many
+};
+
+struct ShmRecord
+{
+    volatile uint64_t seq; // written last by the writer
+    uint64_t time;         // device time, us
+    uint32_t sample;       // device sample #
+    uint32_t status;       // status word, 0 if not sent
+    uint8_t kind;          // ShmRecordKind
+    uint8_t device;        // source device (aggregated streams)
+    uint16_t channels;     // values that follow
+    uint16_t flags;        // artifact flags of the sample (ArtifactFlags.h, ADS channels), 0 if not sent
+    uint16_t reserved;
+    int32_t value[1];      // channels values (codes), the record is padded to the stride
+
+    static size_t stride(uint16_t channels); // bytes per record
+};
+
+// kind, sample # and value[0..2] of an in-band event frame (M, L, R),
+// false for the frames that are not events (B, H, Q, ...)
+bool shm_event(char key, const uint8_t *payload, size_t len, uint8_t *kind, uint32_t *sample, int32_t *value);
+
+struct ShmReaderSlot
+{
+    volatile uint32_t pid;          // 0 = free
+    volatile uint32_t backpressure; // writer waits for this reader
+    volatile uint64_t next;         // next sequence number to read
+    volatile uint64_t lost;         // records the reader missed
+    uint64_t reserved[5];           // one cache line per reader
+};
+
+struct ShmHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity; // records, power of 2
+    uint32_t stride;   // bytes per record
+    uint16_t channels;
+    uint16_t devices;
+    uint32_t rate;     // SPS, 0 if unknown
+    volatile uint32_t writer_pid;
+    volatile uint32_t closed;     // writer went away
+    volatile uint64_t write_seq;  // records published
+    volatile uint64_t stalls;     // times the writer waited for a reader
+    volatile uint64_t forced;     // records a backpressure reader lost after the timeout
+    uint64_t reserved[3];
+    ShmReaderSlot readers[SHM_MAX_READERS];
+};
+
+class ShmWriter
+{
+public:
+    ShmWriter();
+    ~ShmWriter();
+    bool create(const char *name, uint32_t capacity, uint16_t channels, uint16_t devices, uint32_t rate);
+    void close();
+    void setTimeout(uint32_t us) { timeoutUs = us; }
+
+    ShmRecord *claim(); // fill in, then publish()
+    void publish();
+    const ShmHeader *header() const { return hdr; }
+
+private:
+    void waitForReaders(uint64_t oldest);
+
+    char name[64];
+    ShmHeader *hdr;
+    uint8_t *records;
+    size_t mapped;
+    uint32_t timeoutUs;
+    ShmRecord *current;
+};
+
+class ShmReader
+{
+public:
+    ShmReader();
+    ~ShmReader();
+    bool attach(const char *name, bool backpressure); // false if there is no ring or no free slot
+    void detach();
+
+    const ShmRecord *peek();   // next record or 0, valid until release()
+    bool release();            // false if the record was overwritten while in use
+    bool writerGone() const { return hdr && hdr->closed; }
+    uint64_t lost() const { return slot ? slot->lost : 0; }
+    uint64_t lag() const;      // records published but not read yet
+    const ShmHeader *header() const { return hdr; }
+
+private:
+    void skipTo(uint64_t seq);
+
+    ShmHeader *hdr;
+    uint8_t *records;
+    size_t mapped;
+    ShmReaderSlot *slot;
+    uint64_t next;
+};
+
+#endif // _SHM_RING_H
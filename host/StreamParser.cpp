@@ -0,0 +1,305 @@
+/*
+ * StreamParser.cpp
+ *
+ * Frame splitting and decoding of the streaming output, see StreamParser.h
+ */
+
+#include <string.h>
+#include "StreamParser.h"
+
+static const char json_frame_prefix[] = "{\"C\":200,\"";
+#define JSON_FRAME_PREFIX_LEN (sizeof(json_frame_prefix) - 1)
+#define MP_FRAME_HEADER_LEN 9 // 8 header bytes with the key, bin8 length
+
+size_t decode_base64(uint8_t *out, const char *in, size_t len)
+{
+    if (len % 4)
+        return 0;
+    size_t n = len / 4 * 3;
+    if (len && in[len - 1] == '=')
+        n--;
+    if (len > 1 && in[len - 2] == '=')
+        n--;
+    return frame_detail::unbase64(out, in, (int)n) ? n : 0;
+}
+
+size_t decode_hex(uint8_t *out, const char *in, size_t len)
+{
+    if (len % 2)
+        return 0;
+    return frame_detail::unhex(out, in, (int)(len / 2)) ? len / 2 : 0;
+}
+
+size_t encode_inband(char *out, FrameEncoding encoding, char key, const uint8_t *payload, uint8_t len)
+{
+    char *p = out;
+    switch (encoding)
+    {
+    case FRAME_MESSAGEPACK:
+        memcpy(p, frame_detail::mp_header, sizeof(frame_detail::mp_header));
+        p[6] = key;
+        p[MP_FRAME_HEADER_LEN - 1] = len;
+        memcpy(&p[MP_FRAME_HEADER_LEN], payload, len);
+        return MP_FRAME_HEADER_LEN + len;
+    case FRAME_JSONLINES:
+        memcpy(p, json_frame_prefix, JSON_FRAME_PREFIX_LEN);
+        p += JSON_FRAME_PREFIX_LEN;
+        *p++ = key;
+        *p++ = '"';
+        *p++ = ':';
+        *p++ = '"';
+        break;
+    default:
+        *p++ = key;
+        *p++ = ' ';
+        break;
+    }
+    if (encoding == FRAME_HEX)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            *p++ = frame_detail::hex_digits[payload[i] >> 4];
+            *p++ = frame_detail::hex_digits[payload[i] & 0x0f];
+        }
+    }
+    else
+    {
+        for (int i = 0; i < len; i += 3)
+        {
+            uint32_t v = (uint32_t)payload[i] << 16;
+            if (i + 1 < len)
+                v |= (uint32_t)payload[i + 1] << 8;
+            if (i + 2 < len)
+                v |= payload[i + 2];
+            *p++ = frame_detail::b64_alphabet[v >> 18];
+            *p++ = frame_detail::b64_alphabet[(v >> 12) & 0x3f];
+            *p++ = (i + 1 < len) ? frame_detail::b64_alphabet[(v >> 6) & 0x3f] : '=';
+            *p++ = (i + 2 < len) ? frame_detail::b64_alphabet[v & 0x3f] : '=';
+        }
+    }
+    if (encoding == FRAME_JSONLINES)
+    {
+        *p++ = '"';
+        *p++ = '}';
+    }
+    *p++ = '\n';
+    return p - out;
+}
+
+bool StreamParser::parseEncoding(const char *name, FrameEncoding *encoding)
+{
+    if (!strcmp(name, "mp") || !strcmp(name, "messagepack"))
+        *encoding = FRAME_MESSAGEPACK;
+    else if (!strcmp(name, "json") || !strcmp(name, "jsonlines"))
+        *encoding = FRAME_JSONLINES;
+    else if (!strcmp(name, "b64") || !strcmp(name, "base64"))
+        *encoding = FRAME_BASE64;
+    else if (!strcmp(name, "hex"))
+        *encoding = FRAME_HEX;
+    else
+        return false;
+    return true;
+}
+
+StreamParser::StreamParser(const StreamConfig &config)
+    : cfg(config), frameEnd(0), haveLast(false), lastSample(0)
+{
+    decode = frame_decoder(cfg.channels, cfg.status, cfg.encoding, cfg.quantized ? 2 : 3, cfg.flags);
+    memset(&counters, 0, sizeof(counters));
+    memset(shifts, 0, sizeof(shifts));
+}
+
+void StreamParser::sample(FrameSample &s, StreamHandler handler, void *context)
+{
+    if (cfg.quantized)
+    {
+        for (uint8_t ch = 0; ch < s.channels; ch++)
+            s.channel[ch] = Quantizer::reconstruct((int16_t)s.channel[ch], shifts[ch]);
+    }
+    if (haveLast && s.sample != lastSample + 1)
+    {
+        counters.gaps++;
+        uint32_t jump = s.sample - lastSample - 1;
+        if (jump < 0x80000000u) // a step back (device restart, corrupted #) loses nothing
+            counters.missing += jump;
+    }
+    haveLast = true;
+    lastSample = s.sample;
+    counters.samples++;
+    StreamEvent ev;
+    ev.kind = STREAM_SAMPLE;
+    ev.key = 'D';
+    ev.sample = s;
+    ev.payload = 0;
+    ev.len = 0;
+    ev.end = frameEnd;
+    handler(context, ev);
+}
+
+void StreamParser::frame(char key, const uint8_t *payload, size_t len, StreamHandler handler, void *context)
+{
+    if (key == 'Q' && len >= 4) // sent right before the first sample using the new shifts
+    {
+        for (size_t ch = 0; ch + 4 < len && ch < QUANT_MAX_CHANNELS; ch++)
+            shifts[ch] = payload[4 + ch];
+    }
+    counters.frames++;
+    StreamEvent ev;
+    memset(&ev.sample, 0, sizeof(ev.sample));
+    ev.kind = STREAM_FRAME;
+    ev.key = key;
+    ev.payload = payload;
+    ev.len = (uint16_t)len;
+    ev.end = frameEnd;
+    handler(context, ev);
+}
+
+// one frame at p, returns the bytes used, 0 if the frame is incomplete
+size_t StreamParser::parseMessagePack(const char *p, size_t n, StreamHandler handler, void *context)
+{
+    const char *h = frame_detail::mp_header;
+    if (n < MP_FRAME_HEADER_LEN)
+    {
+        if (memcmp(p, h, n < 6 ? n : 6) == 0)
+            return 0; // could still be the start of a header
+        counters.skipped++;
+        return 1;
+    }
+    if (memcmp(p, h, 6) != 0 || p[7] != h[7])
+    {
+        counters.skipped++; // not a frame, e.g. a command response
+        return 1;
+    }
+    size_t len = MP_FRAME_HEADER_LEN + (uint8_t)p[8];
+    if (n < len)
+        return 0;
+    frameEnd += len;
+    if (p[6] == 'D')
+    {
+        FrameSample s;
+        if (decode(p, len, &s))
+            sample(s, handler, context);
+        else
+            counters.bad++;
+    }
+    else
+        frame(p[6], (const uint8_t *)&p[MP_FRAME_HEADER_LEN], len - MP_FRAME_HEADER_LEN, handler, context);
+    return len;
+}
+
+void StreamParser::parseLine(const char *p, size_t n, StreamHandler handler, void *context)
+{
+    uint8_t payload[STREAM_MAX_PAYLOAD];
+    FrameSample s;
+    if (cfg.encoding == FRAME_JSONLINES)
+    {
+        // {"C":200,"<key>":"<base64>"}
+        if (n < JSON_FRAME_PREFIX_LEN + 6 || memcmp(p, json_frame_prefix, JSON_FRAME_PREFIX_LEN) != 0 ||
+            p[JSON_FRAME_PREFIX_LEN + 1] != '"' || p[JSON_FRAME_PREFIX_LEN + 3] != '"' || p[n - 1] != '}')
+        {
+            counters.skipped += n + 1;
+            return;
+        }
+        char key = p[JSON_FRAME_PREFIX_LEN];
+        if (key == 'D')
+        {
+            if (decode(p, n, &s))
+                sample(s, handler, context);
+            else
+                counters.bad++;
+            return;
+        }
+        const char *b64 = &p[JSON_FRAME_PREFIX_LEN + 4];
+        size_t b64_len = n - (JSON_FRAME_PREFIX_LEN + 4) - 2;
+        if (b64_len / 4 * 3 > sizeof(payload))
+        {
+            counters.skipped += n + 1;
+            return;
+        }
+        size_t len = decode_base64(payload, b64, b64_len);
+        if (len || !b64_len)
+            frame(key, payload, len, handler, context);
+        else
+            counters.skipped += n + 1;
+        return;
+    }
+
+    // text: "<key> <base64|hex>" for in-band frames, bare samples
+    if (n >= 2 && p[1] == ' ')
+    {
+        size_t enc_len = n - 2;
+        if (enc_len / 2 > sizeof(payload))
+        {
+            counters.skipped += n + 1;
+            return;
+        }
+        size_t len = (cfg.encoding == FRAME_HEX) ? decode_hex(payload, &p[2], enc_len)
+                                                 : decode_base64(payload, &p[2], enc_len);
+        if (len)
+            frame(p[0], payload, len, handler, context);
+        else
+            counters.skipped += n + 1;
+        return;
+    }
+    if (decode(p, n, &s))
+        sample(s, handler, context);
+    else
+        counters.skipped += n + 1; // responses share the line format
+}
+
+void StreamParser::feed(const char *data, size_t len, StreamHandler handler, void *context)
+{
+    counters.bytes += len;
+    const char *p = data;
+    size_t n = len;
+    if (!pending.empty())
+    {
+        pending.append(data, len);
+        p = pending.data();
+        n = pending.size();
+    }
+    const uint64_t origin = counters.bytes - n; // stream offset of p[0]
+
+    size_t pos = 0;
+    if (cfg.encoding == FRAME_MESSAGEPACK)
+    {
+        while (pos < n)
+        {
+            frameEnd = origin + pos; // parseMessagePack adds the frame length
+            size_t used = parseMessagePack(&p[pos], n - pos, handler, context);
+            if (!used)
+                break;
+            pos += used;
+        }
+    }
+    else
+    {
+        while (pos < n)
+        {
+            const char *nl = (const char *)memchr(&p[pos], '\n', n - pos);
+            if (!nl)
+            {
+                if (n - pos > STREAM_MAX_FRAME)
+                {
+                    counters.skipped += n - pos;
+                    pos = n;
+                }
+                break;
+            }
+            size_t line = nl - &p[pos];
+            size_t end = line;
+            if (end && p[pos + end - 1] == '\r')
+                end--;
+            frameEnd = origin + pos + line + 1;
+            if (end)
+                parseLine(&p[pos], end, handler, context);
+            pos += line + 1;
+        }
+    }
+
+    // keep the incomplete tail
+    if (p == pending.data())
+        pending.erase(0, pos);
+    else
+        pending.assign(&p[pos], n - pos);
+}
@@ -0,0 +1,95 @@
+/*
+ * StreamParser.h
+ *
+ * Incremental decoder for the byte stream the firmware sends while
+ * streaming: sample frames (FrameEncoder.h) and the in-band frames
+ * (B bandpower, L lead-off, R resync, H heartbeat, M marker, Q quantiser
+ * shifts, ...) in any of the protocols. Bytes can come in chunks of any
+ * size, every complete frame is handed to the handler once.
+ *
+ * Quantised samples are scaled back to codes with the shifts of the last
+ * 'Q' frame, so consumers always see 24 bit codes.
+ */
+
+#ifndef _STREAM_PARSER_H
+#define _STREAM_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "FrameEncoder.h"
+#include "Quantizer.h"
+
+#define STREAM_MAX_FRAME 1024  // longer lines are dropped as garbage
+#define STREAM_MAX_PAYLOAD 256 // in-band frames carry a uint8 length
+
+struct StreamConfig
+{
+    FrameEncoding encoding;
+    uint8_t channels;  // on the wire: 4, 6 or 8
+    bool status;       // status word in the sample frames (no "leadoff x 1")
+    bool quantized;    // "quantize 1"
+    bool flags;        // "artifacts 1"
+};
+
+enum StreamEventKind
+{
+    STREAM_SAMPLE,
+    STREAM_FRAME // an in-band frame, key and payload set
+};
+
+struct StreamEvent
+{
+    uint8_t kind;
+    char key;            // in-band frame key
+    FrameSample sample;  // STREAM_SAMPLE
+    const uint8_t *payload;
+    uint16_t len;
+    uint64_t end;        // stream offset just past the frame
+};
+
+struct StreamStats
+{
+    uint64_t bytes;
+    uint64_t samples;
+    uint64_t frames;    // in-band frames
+    uint64_t bad;       // sample frames that did not decode or had a bad status word
+    uint64_t skipped;   // bytes outside of any frame (command responses, garbage)
+    uint64_t gaps;      // sample # jumps
+    uint64_t missing;   // samples missing in those jumps
+};
+
+typedef void (*StreamHandler)(void *context, const StreamEvent &event);
+
+class StreamParser
+{
+public:
+    StreamParser(const StreamConfig &config);
+    void feed(const char *data, size_t len, StreamHandler handler, void *context);
+    const StreamStats &stats() const { return counters; }
+    const StreamConfig &config() const { return cfg; }
+
+    static bool parseEncoding(const char *name, FrameEncoding *encoding); // mp|json|b64|hex
+
+private:
+    size_t parseMessagePack(const char *p, size_t n, StreamHandler handler, void *context);
+    void parseLine(const char *p, size_t n, StreamHandler handler, void *context);
+    void sample(FrameSample &s, StreamHandler handler, void *context);
+    void frame(char key, const uint8_t *payload, size_t len, StreamHandler handler, void *context);
+
+    StreamConfig cfg;
+    FrameDecoderFn decode;
+    std::string pending; // incomplete frame from the last feed()
+    uint64_t frameEnd;
+    StreamStats counters;
+    bool haveLast;
+    uint32_t lastSample;
+    uint8_t shifts[QUANT_MAX_CHANNELS];
+};
+
+size_t decode_base64(uint8_t *out, const char *in, size_t len); // returns bytes, 0 on error
+size_t decode_hex(uint8_t *out, const char *in, size_t len);
+// in-band frame as the firmware's send_frame() puts it on the wire, returns the bytes
+size_t encode_inband(char *out, FrameEncoding encoding, char key, const uint8_t *payload, uint8_t len);
+
+#endif // _STREAM_PARSER_H
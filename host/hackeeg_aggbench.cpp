@@ -0,0 +1,259 @@
+/*
+ * hackeeg_aggbench.cpp
+ *
+ * Aggregator benchmark with simulated boards. Every device runs in its own
+ * thread on a virtual host clock: its crystal is off by up to -k ppm, its
+ * esp_timer and sample # start anywhere, its frames arrive in batches with
+ * USB-like latency jitter and (-g) it drops 50 ms of samples now and then.
+ * Channel 1 of every device carries the true sampling instant, so the
+ * merged stream shows how far apart the samples it put together really
+ * were.
+ *
+ *   hackeeg_aggbench [-n max devices] [-c channels] [-r sps] [-s seconds]
+ *                    [-k skew ppm] [-j jitter us] [-g dropout interval s]
+ *
+ * Runs 1, 2, 4, ... up to -n devices as fast as the merging keeps up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+#include "Aggregator.h"
+
+#define BATCH 32                 // frames per read() on the host
+#define BASE_LATENCY_NS 1000000
+#define TRUTH_UNIT_NS 10000      // channel 1: true time in 10 us
+#define LEAD_NS 50000000         // how far a device may run ahead of the slowest
+
+struct SimConfig
+{
+    int devices;
+    uint8_t channels;
+    double rate;
+    double seconds;
+    double skewPpm;
+    double jitterUs;
+    double dropoutS;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t progress[AGG_MAX_DEVICES]; // virtual ns per device
+
+static uint64_t slowest(int devices)
+{
+    uint64_t m = UINT64_MAX;
+    for (int i = 0; i < devices; i++)
+    {
+        uint64_t p = __atomic_load_n(&progress[i], __ATOMIC_ACQUIRE);
+        if (p < m)
+            m = p;
+    }
+    return m;
+}
+
+static double device_skew(const SimConfig &sim, int device)
+{
+    return device ? sim.skewPpm * 1e-6 * (((device * 7919) % 201) / 100.0 - 1) : 0;
+}
+
+static void simulate(Aggregator *agg, const SimConfig *sim, int device)
+{
+    const double skew = device_skew(*sim, device);
+    const double phase_ns = device * 37000.0 + 5e6;
+    const uint64_t timer_start = 1000000ULL * (17 + 131 * device); // esp_timer since boot, us
+    const uint32_t first_sample = 100000u * device + 7;
+    const uint64_t count = (uint64_t)(sim->seconds * sim->rate * (1 + skew));
+    FrameEncoderFn encode = frame_encoder(sim->channels, true, FRAME_MESSAGEPACK);
+    unsigned rng = 12345 + device;
+    std::vector<char> batch(BATCH * FRAME_MAX_SZ);
+    size_t used = 0;
+    int frames = 0;
+    uint64_t arrival = 0;
+    uint8_t raw[FRAME_RAW_SZ] = {0xC0, 0, 0};
+
+    for (uint64_t k = 0; k < count; k++)
+    {
+        const double tau = phase_ns + k * 1e9 / (sim->rate * (1 + skew)); // true time of the sample, ns
+        const double dropout_at = fmod(tau * 1e-9 + 0.3 * device, sim->dropoutS > 0 ? sim->dropoutS : 1e30);
+        if (device && sim->dropoutS > 0 && dropout_at < 0.05)
+            continue; // lost on the way, the sample # moves on anyway
+        int32_t truth = (int32_t)((uint64_t)(tau / TRUTH_UNIT_NS) & 0x7fffff);
+        for (int ch = 0; ch < sim->channels; ch++)
+        {
+            int32_t v = ch ? (int32_t)(rand_r(&rng) % 2001) - 1000 : truth;
+            raw[3 + 3 * ch] = v >> 16;
+            raw[4 + 3 * ch] = v >> 8;
+            raw[5 + 3 * ch] = v;
+        }
+        uint64_t device_time = timer_start + (uint64_t)(tau / 1000 * (1 + skew));
+        used += encode(&batch[used], device_time, first_sample + (uint32_t)k, raw, 0);
+        if (++frames < BATCH && k + 1 < count)
+            continue;
+
+        double jitter = -log((rand_r(&rng) + 1.0) / (RAND_MAX + 2.0)) * sim->jitterUs * 250; // mean jitter / 4
+        if (jitter > sim->jitterUs * 1000)
+            jitter = sim->jitterUs * 1000;
+        uint64_t a = (uint64_t)(tau + BASE_LATENCY_NS + jitter);
+        if (a > arrival)
+            arrival = a;
+        __atomic_store_n(&progress[device], arrival, __ATOMIC_RELEASE); // not behind itself after a dropout
+        while (agg->backlog(device) > AGG_QUEUE * 3 / 4 || arrival > slowest(sim->devices) + LEAD_NS)
+            sched_yield();
+        agg->feed(device, &batch[0], used, arrival);
+        used = 0;
+        frames = 0;
+    }
+    agg->close(device);
+    __atomic_store_n(&progress[device], UINT64_MAX, __ATOMIC_RELEASE);
+}
+
+struct Check
+{
+    const Aggregator *agg;
+    int devices;
+    uint8_t channels;
+    uint64_t samples, gaps, compared;
+    double errorSum, errorMax; // us
+};
+
+static void check(void *context, const MergedRecord &rec)
+{
+    Check &c = *(Check *)context;
+    if (rec.kind == SHM_GAP)
+    {
+        c.gaps++;
+        return;
+    }
+    if (rec.kind != SHM_SAMPLE)
+        return;
+    c.samples++;
+    const int32_t ref = rec.value[0];
+    for (int d = 1; d < c.devices; d++)
+    {
+        int32_t v = rec.value[d * c.channels];
+        if (v == 0)
+            continue; // filled in
+        int32_t diff = ((v - ref) << 9) >> 9; // 23 bit wrap
+        double us = fabs((double)diff * TRUTH_UNIT_NS / 1000);
+        c.errorSum += us;
+        if (us > c.errorMax)
+            c.errorMax = us;
+        c.compared++;
+    }
+}
+
+static void run(const SimConfig &sim)
+{
+    Aggregator agg;
+    StreamConfig cfg = {FRAME_MESSAGEPACK, sim.channels, true, false, false};
+    for (int d = 0; d < sim.devices; d++)
+    {
+        agg.addDevice(cfg);
+        progress[d] = 0;
+    }
+    Check c;
+    memset(&c, 0, sizeof(c));
+    c.agg = &agg;
+    c.devices = sim.devices;
+    c.channels = sim.channels;
+
+    double t0 = now();
+    std::vector<std::thread> threads;
+    for (int d = 0; d < sim.devices; d++)
+        threads.push_back(std::thread(simulate, &agg, &sim, d));
+    while (!agg.done())
+    {
+        if (!agg.merge(check, &c))
+            sched_yield();
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    double wall = now() - t0;
+
+    uint64_t repeats = 0, skips = 0, missing = 0, device_samples = 0;
+    double skew_error = 0;
+    for (int d = 0; d < sim.devices; d++)
+    {
+        const AggDeviceStats &st = agg.stats(d);
+        device_samples += st.samples;
+        if (d)
+        {
+            repeats += st.repeats;
+            skips += st.skips;
+            missing += st.missing;
+        }
+        // skews are estimated against the host, compare device against device 0
+        double e = fabs((st.skewPpm - agg.stats(0).skewPpm) - device_skew(sim, d) * 1e6);
+        if (e > skew_error)
+            skew_error = e;
+    }
+    printf("%2d devices %4d ch: %8.2f Msamples/s in %6.2f s (%5.0fx real time), merged %llu, "
+           "align mean %5.1f max %6.1f us, repeats %llu skips %llu, gaps %llu (%llu), skew error %.2f ppm\n",
+           sim.devices, sim.devices * sim.channels, device_samples / wall / 1e6, wall, sim.seconds / wall,
+           (unsigned long long)c.samples, c.compared ? c.errorSum / c.compared : 0, c.errorMax,
+           (unsigned long long)repeats, (unsigned long long)skips, (unsigned long long)c.gaps,
+           (unsigned long long)missing, skew_error);
+}
+
+int main(int argc, char **argv)
+{
+    SimConfig sim = {8, 8, 4000, 60, 50, 2000, 10};
+    int max_devices = 8;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:r:s:k:j:g:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            max_devices = atoi(optarg);
+            break;
+        case 'c':
+            sim.channels = atoi(optarg);
+            break;
+        case 'r':
+            sim.rate = atof(optarg);
+            break;
+        case 's':
+            sim.seconds = atof(optarg);
+            break;
+        case 'k':
+            sim.skewPpm = atof(optarg);
+            break;
+        case 'j':
+            sim.jitterUs = atof(optarg);
+            break;
+        case 'g':
+            sim.dropoutS = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_aggbench [-n max devices] [-c channels] [-r sps] [-s seconds]\n"
+                            "                        [-k skew ppm] [-j jitter us] [-g dropout interval s]\n");
+            return 1;
+        }
+    }
+    if (max_devices < 1 || max_devices > AGG_MAX_DEVICES || max_devices * sim.channels > SHM_MAX_CHANNELS ||
+        (sim.channels != 4 && sim.channels != 6 && sim.channels != 8))
+        return 1;
+    printf("%.0f SPS, %.0f s, skew up to %.0f ppm, jitter up to %.0f us, %u hardware threads\n", sim.rate,
+           sim.seconds, sim.skewPpm, sim.jitterUs, std::thread::hardware_concurrency());
+    for (int n = 1;; n *= 2)
+    {
+        sim.devices = (n < max_devices) ? n : max_devices;
+        run(sim);
+        if (sim.devices == max_devices)
+            break;
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * hackeeg_aggd.cpp
+ *
+ * Aggregating capture daemon: like hackeeg_capd, but for several boards
+ * at once. Each device gets a reader thread, the streams are aligned and
+ * merged (Aggregator.h) into one shared memory ring whose samples carry
+ * the channels of all devices, device 0 first.
+ *
+ *   hackeeg_aggd -d /dev/ttyUSB0 -d /dev/ttyUSB1 ... -p mp [-c 8] [-s] [-q] [-a]
+ *                [-n /hackeeg] [-r 65536] [-b 3000000] [-l latency ms]
+ *                [-x command]... [-v]
+ *
+ * All devices must stream in the same protocol and rate; -x commands go to
+ * every device. Device 0 sets the clock of the merged stream, if it stops
+ * the merged stream stops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Aggregator.h"
+#include "SerialPort.h"
+
+#define READ_CHUNK (64 * 1024)
+#define STATS_INTERVAL_S 5
+#define MERGE_IDLE_US 500
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int)
+{
+    running = 0;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void read_device(Aggregator *agg, int device, int fd)
+{
+    std::vector<char> buffer(READ_CHUNK);
+    while (running)
+    {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, 200);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+        ssize_t n = read(fd, &buffer[0], buffer.size());
+        if (n > 0)
+            agg->feed(device, &buffer[0], n, now_ns());
+        else if (n == 0 || (pfd.revents & POLLHUP))
+            break;
+        else if (errno != EAGAIN && errno != EINTR)
+            break;
+    }
+    agg->close(device);
+}
+
+static void publish(void *context, const MergedRecord &merged)
+{
+    ShmWriter *ring = (ShmWriter *)context;
+    ShmRecord *rec = ring->claim();
+    rec->kind = merged.kind;
+    rec->device = merged.device;
+    rec->sample = merged.sample;
+    rec->time = merged.time;
+    rec->status = merged.status;
+    rec->flags = merged.flags;
+    if (merged.kind == SHM_SAMPLE)
+        memcpy(rec->value, merged.value, rec->channels * sizeof(int32_t));
+    else
+        memcpy(rec->value, merged.value, 3 * sizeof(int32_t));
+    ring->publish();
+}
+
+static void print_stats(const Aggregator &agg, const std::vector<const char *> &devices, const ShmHeader *hdr)
+{
+    fprintf(stderr, "merged %llu stalls %llu forced %llu\n", (unsigned long long)hdr->write_seq,
+            (unsigned long long)hdr->stalls, (unsigned long long)hdr->forced);
+    for (size_t i = 0; i < agg.devices(); i++)
+    {
+        const AggDeviceStats &st = agg.stats(i);
+        const StreamStats &ss = agg.streamStats(i);
+        fprintf(stderr, "  %zu %s: samples %llu bad %llu used %llu repeats %llu skips %llu gaps %llu (%llu) overflows %llu skew %+.1f ppm offset %.0f us\n",
+                i, devices[i], (unsigned long long)st.samples, (unsigned long long)ss.bad, (unsigned long long)st.used,
+                (unsigned long long)st.repeats, (unsigned long long)st.skips, (unsigned long long)st.gaps,
+                (unsigned long long)st.missing, (unsigned long long)st.overflows, st.skewPpm, st.offsetUs);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: hackeeg_aggd -d device -d device ... [-p mp|json|b64|hex] [-c channels] [-s] [-q] [-a]\n"
+                    "                    [-n shm name] [-r records] [-b baud] [-t wait us] [-l latency ms]\n"
+                    "                    [-x command]... [-v]\n");
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<const char *> devices, commands;
+    const char *shm_name = SHM_DEFAULT_NAME;
+    StreamConfig cfg = {FRAME_MESSAGEPACK, 8, true, false, false};
+    uint32_t capacity = 65536;
+    long baud = 3000000;
+    uint32_t timeout_us = 100000;
+    uint64_t latency_ms = AGG_DEFAULT_LATENCY_NS / 1000000;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:p:c:sqan:r:b:t:l:x:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            devices.push_back(optarg);
+            break;
+        case 'p':
+            if (!StreamParser::parseEncoding(optarg, &cfg.encoding))
+            {
+                usage();
+                return 1;
+            }
+            break;
+        case 'c':
+            cfg.channels = atoi(optarg);
+            break;
+        case 's':
+            cfg.status = false;
+            break;
+        case 'q':
+            cfg.quantized = true;
+            break;
+        case 'a':
+            cfg.flags = true;
+            break;
+        case 'n':
+            shm_name = optarg;
+            break;
+        case 'r':
+            capacity = strtoul(optarg, 0, 0);
+            break;
+        case 'b':
+            baud = atol(optarg);
+            break;
+        case 't':
+            timeout_us = strtoul(optarg, 0, 0);
+            break;
+        case 'l':
+            latency_ms = strtoull(optarg, 0, 0);
+            break;
+        case 'x':
+            commands.push_back(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (devices.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    Aggregator agg(latency_ms * 1000000);
+    std::vector<int> fds;
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        int fd = open_port(devices[i], baud);
+        if (fd < 0)
+        {
+            perror(devices[i]);
+            return 1;
+        }
+        if (agg.addDevice(cfg) < 0)
+        {
+            fprintf(stderr, "at most %d devices and %d channels\n", AGG_MAX_DEVICES, SHM_MAX_CHANNELS);
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+
+    ShmWriter ring;
+    if (!ring.create(shm_name, capacity, agg.channels(), agg.devices(), 0))
+    {
+        fprintf(stderr, "can not create shared memory %s (capacity must be a power of 2)\n", shm_name);
+        return 1;
+    }
+    ring.setTimeout(timeout_us);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    for (size_t c = 0; c < commands.size(); c++)
+    {
+        std::string line = std::string(commands[c]) + "\n";
+        for (size_t i = 0; i < fds.size(); i++)
+        {
+            if (write(fds[i], line.data(), line.size()) < 0)
+                perror(devices[i]);
+        }
+    }
+
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < fds.size(); i++)
+        readers.push_back(std::thread(read_device, &agg, (int)i, fds[i]));
+
+    time_t last_stats = time(0);
+    while (running && !agg.done())
+    {
+        if (!agg.merge(publish, &ring))
+            usleep(MERGE_IDLE_US);
+        if (verbose && time(0) - last_stats >= STATS_INTERVAL_S)
+        {
+            last_stats = time(0);
+            print_stats(agg, devices, ring.header());
+        }
+    }
+    running = 0;
+    for (size_t i = 0; i < readers.size(); i++)
+        readers[i].join();
+    print_stats(agg, devices, ring.header());
+    ring.close();
+    for (size_t i = 0; i < fds.size(); i++)
+        close(fds[i]);
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * hackeeg_bandpowerbench.cpp
+ *
+ * The firmware's band power estimator (components/uart/BandPower.h)
+ * against the same estimator in double precision, and its speed. At
+ * stream rates of 125, 250 and 500 SPS:
+ *
+ *   - 8 channels of offset, EEG sized sines and noise: every band may be
+ *     at most MAX_ERROR off the double precision periodogram, relative to
+ *     the channel's power in all bands (the fixed point FFT's noise);
+ *   - a sine in the middle of a band, one channel per band: the band must
+ *     hold the sine's power A^2 / 2 within MAX_TONE_ERROR, so the scaling
+ *     and band edges are right.
+ *
+ * Exits 1 if either is off.
+ *
+ *   hackeeg_bandpowerbench [-w windows]
+ *
+ * On the device the "status" command reports cycles per band power frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "BandPower.h"
+
+#define MAX_ERROR 1e-3
+#define MAX_TONE_ERROR 0.01
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Hann windowed periodogram of x[0..BP_WINDOW), summed over the bins of
+// each band as BandPower::configure() picks them
+static void reference(const int32_t *x, int rate, double *powers)
+{
+    double mean = 0, w[BP_WINDOW], s2 = 0;
+    for (int n = 0; n < BP_WINDOW; n++)
+    {
+        mean += x[n];
+        w[n] = 0.5 - 0.5 * cos(2 * M_PI * n / BP_WINDOW);
+        s2 += w[n] * w[n];
+    }
+    mean /= BP_WINDOW;
+    for (int b = 0; b < BP_NUM_BANDS; b++)
+    {
+        int lo = (int)ceil(BandPower::band_edges[b] * BP_WINDOW / rate);
+        int hi = (int)ceil(BandPower::band_edges[b + 1] * BP_WINDOW / rate);
+        lo = (lo < 1) ? 1 : lo;
+        hi = (hi > BP_WINDOW / 2) ? BP_WINDOW / 2 : hi;
+        powers[b] = 0;
+        for (int k = lo; k < hi; k++)
+        {
+            double re = 0, im = 0;
+            for (int n = 0; n < BP_WINDOW; n++)
+            {
+                re += (x[n] - mean) * w[n] * cos(2 * M_PI * k * n / BP_WINDOW);
+                im -= (x[n] - mean) * w[n] * sin(2 * M_PI * k * n / BP_WINDOW);
+            }
+            powers[b] += 2 * (re * re + im * im) / (BP_WINDOW * s2);
+        }
+    }
+}
+
+static bool run(int rate, int windows)
+{
+    const int channels = BP_MAX_CHANNELS;
+    BandPower bp;
+    bp.configure(rate, BP_WINDOW / 4, channels);
+
+    // the mixed signals, one block per window
+    const size_t n = (size_t)windows * BP_WINDOW / 4 + BP_WINDOW;
+    std::vector<int32_t> x(n * channels);
+    unsigned rng = rate;
+    for (size_t i = 0; i < n; i++)
+    {
+        const double t = (double)i / rate;
+        for (int ch = 0; ch < channels; ch++)
+        {
+            double v = 200000 * (ch - 4) + 3000 * sin(2 * M_PI * (2.3 + 5.1 * ch) * t) +
+                       800 * sin(2 * M_PI * 10.2 * t + ch) + 100 * sin(2 * M_PI * (31 + ch) * t) +
+                       (int)(rand_r(&rng) % 401) - 200;
+            x[i * channels + ch] = (int32_t)lrint(v);
+        }
+    }
+    double worst = 0, seconds = 0;
+    int frames = 0;
+    std::vector<int32_t> window(BP_WINDOW);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!bp.push(&x[i * channels], (uint32_t)i))
+            continue;
+        float powers[BP_MAX_CHANNELS * BP_NUM_BANDS];
+        const double t0 = now();
+        uint32_t end = bp.compute(powers);
+        seconds += now() - t0;
+        frames++;
+        for (int ch = 0; ch < channels; ch++)
+        {
+            for (int k = 0; k < BP_WINDOW; k++)
+                window[k] = x[(end + 1 - BP_WINDOW + k) * channels + ch];
+            double want[BP_NUM_BANDS], total = 0;
+            reference(&window[0], rate, want);
+            for (int b = 0; b < BP_NUM_BANDS; b++)
+                total += want[b];
+            for (int b = 0; b < BP_NUM_BANDS; b++)
+            {
+                const double error = fabs(powers[ch * BP_NUM_BANDS + b] - want[b]) / total;
+                if (error > worst)
+                    worst = error;
+            }
+        }
+    }
+
+    // one tone per band, in the middle of the band's bins
+    double tone_worst = 0;
+    int tones = 0;
+    BandPower tp;
+    tp.configure(rate, BP_WINDOW, BP_NUM_BANDS);
+    double f[BP_NUM_BANDS];
+    bool in_band[BP_NUM_BANDS];
+    for (int b = 0; b < BP_NUM_BANDS; b++)
+    {
+        const double bin = (double)rate / BP_WINDOW;
+        const int lo = (int)ceil(BandPower::band_edges[b] / bin), hi = (int)ceil(BandPower::band_edges[b + 1] / bin);
+        f[b] = (lo + hi - 1) / 2.0 * bin + 0.3 * bin; // not on a bin
+        in_band[b] = hi - lo >= 5 && hi <= BP_WINDOW / 2; // room for the Hann main lobe
+    }
+    const double amplitude = 100000;
+    for (int i = 0; i < BP_WINDOW; i++)
+    {
+        int32_t s[BP_NUM_BANDS];
+        for (int b = 0; b < BP_NUM_BANDS; b++)
+            s[b] = (int32_t)lrint(amplitude * sin(2 * M_PI * f[b] * i / rate));
+        if (tp.push(s, i))
+        {
+            float powers[BP_NUM_BANDS * BP_NUM_BANDS];
+            tp.compute(powers);
+            for (int b = 0; b < BP_NUM_BANDS; b++)
+            {
+                if (!in_band[b])
+                    continue;
+                const double error = fabs(powers[b * BP_NUM_BANDS + b] / (amplitude * amplitude / 2) - 1);
+                if (error > tone_worst)
+                    tone_worst = error;
+                tones++;
+            }
+        }
+    }
+
+    const bool ok = frames > 0 && worst <= MAX_ERROR && tones > 0 && tone_worst <= MAX_TONE_ERROR;
+    printf("%3d SPS: %d frames, max error %.1e of total, %d tones within %.2f %%, %5.1f us/frame (8 channels)%s\n", rate,
+           frames, worst, tones, tone_worst * 100, frames ? seconds / frames * 1e6 : 0.0, ok ? "" : "  <--");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int windows = 40;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            windows = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_bandpowerbench [-w windows]\n");
+            return 1;
+        }
+    }
+    if (windows < 1)
+        windows = 1;
+    bool ok = true;
+    ok &= run(125, windows);
+    ok &= run(250, windows);
+    ok &= run(500, windows);
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,262 @@
+/*
+ * hackeeg_capd.cpp
+ *
+ * Capture daemon: owns the serial port, decodes the stream once and
+ * publishes samples and events into a shared memory ring (ShmRing.h) that
+ * any number of local readers map, see hackeeg_tap.
+ *
+ *   hackeeg_capd -d /dev/ttyUSB0 -p mp [-c 8] [-s] [-q] [-a] [-n /hackeeg]
+ *                [-r 65536] [-b 3000000] [-w rec.heeg [-z]] [-x command]... [-v]
+ *
+ * -d may be a serial port, a pty (e.g. from hackeeg_replay) or a fifo.
+ * -x commands are written to the port first, e.g. -x sdatac -x messagepack
+ * -x rdatac (note: after "messagepack" the board expects JSON commands,
+ * so only the text commands belong in front of it).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "StreamParser.h"
+#include "ShmRing.h"
+#include "Recording.h"
+#include "SerialPort.h"
+
+#define READ_CHUNK (64 * 1024)
+#define STATS_INTERVAL_S 5
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int)
+{
+    running = 0;
+}
+
+struct Publisher
+{
+    ShmWriter ring;
+    uint64_t records;
+    RecordingWriter *recorder; // 0 without -w
+};
+
+static void publish(void *context, const StreamEvent &ev)
+{
+    Publisher *pub = (Publisher *)context;
+    ShmRecord *rec;
+    if (ev.kind == STREAM_SAMPLE)
+    {
+        rec = pub->ring.claim();
+        rec->kind = SHM_SAMPLE;
+        rec->time = ev.sample.time;
+        rec->sample = ev.sample.sample;
+        rec->status = ev.sample.status;
+        rec->flags = ev.sample.flags;
+        for (int ch = 0; ch < ev.sample.channels && ch < rec->channels; ch++)
+            rec->value[ch] = ev.sample.channel[ch];
+        if (pub->recorder)
+            pub->recorder->append(rec->sample, rec->time, rec->value);
+        pub->ring.publish();
+        pub->records++;
+        return;
+    }
+
+    uint8_t kind;
+    uint32_t sample;
+    int32_t value[3];
+    if (!shm_event(ev.key, ev.payload, ev.len, &kind, &sample, value))
+        return; // B, H, Q, ... stay with the daemon
+    rec = pub->ring.claim();
+    rec->kind = kind;
+    rec->sample = sample;
+    memcpy(rec->value, value, sizeof(value));
+    rec->time = 0;
+    if (pub->recorder)
+    {
+        RecEvent e;
+        memset(&e, 0, sizeof(e));
+        e.sample = rec->sample;
+        e.kind = rec->kind;
+        memcpy(e.value, rec->value, sizeof(e.value));
+        pub->recorder->event(e);
+    }
+    pub->ring.publish();
+    pub->records++;
+}
+
+static void print_stats(const StreamParser &parser, const ShmHeader *hdr)
+{
+    const StreamStats &st = parser.stats();
+    fprintf(stderr, "bytes %llu samples %llu frames %llu bad %llu skipped %llu gaps %llu missing %llu stalls %llu forced %llu\n",
+            (unsigned long long)st.bytes, (unsigned long long)st.samples, (unsigned long long)st.frames,
+            (unsigned long long)st.bad, (unsigned long long)st.skipped, (unsigned long long)st.gaps,
+            (unsigned long long)st.missing, (unsigned long long)hdr->stalls, (unsigned long long)hdr->forced);
+    for (int r = 0; r < SHM_MAX_READERS; r++)
+    {
+        const ShmReaderSlot &s = hdr->readers[r];
+        if (s.pid)
+            fprintf(stderr, "  reader %u%s lag %llu lost %llu\n", s.pid, s.backpressure ? " (backpressure)" : "",
+                    (unsigned long long)(hdr->write_seq - s.next), (unsigned long long)s.lost);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: hackeeg_capd -d device [-p mp|json|b64|hex] [-c channels] [-s] [-q] [-a]\n"
+                    "                    [-n shm name] [-r records] [-b baud] [-t wait us] [-w recording [-z]]\n"
+                    "                    [-x command]... [-v]\n"
+                    "  -s  no status word in the samples (leadoff x 1)\n"
+                    "  -q  quantised samples (quantize 1)\n"
+                    "  -a  artifact flags in the samples (artifacts 1)\n"
+                    "  -z  delta compressed recording\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = 0;
+    const char *shm_name = SHM_DEFAULT_NAME;
+    StreamConfig cfg = {FRAME_MESSAGEPACK, 8, true, false, false};
+    uint32_t capacity = 65536;
+    long baud = 3000000;
+    uint32_t timeout_us = 100000;
+    bool verbose = false;
+    const char *record_path = 0;
+    RecCodec codec = REC_RAW;
+    std::vector<const char *> commands;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:p:c:sqan:r:b:t:w:zx:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'p':
+            if (!StreamParser::parseEncoding(optarg, &cfg.encoding))
+            {
+                usage();
+                return 1;
+            }
+            break;
+        case 'c':
+            cfg.channels = atoi(optarg);
+            break;
+        case 's':
+            cfg.status = false;
+            break;
+        case 'q':
+            cfg.quantized = true;
+            break;
+        case 'a':
+            cfg.flags = true;
+            break;
+        case 'n':
+            shm_name = optarg;
+            break;
+        case 'r':
+            capacity = strtoul(optarg, 0, 0);
+            break;
+        case 'b':
+            baud = atol(optarg);
+            break;
+        case 't':
+            timeout_us = strtoul(optarg, 0, 0);
+            break;
+        case 'w':
+            record_path = optarg;
+            break;
+        case 'z':
+            codec = REC_DELTA;
+            break;
+        case 'x':
+            commands.push_back(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (!device)
+    {
+        usage();
+        return 1;
+    }
+
+    int fd = open_port(device, baud);
+    if (fd < 0)
+    {
+        perror(device);
+        return 1;
+    }
+
+    Publisher pub;
+    pub.records = 0;
+    if (!pub.ring.create(shm_name, capacity, cfg.channels, 1, 0))
+    {
+        fprintf(stderr, "can not create shared memory %s (capacity must be a power of 2)\n", shm_name);
+        return 1;
+    }
+    pub.ring.setTimeout(timeout_us);
+    RecordingWriter recorder;
+    pub.recorder = 0;
+    if (record_path)
+    {
+        if (!recorder.open(record_path, cfg.channels, 0, codec))
+        {
+            perror(record_path);
+            return 1;
+        }
+        pub.recorder = &recorder;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        std::string line = std::string(commands[i]) + "\n";
+        if (write(fd, line.data(), line.size()) < 0)
+            perror("write");
+    }
+
+    StreamParser parser(cfg);
+    std::vector<char> buffer(READ_CHUNK);
+    time_t last_stats = time(0);
+    while (running)
+    {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, 200);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready > 0)
+        {
+            ssize_t n = read(fd, &buffer[0], buffer.size());
+            if (n > 0)
+                parser.feed(&buffer[0], n, publish, &pub);
+            else if (n == 0 || (pfd.revents & POLLHUP))
+                break; // end of file or the other side of the pty closed
+            else if (errno != EAGAIN && errno != EINTR)
+                break;
+        }
+        if (verbose && time(0) - last_stats >= STATS_INTERVAL_S)
+        {
+            last_stats = time(0);
+            print_stats(parser, pub.ring.header());
+        }
+    }
+    print_stats(parser, pub.ring.header());
+    if (pub.recorder && !recorder.close())
+        fprintf(stderr, "%s: write failed\n", record_path);
+    pub.ring.close();
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * hackeeg_convert.cpp
+ *
+ * Conversions between raw stream dumps (what came out of the serial port,
+ * in any protocol), recordings (Recording.h) and CSV.
+ *
+ *   hackeeg_convert -i dump.bin -o rec.heeg -p mp|json|b64|hex [-c 8] [-s] [-q] [-a]
+ *                   [-z] [-r rate] [-g register hex] [-m note]
+ *   hackeeg_convert -i rec.heeg -o out.csv [-f first] [-n count]
+ *   hackeeg_convert -i rec.heeg            (summary)
+ *
+ * -z stores delta compressed channel data, -g takes the rregs output as
+ * hex (e.g. 3E96C0...) for the register snapshot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "StreamParser.h"
+#include "Recording.h"
+#include "ShmRing.h"
+
+struct Converter
+{
+    RecordingWriter rec;
+    uint16_t channels;
+};
+
+static void store(void *context, const StreamEvent &ev)
+{
+    Converter *conv = (Converter *)context;
+    if (ev.kind == STREAM_SAMPLE)
+    {
+        int32_t values[REC_MAX_CHANNELS] = {0};
+        for (int ch = 0; ch < ev.sample.channels && ch < conv->channels; ch++)
+            values[ch] = ev.sample.channel[ch];
+        conv->rec.append(ev.sample.sample, ev.sample.time, values);
+        return;
+    }
+    RecEvent e;
+    memset(&e, 0, sizeof(e));
+    if (!shm_event(ev.key, ev.payload, ev.len, &e.kind, &e.sample, e.value))
+        return;
+    conv->rec.event(e);
+}
+
+static int parse_registers(const char *hex, uint8_t *regs)
+{
+    int n = 0;
+    size_t len = strlen(hex);
+    for (size_t i = 0; i + 1 < len && n < REC_MAX_REGISTERS; i += 2)
+    {
+        char byte[3] = {hex[i], hex[i + 1], 0};
+        regs[n++] = (uint8_t)strtoul(byte, 0, 16);
+    }
+    return n;
+}
+
+static int dump_to_recording(const char *in, const char *out, const StreamConfig &cfg, RecCodec codec,
+                             uint32_t rate, const uint8_t *regs, int num_regs, const char *note)
+{
+    FILE *f = fopen(in, "rb");
+    if (!f)
+    {
+        perror(in);
+        return 1;
+    }
+    Converter conv;
+    conv.channels = cfg.channels;
+    if (!conv.rec.open(out, cfg.channels, rate, codec, regs, num_regs, note))
+    {
+        perror(out);
+        fclose(f);
+        return 1;
+    }
+    StreamParser parser(cfg);
+    std::vector<char> buffer(1 << 20);
+    size_t n;
+    while ((n = fread(&buffer[0], 1, buffer.size(), f)) > 0)
+        parser.feed(&buffer[0], n, store, &conv);
+    fclose(f);
+    bool ok = conv.rec.close();
+    const StreamStats &st = parser.stats();
+    fprintf(stderr, "%llu samples, %llu frames, %llu bad, %llu gaps (%llu missing), %llu bytes skipped\n",
+            (unsigned long long)st.samples, (unsigned long long)st.frames, (unsigned long long)st.bad,
+            (unsigned long long)st.gaps, (unsigned long long)st.missing, (unsigned long long)st.skipped);
+    return ok ? 0 : 1;
+}
+
+static int recording_to_csv(const char *in, const char *out, uint64_t first, uint64_t count)
+{
+    RecordingReader rec;
+    if (!rec.open(in))
+    {
+        fprintf(stderr, "%s: not a recording\n", in);
+        return 1;
+    }
+    FILE *f = fopen(out, "w");
+    if (!f)
+    {
+        perror(out);
+        return 1;
+    }
+    const uint16_t channels = rec.channels();
+    if (first > rec.records())
+        first = rec.records();
+    if (!count || count > rec.records() - first)
+        count = rec.records() - first;
+
+    fprintf(f, "sample,time");
+    for (int ch = 1; ch <= channels; ch++)
+        fprintf(f, ",ch%d", ch);
+    fprintf(f, "\n");
+    const size_t block = REC_CHUNK_RECORDS;
+    std::vector<int32_t> values(block * channels);
+    std::vector<uint32_t> samples(block);
+    std::vector<uint64_t> times(block);
+    for (uint64_t done = 0; done < count;)
+    {
+        size_t want = (count - done < block) ? count - done : block;
+        size_t got = rec.read(first + done, want, &values[0], &samples[0], &times[0]);
+        if (!got)
+            break;
+        for (size_t r = 0; r < got; r++)
+        {
+            fprintf(f, "%u,%llu", samples[r], (unsigned long long)times[r]);
+            for (int ch = 0; ch < channels; ch++)
+                fprintf(f, ",%d", values[r * channels + ch]);
+            fprintf(f, "\n");
+        }
+        done += got;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int summary(const char *in)
+{
+    RecordingReader rec;
+    if (!rec.open(in))
+    {
+        fprintf(stderr, "%s: not a recording\n", in);
+        return 1;
+    }
+    const RecFileHeader &h = rec.header();
+    printf("channels %u rate %u codec %s records %llu chunks %zu%s\n", h.channels, h.rate,
+           h.codec == REC_DELTA ? "delta" : "raw", (unsigned long long)rec.records(), rec.chunks(),
+           rec.recovered() ? " (no index, recovered)" : "");
+    if (h.note[0])
+        printf("note %.*s\n", (int)sizeof(h.note), h.note);
+    if (h.num_registers)
+    {
+        printf("registers");
+        for (int i = 0; i < h.num_registers; i++)
+            printf(" %02X", h.registers[i]);
+        printf("\n");
+    }
+    std::vector<RecEvent> events;
+    rec.events(0, rec.records(), events);
+    printf("events %zu\n", events.size());
+    return 0;
+}
+
+static bool ends_with(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *in = 0, *out = 0, *note = 0;
+    StreamConfig cfg = {FRAME_MESSAGEPACK, 8, true, false, false};
+    bool have_protocol = false;
+    RecCodec codec = REC_RAW;
+    uint32_t rate = 0;
+    uint8_t regs[REC_MAX_REGISTERS];
+    int num_regs = 0;
+    uint64_t first = 0, count = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:p:c:sqazr:g:m:f:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            in = optarg;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'p':
+            have_protocol = StreamParser::parseEncoding(optarg, &cfg.encoding);
+            break;
+        case 'c':
+            cfg.channels = atoi(optarg);
+            break;
+        case 's':
+            cfg.status = false;
+            break;
+        case 'q':
+            cfg.quantized = true;
+            break;
+        case 'a':
+            cfg.flags = true;
+            break;
+        case 'z':
+            codec = REC_DELTA;
+            break;
+        case 'r':
+            rate = strtoul(optarg, 0, 0);
+            break;
+        case 'g':
+            num_regs = parse_registers(optarg, regs);
+            break;
+        case 'm':
+            note = optarg;
+            break;
+        case 'f':
+            first = strtoull(optarg, 0, 0);
+            break;
+        case 'n':
+            count = strtoull(optarg, 0, 0);
+            break;
+        default:
+            in = 0;
+        }
+    }
+    if (!in)
+    {
+        fprintf(stderr, "usage: hackeeg_convert -i dump -o recording -p mp|json|b64|hex [-c ch] [-s] [-q] [-a] [-z] [-r rate] [-g regs] [-m note]\n"
+                        "       hackeeg_convert -i recording -o file.csv [-f first] [-n count]\n"
+                        "       hackeeg_convert -i recording\n");
+        return 1;
+    }
+    if (have_protocol && out)
+        return dump_to_recording(in, out, cfg, codec, rate, regs, num_regs, note);
+    if (out && ends_with(out, ".csv"))
+        return recording_to_csv(in, out, first, count);
+    return summary(in);
+}
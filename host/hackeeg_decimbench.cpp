@@ -0,0 +1,155 @@
+/*
+ * hackeeg_decimbench.cpp
+ *
+ * The firmware's decimator (components/uart/Decimator.h) for every ratio
+ * the "decimate" command takes, and its speed. From the quantised design
+ * (Decimator::response()): the pass band ripple up to 0.4 of the output
+ * rate must stay within MAX_RIPPLE_DB, everything that folds into it
+ * (within 0.4 of the output rate of one of its multiples) at least
+ * MIN_ALIAS_DB down. Sines then go through process(): one in the pass
+ * band must come out with the gain response() gives, within
+ * MAX_GAIN_ERROR, one in the stop band at least MIN_ALIAS_DB down.
+ * Exits 1 otherwise.
+ *
+ *   hackeeg_decimbench [-n output samples]
+ *
+ * On the device the "status" command reports decimation cycles/sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "Decimator.h"
+
+#define CHANNELS 8
+#define MAX_RIPPLE_DB 0.005
+#define MIN_ALIAS_DB 60.0
+#define MAX_GAIN_ERROR 1e-3 // relative
+#define AMPLITUDE 4000000.0 // codes, half of full scale
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// amplitude of the tone at f (cycles per output sample) in y, least squares
+static double amplitude(const std::vector<double> &y, double f)
+{
+    double cc = 0, ss = 0, cs = 0, yc = 0, ys = 0;
+    for (size_t i = 0; i < y.size(); i++)
+    {
+        const double c = cos(2 * M_PI * f * i), s = sin(2 * M_PI * f * i);
+        cc += c * c;
+        ss += s * s;
+        cs += c * s;
+        yc += y[i] * c;
+        ys += y[i] * s;
+    }
+    const double det = cc * ss - cs * cs;
+    const double a = (yc * ss - ys * cs) / det, b = (ys * cc - yc * cs) / det;
+    return sqrt(a * a + b * b);
+}
+
+// A sin(2 pi f n) on all channels, the outputs of channel 0 after settling
+static std::vector<double> run_tone(Decimator &d, double f, size_t outputs)
+{
+    const size_t settle = DECIM_MAX_TAPS;
+    std::vector<double> y;
+    d.reset();
+    for (size_t n = 0; y.size() < outputs; n++)
+    {
+        int32_t x[CHANNELS];
+        const int32_t v = (int32_t)lrint(AMPLITUDE * sin(2 * M_PI * f * n));
+        for (int ch = 0; ch < CHANNELS; ch++)
+            x[ch] = v;
+        if (d.process(x, CHANNELS) && n / d.ratio() >= settle)
+            y.push_back(x[0]);
+    }
+    return y;
+}
+
+static bool run(uint8_t ratio, size_t outputs)
+{
+    Decimator d;
+    if (!d.configure(ratio))
+    {
+        printf("ratio %2u: not accepted  <--\n", ratio);
+        return false;
+    }
+    const double fout = 1.0 / ratio; // output rate, cycles per input sample
+
+    double ripple = 0;
+    for (int i = 0; i <= 400; i++)
+    {
+        const double db = fabs(20 * log10(d.response(0.4 * fout * i / 400)));
+        if (db > ripple)
+            ripple = db;
+    }
+    // whatever lands within 0.4 fout of a multiple of the output rate
+    double alias = -INFINITY;
+    for (int i = 0; i <= 20000; i++)
+    {
+        const double f = 0.6 * fout + (0.5 - 0.6 * fout) * i / 20000;
+        if (fabs(f / fout - floor(f / fout + 0.5)) > 0.4)
+            continue;
+        const double db = 20 * log10(d.response(f) + 1e-300);
+        if (db > alias)
+            alias = db;
+    }
+
+    // pass band tone, not on a bin of the output rate
+    const double fp = 0.3 * fout + fout / 97;
+    const double gain = amplitude(run_tone(d, fp, outputs), fp / fout) / AMPLITUDE;
+    const double gain_error = fabs(gain / d.response(fp) - 1);
+    // a stop band tone, aliased into the pass band
+    const double fs = 1.37 * fout;
+    const double falias = fabs(fs / fout - floor(fs / fout + 0.5));
+    const double leak = 20 * log10(amplitude(run_tone(d, fs, outputs), falias) / AMPLITUDE + 1e-9);
+
+    // speed: 8 channels of noise
+    std::vector<int32_t> input(outputs * ratio * CHANNELS);
+    unsigned rng = ratio;
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = (int32_t)(rand_r(&rng) % 2000001) - 1000000;
+    d.reset();
+    const double t0 = now();
+    for (size_t i = 0; i < outputs * ratio; i++)
+        d.process(&input[i * CHANNELS], CHANNELS);
+    const double t = now() - t0;
+
+    const bool ok = ripple <= MAX_RIPPLE_DB && alias <= -MIN_ALIAS_DB && gain_error <= MAX_GAIN_ERROR &&
+                    leak <= -MIN_ALIAS_DB;
+    printf("ratio %2u: ripple %.5f dB, aliases %6.1f dB, tone gain error %.1e, leak %6.1f dB, %5.1f ns/input%s\n",
+           ratio, ripple, alias, gain_error, leak, t / (outputs * ratio) * 1e9, ok ? "" : "  <--");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    size_t outputs = 4000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            outputs = strtoul(optarg, 0, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_decimbench [-n output samples]\n");
+            return 1;
+        }
+    }
+    if (outputs < 256)
+        outputs = 256;
+    bool ok = true;
+    for (int ratio = DECIM_MIN_RATIO; ratio <= DECIM_MAX_RATIO; ratio += 2)
+        ok &= run(ratio, outputs);
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
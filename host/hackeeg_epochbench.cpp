@@ -0,0 +1,132 @@
+/*
+ * hackeeg_epochbench.cpp
+ *
+ * Epocher throughput: a synthetic 16 kSPS session (noise plus an evoked
+ * response after every marker), markers every 0.5 s arriving 20 ms late,
+ * epochs of -200 .. 800 ms (so two are open at any time), a spike every
+ * 5 s for the rejection to catch. Each handed out epoch is summed into an
+ * average, as hackeeg_epochs does.
+ *
+ *   hackeeg_epochbench [-r sps] [-s seconds] [-a pre ms] [-b post ms]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "Epocher.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct Average
+{
+    std::vector<double> sum;
+    uint64_t count;
+};
+
+static void accumulate(void *context, const Epoch &e)
+{
+    Average &avg = *(Average *)context;
+    if (e.rejected)
+        return;
+    const size_t n = (size_t)e.length * e.channels;
+    if (avg.sum.size() != n)
+        avg.sum.assign(n, 0);
+    for (size_t i = 0; i < n; i++)
+        avg.sum[i] += e.data[i];
+    avg.count++;
+}
+
+static void run(uint16_t channels, double rate, double seconds, double pre_ms, double post_ms)
+{
+    const uint32_t pre = (uint32_t)(pre_ms * rate / 1000), post = (uint32_t)(post_ms * rate / 1000);
+    const uint32_t interval = (uint32_t)(rate / 2), lag = (uint32_t)(rate / 50);
+    const uint32_t block = (uint32_t)rate; // one second of data, used round and round
+    EpochConfig cfg;
+    Epocher::defaults(&cfg, channels, pre, post);
+    cfg.lag = lag * 2;
+    for (int ch = 0; ch < channels; ch++)
+        cfg.reject[ch] = 150000;
+    Epocher epocher;
+    Average avg;
+    avg.count = 0;
+    if (!epocher.configure(cfg, accumulate, &avg))
+        return;
+
+    // noise plus a response at 300 ms after each marker (markers every 0.5 s)
+    std::vector<int32_t> data((size_t)block * channels);
+    unsigned rng = 1;
+    for (uint32_t i = 0; i < block; i++)
+    {
+        double t = fmod(i, interval) / rate;
+        double erp = 20000 * exp(-pow((t - 0.3) / 0.05, 2));
+        for (int ch = 0; ch < channels; ch++)
+            data[(size_t)i * channels + ch] = (int32_t)(erp + (int)(rand_r(&rng) % 20001) - 10000);
+    }
+    std::vector<int32_t> artifact(channels);
+
+    const uint64_t total = (uint64_t)(seconds * rate);
+    const uint32_t first = 1000;
+    double t0 = now();
+    for (uint64_t k = 0; k < total; k++)
+    {
+        const uint32_t sample = first + (uint32_t)k;
+        const int32_t *row = &data[(size_t)(k % block) * channels];
+        const uint64_t marker_no = k / interval;
+        if (marker_no % 10 == 9 && k % interval == interval / 2) // a spike every 5 s, ends up in two epochs
+        {
+            for (int ch = 0; ch < channels; ch++)
+                artifact[ch] = row[ch] + 400000;
+            row = &artifact[0];
+        }
+        epocher.sample(sample, row);
+        if (k % interval == lag && k >= lag)
+            epocher.marker(sample - lag, 1 + marker_no % 3, 0);
+    }
+    double t = now() - t0;
+    const EpochStats &st = epocher.stats();
+    printf("%2u channels: %7.2f Msamples/s %8.1f Mvalues/s (%6.0fx real time), %llu epochs (%llu rejected), "
+           "%.0f epochs/s, %zu KB held\n",
+           channels, total / t / 1e6, total * channels / t / 1e6, seconds / t, (unsigned long long)st.epochs,
+           (unsigned long long)st.rejected, st.epochs / t, epocher.memory() / 1024);
+}
+
+int main(int argc, char **argv)
+{
+    double rate = 16000, seconds = 120, pre_ms = 200, post_ms = 800;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:a:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'a':
+            pre_ms = atof(optarg);
+            break;
+        case 'b':
+            post_ms = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_epochbench [-r sps] [-s seconds] [-a pre ms] [-b post ms]\n");
+            return 1;
+        }
+    }
+    printf("%.0f SPS, %.0f s, epochs %.0f .. %.0f ms\n", rate, seconds, -pre_ms, post_ms);
+    const uint16_t channels[] = {8, 16, 24, 32};
+    for (size_t i = 0; i < sizeof(channels) / sizeof(channels[0]); i++)
+        run(channels[i], rate, seconds, pre_ms, post_ms);
+    return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * hackeeg_epochs.cpp
+ *
+ * Epochs around markers (Epocher.h) from a recording or live from the
+ * capture daemon's ring, averaged per marker code (ERPs).
+ *
+ *   hackeeg_epochs -i rec.heeg | -n /hackeeg [-w] [-r sps] [-a pre ms] [-b post ms]
+ *                  [-B from:to ms] [-k code,code...] [-t peak to peak] [-o avg.csv] [-l]
+ *
+ * -w attaches to the ring with backpressure, -t rejects epochs with any
+ * channel over the limit (codes), -l lists every epoch on stdout. The
+ * averages of the epochs that were not rejected go to -o as CSV: code,
+ * epochs, sample offset to the marker, then the channels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <map>
+#include <vector>
+#include "Epocher.h"
+#include "Recording.h"
+#include "ShmRing.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int)
+{
+    running = 0;
+}
+
+struct Average
+{
+    uint64_t count;
+    std::vector<double> sum; // length x channels
+};
+
+struct Collector
+{
+    bool list;
+    std::map<uint8_t, Average> averages;
+};
+
+static void collect(void *context, const Epoch &e)
+{
+    Collector &c = *(Collector *)context;
+    if (c.list)
+        printf("%u,%u,%u,%d,%llx\n", e.sample, e.code, e.source, e.rejected,
+               (unsigned long long)e.rejectMask);
+    if (e.rejected)
+        return;
+    Average &avg = c.averages[e.code];
+    const size_t n = (size_t)e.length * e.channels;
+    if (avg.sum.empty())
+        avg.sum.assign(n, 0);
+    for (size_t i = 0; i < n; i++)
+        avg.sum[i] += e.data[i];
+    avg.count++;
+}
+
+static bool write_averages(const char *path, const Collector &c, const EpochConfig &cfg)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return false;
+    fprintf(f, "code,epochs,offset");
+    for (int ch = 1; ch <= cfg.channels; ch++)
+        fprintf(f, ",ch%d", ch);
+    fprintf(f, "\n");
+    for (std::map<uint8_t, Average>::const_iterator it = c.averages.begin(); it != c.averages.end(); ++it)
+    {
+        const Average &avg = it->second;
+        for (uint32_t i = 0; i < cfg.pre + cfg.post; i++)
+        {
+            fprintf(f, "%u,%llu,%d", it->first, (unsigned long long)avg.count, (int)i - (int)cfg.pre);
+            for (int ch = 0; ch < cfg.channels; ch++)
+                fprintf(f, ",%.2f", avg.sum[(size_t)i * cfg.channels + ch] / avg.count);
+            fprintf(f, "\n");
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static bool parse_codes(char *list, uint8_t *codes)
+{
+    memset(codes, 0, 32);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(0, ","))
+    {
+        int code = atoi(tok);
+        if (code < 0 || code > 255)
+            return false;
+        codes[code >> 3] |= 1 << (code & 7);
+    }
+    return true;
+}
+
+static void from_recording(RecordingReader &rec, Epocher &epocher)
+{
+    const uint16_t channels = rec.channels();
+    std::vector<int32_t> values((size_t)REC_CHUNK_RECORDS * channels);
+    std::vector<uint32_t> samples(REC_CHUNK_RECORDS);
+    std::vector<RecEvent> events;
+    for (uint64_t first = 0; first < rec.records() && running;)
+    {
+        size_t got = rec.read(first, REC_CHUNK_RECORDS, &values[0], &samples[0], 0);
+        if (!got)
+            break;
+        events.clear();
+        rec.events(first, got, events);
+        size_t e = 0;
+        for (size_t r = 0; r < got; r++)
+        {
+            epocher.sample(samples[r], &values[r * channels]);
+            // markers go in after their sample, as they do live
+            for (; e < events.size() && (int32_t)(events[e].sample - samples[r]) <= 0; e++)
+            {
+                if (events[e].kind == SHM_MARKER)
+                    epocher.marker(events[e].sample, events[e].value[0], events[e].value[1]);
+            }
+        }
+        for (; e < events.size(); e++)
+        {
+            if (events[e].kind == SHM_MARKER)
+                epocher.marker(events[e].sample, events[e].value[0], events[e].value[1]);
+        }
+        first += got;
+    }
+}
+
+static void from_ring(ShmReader &ring, Epocher &epocher)
+{
+    while (running && !ring.writerGone())
+    {
+        const ShmRecord *rec = ring.peek();
+        if (!rec)
+        {
+            usleep(1000);
+            continue;
+        }
+        if (rec->kind == SHM_SAMPLE)
+            epocher.sample(rec->sample, rec->value);
+        else if (rec->kind == SHM_MARKER)
+            epocher.marker(rec->sample, rec->value[0], rec->value[1]);
+        ring.release();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *in = 0, *shm_name = 0, *out = 0;
+    bool backpressure = false;
+    double rate = 0, pre_ms = 200, post_ms = 800, from_ms = 0, to_ms = 0;
+    bool have_baseline = false;
+    int32_t limit = 0;
+    uint8_t codes[32];
+    bool have_codes = false;
+    Collector collector;
+    collector.list = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:wr:a:b:B:k:t:o:l")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            in = optarg;
+            break;
+        case 'n':
+            shm_name = optarg;
+            break;
+        case 'w':
+            backpressure = true;
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'a':
+            pre_ms = atof(optarg);
+            break;
+        case 'b':
+            post_ms = atof(optarg);
+            break;
+        case 'B':
+            have_baseline = sscanf(optarg, "%lf:%lf", &from_ms, &to_ms) == 2;
+            break;
+        case 'k':
+            have_codes = parse_codes(optarg, codes);
+            break;
+        case 't':
+            limit = atoi(optarg);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'l':
+            collector.list = true;
+            break;
+        default:
+            in = shm_name = 0;
+        }
+    }
+    if (!in == !shm_name)
+    {
+        fprintf(stderr, "usage: hackeeg_epochs -i recording | -n shm name [-w] [-r sps] [-a pre ms] [-b post ms]\n"
+                        "                      [-B from:to ms] [-k codes] [-t peak to peak] [-o avg.csv] [-l]\n");
+        return 1;
+    }
+
+    RecordingReader rec;
+    ShmReader ring;
+    uint16_t channels;
+    if (in)
+    {
+        if (!rec.open(in))
+        {
+            fprintf(stderr, "%s: not a recording\n", in);
+            return 1;
+        }
+        channels = rec.channels();
+        if (!rate)
+            rate = rec.header().rate;
+    }
+    else
+    {
+        if (!ring.attach(shm_name, backpressure))
+        {
+            fprintf(stderr, "can not attach to %s\n", shm_name);
+            return 1;
+        }
+        channels = ring.header()->channels;
+        if (!rate)
+            rate = ring.header()->rate;
+    }
+    if (rate <= 0)
+    {
+        fprintf(stderr, "sample rate unknown, use -r\n");
+        return 1;
+    }
+
+    EpochConfig cfg;
+    Epocher::defaults(&cfg, channels, (uint32_t)(pre_ms * rate / 1000 + 0.5), (uint32_t)(post_ms * rate / 1000 + 0.5));
+    if (have_baseline)
+    {
+        cfg.baselineFrom = (int32_t)(from_ms * rate / 1000);
+        cfg.baselineTo = (int32_t)(to_ms * rate / 1000);
+    }
+    if (have_codes)
+        memcpy(cfg.codes, codes, sizeof(codes));
+    for (int ch = 0; ch < channels && ch < EPOCH_MAX_CHANNELS; ch++)
+        cfg.reject[ch] = limit;
+    Epocher epocher;
+    if (!epocher.configure(cfg, collect, &collector))
+    {
+        fprintf(stderr, "bad epoch settings\n");
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    if (collector.list)
+        printf("sample,code,source,rejected,channels over\n");
+    if (in)
+        from_recording(rec, epocher);
+    else
+        from_ring(ring, epocher);
+
+    const EpochStats &st = epocher.stats();
+    fprintf(stderr, "%llu samples, %llu markers, %llu epochs (%llu rejected), dropped: %llu gaps %llu late %llu overflows\n",
+            (unsigned long long)st.samples, (unsigned long long)st.markers, (unsigned long long)st.epochs,
+            (unsigned long long)st.rejected, (unsigned long long)st.gaps, (unsigned long long)st.late,
+            (unsigned long long)st.overflows);
+    if (out && !write_averages(out, collector, cfg))
+    {
+        perror(out);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * hackeeg_filterbench.cpp
+ *
+ * The firmware's filter bank (components/uart/Biquad.h) against a double
+ * precision cascade of the same designs, and its speed. For every data
+ * rate the "filter" command allows (250..16000 SPS) and a few settings,
+ * 8 channels of offset, EEG sized sines, mains up to near full scale and
+ * noise go through both; the fixed point output may be at most MAX_ERROR
+ * codes off the reference, and a 50 / 60 Hz tone must come out at least
+ * MIN_NOTCH_DB down once the notch has settled. Exits 1 otherwise.
+ *
+ * The reference rounds the feed forward coefficients to Q30 as the
+ * firmware does, which is what limits the notch depth at high rates; the
+ * feedback is exact, the firmware's must come close enough.
+ *
+ *   hackeeg_filterbench [-s seconds]
+ *
+ * On the device the "status" command reports filter cycles/sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "Biquad.h"
+
+#define CHANNELS 8
+#define MAX_ERROR 1.5     // codes
+#define MIN_NOTCH_DB 80.0 // at the notch frequency
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double q30(double c)
+{
+    return lround(c * (1L << BIQUAD_COEFF_SHIFT)) / (double)(1L << BIQUAD_COEFF_SHIFT);
+}
+
+// direct form I in doubles, coefficients designed like Biquad.cpp
+struct Reference
+{
+    double b[BIQUAD_MAX_STAGES][3], a[BIQUAD_MAX_STAGES][3];
+    double x1[BIQUAD_MAX_STAGES][CHANNELS], x2[BIQUAD_MAX_STAGES][CHANNELS];
+    double y1[BIQUAD_MAX_STAGES][CHANNELS], y2[BIQUAD_MAX_STAGES][CHANNELS];
+    int stages;
+
+    void add(double b0, double b1, double b2, double a0, double a1, double a2)
+    {
+        b[stages][0] = q30(b0 / a0);
+        b[stages][2] = q30(b2 / a0);
+        b[stages][1] = (b0 + b1 + b2 == 0) ? -(b[stages][0] + b[stages][2]) : q30(b1 / a0); // zero at DC kept
+        a[stages][1] = a1 / a0;
+        a[stages][2] = a2 / a0;
+        for (int ch = 0; ch < CHANNELS; ch++)
+            x1[stages][ch] = x2[stages][ch] = y1[stages][ch] = y2[stages][ch] = 0;
+        stages++;
+    }
+    void process(double *x)
+    {
+        for (int s = 0; s < stages; s++)
+        {
+            for (int ch = 0; ch < CHANNELS; ch++)
+            {
+                double y = b[s][0] * x[ch] + b[s][1] * x1[s][ch] + b[s][2] * x2[s][ch] - a[s][1] * y1[s][ch] -
+                           a[s][2] * y2[s][ch];
+                x2[s][ch] = x1[s][ch];
+                x1[s][ch] = x[ch];
+                y2[s][ch] = y1[s][ch];
+                y1[s][ch] = y;
+                x[ch] = y;
+            }
+        }
+    }
+};
+
+static void design(int notch_hz, int highpass, double fs, BiquadBank &bank, Reference &ref)
+{
+    bank.clear();
+    ref.stages = 0;
+    if (notch_hz)
+    {
+        bank.addNotch(notch_hz, BIQUAD_NOTCH_Q, fs);
+        double w0 = 2 * M_PI * notch_hz / fs, alpha = sin(w0) / (2 * BIQUAD_NOTCH_Q);
+        ref.add(1, -2 * cos(w0), 1, 1 + alpha, -2 * cos(w0), 1 - alpha);
+    }
+    if (highpass)
+    {
+        bank.addHighpass(highpass / 10.0, fs);
+        double w0 = 2 * M_PI * highpass / 10.0 / fs, alpha = sin(w0) / (2 * M_SQRT1_2), c = cos(w0);
+        ref.add((1 + c) / 2, -(1 + c), (1 + c) / 2, 1 + alpha, -2 * c, 1 - alpha);
+    }
+}
+
+static bool run(int notch_hz, int highpass, int rate, double seconds)
+{
+    BiquadBank bank;
+    Reference ref;
+    design(notch_hz, highpass, rate, bank, ref);
+    const size_t n = (size_t)(seconds * rate);
+
+    // offset, 10 Hz and mains at EEG / interference size, noise; the
+    // last channel near full scale
+    std::vector<int32_t> input(n * CHANNELS);
+    unsigned rng = rate;
+    for (size_t i = 0; i < n; i++)
+    {
+        const double t = (double)i / rate;
+        for (int ch = 0; ch < CHANNELS; ch++)
+        {
+            const double gain = (ch == CHANNELS - 1) ? 60 : 1;
+            double v = 100000 * (ch - 3) + gain * (1000 * sin(2 * M_PI * (10 + ch) * t) +
+                                                   20000 * sin(2 * M_PI * (notch_hz ? notch_hz : 50) * t)) +
+                       (int)(rand_r(&rng) % 2001) - 1000;
+            input[i * CHANNELS + ch] = (v > 0x7fffff) ? 0x7fffff : (v < -0x800000) ? -0x800000 : (int32_t)lrint(v);
+        }
+    }
+
+    double worst = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t x[CHANNELS];
+        double xr[CHANNELS];
+        for (int ch = 0; ch < CHANNELS; ch++)
+            xr[ch] = x[ch] = input[i * CHANNELS + ch];
+        bank.process(x, CHANNELS);
+        ref.process(xr);
+        for (int ch = 0; ch < CHANNELS; ch++)
+        {
+            const double error = fabs(x[ch] - xr[ch]);
+            if (error > worst)
+                worst = error;
+        }
+    }
+
+    // notch depth: a pure tone, measured over the last second
+    double depth = INFINITY;
+    if (notch_hz)
+    {
+        design(notch_hz, 0, rate, bank, ref);
+        const double amplitude = 1000000;
+        double in = 0, out = 0;
+        const size_t settle = n - rate;
+        for (size_t i = 0; i < n; i++)
+        {
+            const double v = amplitude * sin(2 * M_PI * notch_hz * i / rate);
+            int32_t x[CHANNELS];
+            for (int ch = 0; ch < CHANNELS; ch++)
+                x[ch] = (int32_t)lrint(v);
+            bank.process(x, CHANNELS);
+            if (i >= settle)
+            {
+                in += v * v;
+                out += (double)x[0] * x[0];
+            }
+        }
+        depth = (out > 0) ? 10 * log10(in / out) : 200;
+    }
+
+    // speed over the same block
+    design(notch_hz, highpass, rate, bank, ref);
+    const double t0 = now();
+    for (size_t i = 0; i < n; i++)
+        bank.process(&input[i * CHANNELS], CHANNELS);
+    const double t = now() - t0;
+
+    const bool ok = worst <= MAX_ERROR && depth >= MIN_NOTCH_DB;
+    printf("%5d SPS notch %2d Hz highpass %4.1f Hz: max error %.3f codes, notch %6.1f dB, %5.1f ns/sample%s\n", rate,
+           notch_hz, highpass / 10.0, worst, notch_hz ? depth : 0.0, t / n * 1e9, ok ? "" : "  <--");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_filterbench [-s seconds]\n");
+            return 1;
+        }
+    }
+    if (seconds < 2)
+        seconds = 2; // the notch needs time to settle
+    static const int rates[] = {250, 500, 1000, 2000, 4000, 8000, 16000};
+    bool ok = true;
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+    {
+        ok &= run(50, 5, rates[r], seconds);
+        ok &= run(60, 1, rates[r], seconds);
+        ok &= run(0, 255, rates[r], seconds);
+    }
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+/*
+ * hackeeg_impedancebench.cpp
+ *
+ * The firmware's impedance detector (components/uart/Impedance.h) on a
+ * simulated ADS front end: a square wave excitation current through a
+ * 10 kOhm electrode, plus electrode offset, drift and noise, sampled by
+ * the 64x oversampling modulator and decimated by its sinc^3 filter. The
+ * impedance ohms() gets from each channel's amplitude, relative to the
+ * true one, must be within
+ *
+ *   - MAX_ERROR at 31.25 Hz (ADS1299) for 250 and 16k SPS,
+ *   - MAX_DRIFT_ERROR at 31.25 Hz, 1k SPS, with DRIFT_UV_S of drift,
+ *   - MAX_FDR4_ERROR at fDR / 4 (ADS129x), where the odd harmonics of the
+ *     square wave alias onto the bin.
+ *
+ * Exits 1 otherwise. Settings as setImpedance() in main.cpp: a second of
+ * whole cycles after 1/16 s of settling, ADS1299 at gain 24 and 6 nA.
+ *
+ *   hackeeg_impedancebench [-s seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "Impedance.h"
+
+#define CHANNELS 8
+#define OVERSAMPLING 64
+#define MAX_ERROR 0.006
+#define MAX_DRIFT_ERROR 0.011
+#define MAX_FDR4_ERROR 0.02
+#define DRIFT_UV_S 500.0
+#define OHMS 10000.0
+#define AMPS 6e-9
+#define VOLTS_PER_CODE (4.5 / 24 / (1 << 23))
+#define NOISE_CODES 10 // about 0.2 uV rms, what the ADS1299 gives at gain 24
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// sinc^3 decimation as three cascaded running sums of OVERSAMPLING
+// modulator samples, one output per OVERSAMPLING inputs
+struct Sinc3
+{
+    std::vector<double> line[3];
+    double sum[3];
+    size_t pos;
+
+    Sinc3() : pos(0)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            line[i].assign(OVERSAMPLING, 0);
+            sum[i] = 0;
+        }
+    }
+    double push(double x)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            sum[i] += x - line[i][pos];
+            line[i][pos] = x;
+            x = sum[i] / OVERSAMPLING;
+        }
+        pos = (pos + 1) % OVERSAMPLING;
+        return x;
+    }
+};
+
+static bool run(const char *name, double rate, double frequency, double drift_uv_s, double bound, double seconds)
+{
+    const uint32_t settle = (uint32_t)(rate / 16);
+    ImpedanceMeter meter;
+    meter.configure(CHANNELS, (float)rate, (float)frequency, (float)seconds, settle);
+
+    // the excitation is derived from the ADS clock: a whole number of
+    // modulator samples per period, every channel at its own phase
+    const double fmod = rate * OVERSAMPLING;
+    const long period = lrint(fmod / frequency);
+    const double amplitude = AMPS * OHMS / VOLTS_PER_CODE; // codes
+    const double drift = drift_uv_s * 1e-6 / VOLTS_PER_CODE / fmod; // codes per modulator sample
+    Sinc3 filter[CHANNELS];
+    double offset[CHANNELS];
+    long phase[CHANNELS];
+    unsigned rng = (unsigned)rate;
+    for (int ch = 0; ch < CHANNELS; ch++)
+    {
+        offset[ch] = (ch - 3.5) * 1000000; // up to about +-80 mV
+        phase[ch] = period * ch / CHANNELS;
+    }
+
+    const double t0 = now();
+    for (long m = -3 * OVERSAMPLING; !meter.done(); m++)
+    {
+        int32_t codes[CHANNELS];
+        for (int ch = 0; ch < CHANNELS; ch++)
+        {
+            const long p = ((m + phase[ch]) % period + period) % period;
+            const double x = offset[ch] + drift * m + ((p < period / 2) ? amplitude : -amplitude);
+            const double y = filter[ch].push(x) + NOISE_CODES * ((int)(rand_r(&rng) % 2001) - 1000) / 577.0;
+            codes[ch] = (int32_t)lrint(y);
+        }
+        if (m >= 0 && (m + 1) % OVERSAMPLING == 0)
+            meter.push(codes);
+    }
+    const double t = now() - t0;
+
+    double worst = 0;
+    for (int ch = 0; ch < CHANNELS; ch++)
+    {
+        const double ohms =
+            ImpedanceMeter::ohms(meter.amplitude(ch) * (float)VOLTS_PER_CODE, (float)AMPS, (float)frequency, (float)rate);
+        const double error = fabs(ohms / OHMS - 1);
+        if (error > worst)
+            worst = error;
+    }
+    const bool ok = worst <= bound;
+    printf("%-20s %5.0f SPS %6.2f Hz: max error %.2f %% (bound %.1f %%), %u samples, %.2f s simulated in %.2f s%s\n",
+           name, rate, frequency, worst * 100, bound * 100, meter.samples(), meter.samples() / rate, t,
+           ok ? "" : "  <--");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = 1; // IMPEDANCE_SECONDS
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_impedancebench [-s seconds]\n");
+            return 1;
+        }
+    }
+    if (seconds < 0.1)
+        seconds = 0.1;
+    const double ads1299 = 2048000.0 / 65536;
+    bool ok = true;
+    ok &= run("ADS1299", 250, ads1299, 0, MAX_ERROR, seconds);
+    ok &= run("ADS1299", 16000, ads1299, 0, MAX_ERROR, seconds);
+    ok &= run("ADS1299, drift", 1000, ads1299, DRIFT_UV_S, MAX_DRIFT_ERROR, seconds);
+    ok &= run("ADS129x, fDR / 4", 250, 250 / 4.0, 0, MAX_FDR4_ERROR, seconds);
+    ok &= run("ADS129x, fDR / 4", 500, 500 / 4.0, 0, MAX_FDR4_ERROR, seconds);
+    ok &= run("ADS129x, fDR / 4", 8000, 8000 / 4.0, 0, MAX_FDR4_ERROR, seconds);
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+/*
+ * hackeeg_montagebench.cpp
+ *
+ * The firmware's re-referencing kernel (components/uart/Montage.h) against
+ * a double precision reference, and its speed. Random frames (uniform
+ * codes, a share of them at the rails) go through each montage; every
+ * output is compared with the exact sum of weight * code / 2^shift using
+ * the exact common average, which the kernel may only miss by its
+ * rounding (half a code for the average times its weight, half a code
+ * for the final shift). Exits 1 if any output is further off.
+ *
+ *   hackeeg_montagebench [-n frames]
+ *
+ * On the device the "status" command reports montage cycles/sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "Montage.h"
+#include "FrameEncoder.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline int32_t code_at(const uint8_t *p)
+{
+    return ((int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8))) >> 8;
+}
+
+// exact output k, saturated like the kernel
+static double reference(const Montage &m, const int32_t *x, uint8_t k)
+{
+    double average = 0;
+    int count = 0;
+    for (int ch = 0; ch < MONTAGE_MAX_CHANNELS; ch++)
+    {
+        if (m.reference() & (1 << ch))
+        {
+            average += x[ch];
+            count++;
+        }
+    }
+    if (count)
+        average /= count;
+    double sum = 0;
+    for (uint8_t i = 0; i < m.terms(); i++)
+    {
+        uint8_t out, in;
+        int8_t w = m.term(i, &out, &in);
+        if (out == k)
+            sum += w * ((in == MONTAGE_AVERAGE) ? average : x[in]);
+    }
+    sum /= 1 << m.shift();
+    return (sum > 0x7fffff) ? 0x7fffff : (sum < -0x800000) ? -0x800000 : sum;
+}
+
+static double tolerance(const Montage &m, uint8_t k)
+{
+    double average_weight = 0;
+    for (uint8_t i = 0; i < m.terms(); i++)
+    {
+        uint8_t out, in;
+        int8_t w = m.term(i, &out, &in);
+        if (out == k && in == MONTAGE_AVERAGE)
+            average_weight += abs(w);
+    }
+    return 0.5 * average_weight / (1 << m.shift()) + (m.shift() ? 0.5 : 0) + 1e-9;
+}
+
+static bool run(const char *name, const Montage &m, size_t frames)
+{
+    std::vector<uint8_t> raw(frames * FRAME_RAW_SZ);
+    unsigned rng = 1;
+    for (size_t f = 0; f < frames; f++)
+    {
+        uint8_t *p = &raw[f * FRAME_RAW_SZ];
+        p[0] = 0xC0;
+        p[1] = p[2] = 0;
+        for (int ch = 0; ch < MONTAGE_MAX_CHANNELS; ch++)
+        {
+            int32_t v = (int32_t)(((uint32_t)rand_r(&rng) << 8) ^ (uint32_t)rand_r(&rng)) >> 8;
+            unsigned r = rand_r(&rng) % 64;
+            if (r == 0)
+                v = 0x7fffff;
+            else if (r == 1)
+                v = -0x800000;
+            else if (r < 16)
+                v >>= 8; // EEG sized
+            p[3 + 3 * ch] = v >> 16;
+            p[4 + 3 * ch] = v >> 8;
+            p[5 + 3 * ch] = v;
+        }
+    }
+
+    // correctness, one frame at a time
+    double worst = 0;
+    size_t bad = 0;
+    for (size_t f = 0; f < frames; f++)
+    {
+        uint8_t frame[FRAME_RAW_SZ];
+        memcpy(frame, &raw[f * FRAME_RAW_SZ], FRAME_RAW_SZ);
+        int32_t x[MONTAGE_MAX_CHANNELS];
+        for (int ch = 0; ch < MONTAGE_MAX_CHANNELS; ch++)
+            x[ch] = code_at(&frame[3 + 3 * ch]);
+        m.apply(frame);
+        for (uint8_t k = 0; k < MONTAGE_MAX_CHANNELS; k++)
+        {
+            const double want = (k < m.outputs()) ? reference(m, x, k) : 0;
+            const double error = fabs(code_at(&frame[3 + 3 * k]) - want);
+            if (error > worst)
+                worst = error;
+            if (error > tolerance(m, k))
+                bad++;
+        }
+        if (memcmp(frame, &raw[f * FRAME_RAW_SZ], 3) != 0)
+            bad++; // the status word stays
+    }
+
+    // speed, in place over the whole block as the firmware does per sample
+    const int rounds = 20;
+    double t0 = now();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (size_t f = 0; f < frames; f++)
+            m.apply(&raw[f * FRAME_RAW_SZ]);
+    }
+    double t = now() - t0;
+    printf("%-20s %u outputs, %2u terms: max error %.3f codes, %zu bad, %6.1f ns/sample %7.1f Msamples/s\n", name,
+           m.outputs(), m.terms(), worst, bad, t / (rounds * (double)frames) * 1e9, rounds * frames / t / 1e6);
+    return bad == 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t frames = 200000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            frames = strtoul(optarg, 0, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_montagebench [-n frames]\n");
+            return 1;
+        }
+    }
+    bool ok = true;
+    Montage m;
+
+    m.commonAverage(0xff);
+    ok &= run("average of 8", m, frames);
+
+    m.commonAverage(0x0f);
+    ok &= run("average of 4", m, frames);
+
+    m.commonAverage(0x3f);
+    ok &= run("average of 6", m, frames);
+
+    m.clear();
+    for (uint8_t ch = 0; ch < 7; ch++)
+        m.bipolar(ch, ch + 1);
+    ok &= run("bipolar chain of 8", m, frames);
+
+    m.clear();
+    m.bipolar(0, 1);
+    m.bipolar(2, 3);
+    m.bipolar(6, 7);
+    ok &= run("3 bipolar pairs", m, frames);
+
+    m.clear(); // surface Laplacian around ch 1, ch 5 against the average of 5..8
+    m.setShift(2);
+    m.addTerm(0, 0, 4);
+    for (uint8_t ch = 1; ch < 5; ch++)
+        m.addTerm(0, ch, -1);
+    m.setReference(0xf0);
+    m.addTerm(1, 4, 4);
+    m.addTerm(1, MONTAGE_AVERAGE, -3);
+    ok &= run("Laplacian, weighted", m, frames);
+
+    m.clear(); // largest gain, must not overflow
+    m.setShift(7);
+    m.addTerm(0, 0, 127);
+    m.addTerm(0, 1, -128);
+    ok &= run("full scale weights", m, frames);
+
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+/*
+ * hackeeg_quantbench.cpp
+ *
+ * The firmware's 16 bit quantiser (components/uart/Quantizer.h) through
+ * the MessagePack encoder and decoder, and its speed:
+ *
+ *   - adaptive shifts: 8 channels whose level jumps between a few codes
+ *     and full scale, one channel beyond it. Every value the host
+ *     reconstructs must be within 2^(shift - 1) codes of the 24 bit code
+ *     unless it was clipped, and only codes no shift can hold may clip;
+ *   - every fixed shift 0..QUANT_MAX_SHIFT over every 24 bit code, with
+ *     the same bound.
+ *
+ * Exits 1 if any value is further off.
+ *
+ *   hackeeg_quantbench [-n samples]
+ *
+ * On the device the "status" command reports quantize cycles/sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "Quantizer.h"
+#include "FrameEncoder.h"
+
+#define CHANNELS 8
+#define FRAME_SZ (ADS_STATUS_SZ + 3 * CHANNELS)
+#define FULL_SCALE 0x7fffff
+#define UNAVOIDABLE_CLIP (32767 * 256 + 128) // rounds past int16 even at shift 8
+
+typedef FrameLayout<CHANNELS, FRAME_TIME_BYTES, true, FRAME_MESSAGEPACK, 2> Quantised;
+typedef FrameLayout<CHANNELS, FRAME_TIME_BYTES, true, FRAME_MESSAGEPACK, 3> Plain;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void put_code(uint8_t *p, int32_t code)
+{
+    p[0] = (uint8_t)(code >> 16);
+    p[1] = (uint8_t)(code >> 8);
+    p[2] = (uint8_t)code;
+}
+
+// level steps every few thousand samples: sine, offset and noise at 2^4..2^23 codes
+static void make_signal(std::vector<int32_t> &codes, size_t n)
+{
+    codes.resize(n * CHANNELS);
+    unsigned rng = 1;
+    double level[CHANNELS];
+    size_t next[CHANNELS];
+    for (int ch = 0; ch < CHANNELS; ch++)
+        next[ch] = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        for (int ch = 0; ch < CHANNELS; ch++)
+        {
+            if (i == next[ch])
+            {
+                level[ch] = ldexp(1.0, 4 + rand_r(&rng) % 20) * (1 + (rand_r(&rng) % 1000) / 1000.0);
+                if (ch == CHANNELS - 1)
+                    level[ch] *= 2; // past full scale now and then
+                next[ch] = i + 100 + rand_r(&rng) % 5000;
+            }
+            double v = level[ch] * (0.6 * sin(2 * M_PI * (3.1 + ch) * i / 1000.0) + 0.3) +
+                       level[ch] * 0.1 * ((int)(rand_r(&rng) % 2001) - 1000) / 1000.0;
+            codes[i * CHANNELS + ch] = (v > FULL_SCALE) ? FULL_SCALE : (v < -FULL_SCALE - 1) ? -FULL_SCALE - 1
+                                                                                                : (int32_t)lrint(v);
+        }
+    }
+}
+
+static bool run_adaptive(const std::vector<int32_t> &codes, size_t n)
+{
+    Quantizer q;
+    q.configure(CHANNELS, QUANT_AUTO);
+    uint64_t values = 0, limits = 0, clipped = 0, bad_clips = 0, changes = 0;
+    double worst = 0; // in units of 2^(shift - 1)
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t frame[FRAME_SZ] = {0xc0, 0, 0};
+        for (int ch = 0; ch < CHANNELS; ch++)
+            put_code(&frame[ADS_STATUS_SZ + 3 * ch], codes[i * CHANNELS + ch]);
+        if (q.process(frame))
+            changes++;
+        char out[Quantised::FRAME_BYTES];
+        Quantised::encode(out, i, (uint32_t)i, frame, 0);
+        FrameSample s;
+        Quantised::decode(out, sizeof(out), &s);
+        for (int ch = 0; ch < CHANNELS; ch++)
+        {
+            const int32_t code = codes[i * CHANNELS + ch];
+            const uint8_t shift = q.shift(ch);
+            const double error = fabs((double)Quantizer::reconstruct((int16_t)s.channel[ch], shift) - code) /
+                                 (shift ? 1 << (shift - 1) : 1);
+            values++;
+            if (s.channel[ch] == 32767 || s.channel[ch] == -32768)
+                limits++;
+            if (shift ? error <= 1 : error == 0)
+            {
+                if (error > worst)
+                    worst = error;
+                continue;
+            }
+            if (s.channel[ch] != 32767 && s.channel[ch] != -32768)
+                worst = INFINITY; // off without being clipped
+            else if (code >= UNAVOIDABLE_CLIP)
+                clipped++;
+            else
+                bad_clips++; // a larger shift would have held it
+        }
+    }
+    const bool ok = worst <= 1 && !bad_clips && limits == q.clipped() && changes > 0;
+    printf("adaptive: %llu values, max error %.3f x 2^(shift-1), %llu shift changes, %llu clipped (%llu avoidable)%s\n",
+           (unsigned long long)values, worst, (unsigned long long)changes, (unsigned long long)clipped,
+           (unsigned long long)bad_clips, ok ? "" : "  <--");
+    return ok;
+}
+
+// every 24 bit code at a fixed shift
+static bool run_fixed(uint8_t shift)
+{
+    const int32_t half = shift ? 1 << (shift - 1) : 0;
+    uint64_t clipped = 0, bad = 0;
+    for (int32_t code = -FULL_SCALE - 1; code <= FULL_SCALE; code++)
+    {
+        const int16_t v = Quantizer::quantize(code, shift);
+        if (abs(Quantizer::reconstruct(v, shift) - code) <= half)
+            continue;
+        if (v == 32767 || v == -32768)
+            clipped++;
+        else
+            bad++;
+    }
+    const bool ok = !bad;
+    printf("shift %u: %llu codes off by more than %d, %llu clipped%s\n", shift, (unsigned long long)bad, half,
+           (unsigned long long)clipped, ok ? "" : "  <--");
+    return ok;
+}
+
+// quantise + encode against the plain 24 bit encode
+static void run_speed(const std::vector<int32_t> &codes, size_t n)
+{
+    std::vector<uint8_t> frames(n * FRAME_SZ);
+    for (size_t i = 0; i < n; i++)
+    {
+        frames[i * FRAME_SZ] = 0xc0;
+        for (int ch = 0; ch < CHANNELS; ch++)
+            put_code(&frames[i * FRAME_SZ + ADS_STATUS_SZ + 3 * ch], codes[i * CHANNELS + ch]);
+    }
+    std::vector<char> out(Plain::FRAME_BYTES * 64);
+    size_t sink = 0;
+
+    double t0 = now();
+    for (size_t i = 0; i < n; i++)
+        sink += Plain::encode(&out[(i % 64) * Plain::FRAME_BYTES], i, (uint32_t)i, &frames[i * FRAME_SZ], 0);
+    const double plain = (now() - t0) / n;
+
+    Quantizer q;
+    q.configure(CHANNELS, QUANT_AUTO);
+    t0 = now();
+    for (size_t i = 0; i < n; i++)
+    {
+        q.process(&frames[i * FRAME_SZ]);
+        sink += Quantised::encode(&out[(i % 64) * Quantised::FRAME_BYTES], i, (uint32_t)i, &frames[i * FRAME_SZ], 0);
+    }
+    const double quantised = (now() - t0) / n;
+    printf("speed: %.1f ns/sample quantise + encode, %.1f ns/sample 24 bit encode (%zu bytes)\n", quantised * 1e9,
+           plain * 1e9, sink);
+}
+
+int main(int argc, char **argv)
+{
+    size_t samples = 200000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            samples = strtoul(optarg, 0, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_quantbench [-n samples]\n");
+            return 1;
+        }
+    }
+    if (samples < QUANT_WINDOW * 4)
+        samples = QUANT_WINDOW * 4;
+    std::vector<int32_t> codes;
+    make_signal(codes, samples);
+    bool ok = run_adaptive(codes, samples);
+    for (uint8_t shift = 0; shift <= QUANT_MAX_SHIFT; shift++)
+        ok &= run_fixed(shift);
+    run_speed(codes, samples);
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
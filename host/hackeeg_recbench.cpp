@@ -0,0 +1,196 @@
+/*
+ * hackeeg_recbench.cpp
+ *
+ * Read throughput of recordings against re-decoding stream dumps.
+ * Writes a synthetic EEG-like session (random walk plus alpha) as raw and
+ * delta recordings and as MessagePack and JSON Lines dumps, then times
+ *
+ *   - sequential reads of the recordings in chunk sized blocks
+ *   - random 256 record range reads (seek + read)
+ *   - StreamParser over the dumps, i.e. what every analysis run costs now
+ *
+ *   hackeeg_recbench [-n records] [-c channels] [-d dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "Recording.h"
+#include "StreamParser.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long file_size(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fclose(f);
+    return n;
+}
+
+static void count_samples(void *context, const StreamEvent &ev)
+{
+    if (ev.kind == STREAM_SAMPLE)
+        (*(uint64_t *)context)++;
+}
+
+static void bench_recording(const std::string &path, uint64_t records, uint16_t channels)
+{
+    RecordingReader rec;
+    if (!rec.open(path.c_str()))
+    {
+        fprintf(stderr, "%s: open failed\n", path.c_str());
+        return;
+    }
+    std::vector<int32_t> values((size_t)REC_CHUNK_RECORDS * channels);
+    std::vector<uint32_t> samples(REC_CHUNK_RECORDS);
+    int64_t check = 0;
+    double t0 = now();
+    for (uint64_t r = 0; r < records;)
+    {
+        size_t got = rec.read(r, REC_CHUNK_RECORDS, &values[0], &samples[0], 0);
+        if (!got)
+            break;
+        check += values[0] + samples[got - 1];
+        r += got;
+    }
+    double seq = now() - t0;
+
+    const int ranges = 2000;
+    srand(1);
+    t0 = now();
+    for (int i = 0; i < ranges; i++)
+    {
+        uint64_t first = ((uint64_t)rand() * RAND_MAX + rand()) % (records - 256);
+        rec.read(first, 256, &values[0], 0, 0);
+        check += values[255 * channels];
+    }
+    double rnd = now() - t0;
+    printf("%-28s %9ld bytes  sequential %8.1f Msamples/s %8.1f MB/s  random 256: %6.1f us  (%lld)\n",
+           path.substr(path.rfind('/') + 1).c_str(), file_size(path), records / seq / 1e6,
+           records * channels * 4.0 / seq / 1e6, rnd / ranges * 1e6, (long long)(check & 1));
+}
+
+static void bench_dump(const std::string &path, FrameEncoding encoding, uint16_t channels)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    std::vector<char> data;
+    data.resize(file_size(path));
+    if (!f || fread(&data[0], 1, data.size(), f) != data.size())
+    {
+        fprintf(stderr, "%s: read failed\n", path.c_str());
+        if (f)
+            fclose(f);
+        return;
+    }
+    fclose(f);
+    StreamConfig cfg = {encoding, (uint8_t)channels, true, false, false};
+    StreamParser parser(cfg);
+    uint64_t samples = 0;
+    double t0 = now();
+    const size_t block = 64 * 1024; // as read() from the port would deliver it
+    for (size_t at = 0; at < data.size(); at += block)
+        parser.feed(&data[at], (data.size() - at < block) ? data.size() - at : block, count_samples, &samples);
+    double t = now() - t0;
+    printf("%-28s %9ld bytes  decode     %8.1f Msamples/s %8.1f MB/s\n",
+           path.substr(path.rfind('/') + 1).c_str(), (long)data.size(), samples / t / 1e6, data.size() / t / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t records = 2000000;
+    uint16_t channels = 8;
+    std::string dir = "/tmp";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            records = strtoull(optarg, 0, 0);
+            break;
+        case 'c':
+            channels = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_recbench [-n records] [-c channels (8 for the dumps)] [-d dir]\n");
+            return 1;
+        }
+    }
+    if (records < 512 || channels == 0 || channels > REC_MAX_CHANNELS)
+        return 1;
+
+    std::string raw = dir + "/recbench_raw.heeg", delta = dir + "/recbench_delta.heeg";
+    std::string mp = dir + "/recbench.mp", json = dir + "/recbench.jsonl";
+    RecordingWriter wraw, wdelta;
+    wraw.open(raw.c_str(), channels, 16000, REC_RAW);
+    wdelta.open(delta.c_str(), channels, 16000, REC_DELTA);
+    FILE *fmp = fopen(mp.c_str(), "wb"), *fjson = fopen(json.c_str(), "wb");
+    const bool dumps = channels == 8 && fmp && fjson;
+    FrameEncoderFn enc_mp = frame_encoder(8, true, FRAME_MESSAGEPACK);
+    FrameEncoderFn enc_json = frame_encoder(8, true, FRAME_JSONLINES);
+
+    std::vector<int32_t> walk(channels, 0), values(channels);
+    srand(7);
+    double t0 = now();
+    for (uint64_t r = 0; r < records; r++)
+    {
+        uint8_t raw_frame[FRAME_RAW_SZ] = {0xC0, 0, 0};
+        for (int ch = 0; ch < channels; ch++)
+        {
+            walk[ch] += rand() % 41 - 20;
+            values[ch] = walk[ch] + (int32_t)(2000 * sin(2 * M_PI * 10 * r / 16000.0 + ch));
+            if (ch < 8)
+            {
+                raw_frame[3 + 3 * ch] = values[ch] >> 16;
+                raw_frame[4 + 3 * ch] = values[ch] >> 8;
+                raw_frame[5 + 3 * ch] = values[ch];
+            }
+        }
+        uint64_t t = r * 62;
+        wraw.append(r, t, &values[0]);
+        wdelta.append(r, t, &values[0]);
+        if (dumps)
+        {
+            char frame[FRAME_MAX_SZ];
+            fwrite(frame, 1, enc_mp(frame, t, r, raw_frame, 0), fmp);
+            fwrite(frame, 1, enc_json(frame, t, r, raw_frame, 0), fjson);
+        }
+    }
+    wraw.close();
+    wdelta.close();
+    if (fmp)
+        fclose(fmp);
+    if (fjson)
+        fclose(fjson);
+    printf("generated %llu records x %u channels in %.2f s\n", (unsigned long long)records, channels, now() - t0);
+
+    bench_recording(raw, records, channels);
+    bench_recording(delta, records, channels);
+    if (dumps)
+    {
+        bench_dump(mp, FRAME_MESSAGEPACK, channels);
+        bench_dump(json, FRAME_JSONLINES, channels);
+    }
+    unlink(raw.c_str());
+    unlink(delta.c_str());
+    unlink(mp.c_str());
+    unlink(json.c_str());
+    return 0;
+}
@@ -0,0 +1,579 @@
+/*
+ * hackeeg_replay.cpp
+ *
+ * Plays a capture back into a pty, a fifo or stdout, as a stand-in for the
+ * board when testing hackeeg_capd and everything else downstream.
+ *
+ *   hackeeg_replay -i dump.bin -p mp|json|b64|hex [-c 8] [-s] [-q] [-a] [options]
+ *   hackeeg_replay -i rec.heeg [-p mp|json|b64|hex] [-s] [-a] [options]
+ *
+ * A dump (what came out of the serial port) is replayed byte for byte, a
+ * recording (Recording.h) is encoded again in the protocol given by -p,
+ * with its markers, lead-off and resync events as in-band frames. With -a
+ * the artifact flags are computed again as the firmware would
+ * (ArtifactFlags.h, default step, no lead-off).
+ *
+ *   -o path      write to a fifo or file ("-" for stdout) instead of a new
+ *                pty, whose name is printed on stdout
+ *   -W           pty: wait for a line from the reader first (capd -x rdatac)
+ *   -r sps       fixed sample rate instead of the device time stamps
+ *   -f           as fast as the reader takes it
+ *   -x factor    faster (or slower) than real time
+ *   -l loops     play it this many times (0: until stopped)
+ *   -e rate      byte drop probability
+ *   -E rate      bit error rate
+ *   -S seed      for the drops and bit errors, the same seed gives the
+ *                same damage
+ *   -v           statistics every 5 s
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <vector>
+#include "StreamParser.h"
+#include "Recording.h"
+#include "ShmRing.h"
+#include "ArtifactFlags.h"
+
+#define WRITE_CHUNK (64 * 1024)
+#define STALL_LIMIT_S 10 // nobody reading the pty
+#define STATS_INTERVAL_S 5
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int)
+{
+    running = 0;
+}
+
+// the stream and, per sample, where its frame ends and when it is due
+struct Replay
+{
+    std::vector<char> bytes;
+    std::vector<uint64_t> end;
+    std::vector<uint64_t> offset_us; // device time relative to the first sample
+    bool haveTime;
+    uint32_t lastTime;
+};
+
+static void note_sample(Replay &replay, uint64_t end, uint32_t time)
+{
+    uint64_t rel = 0;
+    if (replay.haveTime)
+        rel = replay.offset_us.back() + (uint32_t)(time - replay.lastTime); // frames carry 32 bit time
+    replay.haveTime = true;
+    replay.lastTime = time;
+    replay.end.push_back(end);
+    replay.offset_us.push_back(rel);
+}
+
+static void schedule_dump(void *context, const StreamEvent &ev)
+{
+    if (ev.kind == STREAM_SAMPLE)
+        note_sample(*(Replay *)context, ev.end, (uint32_t)ev.sample.time);
+}
+
+static bool load_dump(const char *path, const StreamConfig &cfg, Replay &replay)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    replay.bytes.resize(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    bool ok = replay.bytes.empty() || fread(&replay.bytes[0], 1, replay.bytes.size(), f) == replay.bytes.size();
+    fclose(f);
+    if (!ok)
+        return false;
+    StreamParser parser(cfg);
+    if (!replay.bytes.empty())
+        parser.feed(&replay.bytes[0], replay.bytes.size(), schedule_dump, &replay);
+    const StreamStats &st = parser.stats();
+    fprintf(stderr, "%s: %llu samples, %llu frames, %llu bad, %llu bytes outside of frames\n", path,
+            (unsigned long long)st.samples, (unsigned long long)st.frames, (unsigned long long)st.bad,
+            (unsigned long long)st.skipped);
+    return true;
+}
+
+static void append_event(Replay &replay, FrameEncoding encoding, const RecEvent &e)
+{
+    uint8_t p[8];
+    uint8_t len = 0;
+    p[0] = e.sample;
+    p[1] = e.sample >> 8;
+    p[2] = e.sample >> 16;
+    p[3] = e.sample >> 24;
+    char key;
+    switch (e.kind)
+    {
+    case SHM_MARKER: // MarkerEvent
+        key = 'M';
+        p[4] = e.value[2];
+        p[5] = e.value[2] >> 8;
+        p[6] = e.value[0];
+        p[7] = e.value[1];
+        len = 8;
+        break;
+    case SHM_LEADOFF:
+        key = 'L';
+        p[4] = e.value[0];
+        p[5] = e.value[1];
+        len = 6;
+        break;
+    case SHM_RESYNC:
+        key = 'R';
+        for (int i = 0; i < 4; i++)
+            p[4 + i] = (uint32_t)e.value[0] >> (8 * i);
+        len = 8;
+        break;
+    default:
+        return; // gaps show as sample # jumps
+    }
+    char frame[STREAM_MAX_FRAME];
+    size_t n = encode_inband(frame, encoding, key, p, len);
+    replay.bytes.insert(replay.bytes.end(), frame, frame + n);
+}
+
+static bool load_recording(const char *path, FrameEncoding encoding, bool status, bool flags, Replay &replay)
+{
+    RecordingReader rec;
+    if (!rec.open(path))
+        return false;
+    const uint16_t channels = rec.channels();
+    if (channels != 4 && channels != 6 && channels != 8)
+    {
+        fprintf(stderr, "%s: %u channels can not be sent as sample frames\n", path, channels);
+        return false;
+    }
+    FrameEncoderFn encode = frame_encoder(channels, status, encoding, 3, flags);
+    ArtifactFlags artifacts;
+    artifacts.configure(channels, 0, ARTIFACT_DEFAULT_STEP);
+    std::vector<int32_t> values((size_t)REC_CHUNK_RECORDS * channels);
+    std::vector<uint32_t> samples(REC_CHUNK_RECORDS);
+    std::vector<uint64_t> times(REC_CHUNK_RECORDS);
+    std::vector<RecEvent> events;
+    for (uint64_t first = 0; first < rec.records();)
+    {
+        size_t got = rec.read(first, REC_CHUNK_RECORDS, &values[0], &samples[0], &times[0]);
+        if (!got)
+            break;
+        events.clear();
+        rec.events(first, got, events);
+        size_t e = 0;
+        for (size_t r = 0; r < got; r++)
+        {
+            uint8_t raw[FRAME_RAW_SZ] = {0xC0, 0, 0}; // status word of a running ADS129x
+            for (int ch = 0; ch < channels; ch++)
+            {
+                int32_t v = values[r * channels + ch];
+                raw[3 + 3 * ch] = v >> 16;
+                raw[4 + 3 * ch] = v >> 8;
+                raw[5 + 3 * ch] = v;
+            }
+            char frame[FRAME_MAX_SZ];
+            size_t n = encode(frame, times[r], samples[r], raw, flags ? artifacts.process(raw) : 0);
+            replay.bytes.insert(replay.bytes.end(), frame, frame + n);
+            // the firmware sends an event after the sample it belongs to
+            for (; e < events.size() && (int32_t)(events[e].sample - samples[r]) <= 0; e++)
+                append_event(replay, encoding, events[e]);
+            note_sample(replay, replay.bytes.size(), (uint32_t)times[r]);
+        }
+        for (; e < events.size(); e++)
+            append_event(replay, encoding, events[e]);
+        first += got;
+    }
+    if (!replay.end.empty())
+        replay.end.back() = replay.bytes.size();
+    fprintf(stderr, "%s: %llu records, %zu bytes as %s\n", path, (unsigned long long)rec.records(),
+            replay.bytes.size(), encoding == FRAME_MESSAGEPACK ? "messagepack" : encoding == FRAME_JSONLINES ? "jsonlines" : "text");
+    return true;
+}
+
+// drops and bit errors at geometrically distributed positions, so low
+// rates cost nothing per byte and a seed always gives the same damage
+struct Injector
+{
+    double dropRate, bitRate;
+    uint64_t state;
+    uint64_t nextDrop; // byte position
+    uint64_t nextFlip; // bit position
+    uint64_t position; // bytes seen
+    uint64_t dropped, flipped;
+
+    double uniform()
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return ((state >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    }
+    uint64_t gap(double rate)
+    {
+        if (rate <= 0)
+            return UINT64_MAX / 2;
+        if (rate >= 1)
+            return 0;
+        return (uint64_t)(log(uniform()) / log(1 - rate));
+    }
+    void start(double drop_rate, double bit_rate, uint64_t seed)
+    {
+        dropRate = drop_rate;
+        bitRate = bit_rate;
+        state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+        position = 0;
+        dropped = 0;
+        flipped = 0;
+        nextDrop = gap(dropRate);
+        nextFlip = gap(bitRate);
+    }
+    // damages data[0 .. n - 1] in place, returns the bytes left
+    size_t apply(char *data, size_t n)
+    {
+        const uint64_t end = position + n;
+        while (nextFlip / 8 < end)
+        {
+            data[nextFlip / 8 - position] ^= 1 << (nextFlip % 8);
+            flipped++;
+            nextFlip += 1 + gap(bitRate);
+        }
+        size_t out = n;
+        if (nextDrop < end)
+        {
+            out = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                if (position + i == nextDrop)
+                {
+                    dropped++;
+                    nextDrop += 1 + gap(dropRate);
+                    continue;
+                }
+                data[out++] = data[i];
+            }
+        }
+        position = end;
+        return out;
+    }
+};
+
+struct Output
+{
+    int fd;
+    int slave; // pty: our end of the reader's side, -1 otherwise
+    time_t stalledSince;
+};
+
+// false once the reader is gone or has not taken anything for STALL_LIMIT_S
+static bool write_all(Output &out, const char *data, size_t n)
+{
+    while (n && running)
+    {
+        ssize_t w = write(out.fd, data, n);
+        if (w > 0)
+        {
+            data += w;
+            n -= w;
+            out.stalledSince = 0;
+            continue;
+        }
+        if (w < 0 && errno != EAGAIN && errno != EINTR)
+            return false; // EPIPE, EIO
+        if (!out.stalledSince)
+            out.stalledSince = time(0);
+        else if (time(0) - out.stalledSince >= STALL_LIMIT_S)
+        {
+            fprintf(stderr, "reader stalled for %d s\n", STALL_LIMIT_S);
+            return false;
+        }
+        struct pollfd pfd = {out.fd, POLLOUT, 0};
+        poll(&pfd, 1, 200);
+    }
+    return running;
+}
+
+static bool open_pty(Output &out, bool wait_for_reader)
+{
+    out.fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (out.fd < 0 || grantpt(out.fd) != 0 || unlockpt(out.fd) != 0)
+        return false;
+    const char *name = ptsname(out.fd);
+    // raw from the start, so nothing is echoed or translated before the
+    // reader sets the port up; held open so the data waits for it
+    out.slave = open(name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (out.slave < 0 || tcgetattr(out.slave, &tio) != 0)
+        return false;
+    cfmakeraw(&tio);
+    tcsetattr(out.slave, TCSANOW, &tio);
+    fcntl(out.fd, F_SETFL, O_NONBLOCK);
+    printf("%s\n", name);
+    fflush(stdout);
+
+    if (wait_for_reader)
+    {
+        fprintf(stderr, "waiting for a line from the reader\n");
+        char c = 0;
+        while (running && c != '\n')
+        {
+            struct pollfd pfd = {out.fd, POLLIN, 0};
+            if (poll(&pfd, 1, 200) > 0 && read(out.fd, &c, 1) != 1)
+                c = 0;
+        }
+    }
+    return true;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR && running)
+        ;
+}
+
+struct Totals
+{
+    uint64_t bytes, samples;
+    uint64_t maxLateNs;
+};
+
+static void print_stats(const Totals &t, const Injector &inj, uint64_t elapsed_ns)
+{
+    double s = elapsed_ns * 1e-9;
+    fprintf(stderr, "bytes %llu samples %llu in %.2f s: %.0f SPS %.2f MB/s, late max %.2f ms, dropped %llu bytes, flipped %llu bits\n",
+            (unsigned long long)t.bytes, (unsigned long long)t.samples, s, s > 0 ? t.samples / s : 0,
+            s > 0 ? t.bytes / s / 1e6 : 0, t.maxLateNs * 1e-6, (unsigned long long)inj.dropped,
+            (unsigned long long)inj.flipped);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: hackeeg_replay -i dump|recording [-p mp|json|b64|hex] [-c channels] [-s] [-q] [-a]\n"
+                    "                      [-o path|-] [-W] [-r sps | -f] [-x factor] [-l loops]\n"
+                    "                      [-e drop rate] [-E bit error rate] [-S seed] [-v]\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *in = 0, *out_path = 0;
+    StreamConfig cfg = {FRAME_MESSAGEPACK, 8, true, false, false};
+    bool have_protocol = false, wait_for_reader = false, fast = false, verbose = false;
+    double sps = 0, factor = 1, drop_rate = 0, bit_rate = 0;
+    unsigned long loops = 1;
+    uint64_t seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:p:c:sqao:Wr:fx:l:e:E:S:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            in = optarg;
+            break;
+        case 'p':
+            if (!StreamParser::parseEncoding(optarg, &cfg.encoding))
+            {
+                usage();
+                return 1;
+            }
+            have_protocol = true;
+            break;
+        case 'c':
+            cfg.channels = atoi(optarg);
+            break;
+        case 's':
+            cfg.status = false;
+            break;
+        case 'q':
+            cfg.quantized = true;
+            break;
+        case 'a':
+            cfg.flags = true;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'W':
+            wait_for_reader = true;
+            break;
+        case 'r':
+            sps = atof(optarg);
+            break;
+        case 'f':
+            fast = true;
+            break;
+        case 'x':
+            factor = atof(optarg);
+            break;
+        case 'l':
+            loops = strtoul(optarg, 0, 0);
+            break;
+        case 'e':
+            drop_rate = atof(optarg);
+            break;
+        case 'E':
+            bit_rate = atof(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, 0, 0);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (!in || factor <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    Replay replay;
+    replay.haveTime = false;
+    replay.lastTime = 0;
+    char magic[sizeof(RecFileHeader().magic)] = {0};
+    FILE *f = fopen(in, "rb");
+    if (!f)
+    {
+        perror(in);
+        return 1;
+    }
+    bool is_recording = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, REC_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    if (is_recording ? !load_recording(in, cfg.encoding, cfg.status, cfg.flags, replay)
+                     : (!have_protocol || !load_dump(in, cfg, replay)))
+    {
+        if (!is_recording && !have_protocol)
+            fprintf(stderr, "%s: not a recording, -p is needed for a dump\n", in);
+        return 1;
+    }
+    if (replay.end.empty())
+    {
+        fprintf(stderr, "%s: no samples\n", in);
+        return 1;
+    }
+    const size_t samples = replay.end.size();
+    replay.end.back() = replay.bytes.size(); // whatever follows the last sample goes with it
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    Output out;
+    out.slave = -1;
+    out.stalledSince = 0;
+    if (!out_path)
+    {
+        if (!open_pty(out, wait_for_reader))
+        {
+            perror("pty");
+            return 1;
+        }
+    }
+    else if (!strcmp(out_path, "-"))
+        out.fd = STDOUT_FILENO;
+    else
+        out.fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644); // blocks until a fifo has a reader
+    if (out.fd < 0)
+    {
+        perror(out_path);
+        return 1;
+    }
+
+    // due time of sample k in ns after the start of a loop
+    std::vector<uint64_t> due(samples);
+    for (size_t k = 0; k < samples; k++)
+        due[k] = (uint64_t)((sps > 0 ? k * 1e9 / sps : replay.offset_us[k] * 1e3) / factor);
+    const uint64_t period = due.back() + (samples > 1 ? due.back() / (samples - 1) : 0);
+
+    Injector inj;
+    inj.start(drop_rate, bit_rate, seed);
+    Totals totals = {0, 0, 0};
+    std::vector<char> chunk(WRITE_CHUNK);
+    const uint64_t start = now_ns();
+    uint64_t last_stats = start;
+    bool ok = true;
+    for (unsigned long loop = 0; ok && running && (loops == 0 || loop < loops); loop++)
+    {
+        const uint64_t base = start + loop * period;
+        size_t sent = 0; // bytes of this loop
+        for (size_t k = 0; ok && running && k < samples;)
+        {
+            size_t next = k;
+            if (fast)
+            {
+                while (next < samples && replay.end[next] - sent < WRITE_CHUNK)
+                    next++;
+                if (next == k)
+                    next++;
+            }
+            else
+            {
+                uint64_t now = now_ns();
+                if (base + due[k] > now)
+                {
+                    sleep_until(base + due[k]);
+                    now = now_ns();
+                }
+                if (now - (base + due[k]) > totals.maxLateNs)
+                    totals.maxLateNs = now - (base + due[k]);
+                // everything that is due by now in one write
+                while (next < samples && base + due[next] <= now && replay.end[next] - sent < WRITE_CHUNK)
+                    next++;
+                if (next == k)
+                    next++;
+            }
+            const size_t end = replay.end[next - 1];
+            for (size_t at = sent; ok && at < end; at += WRITE_CHUNK)
+            {
+                size_t n = (end - at < WRITE_CHUNK) ? end - at : WRITE_CHUNK;
+                memcpy(&chunk[0], &replay.bytes[at], n);
+                n = inj.apply(&chunk[0], n);
+                ok = write_all(out, &chunk[0], n);
+                totals.bytes += n;
+            }
+            totals.samples += next - k;
+            sent = end;
+            k = next;
+            if (verbose && now_ns() - last_stats >= STATS_INTERVAL_S * 1000000000ULL)
+            {
+                last_stats = now_ns();
+                print_stats(totals, inj, last_stats - start);
+            }
+        }
+    }
+    print_stats(totals, inj, now_ns() - start);
+
+    // a pty drops what is still buffered when it closes, give the reader a moment
+    if (out.slave >= 0)
+    {
+        int pending = 0;
+        for (int i = 0; i < 50 && running && ioctl(out.slave, FIONREAD, &pending) == 0 && pending > 0; i++)
+            usleep(100000);
+        close(out.slave);
+    }
+    if (out.fd != STDOUT_FILENO)
+        close(out.fd);
+    return ok ? 0 : 1;
+}
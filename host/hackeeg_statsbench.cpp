@@ -0,0 +1,140 @@
+/*
+ * hackeeg_statsbench.cpp
+ *
+ * The firmware's windowed channel statistics (components/uart/ChannelStats.h)
+ * against a double precision two pass reference, and their speed. For
+ * windows from STATS_MIN_WINDOW to STATS_MAX_WINDOW, 8 channels of
+ * offsets up to the rails, sines and noise down to a code, and one channel
+ * clipping: mean, min, max and clip counts must be exact (the mean as
+ * the float nearest the exact one), the RMS within MAX_RMS_ERROR of the
+ * reference. Exits 1 otherwise.
+ *
+ *   hackeeg_statsbench [-w windows]
+ *
+ * On the device the "status" command reports stats cycles/sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "ChannelStats.h"
+
+#define CHANNELS 8
+#define MAX_RMS_ERROR 4e-7 // relative
+#define RAIL 0x7fffff
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// channel ch of sample i: offsets from -2^23 to near +2^23, noise from 1
+// to 10^5 codes; the last channel is driven past the rails
+static int32_t signal(unsigned &rng, size_t i, int ch)
+{
+    static const double offset[CHANNELS] = {0, -8000000, 8300000, 123456.5, -4000000, 2000000, -8380000, 0};
+    static const double noise[CHANNELS] = {1, 3, 10, 100, 1000, 30000, 5, 0};
+    double v = offset[ch] + noise[ch] * (((int)(rand_r(&rng) % 2001) - 1000) / 1000.0) +
+               noise[ch] * sin(2 * M_PI * (7.3 + ch) * i / 1000.0);
+    if (ch == CHANNELS - 1)
+        v = 9000000 * sin(2 * M_PI * 1.7 * i / 1000.0);
+    return (v > RAIL) ? RAIL : (v < -RAIL - 1) ? -RAIL - 1 : (int32_t)lrint(v);
+}
+
+static bool run(uint32_t window, int windows)
+{
+    ChannelStats stats;
+    stats.configure(CHANNELS, window);
+    const size_t n = (size_t)window * windows;
+    std::vector<int32_t> x(n * CHANNELS);
+    unsigned rng = window;
+    for (size_t i = 0; i < n; i++)
+        for (int ch = 0; ch < CHANNELS; ch++)
+            x[i * CHANNELS + ch] = signal(rng, i, ch);
+
+    int checked = 0;
+    uint64_t mismatches = 0;
+    double worst = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!stats.push(&x[i * CHANNELS], (uint32_t)i))
+            continue;
+        ChannelStatsResult r[STATS_MAX_CHANNELS];
+        uint32_t end;
+        if (!stats.read(r, &end) || end != i)
+        {
+            mismatches++;
+            continue;
+        }
+        checked++;
+        const size_t first = i + 1 - window;
+        for (int ch = 0; ch < CHANNELS; ch++)
+        {
+            int64_t sum = 0;
+            int32_t lo = INT32_MAX, hi = INT32_MIN;
+            uint32_t clipped = 0;
+            for (size_t k = first; k <= i; k++)
+            {
+                const int32_t v = x[k * CHANNELS + ch];
+                sum += v;
+                lo = (v < lo) ? v : lo;
+                hi = (v > hi) ? v : hi;
+                if (v >= RAIL - STATS_CLIP_MARGIN || v <= -RAIL - 1 + STATS_CLIP_MARGIN)
+                    clipped++;
+            }
+            const double mean = (double)sum / window;
+            double var = 0;
+            for (size_t k = first; k <= i; k++)
+                var += (x[k * CHANNELS + ch] - mean) * (x[k * CHANNELS + ch] - mean);
+            const double rms = sqrt(var / window);
+            if (r[ch].mean != (float)mean || r[ch].min != lo || r[ch].max != hi || r[ch].clipped != clipped)
+                mismatches++;
+            const double error = fabs(r[ch].rms - rms) / (rms > 1 ? rms : 1);
+            if (error > worst)
+                worst = error;
+        }
+    }
+
+    // speed over the same samples
+    stats.configure(CHANNELS, window);
+    const double t0 = now();
+    for (size_t i = 0; i < n; i++)
+        stats.push(&x[i * CHANNELS], (uint32_t)i);
+    const double t = now() - t0;
+
+    const bool ok = checked == windows && !mismatches && worst <= MAX_RMS_ERROR;
+    printf("window %6u: %d windows, %llu mismatches, max RMS error %.1e, %5.1f ns/sample (8 channels)%s\n", window,
+           checked, (unsigned long long)mismatches, worst, t / n * 1e9, ok ? "" : "  <--");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int windows = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            windows = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_statsbench [-w windows]\n");
+            return 1;
+        }
+    }
+    if (windows < 1)
+        windows = 1;
+    static const uint32_t sizes[] = {STATS_MIN_WINDOW, 250, 1000, 16000, 65536, STATS_MAX_WINDOW};
+    bool ok = true;
+    for (size_t w = 0; w < sizeof(sizes) / sizeof(sizes[0]); w++)
+        ok &= run(sizes[w], windows);
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+/*
+ * hackeeg_synthcheck.cpp
+ *
+ * Receiver side of the bench mode: the board streams SynthSource frames
+ * (components/uart/Synth.h) from a timer instead of the ADS, this checks
+ * every frame against the same generator and finds the highest rate the
+ * link carries without loss.
+ *
+ *   hackeeg_synthcheck -d device [-p mp|json|b64|hex] [-c 8] [-s] [-a]
+ *                      [-r sps,sps,...] [-P pattern] [-t seconds] [-b baud]
+ *
+ * With -r the rates are tried in turn ("sdatac", then "bench <sps>
+ * <pattern>"; text commands for b64/hex, JSON commands for mp/json, which
+ * only take whole kSPS). A rate is sustained if every sample arrived and
+ * no bit was wrong. Without -r whatever comes in is checked until the end
+ * of the input, e.g. a dump of a bench session.
+ *
+ * The stream must leave the data alone: no decimation, filter, montage or
+ * quantisation. Exits 1 on any bit error, or if no rate was sustained.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "StreamParser.h"
+#include "SerialPort.h"
+#include "Synth.h"
+
+#define READ_CHUNK (64 * 1024)
+#define SETTLE_S 0.5 // after a rate change, before counting
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct Check
+{
+    SynthSource synth;
+    bool status; // status word on the wire
+    uint64_t samples;
+    uint64_t errors; // bit errors
+    uint64_t corrupt; // samples with any
+};
+
+static void check(void *context, const StreamEvent &ev)
+{
+    Check &c = *(Check *)context;
+    if (ev.kind != STREAM_SAMPLE)
+        return;
+    const FrameSample &s = ev.sample;
+    uint8_t frame[SYNTH_FRAME_SZ];
+    c.synth.fill(frame, s.sample); // what is not on the wire can not be wrong
+    if (c.status)
+    {
+        frame[0] = s.status >> 16;
+        frame[1] = s.status >> 8;
+        frame[2] = s.status;
+    }
+    for (int ch = 0; ch < s.channels && ch < SYNTH_CHANNELS; ch++)
+    {
+        frame[3 + 3 * ch] = s.channel[ch] >> 16;
+        frame[4 + 3 * ch] = s.channel[ch] >> 8;
+        frame[5 + 3 * ch] = s.channel[ch];
+    }
+    uint32_t errors = c.synth.verify(frame, s.sample);
+    c.samples++;
+    c.errors += errors;
+    if (errors)
+        c.corrupt++;
+}
+
+// feeds the parser until seconds are up or the input ends, false at the end
+static bool read_for(int fd, StreamParser &parser, double seconds, Check &c)
+{
+    std::vector<char> buffer(READ_CHUNK);
+    const double end = now() + seconds;
+    while (seconds < 0 || now() < end)
+    {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, 100);
+        if (ready < 0 && errno != EINTR)
+            return false;
+        if (ready <= 0)
+            continue;
+        ssize_t n = read(fd, &buffer[0], buffer.size());
+        if (n > 0)
+            parser.feed(&buffer[0], n, check, &c);
+        else if (n == 0 || (pfd.revents & POLLHUP))
+            return false;
+        else if (errno != EAGAIN && errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static void command(int fd, FrameEncoding encoding, const char *name, int a, int b)
+{
+    char line[96];
+    if (encoding == FRAME_MESSAGEPACK || encoding == FRAME_JSONLINES)
+    {
+        if (a < 0)
+            snprintf(line, sizeof(line), "{\"COMMAND\":\"%s\"}\n", name);
+        else
+            snprintf(line, sizeof(line), "{\"COMMAND\":\"%s\",\"PARAMETERS\":[%d,%d]}\n", name, a / 1000, b);
+    }
+    else if (a < 0)
+        snprintf(line, sizeof(line), "%s\n", name);
+    else
+        snprintf(line, sizeof(line), "%s %d %d\n", name, a, b);
+    if (write(fd, line, strlen(line)) < 0)
+        perror("write");
+}
+
+static void report(const char *what, const StreamStats &st, const Check &c, double seconds)
+{
+    printf("%-10s %9llu samples %9.0f SPS  missing %llu  bad %llu  bit errors %llu in %llu samples\n", what,
+           (unsigned long long)c.samples, seconds > 0 ? c.samples / seconds : 0.0, (unsigned long long)st.missing,
+           (unsigned long long)st.bad, (unsigned long long)c.errors, (unsigned long long)c.corrupt);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: hackeeg_synthcheck -d device [-p mp|json|b64|hex] [-c channels] [-s] [-a]\n"
+                    "                          [-r sps,sps,...] [-P pattern] [-t seconds] [-b baud]\n"
+                    "  -s  no status word in the samples (leadoff x 1)\n"
+                    "  -a  artifact flags in the samples (artifacts 1)\n"
+                    "  -P  0 counter, 1 PRNG (bench pattern)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = 0;
+    StreamConfig cfg = {FRAME_MESSAGEPACK, 8, true, false, false};
+    std::vector<int> rates;
+    int pattern = SYNTH_COUNTER;
+    double seconds = 5;
+    long baud = 3000000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:p:c:sar:P:t:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'p':
+            if (!StreamParser::parseEncoding(optarg, &cfg.encoding))
+            {
+                usage();
+                return 1;
+            }
+            break;
+        case 'c':
+            cfg.channels = atoi(optarg);
+            break;
+        case 's':
+            cfg.status = false;
+            break;
+        case 'a':
+            cfg.flags = true;
+            break;
+        case 'r':
+            for (char *p = optarg; *p;)
+            {
+                rates.push_back(strtol(p, &p, 0));
+                if (*p == ',')
+                    p++;
+                else if (*p)
+                {
+                    usage();
+                    return 1;
+                }
+            }
+            break;
+        case 'P':
+            pattern = atoi(optarg);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'b':
+            baud = atol(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (!device || seconds <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    int fd = open_port(device, baud);
+    if (fd < 0)
+    {
+        perror(device);
+        return 1;
+    }
+
+    Check c;
+    c.synth.configure(pattern, 0); // the seed the firmware uses
+    c.status = cfg.status;
+    uint64_t errors = 0;
+
+    if (rates.empty())
+    {
+        c.samples = c.errors = c.corrupt = 0;
+        StreamParser parser(cfg);
+        double t0 = now();
+        read_for(fd, parser, -1, c);
+        report("input", parser.stats(), c, now() - t0);
+        close(fd);
+        return c.errors ? 1 : 0;
+    }
+
+    int sustained = 0;
+    for (size_t i = 0; i < rates.size(); i++)
+    {
+        command(fd, cfg.encoding, "sdatac", -1, 0);
+        command(fd, cfg.encoding, "bench", rates[i], pattern);
+        StreamParser settle(cfg);
+        c.samples = c.errors = c.corrupt = 0;
+        if (!read_for(fd, settle, SETTLE_S, c))
+            break;
+
+        StreamParser parser(cfg); // from here on every sample must arrive
+        c.samples = c.errors = c.corrupt = 0;
+        double t0 = now();
+        bool open = read_for(fd, parser, seconds, c);
+        double t = now() - t0;
+        char what[16];
+        snprintf(what, sizeof(what), "%d", rates[i]);
+        report(what, parser.stats(), c, t);
+        errors += c.errors;
+        const StreamStats &st = parser.stats();
+        if (c.samples && !st.missing && !st.bad && !c.errors && rates[i] > sustained)
+            sustained = rates[i];
+        if (!open)
+            break;
+    }
+    command(fd, cfg.encoding, "sdatac", -1, 0);
+    close(fd);
+    printf("max sustained %d SPS, %llu bit errors\n", sustained, (unsigned long long)errors);
+    return (errors || !sustained) ? 1 : 0;
+}
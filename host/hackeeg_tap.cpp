@@ -0,0 +1,108 @@
+/*
+ * hackeeg_tap.cpp
+ *
+ * Minimal reader of the hackeeg_capd ring: counts what comes through, or
+ * prints it as CSV (sample, time, channels... / events as comments).
+ *
+ *   hackeeg_tap [-n /hackeeg] [-b] [-p] [-d delay us]
+ *
+ * -b attaches with backpressure, -d slows the reader down, which is handy
+ * to see the loss accounting at work.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "ShmRing.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int)
+{
+    running = 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *shm_name = SHM_DEFAULT_NAME;
+    bool backpressure = false, print = false;
+    unsigned delay_us = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:bpd:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            shm_name = optarg;
+            break;
+        case 'b':
+            backpressure = true;
+            break;
+        case 'p':
+            print = true;
+            break;
+        case 'd':
+            delay_us = strtoul(optarg, 0, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: hackeeg_tap [-n shm name] [-b] [-p] [-d delay us]\n");
+            return 1;
+        }
+    }
+
+    ShmReader reader;
+    if (!reader.attach(shm_name, backpressure))
+    {
+        fprintf(stderr, "can not attach to %s\n", shm_name);
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    uint64_t samples = 0, events = 0, torn = 0;
+    time_t last = time(0);
+    while (running)
+    {
+        const ShmRecord *rec = reader.peek();
+        if (!rec)
+        {
+            if (reader.writerGone())
+                break;
+            usleep(200);
+            continue;
+        }
+        if (rec->kind == SHM_SAMPLE)
+        {
+            samples++;
+            if (print)
+            {
+                printf("%u,%llu", rec->sample, (unsigned long long)rec->time);
+                for (int ch = 0; ch < rec->channels; ch++)
+                    printf(",%d", rec->value[ch]);
+                printf("\n");
+            }
+        }
+        else
+        {
+            events++;
+            if (print)
+                printf("# kind %d sample %u %d %d %d\n", rec->kind, rec->sample, rec->value[0], rec->value[1], rec->value[2]);
+        }
+        if (!reader.release())
+            torn++;
+        if (delay_us)
+            usleep(delay_us);
+        if (!print && time(0) != last)
+        {
+            last = time(0);
+            fprintf(stderr, "samples %llu events %llu lost %llu torn %llu lag %llu\n", (unsigned long long)samples,
+                    (unsigned long long)events, (unsigned long long)reader.lost(), (unsigned long long)torn,
+                    (unsigned long long)reader.lag());
+        }
+    }
+    fprintf(stderr, "samples %llu events %llu lost %llu torn %llu\n", (unsigned long long)samples,
+            (unsigned long long)events, (unsigned long long)reader.lost(), (unsigned long long)torn);
+    return 0;
+}
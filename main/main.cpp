@@ -11,7 +11,9 @@ CB
 #include "esp_system.h"
 #include "esp_spi_flash.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include "driver/gpio.h"
+#include "sdkconfig.h"
 
 #include "ads129x.h"
 #include "SerialCommand.h"
@@ -19,6 +21,22 @@ CB
 #include "adsCommand.h"
 #include "Base64.h"
 #include "uart.h"
+#include "Biquad.h"
+#include "Decimator.h"
+#include "BandPower.h"
+#include "ChannelStats.h"
+#include "Impedance.h"
+#include "LeadOff.h"
+#include "Trace.h"
+#include "Synth.h"
+#include "Capture.h"
+#include "Profile.h"
+#include "SampleRing.h"
+#include "FrameEncoder.h"
+#include "Quantizer.h"
+#include "ArtifactFlags.h"
+#include "Montage.h"
+#include "Cycles.h"
 #include "driver/spi_master.h"
 
 #define TAG "main"
@@ -30,6 +48,85 @@ CB
 #define SPI_BUFFER_SIZE 200    //max 27 bytes ...
 #define OUTPUT_BUFFER_SIZE 512 //same here
 
+#define BANDPOWER_OFF 0
+#define BANDPOWER_ONLY 1    // band power frames instead of raw samples
+#define BANDPOWER_AND_RAW 2 // band power frames alongside the raw samples
+
+#define STATS_OFF 0
+#define STATS_ONLY 1    // stats frames instead of raw samples, for setup checks
+#define STATS_AND_RAW 2 // stats frames alongside the raw samples
+#define STATS_REPORT 3  // last complete window as the response
+
+#define MONTAGE_OFF 0
+#define MONTAGE_CAR 1     // common average reference
+#define MONTAGE_BIPOLAR 2 // differences of channel pairs
+#define MONTAGE_TERM 3    // one weighted term of a custom matrix (text only)
+#define MONTAGE_REPORT 4  // the matrix as the response
+
+#define LINK_OFF 0    // stream whatever the UART can take
+#define LINK_REFUSE 1 // rdatac fails if the stream does not fit the UART
+#define LINK_ADJUST 2 // shrink the stream until it fits, else fail
+#define LINK_LOAD_MAX 90                    // percent of the UART a stream may plan for
+#define LINK_CAPACITY (UART_BAUD_RATE / 10) // bytes/s
+
+#define LINK_MASKED 0x01    // shorted channels left out of the frames
+#define LINK_NO_STATUS 0x02 // status word left out of the frames
+#define LINK_QUANTIZED 0x04 // 16 bit samples
+
+#define BANDPOWER_FRAME_KEY 'B'
+#define LEADOFF_FRAME_KEY 'L'
+#define RESYNC_FRAME_KEY 'R'
+#define TRACE_FRAME_KEY 'T'
+#define HEARTBEAT_FRAME_KEY 'H'
+#define CAPTURE_FRAME_KEY 'K' // 'C' is the status code key
+#define MARKER_FRAME_KEY 'M'
+#define QUANT_FRAME_KEY 'Q'
+#define STATS_FRAME_KEY 'S'
+
+#define CAPTURE_HEAP_RESERVE (48 * 1024) // left for cJSON, tasks and the drivers
+#define CAPTURE_RECORDS_PER_FRAME 7      // 4 + 7 x 31 + 4 bytes per 'K' frame
+
+#define CAPTURE_OFF 0
+#define CAPTURE_BURST 1   // burst command, N samples then stop
+#define CAPTURE_TRIGGER 2 // rdatac with a trigger set, pre/post windows around each trigger
+#define CAPTURE_IMPEDANCE 3 // impedance command, lead-off excitation into the Goertzel filters
+
+#define IMPEDANCE_SECONDS 1.0f // detection window, whole excitation cycles
+#define IMPEDANCE_SIDE_P 0     // excite and measure the positive inputs
+#define IMPEDANCE_SIDE_N 1     // the negative inputs
+
+#define TRIGGER_OFF 0
+#define TRIGGER_GPIO 1      // rising edge on TRIGGER_PIN
+#define TRIGGER_THRESHOLD 2 // |channel| crossing trigger_level
+#define TRIGGER_WINDOW_UNIT 16 // JSON window parameters are in these
+
+#define PROFILE_SAVE 0
+#define PROFILE_LOAD 1
+#define PROFILE_DELETE 2
+#define PROFILE_AUTOSTART 3
+#define PROFILE_AUTOSTART_OFF 4
+
+#define TRACE_OFF 0
+#define TRACE_ON 1     // clear the ring and start tracing
+#define TRACE_REPORT 2 // min/avg/p99/max per stage
+#define TRACE_DUMP 3   // raw records as 'T' frames
+
+#define TRACE_RECORDS_PER_FRAME 10
+
+// task placement, the DRDY ISR is installed by spi_init() from app_main,
+// which runs on core 0, so it shares the core with acquisition
+#define ACQUIRE_TASK_CORE 0 // rdatac_task: ISR hand-over and SPI
+#define ACQUIRE_TASK_PRIO 5
+#define PROCESS_TASK_CORE 1 // process_task: DSP, encoding, UART
+#define PROCESS_TASK_PRIO 4
+#define FEATURE_TASK_CORE 1
+#define FEATURE_TASK_PRIO 2
+#define READ_TASK_CORE 1
+#define READ_TASK_PRIO 1
+
+#define PIPELINE_DEPTH 64 // samples between the stages, power of 2
+#define CPU_HZ (CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000)
+
 const char *STATUS_TEXT_OK = "Ok";
 const char *STATUS_TEXT_BAD_REQUEST = "Bad request";
 const char *STATUS_TEXT_UNRECOGNIZED_COMMAND = "Unrecognized command";
@@ -38,72 +135,233 @@ const char *STATUS_TEXT_WRONG_REG_VAL = "Unrecognized register value";
 const char *STATUS_TEXT_ERROR = "Error";
 const char *STATUS_TEXT_NOT_IMPLEMENTED = "Not Implemented";
 const char *STATUS_TEXT_NO_ACTIVE_CHANNELS = "No Active Channels";
+const char *STATUS_TEXT_LINK_OVERLOAD = "Link overload";
 
 const char *hardware_type = "TI ADS1299 EVM";
 const char *board_name = "ADS1299 EVM";
 const char *maker_name = "Buchels";
 const char *driver_version = "v0.1";
 
-const char json_rdatac_header[] = "{\"C\":200,\"D\":\"";
-uint8_t json_rdatac_header_size = sizeof(json_rdatac_header);
-//uint8_t json_rdatac_header_size = sizeof (&json_rdatac_header[0]);
-
-const char json_rdatac_footer[] = "\"}";
-uint8_t json_rdatac_footer_size = sizeof(json_rdatac_footer);
-//uint8_t json_rdatac_footer_size = sizeof (&json_rdatac_footer[0]);
-
 const char messagepack_rdatac_header[] = {0x82, 0xa1, 0x43, 0xcc, 0xc8, 0xa1, 0x44, 0xc4};
-uint8_t messagepack_rdatac_header_size = sizeof(messagepack_rdatac_header);
 
 #define MP_HEADER_SZ 8
-#define MP_DATA_SZ 27
-#define MP_FULL_SZ 44 //8 + 4 + 4 + 1 + 27
-#define MP_PRE_SZ 17  //MP_HEADER_SZ + 4 + 4 +1
+#define MP_DATA_SZ 27 // one RDATAC read: (8 ch + 1 status) x 3 bytes
+
+// sample frames come from FrameEncoder.h, the layout is picked by
+// setupFrames() when rdatac starts or the protocol changes
+FrameEncoderFn encode_frame = frame_encoder(8, true, FRAME_JSONLINES);
+uint8_t sample_data[MP_DATA_SZ]; // single task mode read buffer
+
+
+//int protocol_mode = TEXT_MODE;
+int protocol_mode = JSONLINES_MODE;
+
+int max_channels = 0;
+int num_active_channels = 0;
+bool active_channels[9]; // reports whether channels 1..9 are active
+uint8_t active_list[8];  // channel numbers (1..8) of the active channels
+int sample_rate = 0;     // SPS derived from CONFIG1, updated when rdatac starts
+int stream_rate = 0;     // SPS actually streamed (after decimation)
+
+int32_t channel_data[8]; // active channels unpacked for on-device processing
+
+BiquadBank filter_bank;
+uint8_t filter_notch_hz = 0;  // 0 = off, else 50 or 60 Hz
+uint8_t filter_highpass = 0;  // high-pass cut-off in 0.1 Hz, 0 = off
+bool filter_enabled = false;
+uint32_t filter_cycles = 0;   // running average cycles/sample of the filter bank
+
+Decimator decimator;
+uint8_t decimate_ratio = 0;   // 0 = off, else even ratio 2..64
+bool decimate_enabled = false;
+uint32_t decimate_cycles = 0; // running average cycles per input sample
+
+BandPower band_power;
+uint8_t bandpower_mode = BANDPOWER_OFF;
+uint8_t bandpower_rate = 10;   // feature frames per second
+bool bandpower_enabled = false;
+uint32_t bandpower_cycles = 0; // running average cycles per feature frame (all channels)
+volatile bool feature_frame_ready = false; // set by feature_task, cleared once sent
+TaskHandle_t feature_task_handle = NULL;
+
+#define BP_FRAME_SZ (4 + 1 + 1 + 4 * BP_MAX_CHANNELS * BP_NUM_BANDS)
 
 union
 {
-    char bytes[MP_FULL_SZ];
+    uint8_t bytes[BP_FRAME_SZ];
 
     struct __attribute__((packed))
     {
-        char header[MP_HEADER_SZ]; // messagepack header
-        uint8_t size;              // size of cargo ie MP_DATA_SZ + 4 + 4
-        uint32_t time;             // sample time
-        uint32_t sample;           // sample #
-        uint8_t data[MP_DATA_SZ];  // data ((8 ch + 1 status) x 3 bytes )
+        uint32_t sample;   // sample # of the last sample in the window
+        uint8_t channels;  // number of active channels
+        uint8_t bands;     // bands per channel
+        float powers[BP_MAX_CHANNELS * BP_NUM_BANDS]; // ADC codes^2, channel major
     } data_fields;
+} feature_frame;
+
+ChannelStats channel_stats;
+uint8_t stats_mode = STATS_OFF;
+uint16_t stats_window_ms = 1000; // window, one 'S' frame each
+bool stats_enabled = false;
+uint32_t stats_cycles = 0;       // running average cycles/sample (all channels)
+bool stats_frame_pending = false;
+
+struct __attribute__((packed)) StatsFrameChannel
+{
+    float mean;       // codes
+    float rms;        // about the mean
+    int32_t min;
+    int32_t max;
+    uint16_t clipped; // samples near the rails
+};
+
+union
+{
+    uint8_t bytes[9 + STATS_MAX_CHANNELS * sizeof(StatsFrameChannel)];
 
     struct __attribute__((packed))
     {
-        char preSPI[MP_PRE_SZ];
-        char postSPI[MP_DATA_SZ];
-    } pre_post;
+        uint32_t sample;   // sample # of the last sample in the window
+        uint8_t channels;  // number of active channels
+        uint32_t window;   // samples
+        StatsFrameChannel channel[STATS_MAX_CHANNELS];
+    } data_fields;
+} stats_frame;
 
-} mp_transfer;
+char frame_buffer[OUTPUT_BUFFER_SIZE]; // in-band frames other than samples
 
-#define SPI_FULL_SZ 35 // MP_DATA_SZ + 4 + 4
+bool leadoff_events = false;  // send an 'L' frame whenever LOFF_STATP/N change
+bool drop_status = false;     // leave the status word out of the sample frames
+uint32_t status_errors = 0;   // status words without the 1100 prefix
+uint16_t leadoff_state = 0;   // LOFF_STATP << 8 | LOFF_STATN of the last valid status word
+bool leadoff_known = false;   // leadoff_state is valid
+bool leadoff_event_pending = false;
 
 union
 {
-    char bytes[SPI_FULL_SZ];
+    uint8_t bytes[6];
 
     struct __attribute__((packed))
     {
-        uint32_t time;            // sample time
-        uint32_t sample;          // sample #
-        uint8_t data[MP_DATA_SZ]; // data ((8 ch + 1 status) x 3 bytes )
+        uint32_t sample; // first sample # with the new state
+        uint8_t statp;   // LOFF_STATP
+        uint8_t statn;   // LOFF_STATN
     } data_fields;
-} spi_transfer;
+} leadoff_event;
 
-// do the same for b64 package anh hex package --> very nice ...
-// but check whether data strings always have same length
+bool resync_pending = false;
 
-//int protocol_mode = TEXT_MODE;
-int protocol_mode = JSONLINES_MODE;
+union
+{
+    uint8_t bytes[8];
 
-int max_channels = 0;
-int num_active_channels = 0;
-bool active_channels[9]; // reports whether channels 1..9 are active
+    struct __attribute__((packed))
+    {
+        uint32_t sample; // sample # that was dropped
+        uint32_t errors; // status_errors so far
+    } data_fields;
+} resync_event;
+
+Quantizer quantizer;               // int16 samples, see the quantize command
+bool quantize_enabled = false;    // setting, applied when rdatac starts
+bool quantize_active = false;     // as applied
+uint8_t quantize_shift = QUANT_AUTO; // fixed shift or QUANT_AUTO
+bool quant_frame_pending = false;
+uint32_t quantize_cycles = 0;      // running average per sample
+
+ArtifactFlags artifact_flags;      // rail/step/lead-off bits in the sample frames, see the artifacts command
+bool artifacts_enabled = false;    // setting, applied when rdatac starts
+bool artifacts_active = false;     // as applied
+int32_t artifact_step = ARTIFACT_DEFAULT_STEP; // codes between samples, 0 = no step flags
+uint16_t artifact_bits = 0;        // flags of the raw samples since the last one sent, channel bits are ADS channels
+uint32_t artifact_cycles = 0;      // running average per raw sample
+
+Montage montage_setting;           // re-referencing matrix as set, see the montage command
+Montage montage;                   // as applied when rdatac started
+bool montage_active = false;
+uint32_t montage_cycles = 0;       // running average per sample
+int stream_channels = 0;           // channels after the montage, for decimation, filters and band power
+uint8_t stream_list[8];            // their channel numbers (1..8) in the sample frame
+
+uint8_t link_mode = LINK_REFUSE;
+uint32_t link_bytes = 0;           // bytes/s of the stream as planned at rdatac
+uint8_t link_adjusted = 0;         // LINK_* changes planLink() made to this session
+
+// shifts in effect from sample on, sent before that sample's frame
+union
+{
+    uint8_t bytes[4 + QUANT_MAX_CHANNELS];
+
+    struct __attribute__((packed))
+    {
+        uint32_t sample;
+        uint8_t shift[QUANT_MAX_CHANNELS];
+    } data_fields;
+} quant_frame;
+
+TraceRing trace; // hot path latencies, see the trace command
+
+SynthSource synth; // sample source in bench mode
+
+// two stage pipeline: rdatac_task only reads samples into sample_ring,
+// process_task on the other core does processing, encoding and the UART
+struct PipelineRecord
+{
+    uint32_t time;   // sample time, us
+    uint32_t sample; // sample #
+    uint32_t drdy;   // cycle counts for the trace, all core 0
+    uint32_t wake;
+    uint32_t spi;
+    uint32_t timed;  // when time was taken
+    bool valid;      // status word ok
+    uint8_t data[MP_DATA_SZ];
+};
+
+SampleRing<PipelineRecord, PIPELINE_DEPTH> sample_ring;
+bool pipeline_enabled = true;          // setting, applied when rdatac starts
+volatile bool pipeline_active = false; // as applied
+volatile bool process_idle = true;     // process_task waits for a notification
+TaskHandle_t process_task_handle = NULL;
+uint32_t pipeline_overflows = 0; // samples lost on a full ring
+uint32_t acquire_cycles = 0;     // running average cycles/sample of rdatac_task
+uint32_t process_cycles = 0;     // same for process_task
+
+int64_t boot_ready_us = 0;   // app_main done, commands are served
+int64_t first_sample_us = 0; // first sample after boot
+
+CaptureBuffer capture;              // preallocated at startup, see setupCapture()
+volatile uint8_t capture_mode = CAPTURE_OFF; // samples go to capture instead of the UART
+
+ImpedanceMeter impedance_meter;
+volatile bool impedance_done = false; // set by rdatac_task once the window is in
+
+uint8_t trigger_source = TRIGGER_OFF;
+uint8_t trigger_channel = 1;       // 1..8, threshold trigger
+int32_t trigger_level = 1 << 20;   // codes, threshold trigger
+uint16_t trigger_pre = 256;        // samples before the trigger sample
+uint16_t trigger_post = 768;       // trigger sample and after
+bool trigger_above = false;        // last sample was above the level
+
+uint8_t heartbeat_seconds = 1;  // heartbeat period while streaming, 0 = off
+uint32_t heartbeat_samples = 0; // same in DRDYs, set when rdatac starts
+uint32_t heartbeat_last = 0;    // sample # of the last heartbeat
+uint32_t wake_latency_max = 0;  // cycles from DRDY to the acquisition task running
+
+// health counters of the current rdatac session
+union
+{
+    uint8_t bytes[21];
+
+    struct __attribute__((packed))
+    {
+        uint32_t sample;           // sample # when sent
+        uint32_t drdy_collisions;  // samples lost because the last one was still in flight
+        uint32_t tx_drops;         // sample frames dropped for lack of UART FIFO space
+        uint32_t resyncs;          // SPI resyncs (bad status words)
+        uint32_t wake_latency_max; // cycles
+        uint8_t tx_fifo_max;       // TX FIFO high-water mark, bytes
+    } data_fields;
+} heartbeat;
 
 int num_spi_bytes = 0;
 int num_timestamped_spi_bytes = 0;
@@ -169,477 +427,2321 @@ void detectActiveChannels()
         int chSet = adcRreg(CHnSET + i);
         active_channels[i] = ((chSet & 7) != SHORTED);
         if ((chSet & 7) != SHORTED)
-            num_active_channels++;
+            active_list[num_active_channels++] = i;
     }
 }
 
-void send_response(int status_code, const char *status_text)
+void detectSampleRate()
 {
-    switch (protocol_mode)
-    {
-    case TEXT_MODE:
-        printf("%d %s\n", status_code, status_text);
-        break;
-    case JSONLINES_MODE:
-        jsonCommand.sendJsonLinesResponse(status_code, (char *)status_text);
-        break;
-    case MESSAGEPACK_MODE:
-        // all responses are in JSON Lines, MessagePack mode is only for sending samples
-        jsonCommand.sendJsonLinesResponse(status_code, (char *)status_text);
-        break;
-    default:
-        // unknown protocol
-        ;
-    }
+    if ((is_rdatac) || (max_channels < 1))
+        return; //we can not read registers when in RDATAC mode
+    using namespace ADS129x;
+    uint8_t config1 = adcRreg(CONFIG1);
+    // ADS1299: 16k SPS >> DR, the ADS129x family starts at 32k SPS
+    int base_rate = (strncmp(hardware_type, "ADS1299", 7) == 0) ? 16000 : 32000;
+    sample_rate = base_rate >> (config1 & (DR2 | DR1 | DR0));
 }
 
-void send_response_ok()
+void setupDecimator()
 {
-    send_response(RESPONSE_OK, STATUS_TEXT_OK);
+    decimate_enabled = (decimate_ratio > 0) && decimator.configure(decimate_ratio);
+    stream_rate = decimate_enabled ? sample_rate / decimate_ratio : sample_rate;
+    decimate_cycles = 0;
 }
 
-void send_response_error()
+// band power frames per second as set up, may be off the requested rate
+static float bandpower_frame_rate()
 {
-    send_response(RESPONSE_ERROR, STATUS_TEXT_ERROR);
+    return bandpower_enabled ? (float)stream_rate / band_power.hopSamples() : 0.0f;
 }
 
-// This gets set as the default handler, and gets called when no other command matches.
-void unrecognized(const char *command)
+void setupBandPower()
 {
-    //Serial.println("406 Error: Unrecognized command.");
-    //Serial.println();
-    printf("406 Error: Unrecognized command.\n");
-    ESP_LOGI(TAG, "%s\n", command);
+    bandpower_enabled = (bandpower_mode != BANDPOWER_OFF) && (stream_rate > 0);
+    if (!bandpower_enabled)
+        return;
+    // whole samples per frame, so the rate sent is stream_rate / hop
+    int hop = stream_rate / bandpower_rate;
+    band_power.configure(stream_rate, (hop > 0xffff) ? 0xffff : hop, stream_channels);
+    feature_frame_ready = false;
+    bandpower_cycles = 0;
 }
-// This gets set as the default handler for jsonlines and messagepack, and gets called when no other command matches.
-void unrecognizedJsonLines(const char *command)
+
+// statistics of the raw codes at the ADC rate, ahead of decimation and filters
+void setupStats()
 {
-    /*StaticJsonDocument<1024> doc;
-    JsonObject root = doc.to<JsonObject>();
-    root[STATUS_CODE_KEY] = UNRECOGNIZED_COMMAND;
-    root[STATUS_TEXT_KEY] = "Unrecognized command";
-    jsonCommand.sendJsonLinesDocResponse(doc);*/
+    stats_enabled = (stats_mode != STATS_OFF) && (sample_rate > 0);
+    stats_frame_pending = false;
+    stats_cycles = 0;
+    if (stats_enabled)
+        channel_stats.configure(num_active_channels, (uint32_t)sample_rate * stats_window_ms / 1000);
+}
 
-    cJSON *root;
-    root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(RESPONSE_UNRECOGNIZED_COMMAND));
-    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString("Unrecognized command"));
+// channels in an RDATAC read, the ADS129x send 4, 6 or 8
+static inline uint8_t raw_channels()
+{
+    return (max_channels == 4 || max_channels == 6) ? max_channels : 8;
+}
 
-    /*char* text = cJSON_Print(root);
-    printf("%s\n", text);
-    free(text);
-    cJSON_Delete(root);*/
-    jsonCommand.sendJsonLinesDocResponse(root); //als Alternative
+// channels in a sample frame: the raw ones or the montage outputs
+static inline uint8_t frame_channels()
+{
+    return montage_active ? montage.wireChannels() : raw_channels();
 }
 
-void adsSetup()
-{ //default settings for ADS1298 and compatible chips
-    using namespace ADS129x;
-    // Send SDATAC Command (Stop Read Data Continuously mode)
-    //spi_data_available = 0;
+static uint8_t active_mask()
+{
+    uint8_t mask = 0;
+    for (int i = 0; i < num_active_channels; i++)
+        mask |= 1 << (active_list[i] - 1);
+    return mask;
+}
 
-    current_sample = 0;
-    handling_data = false;
+// the montage outputs replace the active channels from the raw read on
+static void useMontage(const Montage &m)
+{
+    montage = m;
+    montage_active = montage.outputs() > 0;
+    if (montage_active && montage.usesAverage() && !montage.reference())
+        montage.setReference(active_mask());
+    stream_channels = montage_active ? montage.outputs() : num_active_channels;
+    for (int i = 0; i < stream_channels; i++)
+        stream_list[i] = montage_active ? i + 1 : active_list[i];
+    montage_cycles = 0;
+}
 
-    adcSendCommand(SDATAC);
-    ESP_LOGI(TAG, "sent SDATAC");
-    //vTaskDelay(100 / portTICK_PERIOD_MS);
-    //ets_delay_us(2);
-    //delay(100);
-    uint8_t val = adcRreg(ID);
-    ESP_LOGI(TAG, "ID = %d", val);
-    switch (val & DEV_ID_MASK)
+void setupMontage()
+{
+    useMontage(montage_setting);
+}
+
+void setupFrames()
+{
+    FrameEncoding encoding;
+    switch (protocol_mode)
     {
-    case (DEV_ID_MASK_129x | ID_4CHAN):
-        hardware_type = "ADS1294";
-        max_channels = 4;
-        break;
-    //case B10001:
-    case (DEV_ID_MASK_129x | ID_6CHAN):
-        hardware_type = "ADS1296";
-        max_channels = 6;
-        break;
-    //case B10010:
-    case (DEV_ID_MASK_129x | ID_8CHAN):
-        hardware_type = "ADS1298";
-        max_channels = 8;
-        break;
-    //case B11110:
-    case (DEV_ID_MASK_1299 | ID_8CHAN):
-        hardware_type = "ADS1299";
-        max_channels = 8;
-        break;
-    //case B11100:
-    case (DEV_ID_MASK_1299 | ID_4CHAN):
-        hardware_type = "ADS1299-4";
-        max_channels = 4;
+    case MESSAGEPACK_MODE:
+        encoding = FRAME_MESSAGEPACK;
         break;
-    //case B11101:
-    case (DEV_ID_MASK_1299 | ID_6CHAN):
-        hardware_type = "ADS1299-6";
-        max_channels = 6;
+    case JSONLINES_MODE:
+        encoding = FRAME_JSONLINES;
         break;
     default:
-        max_channels = 0;
+        encoding = base64_mode ? FRAME_BASE64 : FRAME_HEX;
     }
-    if (max_channels == 0)
-    { //error mode
-        while (1)
-        {
-            gpio_set_level(LED_PIN, 1);
-            vTaskDelay(500 / portTICK_PERIOD_MS);
-            gpio_set_level(LED_PIN, 0);
-            vTaskDelay(500 / portTICK_PERIOD_MS);
-        }
-    } //error mode
-
-    // All GPIO set to output 0x0000: (floating CMOS inputs can flicker on and off, creating noise)
-    adcWreg(ADS_GPIO, 0);
-    adcWreg(CONFIG3, PD_REFBUF | CONFIG3_const);
-    //gpio_set_level(START_PIN, 1); //Hmmm not sure ??? should be L to use commands ...
-    //gpio_set_level(START_PIN, 0); //L to use commands ...
+    encode_frame = frame_encoder(frame_channels(), !drop_status && !(link_adjusted & LINK_NO_STATUS), encoding,
+                                 quantize_active ? 2 : 3, artifacts_active);
 }
 
-void nopCommand(unsigned char unused1, unsigned char unused2)
+void setupQuantizer()
 {
-    send_response_ok();
+    quantize_active = quantize_enabled || (link_adjusted & LINK_QUANTIZED);
+    quantizer.configure(frame_channels(), quantize_shift);
+    quant_frame_pending = quantize_active; // the host needs the shifts before the first sample
+    quantize_cycles = 0;
 }
 
-void microsCommand(unsigned char unused1, unsigned char unused2)
+// flags of the raw channels, lead-off only for the active ones
+void setupArtifacts()
 {
-    int64_t microseconds = esp_timer_get_time();
-    if (protocol_mode == TEXT_MODE)
-    {
-        send_response_ok();
-        printf("%" PRId64 "\n", microseconds);
-        return;
-    }
+    artifacts_active = artifacts_enabled;
+    artifact_flags.configure(raw_channels(), active_mask(), artifact_step);
+    artifact_bits = 0;
+    artifact_cycles = 0;
+}
 
-    cJSON *root;
-    ESP_LOGI(TAG, "Main Free Heap before root %d", esp_get_free_heap_size());
-    root = cJSON_CreateObject();
-    ESP_LOGI(TAG, "Main Free Heap after root %d", esp_get_free_heap_size());
-    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
-    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
-    cJSON_AddItemToObject(root, DATA_KEY, cJSON_CreateNumber(microseconds));
+void setupLeadOff()
+{
+    leadoff_known = false; // report the state of the first sample
+    leadoff_event_pending = false;
+    resync_pending = false;
+}
 
-    switch (protocol_mode)
-    {
-    case JSONLINES_MODE:
-    case MESSAGEPACK_MODE:
-        ESP_LOGI(TAG, "Main Free Heap before sendJsonLinesDocResponse %d", esp_get_free_heap_size());
-        jsonCommand.sendJsonLinesDocResponse(root);
-        break;
-    default:
-        // unknown protocol
-        ;
-    }
+void setupHealth()
+{
+    drdy_collisions = 0;
+    uart_tx_drops = 0;
+    uart_tx_fifo_max = 0;
+    status_errors = 0;
+    wake_latency_max = 0;
+    heartbeat_samples = (uint32_t)sample_rate * heartbeat_seconds;
+    heartbeat_last = 0;
 }
-void versionCommand(unsigned char unused1, unsigned char unused2)
+
+// markers left from an earlier session would carry its sample numbers
+void clearMarkers()
 {
-    send_response(RESPONSE_OK, driver_version);
+    xQueueReset(marker_queue);
+    marker_waiting = false;
 }
 
-void statusCommand(unsigned char unused1, unsigned char unused2)
+void setupFilter()
 {
-    detectActiveChannels();
-    if (protocol_mode == TEXT_MODE)
+    filter_bank.clear();
+    if (stream_rate > 0)
     {
-        printf("200 Ok\n");
-        printf("Driver version: %s\n", driver_version);
-        printf("Board name: %s\n", board_name);
-        printf("Board maker: %s\n", maker_name);
-        printf("Hardware type: %s\n", hardware_type);
-        printf("Max channels: %d\n", max_channels);
-        printf("Number of active channels: %d\n\n", num_active_channels);
-        return;
+        if (filter_notch_hz > 0)
+            filter_bank.addNotch(filter_notch_hz, BIQUAD_NOTCH_Q, stream_rate);
+        if (filter_highpass > 0)
+            filter_bank.addHighpass(filter_highpass / 10.0, stream_rate);
     }
+    filter_enabled = (filter_bank.stages() > 0);
+    filter_cycles = 0;
+}
 
-    cJSON *root, *cj_data;
-    ESP_LOGI(TAG, "Main Free Heap before root %d", esp_get_free_heap_size());
-    root = cJSON_CreateObject();
-    ESP_LOGI(TAG, "Main Free Heap after root %d", esp_get_free_heap_size());
-    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
-    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
-    cJSON_AddItemToObject(root, DATA_KEY, cj_data = cJSON_CreateObject());
-    cJSON_AddStringToObject(cj_data, "driver_version", driver_version);
-    cJSON_AddStringToObject(cj_data, "board_name", board_name);
-    cJSON_AddStringToObject(cj_data, "maker_name", maker_name);
-    cJSON_AddStringToObject(cj_data, "hardware_type", hardware_type);
-    cJSON_AddNumberToObject(cj_data, "max_channels", max_channels);
-    cJSON_AddNumberToObject(cj_data, "active_channels", num_active_channels);
-
-    switch (protocol_mode)
+// 24 bit big endian codes of the listed channels (1..8) <-> channel_data
+static inline void unpack_channels(const uint8_t *data, const uint8_t *list, int count)
+{
+    for (int i = 0; i < count; i++)
     {
-    case JSONLINES_MODE:
-    case MESSAGEPACK_MODE:
-        jsonCommand.sendJsonLinesDocResponse(root);
-        break;
-    default:
-        // unknown protocol
-        ;
+        const uint8_t *p = &data[3 * list[i]];
+        channel_data[i] = ((int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8))) >> 8;
     }
 }
 
-void serialNumberCommand(unsigned char unused1, unsigned char unused2)
+static inline void pack_channels(uint8_t *data, const uint8_t *list, int count)
 {
-    send_response(RESPONSE_NOT_IMPLEMENTED, STATUS_TEXT_NOT_IMPLEMENTED);
+    for (int i = 0; i < count; i++)
+    {
+        int32_t v = channel_data[i];
+        if (v > 0x7fffff)
+            v = 0x7fffff;
+        else if (v < -0x800000)
+            v = -0x800000;
+        uint8_t *p = &data[3 * list[i]];
+        p[0] = v >> 16;
+        p[1] = v >> 8;
+        p[2] = v;
+    }
 }
 
-void textCommand(unsigned char unused1, unsigned char unused2)
+static inline void average_cycles(uint32_t &avg, uint32_t start)
 {
-    protocol_mode = TEXT_MODE;
-    send_response_ok();
+    uint32_t cycles = cycle_count() - start;
+    avg = avg ? avg + (((int32_t)(cycles - avg)) >> 4) : cycles;
 }
 
-void jsonlinesCommand(unsigned char unused1, unsigned char unused2)
+// acquisition side of check_status(), the resync has to happen right away
+static inline bool validate_status(const uint8_t *data)
 {
-    protocol_mode = JSONLINES_MODE;
-    send_response_ok();
+    if (status_valid(data))
+        return true;
+    status_errors++;
+    spiResync();
+    return false;
 }
 
-void messagepackCommand(unsigned char unused1, unsigned char unused2)
+// transmit side of check_status()
+static inline void flag_resync(uint32_t sample)
 {
-    protocol_mode = MESSAGEPACK_MODE;
-    send_response_ok();
+    resync_event.data_fields.sample = sample;
+    resync_event.data_fields.errors = status_errors;
+    resync_pending = true;
 }
 
-void ledOnCommand(unsigned char unused1, unsigned char unused2)
+static inline void track_leadoff(const uint8_t *data, uint32_t sample)
 {
-    gpio_set_level(LED_PIN, 1);
+    if (!leadoff_events)
+        return;
+    uint16_t state = status_leadoff(data);
+    if (leadoff_known && state == leadoff_state)
+        return;
+    leadoff_state = state;
+    leadoff_known = true;
+    leadoff_event.data_fields.sample = sample;
+    leadoff_event.data_fields.statp = state >> 8;
+    leadoff_event.data_fields.statn = state & 0xff;
+    leadoff_event_pending = true;
+}
+
+// validate the status word and queue a lead-off event if the state changed,
+// the event goes out after the current sample frame.
+// A bad prefix means the reads have slipped against the ADS (e.g. a glitch
+// on SCLK with CS held low), all later samples would be garbage: resync the
+// serial interface right away and flag the lost sample. Returns false then.
+static inline bool check_status(const uint8_t *data)
+{
+    if (!validate_status(data))
+    {
+        flag_resync(current_sample);
+        return false;
+    }
+    track_leadoff(data, current_sample);
+    return true;
+}
+
+// hand the largest internal RAM block we can spare to the capture buffer,
+// its size sets the maximum burst length
+void setupCapture()
+{
+    const uint32_t caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+    size_t free_size = heap_caps_get_free_size(caps);
+    size_t bytes = heap_caps_get_largest_free_block(caps);
+    if (free_size < CAPTURE_HEAP_RESERVE)
+        bytes = 0;
+    else if (bytes > free_size - CAPTURE_HEAP_RESERVE)
+        bytes = free_size - CAPTURE_HEAP_RESERVE;
+    uint8_t *buffer = (bytes > 0) ? (uint8_t *)heap_caps_malloc(bytes, caps) : NULL;
+    capture.attach(buffer, buffer ? bytes : 0);
+    ESP_LOGI(TAG, "burst capture: %u samples max", capture.capacity()); // logging is off, "burst 0" and "status" report it
+}
+
+// read the sample from the ADS, in bench mode make it up
+static inline void acquire(uint8_t *data, uint32_t sample)
+{
+    if (is_bench)
+        synth.fill(data, sample);
+    else
+        spiRec(data, MP_DATA_SZ);
+}
+
+// on-device processing between spiRec and encoding: artifact flags and
+// channel statistics of the raw codes, the montage, decimation, then the
+// filter bank at the output rate, then the band power ring. The status
+// word stays untouched. Returns false if the raw sample is not to be sent.
+static inline bool process_sample(uint8_t *data, uint32_t sample)
+{
+    if (artifacts_active) // a decimated sample carries the flags of all its inputs
+    {
+        uint32_t start = cycle_count();
+        artifact_bits |= artifact_flags.process(data);
+        average_cycles(artifact_cycles, start);
+    }
+    if (!montage_active && !decimate_enabled && !filter_enabled && !bandpower_enabled && !stats_enabled)
+        return true;
+    uint32_t start = cycle_count();
+    bool send = true;
+    if (stats_enabled)
+    {
+        unpack_channels(data, active_list, num_active_channels);
+        if (channel_stats.push(channel_data, sample))
+            stats_frame_pending = true;
+        average_cycles(stats_cycles, start);
+        send = stats_mode == STATS_AND_RAW;
+        start = cycle_count();
+    }
+    if (montage_active)
+    {
+        montage.apply(data);
+        average_cycles(montage_cycles, start);
+        start = cycle_count();
+    }
+    if (!decimate_enabled && !filter_enabled && !bandpower_enabled)
+        return send;
+    if (montage_active || !stats_enabled) // else channel_data has them already
+        unpack_channels(data, stream_list, stream_channels);
+    if (decimate_enabled)
+    {
+        bool out = decimator.process(channel_data, stream_channels);
+        average_cycles(decimate_cycles, start);
+        if (!out)
+            return false;
+        start = cycle_count();
+    }
+    if (filter_enabled)
+    {
+        filter_bank.process(channel_data, stream_channels);
+        average_cycles(filter_cycles, start);
+    }
+    if (decimate_enabled || filter_enabled)
+        pack_channels(data, stream_list, stream_channels);
+    if (bandpower_enabled)
+    {
+        if (band_power.push(channel_data, sample))
+            xTaskNotifyGive(feature_task_handle); // FFT runs on the other core
+        return send && bandpower_mode == BANDPOWER_AND_RAW;
+    }
+    return send;
+}
+
+// compact in-band frame of type key, sent between samples:
+// MessagePack {"C":200,"<key>":<bin>}, JSON Lines {"C":200,"<key>":"<base64>"},
+// text "<key> <base64 or hex>"
+void send_frame(char key, const uint8_t *payload, uint8_t len)
+{
+    size_t count = 0;
+    switch (protocol_mode)
+    {
+    case MESSAGEPACK_MODE:
+        memcpy(frame_buffer, messagepack_rdatac_header, MP_HEADER_SZ);
+        frame_buffer[6] = key; // replaces the 'D'
+        frame_buffer[MP_HEADER_SZ] = len;
+        memcpy(&frame_buffer[MP_HEADER_SZ + 1], payload, len);
+        count = MP_HEADER_SZ + 1 + len;
+        break;
+    case JSONLINES_MODE:
+        count = sprintf(frame_buffer, "{\"C\":200,\"%c\":\"", key);
+        count += base64_encode(&frame_buffer[count], (char *)payload, len);
+        frame_buffer[count++] = '"';
+        frame_buffer[count++] = '}';
+        frame_buffer[count++] = 0x0a;
+        break;
+    case TEXT_MODE:
+        frame_buffer[count++] = key;
+        frame_buffer[count++] = ' ';
+        if (base64_mode)
+            count += base64_encode(&frame_buffer[count], (char *)payload, len);
+        else
+            count += encode_hex(&frame_buffer[count], (char *)payload, len);
+        frame_buffer[count++] = 0x0a;
+        break;
+    default:
+        return;
+    }
+    uart_write_blocking(frame_buffer, count);
+}
+
+void setupPipeline()
+{
+    pipeline_active = false;
+    while (!process_idle) // let process_task finish the last session
+        vTaskDelay(1);
+    sample_ring.clear();
+    pipeline_overflows = 0;
+    acquire_cycles = 0;
+    process_cycles = 0;
+    pipeline_active = pipeline_enabled;
+}
+
+// everything between the rate being known and the first sample
+void setupStreaming()
+{
+    clearMarkers();
+    link_adjusted = 0; // planLink() may shrink it again
+    link_bytes = 0;
+    setupPipeline();
+    setupMontage();
+    setupDecimator();
+    setupFilter();
+    setupBandPower();
+    setupStats();
+    setupLeadOff();
+    setupQuantizer();
+    setupArtifacts();
+    setupFrames();
+    setupHealth();
+}
+
+// length of a send_frame() frame with len bytes of payload
+static size_t inband_frame_bytes(size_t len)
+{
+    const size_t base64 = (len + 2) / 3 * 4;
+    switch (protocol_mode)
+    {
+    case MESSAGEPACK_MODE:
+        return MP_HEADER_SZ + 1 + len;
+    case JSONLINES_MODE:
+        return 14 + base64 + 3; // {"C":200,"<key>":"..."}\n
+    default:
+        return 2 + (base64_mode ? base64 : 2 * len) + 1;
+    }
+}
+
+// every sample frame layout has a fixed length
+static size_t sample_frame_bytes()
+{
+    char frame[FRAME_MAX_SZ];
+    uint8_t blank[MP_DATA_SZ] = {0};
+    return encode_frame(frame, 0, 0, blank, 0);
+}
+
+// bytes/s the stream puts on the UART as set up, the occasional events aside
+static uint32_t stream_bytes_per_second()
+{
+    uint64_t bytes = 0;
+    if ((!stats_enabled || stats_mode == STATS_AND_RAW) && (!bandpower_enabled || bandpower_mode == BANDPOWER_AND_RAW))
+        bytes += (uint64_t)stream_rate * sample_frame_bytes();
+    if (bandpower_enabled)
+        bytes += (uint64_t)stream_rate * inband_frame_bytes(6 + 4 * band_power.channels() * BP_NUM_BANDS) /
+                 band_power.hopSamples();
+    if (stats_enabled)
+        bytes += (uint64_t)sample_rate * inband_frame_bytes(9 + num_active_channels * sizeof(StatsFrameChannel)) /
+                 channel_stats.window();
+    if (heartbeat_seconds > 0)
+        bytes += inband_frame_bytes(sizeof(heartbeat.bytes)) / heartbeat_seconds;
+    return (uint32_t)bytes;
+}
+
+static inline bool link_fits()
+{
+    return (uint64_t)link_bytes * 100 <= (uint64_t)LINK_CAPACITY * LINK_LOAD_MAX;
+}
+
+// the stream against the UART before it starts, so a rate the protocol can
+// not carry fails at rdatac rather than as TX drops. LINK_ADJUST first
+// leaves the shorted channels out (a montage of the active ones), then the
+// status word, then quantises. Returns false if it does not fit.
+bool planLink()
+{
+    link_bytes = stream_bytes_per_second();
+    if (link_mode == LINK_OFF || link_fits())
+        return true;
+    if (link_mode != LINK_ADJUST)
+        return false;
+    if (!montage_active)
+    {
+        Montage mask;
+        for (int i = 0; i < num_active_channels; i++)
+            mask.addTerm(i, active_list[i] - 1, 1);
+        if (mask.wireChannels() < frame_channels())
+        {
+            useMontage(mask);
+            link_adjusted |= LINK_MASKED;
+            setupQuantizer();
+            setupFrames();
+            link_bytes = stream_bytes_per_second();
+        }
+    }
+    if (!link_fits() && !drop_status)
+    {
+        link_adjusted |= LINK_NO_STATUS;
+        setupFrames();
+        link_bytes = stream_bytes_per_second();
+    }
+    if (!link_fits() && !quantize_active)
+    {
+        link_adjusted |= LINK_QUANTIZED;
+        setupQuantizer();
+        setupFrames();
+        link_bytes = stream_bytes_per_second();
+    }
+    return link_fits();
+}
+
+// 'M' frames for the markers queued since the last call
+static inline void send_markers()
+{
+    if (marker_waiting)
+    {
+        MarkerEvent marker;
+        marker_waiting = false;
+        while (xQueueReceive(marker_queue, &marker, 0) == pdTRUE)
+            send_frame(MARKER_FRAME_KEY, (const uint8_t *)&marker, sizeof(marker));
+    }
+}
+
+// captured records, from record first on, as 'K' frames: uint16 index of the
+// first record, uint16 number of records captured, up to
+// CAPTURE_RECORDS_PER_FRAME records, CRC-32 of all that
+void drainCapture(uint32_t first)
+{
+    static uint8_t payload[4 + CAPTURE_RECORDS_PER_FRAME * CAPTURE_RECORD_SZ + 4];
+    const uint16_t total = capture.size();
+    for (uint32_t i = first; i < total; i += CAPTURE_RECORDS_PER_FRAME)
+    {
+        uint16_t index = i;
+        uint32_t n = total - i;
+        if (n > CAPTURE_RECORDS_PER_FRAME)
+            n = CAPTURE_RECORDS_PER_FRAME;
+        memcpy(payload, &index, 2);
+        memcpy(&payload[2], &total, 2);
+        for (uint32_t k = 0; k < n; k++) // the ring may wrap
+            memcpy(&payload[4 + k * CAPTURE_RECORD_SZ], capture.record(i + k), CAPTURE_RECORD_SZ);
+        size_t len = 4 + n * CAPTURE_RECORD_SZ;
+        uint32_t crc = crc32_update(0, payload, len);
+        memcpy(&payload[len], &crc, 4);
+        send_frame(CAPTURE_FRAME_KEY, payload, len + 4);
+    }
+}
+
+// called by the rdatac task with the last record in
+void finishBurst()
+{
+    using namespace ADS129x;
+    is_rdatac = false;
+    capture_mode = CAPTURE_OFF;
+    bench_stop();
+    adcSendCommand(SDATAC);
+    drainCapture(0);
+    send_markers(); // their sample numbers place them among the records
+}
+
+// arm for the next trigger, true if the windows fit the capture buffer
+bool armTrigger()
+{
+    trigger_pending = false;
+    trigger_above = true; // the level has to be crossed, not just exceeded
+    return capture.startRing(trigger_pre, trigger_post);
+}
+
+// evaluated for every sample while armed
+static inline bool trigger_hit(const uint8_t *data)
+{
+    if (trigger_source == TRIGGER_GPIO)
+    {
+        bool hit = trigger_pending;
+        trigger_pending = false;
+        return hit;
+    }
+    const uint8_t *p = &data[3 * trigger_channel];
+    int32_t v = (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8)) >> 8;
+    bool above = (v >= trigger_level) || (v <= -trigger_level);
+    bool hit = above && !trigger_above;
+    trigger_above = above;
+    return hit;
+}
+
+// one sample into the capture buffer; a complete burst is drained and
+// ends rdatac, a complete trigger window is drained and the next one armed
+static inline void capture_sample()
+{
+    uint32_t sample = current_sample;
+    uint8_t *data = capture.next(sample);
+    acquire(data, sample);
+    if (capture_mode == CAPTURE_TRIGGER && !capture.triggered() && trigger_hit(data))
+        capture.trigger();
+    if (!capture.full())
+        return;
+    if (capture_mode == CAPTURE_BURST)
+    {
+        finishBurst();
+        return;
+    }
+    drainCapture(0); // samples arriving meanwhile count as collisions
+    send_markers();
+    armTrigger();
+}
+
+// one sample into the impedance detector, the last one ends rdatac
+static inline void impedance_sample()
+{
+    using namespace ADS129x;
+    acquire(sample_data, current_sample);
+    if (!validate_status(sample_data))
+        return;
+    unpack_channels(sample_data, active_list, num_active_channels);
+    if (!impedance_meter.push(channel_data))
+        return;
+    is_rdatac = false;
+    capture_mode = CAPTURE_OFF;
+    adcSendCommand(SDATAC);
+    impedance_done = true;
+}
+
+void sendHeartbeat()
+{
+    heartbeat.data_fields.sample = current_sample;
+    heartbeat.data_fields.drdy_collisions = drdy_collisions;
+    heartbeat.data_fields.tx_drops = uart_tx_drops;
+    heartbeat.data_fields.resyncs = status_errors;
+    heartbeat.data_fields.wake_latency_max = wake_latency_max;
+    heartbeat.data_fields.tx_fifo_max = uart_tx_fifo_max;
+    send_frame(HEARTBEAT_FRAME_KEY, heartbeat.bytes, sizeof(heartbeat.bytes));
+}
+
+// last complete stats window as an 'S' frame: uint32 sample #, uint8
+// channels, uint32 window, then per channel float mean, float rms, int32
+// min, int32 max, uint16 clipped
+void sendStatsFrame()
+{
+    ChannelStatsResult results[STATS_MAX_CHANNELS];
+    uint32_t end;
+    if (!channel_stats.read(results, &end))
+        return;
+    const uint8_t channels = channel_stats.channels();
+    stats_frame.data_fields.sample = end;
+    stats_frame.data_fields.channels = channels;
+    stats_frame.data_fields.window = channel_stats.window();
+    for (uint8_t ch = 0; ch < channels; ch++)
+    {
+        StatsFrameChannel c; // frame is packed, fields unaligned
+        c.mean = results[ch].mean;
+        c.rms = results[ch].rms;
+        c.min = results[ch].min;
+        c.max = results[ch].max;
+        c.clipped = results[ch].clipped > 0xffff ? 0xffff : results[ch].clipped;
+        memcpy(&stats_frame.data_fields.channel[ch], &c, sizeof(c));
+    }
+    send_frame(STATS_FRAME_KEY, stats_frame.bytes, 9 + channels * sizeof(StatsFrameChannel));
+}
+
+void send_response(int status_code, const char *status_text)
+{
+    switch (protocol_mode)
+    {
+    case TEXT_MODE:
+        printf("%d %s\n", status_code, status_text);
+        break;
+    case JSONLINES_MODE:
+        jsonCommand.sendJsonLinesResponse(status_code, (char *)status_text);
+        break;
+    case MESSAGEPACK_MODE:
+        // all responses are in JSON Lines, MessagePack mode is only for sending samples
+        jsonCommand.sendJsonLinesResponse(status_code, (char *)status_text);
+        break;
+    default:
+        // unknown protocol
+        ;
+    }
+}
+
+void send_response_ok()
+{
+    send_response(RESPONSE_OK, STATUS_TEXT_OK);
+}
+
+void send_response_error()
+{
+    send_response(RESPONSE_ERROR, STATUS_TEXT_ERROR);
+}
+
+// This gets set as the default handler, and gets called when no other command matches.
+void unrecognized(const char *command)
+{
+    //Serial.println("406 Error: Unrecognized command.");
+    //Serial.println();
+    printf("406 Error: Unrecognized command.\n");
+    ESP_LOGI(TAG, "%s\n", command);
+}
+// This gets set as the default handler for jsonlines and messagepack, and gets called when no other command matches.
+void unrecognizedJsonLines(const char *command)
+{
+    /*StaticJsonDocument<1024> doc;
+    JsonObject root = doc.to<JsonObject>();
+    root[STATUS_CODE_KEY] = UNRECOGNIZED_COMMAND;
+    root[STATUS_TEXT_KEY] = "Unrecognized command";
+    jsonCommand.sendJsonLinesDocResponse(doc);*/
+
+    cJSON *root;
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(RESPONSE_UNRECOGNIZED_COMMAND));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString("Unrecognized command"));
+
+    /*char* text = cJSON_Print(root);
+    printf("%s\n", text);
+    free(text);
+    cJSON_Delete(root);*/
+    jsonCommand.sendJsonLinesDocResponse(root); //als Alternative
+}
+
+void adsSetup()
+{ //default settings for ADS1298 and compatible chips
+    using namespace ADS129x;
+    // Send SDATAC Command (Stop Read Data Continuously mode)
+    //spi_data_available = 0;
+
+    current_sample = 0;
+    handling_data = false;
+
+    adcSendCommand(SDATAC);
+    ESP_LOGI(TAG, "sent SDATAC");
+    //vTaskDelay(100 / portTICK_PERIOD_MS);
+    //ets_delay_us(2);
+    //delay(100);
+    uint8_t val = adcRreg(ID);
+    ESP_LOGI(TAG, "ID = %d", val);
+    switch (val & DEV_ID_MASK)
+    {
+    case (DEV_ID_MASK_129x | ID_4CHAN):
+        hardware_type = "ADS1294";
+        max_channels = 4;
+        break;
+    //case B10001:
+    case (DEV_ID_MASK_129x | ID_6CHAN):
+        hardware_type = "ADS1296";
+        max_channels = 6;
+        break;
+    //case B10010:
+    case (DEV_ID_MASK_129x | ID_8CHAN):
+        hardware_type = "ADS1298";
+        max_channels = 8;
+        break;
+    //case B11110:
+    case (DEV_ID_MASK_1299 | ID_8CHAN):
+        hardware_type = "ADS1299";
+        max_channels = 8;
+        break;
+    //case B11100:
+    case (DEV_ID_MASK_1299 | ID_4CHAN):
+        hardware_type = "ADS1299-4";
+        max_channels = 4;
+        break;
+    //case B11101:
+    case (DEV_ID_MASK_1299 | ID_6CHAN):
+        hardware_type = "ADS1299-6";
+        max_channels = 6;
+        break;
+    default:
+        max_channels = 0;
+    }
+    if (max_channels == 0)
+    { //error mode
+        while (1)
+        {
+            gpio_set_level(LED_PIN, 1);
+            vTaskDelay(500 / portTICK_PERIOD_MS);
+            gpio_set_level(LED_PIN, 0);
+            vTaskDelay(500 / portTICK_PERIOD_MS);
+        }
+    } //error mode
+
+    // All GPIO set to output 0x0000: (floating CMOS inputs can flicker on and off, creating noise)
+    adcWreg(ADS_GPIO, 0);
+    adcWreg(CONFIG3, PD_REFBUF | CONFIG3_const);
+    //gpio_set_level(START_PIN, 1); //Hmmm not sure ??? should be L to use commands ...
+    //gpio_set_level(START_PIN, 0); //L to use commands ...
+}
+
+void nopCommand(unsigned char unused1, unsigned char unused2)
+{
+    send_response_ok();
+}
+
+void microsCommand(unsigned char unused1, unsigned char unused2)
+{
+    int64_t microseconds = esp_timer_get_time();
+    if (protocol_mode == TEXT_MODE)
+    {
+        send_response_ok();
+        printf("%" PRId64 "\n", microseconds);
+        return;
+    }
+
+    cJSON *root;
+    ESP_LOGI(TAG, "Main Free Heap before root %d", esp_get_free_heap_size());
+    root = cJSON_CreateObject();
+    ESP_LOGI(TAG, "Main Free Heap after root %d", esp_get_free_heap_size());
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
+    cJSON_AddItemToObject(root, DATA_KEY, cJSON_CreateNumber(microseconds));
+
+    switch (protocol_mode)
+    {
+    case JSONLINES_MODE:
+    case MESSAGEPACK_MODE:
+        ESP_LOGI(TAG, "Main Free Heap before sendJsonLinesDocResponse %d", esp_get_free_heap_size());
+        jsonCommand.sendJsonLinesDocResponse(root);
+        break;
+    default:
+        // unknown protocol
+        ;
+    }
+}
+void versionCommand(unsigned char unused1, unsigned char unused2)
+{
+    send_response(RESPONSE_OK, driver_version);
+}
+
+void statusCommand(unsigned char unused1, unsigned char unused2)
+{
+    detectActiveChannels();
+    if (protocol_mode == TEXT_MODE)
+    {
+        printf("200 Ok\n");
+        printf("Driver version: %s\n", driver_version);
+        printf("Board name: %s\n", board_name);
+        printf("Board maker: %s\n", maker_name);
+        printf("Hardware type: %s\n", hardware_type);
+        printf("Max channels: %d\n", max_channels);
+        printf("Number of active channels: %d\n", num_active_channels);
+        printf("Sample rate: %d%s\n", sample_rate, is_bench ? " (bench)" : "");
+        printf("Stream rate: %d\n", stream_rate);
+        printf("Burst capacity: %u\n", capture.capacity());
+        printf("Boot ready (ms): %d first sample (ms): %d\n", (int)(boot_ready_us / 1000), (int)(first_sample_us / 1000));
+        printf("Decimation: %d\n", decimate_enabled ? decimate_ratio : 1);
+        printf("Decimate cycles/sample: %u\n", decimate_cycles);
+        printf("Band power mode: %d frames/s: %.2f\n", bandpower_mode, bandpower_frame_rate());
+        printf("Band power cycles/frame: %u\n", bandpower_cycles);
+        printf("Stats mode: %d window (ms): %d samples: %u clipped: %u cycles/sample: %u\n", stats_mode,
+               stats_window_ms, channel_stats.window(), channel_stats.clipped(), stats_cycles);
+        printf("Status word errors / resyncs: %u\n", status_errors);
+        printf("DRDY collisions: %u\n", drdy_collisions);
+        printf("TX drops: %u\n", uart_tx_drops);
+        printf("TX FIFO high-water: %u\n", uart_tx_fifo_max);
+        printf("Wake latency max (cycles): %u\n", wake_latency_max);
+        printf("Quantize: %d shift: %d clipped: %u cycles/sample: %u\n", quantize_enabled, quantize_shift, quantizer.clipped(), quantize_cycles);
+        printf("Artifacts: %d step: %d flagged: %u cycles/sample: %u\n", artifacts_enabled, artifact_step, artifact_flags.flagged(), artifact_cycles);
+        printf("Montage outputs: %d terms: %d cycles/sample: %u\n", montage_setting.outputs(), montage_setting.terms(), montage_cycles);
+        printf("Link mode: %d bytes/s: %u of %u adjusted: %#x\n", link_mode, link_bytes, LINK_CAPACITY, link_adjusted);
+        printf("Pipeline: %d overflows: %u ring high-water: %u\n", pipeline_active, pipeline_overflows, sample_ring.highWater());
+        printf("Cycles/sample acquire: %u process: %u budget: %u\n", acquire_cycles, process_cycles,
+               sample_rate ? CPU_HZ / sample_rate : 0);
+        printf("LOFF_STATP: %#x LOFF_STATN: %#x\n", leadoff_state >> 8, leadoff_state & 0xff);
+        printf("Filter stages: %d\n", filter_bank.stages());
+        printf("Filter cycles/sample: %u\n\n", filter_cycles);
+        return;
+    }
+
+    cJSON *root, *cj_data;
+    ESP_LOGI(TAG, "Main Free Heap before root %d", esp_get_free_heap_size());
+    root = cJSON_CreateObject();
+    ESP_LOGI(TAG, "Main Free Heap after root %d", esp_get_free_heap_size());
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
+    cJSON_AddItemToObject(root, DATA_KEY, cj_data = cJSON_CreateObject());
+    cJSON_AddStringToObject(cj_data, "driver_version", driver_version);
+    cJSON_AddStringToObject(cj_data, "board_name", board_name);
+    cJSON_AddStringToObject(cj_data, "maker_name", maker_name);
+    cJSON_AddStringToObject(cj_data, "hardware_type", hardware_type);
+    cJSON_AddNumberToObject(cj_data, "max_channels", max_channels);
+    cJSON_AddNumberToObject(cj_data, "active_channels", num_active_channels);
+    cJSON_AddNumberToObject(cj_data, "sample_rate", sample_rate);
+    cJSON_AddBoolToObject(cj_data, "bench", is_bench);
+    cJSON_AddNumberToObject(cj_data, "burst_capacity", capture.capacity());
+    cJSON_AddNumberToObject(cj_data, "boot_ready_ms", boot_ready_us / 1000);
+    cJSON_AddNumberToObject(cj_data, "first_sample_ms", first_sample_us / 1000);
+    cJSON_AddNumberToObject(cj_data, "stream_rate", stream_rate);
+    cJSON_AddNumberToObject(cj_data, "decimation", decimate_enabled ? decimate_ratio : 1);
+    cJSON_AddNumberToObject(cj_data, "decimate_cycles", decimate_cycles);
+    cJSON_AddNumberToObject(cj_data, "bandpower_mode", bandpower_mode);
+    cJSON_AddNumberToObject(cj_data, "bandpower_rate", bandpower_frame_rate());
+    cJSON_AddNumberToObject(cj_data, "bandpower_cycles", bandpower_cycles);
+    cJSON_AddNumberToObject(cj_data, "stats_mode", stats_mode);
+    cJSON_AddNumberToObject(cj_data, "stats_window_ms", stats_window_ms);
+    cJSON_AddNumberToObject(cj_data, "stats_window", channel_stats.window());
+    cJSON_AddNumberToObject(cj_data, "stats_clipped", channel_stats.clipped());
+    cJSON_AddNumberToObject(cj_data, "stats_cycles", stats_cycles);
+    cJSON_AddNumberToObject(cj_data, "status_errors", status_errors);
+    cJSON_AddNumberToObject(cj_data, "drdy_collisions", drdy_collisions);
+    cJSON_AddNumberToObject(cj_data, "tx_drops", uart_tx_drops);
+    cJSON_AddNumberToObject(cj_data, "tx_fifo_max", uart_tx_fifo_max);
+    cJSON_AddNumberToObject(cj_data, "wake_latency_max", wake_latency_max);
+    cJSON_AddBoolToObject(cj_data, "quantize", quantize_enabled);
+    cJSON_AddNumberToObject(cj_data, "quantize_shift", quantize_shift);
+    cJSON_AddNumberToObject(cj_data, "quantize_clipped", quantizer.clipped());
+    cJSON_AddNumberToObject(cj_data, "quantize_cycles", quantize_cycles);
+    cJSON_AddBoolToObject(cj_data, "artifacts", artifacts_enabled);
+    cJSON_AddNumberToObject(cj_data, "artifact_step", artifact_step);
+    cJSON_AddNumberToObject(cj_data, "artifact_flagged", artifact_flags.flagged());
+    cJSON_AddNumberToObject(cj_data, "artifact_cycles", artifact_cycles);
+    cJSON_AddNumberToObject(cj_data, "montage_outputs", montage_setting.outputs());
+    cJSON_AddNumberToObject(cj_data, "montage_terms", montage_setting.terms());
+    cJSON_AddNumberToObject(cj_data, "montage_cycles", montage_cycles);
+    cJSON_AddNumberToObject(cj_data, "link_mode", link_mode);
+    cJSON_AddNumberToObject(cj_data, "link_bytes", link_bytes);
+    cJSON_AddNumberToObject(cj_data, "link_capacity", LINK_CAPACITY);
+    cJSON_AddNumberToObject(cj_data, "link_adjusted", link_adjusted);
+    cJSON_AddBoolToObject(cj_data, "pipeline", pipeline_active);
+    cJSON_AddNumberToObject(cj_data, "pipeline_overflows", pipeline_overflows);
+    cJSON_AddNumberToObject(cj_data, "pipeline_high_water", sample_ring.highWater());
+    cJSON_AddNumberToObject(cj_data, "acquire_cycles", acquire_cycles);
+    cJSON_AddNumberToObject(cj_data, "process_cycles", process_cycles);
+    cJSON_AddNumberToObject(cj_data, "cycle_budget", sample_rate ? CPU_HZ / sample_rate : 0);
+    cJSON_AddNumberToObject(cj_data, "loff_statp", leadoff_state >> 8);
+    cJSON_AddNumberToObject(cj_data, "loff_statn", leadoff_state & 0xff);
+    cJSON_AddNumberToObject(cj_data, "filter_stages", filter_bank.stages());
+    cJSON_AddNumberToObject(cj_data, "filter_cycles", filter_cycles);
+
+    switch (protocol_mode)
+    {
+    case JSONLINES_MODE:
+    case MESSAGEPACK_MODE:
+        jsonCommand.sendJsonLinesDocResponse(root);
+        break;
+    default:
+        // unknown protocol
+        ;
+    }
+}
+
+void serialNumberCommand(unsigned char unused1, unsigned char unused2)
+{
+    send_response(RESPONSE_NOT_IMPLEMENTED, STATUS_TEXT_NOT_IMPLEMENTED);
+}
+
+void textCommand(unsigned char unused1, unsigned char unused2)
+{
+    protocol_mode = TEXT_MODE;
+    setupFrames();
+    send_response_ok();
+}
+
+void jsonlinesCommand(unsigned char unused1, unsigned char unused2)
+{
+    protocol_mode = JSONLINES_MODE;
+    setupFrames();
+    send_response_ok();
+}
+
+void messagepackCommand(unsigned char unused1, unsigned char unused2)
+{
+    protocol_mode = MESSAGEPACK_MODE;
+    setupFrames();
+    send_response_ok();
+}
+
+void ledOnCommand(unsigned char unused1, unsigned char unused2)
+{
+    gpio_set_level(LED_PIN, 1);
+    send_response_ok();
+}
+
+void ledOffCommand(unsigned char unused1, unsigned char unused2)
+{
+    gpio_set_level(LED_PIN, 0);
+    send_response_ok();
+}
+
+void boardLedOnCommand(unsigned char unused1, unsigned char unused2)
+{
+    uint8_t state = adcRreg(ADS129x::ADS_GPIO);
+    //state = state & 0xF7; --> was all done for GPIO4 we now use GPIO1
+    state = state & ~ADS129x::GPIO_bits::GPIOC1; //set pin to OUTPUT
+    //state = state | 0x80;
+    state = state | ADS129x::GPIO_bits::GPIOD1; //set GPIO Pin
+
+    adcWreg(ADS129x::ADS_GPIO, state);
+
+    send_response_ok();
+}
+
+void boardLedOffCommand(unsigned char unused1, unsigned char unused2)
+{
+    uint8_t state = adcRreg(ADS129x::ADS_GPIO);
+    ESP_LOGI(TAG, "State after read %#x", state);
+    //state = state & 0x77;
+    state = state & ~(ADS129x::GPIO_bits::GPIOC1 | ADS129x::GPIO_bits::GPIOD1);
+    ESP_LOGI(TAG, "State before write %#x", state);
+    adcWreg(ADS129x::ADS_GPIO, state);
+
+    send_response_ok();
+}
+
+void wakeupCommand(unsigned char unused1, unsigned char unused2)
+{
+    using namespace ADS129x;
+    adcSendCommand(WAKEUP);
+    send_response_ok();
+}
+
+void standbyCommand(unsigned char unused1, unsigned char unused2)
+{
+    using namespace ADS129x;
+    adcSendCommand(STANDBY);
+    send_response_ok();
+}
+
+void resetCommand(unsigned char unused1, unsigned char unused2)
+{
+    using namespace ADS129x;
+    adcSendCommand(RESET);
+    vTaskDelay(150 / portTICK_PERIOD_MS); //now wait 2^18 tCLK = 128ms
+    adsSetup();
+    send_response_ok();
+}
+
+void startCommand(unsigned char unused1, unsigned char unused2)
+{
+    using namespace ADS129x;
+    adcSendCommand(START);
+    current_sample = 0;
+    send_response_ok();
+}
+
+void stopCommand(unsigned char unused1, unsigned char unused2)
+{
+    using namespace ADS129x;
+    adcSendCommand(STOP);
+    send_response_ok();
+}
+
+// everything rdatac does up to arming the ISR, returns the response code
+int prepareRdatac()
+{
+    using namespace ADS129x;
+    detectActiveChannels();
+    if (num_active_channels < 1)
+        return RESPONSE_NO_ACTIVE_CHANNELS;
+    detectSampleRate();
+    setupStreaming();
+    if (trigger_source != TRIGGER_OFF)
+    {
+        if (!armTrigger())
+            return RESPONSE_BAD_REQUEST;
+        capture_mode = CAPTURE_TRIGGER;
+    }
+    else
+    {
+        capture_mode = CAPTURE_OFF;
+        if (!planLink())
+            return RESPONSE_LINK_OVERLOAD;
+    }
+    adcSendCommand(RDATAC);
+    return RESPONSE_OK;
+}
+
+void armRdatac()
+{
+    handling_data = false; //fresh start
+    current_sample = 0;    //here or whe start commad is issued?
+    is_rdatac = true;      //now ISR is armed ...
+}
+
+// the link plan: bytes/s of the stream, the UART's, the load in percent and
+// the LINK_* adjustments made
+void sendLinkResponse(int status_code, const char *status_text)
+{
+    const uint32_t permille = (uint64_t)link_bytes * 1000 / LINK_CAPACITY;
+    if (protocol_mode == TEXT_MODE)
+    {
+        printf("%d %s\nLink bytes/s: %u of %u (%u.%u%%) adjusted: %#x\n\n", status_code, status_text, link_bytes,
+               LINK_CAPACITY, permille / 10, permille % 10, link_adjusted);
+        return;
+    }
+
+    cJSON *root, *cj_data;
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(status_code));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(status_text));
+    cJSON_AddItemToObject(root, DATA_KEY, cj_data = cJSON_CreateObject());
+    cJSON_AddNumberToObject(cj_data, "link_bytes", link_bytes);
+    cJSON_AddNumberToObject(cj_data, "link_capacity", LINK_CAPACITY);
+    cJSON_AddNumberToObject(cj_data, "link_load", permille / 10.0);
+    cJSON_AddNumberToObject(cj_data, "link_adjusted", link_adjusted);
+    jsonCommand.sendJsonLinesDocResponse(root);
+}
+
+void rdatacCommand(unsigned char unused1, unsigned char unused2)
+{
+    switch (prepareRdatac())
+    {
+    case RESPONSE_OK:
+        if (capture_mode == CAPTURE_OFF)
+            sendLinkResponse(RESPONSE_OK, STATUS_TEXT_OK);
+        else
+            send_response_ok();
+        armRdatac();
+        break;
+    case RESPONSE_LINK_OVERLOAD:
+        sendLinkResponse(RESPONSE_LINK_OVERLOAD, STATUS_TEXT_LINK_OVERLOAD);
+        break;
+    case RESPONSE_NO_ACTIVE_CHANNELS:
+        send_response(RESPONSE_NO_ACTIVE_CHANNELS, STATUS_TEXT_NO_ACTIVE_CHANNELS);
+        break;
+    default:
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+    }
+}
+
+void rdataCommand(unsigned char unused1, unsigned char unused2)
+{
+    using namespace ADS129x;
+    detectActiveChannels();
+    if (num_active_channels > 0)
+    {
+        send_response_ok();
+        handling_data = false; //fresh start
+        current_sample = 0;    //here or whe start commad is issued?
+        is_rdata = true;       //now ISR is armed ...
+    }
+    else
+    {
+        send_response(RESPONSE_NO_ACTIVE_CHANNELS, STATUS_TEXT_NO_ACTIVE_CHANNELS);
+    }
+}
+
+void sdatacCommand(unsigned char unused1, unsigned char unused2)
+{
+    using namespace ADS129x;
+    is_rdatac = false;
+    capture_mode = CAPTURE_OFF;
+    bench_stop();
+    adcSendCommand(SDATAC);
+    using namespace ADS129x;
+    send_response_ok();
+}
+
+/*void rdataCommand(unsigned char unused1, unsigned char unused2) // TBD
+{
+    using namespace ADS129x;
+    while (gpio_get_level(DRDY_PIN) == 1)
+        ; //wdt kicks in ...
+    adcSendCommand(RDATA);
+    if (protocol_mode == TEXT_MODE)
+    {
+        send_response_ok();
+    }
+    //send_sample(); TBD --> not implemented ...
+
+}
+*/
+void readRegisterCommand(unsigned char unused1, unsigned char unused2)
+{
+    using namespace ADS129x;
+    char *arg1;
+    arg1 = serialCommand.next();
+    if (arg1 != NULL)
+    {
+        int registerNumber = hex_to_long(arg1);
+        //if (registerNumber >= 0)
+        if (registerNumber >= 0x00 && registerNumber <= 0xff)
+        {
+            int result = adcRreg(registerNumber);
+            printf("200 Ok (Read Register %#x)\n%#x\n", registerNumber, result);
+        }
+        else
+        {
+            printf("402 Error: expected hexidecimal digits.\n");
+        }
+    }
+    else
+    {
+        printf("403 Error: register argument missing.\n");
+    }
+    printf("\n");
+}
+
+void writeRegisterCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    if (arg1 != NULL)
+    {
+        if (arg2 != NULL)
+        {
+            int registerNumber = hex_to_long(arg1);
+            int registerValue = hex_to_long(arg2);
+            if (registerNumber >= 0 && registerValue >= 0)
+            {
+                adcWreg(registerNumber, registerValue);
+                printf("200 Ok (Write Register %#x %#x)\n", registerNumber, registerValue);
+            }
+            else
+            {
+                printf("402 Error: expected hexadecimal digits.\n");
+            }
+        }
+        else
+        {
+            printf("404 Error: value argument missing.\n");
+        }
+    }
+    else
+    {
+        printf("403 Error: register argument missing.\n");
+    }
+    printf("\n");
+}
+
+void readRegisterCommandDirect(unsigned char register_number, unsigned char unused1)
+{
+    using namespace ADS129x;
+    /*   if (register_number >= 0 and register_number <= 255)
+    // this needs to checked in JSON decoding !!!
+    {
+     */
+    unsigned char result = adcRreg(register_number);
+    cJSON *root;
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
+    cJSON_AddItemToObject(root, DATA_KEY, cJSON_CreateNumber(result));
+    jsonCommand.sendJsonLinesDocResponse(root);
+    /* }
+    else
+    {
+        send_response_error();
+    } */
+}
+
+void writeRegisterCommandDirect(unsigned char register_number, unsigned char register_value)
+{
+    /*    if (register_number >= 0 && register_value >= 0)
+    // this needs to checked in JSON decoding !!!
+    {  */
+    adcWreg(register_number, register_value);
+    send_response_ok();
+    /*}
+    else
+    {
+        send_response_error();
+    }*/
+}
+
+void setFilter(int notch_hz, int highpass)
+{
+    if ((notch_hz != 0 && notch_hz != 50 && notch_hz != 60) || highpass < 0 || highpass > 0xff)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    filter_notch_hz = notch_hz;
+    filter_highpass = highpass;
+    // the coefficients get designed for the current data rate when rdatac starts
+    send_response_ok();
+}
+
+void filterCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    int notch_hz = (arg1 != NULL) ? atoi(arg1) : 0;
+    int highpass = (arg2 != NULL) ? atoi(arg2) : 0;
+    setFilter(notch_hz, highpass);
+}
+
+void filterCommandDirect(unsigned char notch_hz, unsigned char highpass)
+{
+    setFilter(notch_hz, highpass);
+}
+
+void setDecimation(int ratio)
+{
+    if (ratio == 1)
+        ratio = 0;
+    if (ratio != 0 && (ratio < DECIM_MIN_RATIO || ratio > DECIM_MAX_RATIO || (ratio & 1)))
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    decimate_ratio = ratio;
+    // the FIR gets designed when rdatac starts
+    send_response_ok();
+}
+
+void decimateCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1;
+    arg1 = serialCommand.next();
+    setDecimation((arg1 != NULL) ? atoi(arg1) : 0);
+}
+
+void decimateCommandDirect(unsigned char ratio, unsigned char unused1)
+{
+    setDecimation(ratio);
+}
+
+void setBandPower(int mode, int rate)
+{
+    if (mode < BANDPOWER_OFF || mode > BANDPOWER_AND_RAW || rate < 1 || rate > 50)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    bandpower_mode = mode;
+    bandpower_rate = rate;
+    send_response_ok();
+}
+
+void bandpowerCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setBandPower((arg1 != NULL) ? atoi(arg1) : BANDPOWER_OFF, (arg2 != NULL) ? atoi(arg2) : 10);
+}
+
+void bandpowerCommandDirect(unsigned char mode, unsigned char rate)
+{
+    setBandPower(mode, rate ? rate : 10);
+}
+
+// last complete window of the current (or last) session
+void sendStatsReport()
+{
+    ChannelStatsResult results[STATS_MAX_CHANNELS];
+    uint32_t end = 0;
+    const bool have = channel_stats.read(results, &end);
+    const uint8_t channels = have ? channel_stats.channels() : 0;
+
+    if (protocol_mode == TEXT_MODE)
+    {
+        printf("200 Ok\n");
+        printf("Stats window: %u samples, last sample: %u, windows: %u, clipped: %u\n", channel_stats.window(), end,
+               channel_stats.windows(), channel_stats.clipped());
+        for (uint8_t i = 0; i < channels; i++)
+            printf("ch%d mean %.1f rms %.2f min %d max %d clipped %u\n", active_list[i], results[i].mean,
+                   results[i].rms, results[i].min, results[i].max, results[i].clipped);
+        printf("\n");
+        return;
+    }
+
+    cJSON *root, *cj_data, *cj_channels, *cj_ch;
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
+    cJSON_AddItemToObject(root, DATA_KEY, cj_data = cJSON_CreateObject());
+    cJSON_AddNumberToObject(cj_data, "window", channel_stats.window());
+    cJSON_AddNumberToObject(cj_data, "sample", end);
+    cJSON_AddNumberToObject(cj_data, "windows", channel_stats.windows());
+    cJSON_AddNumberToObject(cj_data, "clipped", channel_stats.clipped());
+    cJSON_AddItemToObject(cj_data, "channels", cj_channels = cJSON_CreateArray());
+    for (uint8_t i = 0; i < channels; i++)
+    {
+        cJSON_AddItemToArray(cj_channels, cj_ch = cJSON_CreateObject());
+        cJSON_AddNumberToObject(cj_ch, "channel", active_list[i]);
+        cJSON_AddNumberToObject(cj_ch, "mean", results[i].mean);
+        cJSON_AddNumberToObject(cj_ch, "rms", results[i].rms);
+        cJSON_AddNumberToObject(cj_ch, "min", results[i].min);
+        cJSON_AddNumberToObject(cj_ch, "max", results[i].max);
+        cJSON_AddNumberToObject(cj_ch, "clipped", results[i].clipped);
+    }
+    jsonCommand.sendJsonLinesDocResponse(root);
+}
+
+// mode and window apply from the next rdatac on, a report works any time
+void setStats(int mode, int window_ms)
+{
+    if (mode == STATS_REPORT)
+    {
+        sendStatsReport();
+        return;
+    }
+    const uint32_t window = (uint32_t)sample_rate * window_ms / 1000; // at the current rate
+    if (mode < STATS_OFF || mode > STATS_AND_RAW || window_ms < 10 || window_ms > 25500 ||
+        (sample_rate > 0 && (window < STATS_MIN_WINDOW || window > STATS_MAX_WINDOW)))
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    stats_mode = mode;
+    stats_window_ms = window_ms;
+    send_response_ok();
+}
+
+void statsCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setStats((arg1 != NULL) ? atoi(arg1) : STATS_REPORT, (arg2 != NULL) ? atoi(arg2) : 1000);
+}
+
+// no mode reports, as the text command
+void statsCommandDirect(unsigned char mode, unsigned char window)
+{
+    setStats(jsonCommand.parameters() > 0 ? mode : STATS_REPORT, window ? window * 100 : 1000);
+}
+
+void setLeadOff(int events, int no_status)
+{
+    leadoff_events = (events != 0);
+    drop_status = (no_status != 0);
+    send_response_ok();
+}
+
+void leadoffCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setLeadOff((arg1 != NULL) ? atoi(arg1) : 0, (arg2 != NULL) ? atoi(arg2) : 0);
+}
+
+void leadoffCommandDirect(unsigned char events, unsigned char no_status)
+{
+    setLeadOff(events, no_status);
+}
+
+void sendTraceReport()
+{
+    const char *names[TRACE_NUM_STAGES] = {"wake", "spi", "encode", "queued"};
+    TraceStats st[TRACE_NUM_STAGES];
+    bool was_enabled = trace.enabled();
+    trace.enable(false); // consistent snapshot
+    for (int s = 0; s < TRACE_NUM_STAGES; s++)
+        trace.stats(s, st[s]);
+    trace.enable(was_enabled);
+
+    if (protocol_mode == TEXT_MODE)
+    {
+        printf("200 Ok\n");
+        printf("Trace records: %d (cycles since DRDY)\n", trace.size());
+        for (int s = 0; s < TRACE_NUM_STAGES; s++)
+            printf("%-7s n %3d min %6u avg %6u p99 %6u max %6u\n", names[s], st[s].count,
+                   st[s].min, st[s].avg, st[s].p99, st[s].max);
+        printf("\n");
+        return;
+    }
+
+    cJSON *root, *cj_data, *cj_stage;
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
+    cJSON_AddItemToObject(root, DATA_KEY, cj_data = cJSON_CreateObject());
+    cJSON_AddNumberToObject(cj_data, "records", trace.size());
+    for (int s = 0; s < TRACE_NUM_STAGES; s++)
+    {
+        cJSON_AddItemToObject(cj_data, names[s], cj_stage = cJSON_CreateObject());
+        cJSON_AddNumberToObject(cj_stage, "count", st[s].count);
+        cJSON_AddNumberToObject(cj_stage, "min", st[s].min);
+        cJSON_AddNumberToObject(cj_stage, "avg", st[s].avg);
+        cJSON_AddNumberToObject(cj_stage, "p99", st[s].p99);
+        cJSON_AddNumberToObject(cj_stage, "max", st[s].max);
+    }
+    jsonCommand.sendJsonLinesDocResponse(root);
+}
+
+// raw records, oldest first, as 'T' frames: uint16 index of the first
+// record followed by up to TRACE_RECORDS_PER_FRAME TraceRecords
+void sendTraceDump()
+{
+    static uint8_t payload[2 + TRACE_RECORDS_PER_FRAME * sizeof(TraceRecord)];
+    send_response_ok();
+    for (uint16_t first = 0; first < trace.size(); first += TRACE_RECORDS_PER_FRAME)
+    {
+        uint16_t n = trace.size() - first;
+        if (n > TRACE_RECORDS_PER_FRAME)
+            n = TRACE_RECORDS_PER_FRAME;
+        memcpy(payload, &first, 2);
+        for (uint16_t i = 0; i < n; i++)
+            memcpy(&payload[2 + i * sizeof(TraceRecord)], &trace.record(first + i), sizeof(TraceRecord));
+        send_frame(TRACE_FRAME_KEY, payload, 2 + n * sizeof(TraceRecord));
+    }
+}
+
+void setTrace(int mode)
+{
+    switch (mode)
+    {
+    case TRACE_OFF:
+        trace.enable(false);
+        send_response_ok();
+        break;
+    case TRACE_ON:
+        trace.enable(false);
+        trace.clear();
+        trace.enable(true);
+        send_response_ok();
+        break;
+    case TRACE_REPORT:
+        sendTraceReport();
+        break;
+    case TRACE_DUMP:
+        if (is_rdatac) // the acquisition task owns the UART while streaming
+        {
+            send_response_error();
+            break;
+        }
+        trace.enable(false);
+        sendTraceDump();
+        break;
+    default:
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+    }
+}
+
+// timer driven synthetic stream through the normal encode path, to
+// measure the link without the ADS setting the rate; stopped by sdatac
+void setBench(int rate, int pattern)
+{
+    if (is_rdatac || rate < 1 || rate > BENCH_MAX_RATE || pattern < SYNTH_COUNTER || pattern > SYNTH_PRNG)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    detectActiveChannels();
+    synth.configure(pattern, 0);
+    capture_mode = CAPTURE_OFF;
+    sample_rate = BENCH_TIMER_HZ / (BENCH_TIMER_HZ / rate); // what the timer will do
+    setupStreaming();
     send_response_ok();
+    handling_data = false;
+    current_sample = 0;
+    is_bench = true; // a running ADS's DRDYs are ignored before rdatac_task could act on them
+    is_rdatac = true;
+    bench_start(rate);
 }
 
-void ledOffCommand(unsigned char unused1, unsigned char unused2)
+void benchCommand(unsigned char unused1, unsigned char unused2)
 {
-    gpio_set_level(LED_PIN, 0);
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setBench((arg1 != NULL) ? atoi(arg1) : 0, (arg2 != NULL) ? atoi(arg2) : SYNTH_COUNTER);
+}
+
+void benchCommandDirect(unsigned char rate_khz, unsigned char pattern)
+{
+    setBench(rate_khz * 1000, pattern);
+}
+
+// capture n raw samples at full rate into RAM, then drain them;
+// n = 0 only reports the capacity
+void setBurst(uint32_t n)
+{
+    using namespace ADS129x;
+    if (n == 0)
+    {
+        if (protocol_mode == TEXT_MODE)
+            printf("200 Ok\nBurst capacity: %u\n\n", capture.capacity());
+        else
+        {
+            cJSON *root = cJSON_CreateObject();
+            cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
+            cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
+            cJSON_AddItemToObject(root, DATA_KEY, cJSON_CreateNumber(capture.capacity()));
+            jsonCommand.sendJsonLinesDocResponse(root);
+        }
+        return;
+    }
+    if (is_rdatac || n > capture.capacity() || n > 0xffff)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    detectActiveChannels();
+    if (num_active_channels < 1)
+    {
+        send_response(RESPONSE_NO_ACTIVE_CHANNELS, STATUS_TEXT_NO_ACTIVE_CHANNELS);
+        return;
+    }
+    detectSampleRate();
+    setupHealth();
+    clearMarkers();
+    capture.start(n);
+    capture_mode = CAPTURE_BURST;
+    adcSendCommand(RDATAC);
     send_response_ok();
+    handling_data = false;
+    current_sample = 0;
+    is_rdatac = true;
 }
 
-void boardLedOnCommand(unsigned char unused1, unsigned char unused2)
+void burstCommand(unsigned char unused1, unsigned char unused2)
 {
-    uint8_t state = adcRreg(ADS129x::ADS_GPIO);
-    //state = state & 0xF7; --> was all done for GPIO4 we now use GPIO1
-    state = state & ~ADS129x::GPIO_bits::GPIOC1; //set pin to OUTPUT
-    //state = state | 0x80;
-    state = state | ADS129x::GPIO_bits::GPIOD1; //set GPIO Pin
+    char *arg1;
+    arg1 = serialCommand.next();
+    setBurst((arg1 != NULL) ? strtoul(arg1, NULL, 10) : 0);
+}
 
-    adcWreg(ADS129x::ADS_GPIO, state);
+void burstCommandDirect(unsigned char n_high, unsigned char n_low)
+{
+    setBurst((n_high << 8) | n_low);
+}
+
+// volts per code of channel ch (1..8) with its PGA gain and the reference
+float channelVoltsPerCode(int ch)
+{
+    using namespace ADS129x;
+    static const uint8_t ads1299_gain[8] = {1, 2, 4, 6, 8, 12, 24, 1};
+    static const uint8_t ads129x_gain[8] = {6, 1, 2, 3, 4, 8, 12, 1};
+    const bool ads1299 = strncmp(hardware_type, "ADS1299", 7) == 0;
+    const uint8_t code = (adcRreg(CHnSET + ch) >> 4) & 7;
+    const float gain = ads1299 ? ads1299_gain[code] : ads129x_gain[code];
+    const float vref = ads1299 ? 4.5f : ((adcRreg(CONFIG3) & VREF_4V) ? 4.0f : 2.4f);
+    return vref / gain / (1 << 23);
+}
+
+// AC lead-off excitation on the active channels for about a second, the
+// amplitude at the excitation frequency gives the electrode impedance.
+// The ADS1299 excites at 31.25 Hz (its currents are 6 nA, 24 nA, 6 uA,
+// 24 uA), the ADS129x at fDR / 4 (6, 12, 18, 24 nA). The lead-off
+// registers are put back afterwards.
+void setImpedance(int current, int side)
+{
+    using namespace ADS129x;
+    static const float ads1299_current[4] = {6e-9f, 24e-9f, 6e-6f, 24e-6f};
+    static const float ads129x_current[4] = {6e-9f, 12e-9f, 18e-9f, 24e-9f};
+    if (is_rdatac || current < 0 || current > 3 || side < IMPEDANCE_SIDE_P || side > IMPEDANCE_SIDE_N)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    detectActiveChannels();
+    if (num_active_channels < 1)
+    {
+        send_response(RESPONSE_NO_ACTIVE_CHANNELS, STATUS_TEXT_NO_ACTIVE_CHANNELS);
+        return;
+    }
+    detectSampleRate();
+    const bool ads1299 = strncmp(hardware_type, "ADS1299", 7) == 0;
+    const float amps = ads1299 ? ads1299_current[current] : ads129x_current[current];
+    const float frequency = ads1299 ? 2048000.0f / 65536 : sample_rate / 4.0f;
+
+    float volts_per_code[8];
+    uint8_t mask = 0;
+    for (int i = 0; i < num_active_channels; i++)
+    {
+        volts_per_code[i] = channelVoltsPerCode(active_list[i]);
+        mask |= 1 << (active_list[i] - 1);
+    }
+    uint8_t saved_loff = adcRreg(LOFF);
+    uint8_t saved_sensp = adcRreg(LOFF_SENSP);
+    uint8_t saved_sensn = adcRreg(LOFF_SENSN);
+    uint8_t saved_config4 = adcRreg(CONFIG4);
+    adcWreg(LOFF, (saved_loff & (COMP_TH2 | COMP_TH1 | COMP_TH0)) | (current << 2) |
+                      (ads1299 ? FLEAD_OFF1 : FLEAD_OFF_AC));
+    adcWreg(LOFF_SENSP, side == IMPEDANCE_SIDE_P ? mask : 0);
+    adcWreg(LOFF_SENSN, side == IMPEDANCE_SIDE_N ? mask : 0);
+    adcWreg(CONFIG4, (saved_config4 & ~SINGLE_SHOT) | PD_LOFF_COMP);
+
+    // the first 1/16 s lets the filter and the electrodes settle
+    impedance_meter.configure(num_active_channels, sample_rate, frequency, IMPEDANCE_SECONDS, sample_rate / 16);
+    impedance_done = false;
+    setupHealth();
+    capture_mode = CAPTURE_IMPEDANCE;
+    adcSendCommand(RDATAC);
+    handling_data = false;
+    current_sample = 0;
+    is_rdatac = true;
+
+    int64_t deadline = esp_timer_get_time() + (int64_t)impedance_meter.samples() * 1000000 / sample_rate + 500000;
+    while (!impedance_done && esp_timer_get_time() < deadline)
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    bool complete = impedance_done;
+    if (!complete) // no DRDYs, e.g. START low
+    {
+        is_rdatac = false;
+        capture_mode = CAPTURE_OFF;
+        vTaskDelay(1);
+        adcSendCommand(SDATAC);
+    }
+    adcWreg(LOFF, saved_loff);
+    adcWreg(LOFF_SENSP, saved_sensp);
+    adcWreg(LOFF_SENSN, saved_sensn);
+    adcWreg(CONFIG4, saved_config4);
+    if (!complete)
+    {
+        send_response_error();
+        return;
+    }
+
+    float ohms[8];
+    for (int i = 0; i < num_active_channels; i++)
+        ohms[i] = ImpedanceMeter::ohms(impedance_meter.amplitude(i) * volts_per_code[i], amps, frequency, sample_rate);
+
+    if (protocol_mode == TEXT_MODE)
+    {
+        printf("200 Ok\n");
+        printf("Impedance at %.2f Hz, %g nA, %s inputs (kOhm):\n", frequency, amps * 1e9f,
+               side == IMPEDANCE_SIDE_P ? "P" : "N");
+        for (int i = 0; i < num_active_channels; i++)
+            printf("ch%d %.1f\n", active_list[i], ohms[i] / 1000);
+        printf("\n");
+        return;
+    }
+
+    cJSON *root, *cj_data, *cj_channels, *cj_ch;
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
+    cJSON_AddItemToObject(root, DATA_KEY, cj_data = cJSON_CreateObject());
+    cJSON_AddNumberToObject(cj_data, "frequency", frequency);
+    cJSON_AddNumberToObject(cj_data, "current_na", amps * 1e9f);
+    cJSON_AddStringToObject(cj_data, "side", side == IMPEDANCE_SIDE_P ? "P" : "N");
+    cJSON_AddItemToObject(cj_data, "channels", cj_channels = cJSON_CreateArray());
+    for (int i = 0; i < num_active_channels; i++)
+    {
+        cJSON_AddItemToArray(cj_channels, cj_ch = cJSON_CreateObject());
+        cJSON_AddNumberToObject(cj_ch, "channel", active_list[i]);
+        cJSON_AddNumberToObject(cj_ch, "kohm", ohms[i] / 1000);
+        cJSON_AddNumberToObject(cj_ch, "amplitude_uv", impedance_meter.amplitude(i) * volts_per_code[i] * 1e6f);
+    }
+    jsonCommand.sendJsonLinesDocResponse(root);
+}
+
+void impedanceCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setImpedance((arg1 != NULL) ? atoi(arg1) : 0, (arg2 != NULL) ? atoi(arg2) : IMPEDANCE_SIDE_P);
+}
+
+void impedanceCommandDirect(unsigned char current, unsigned char side)
+{
+    setImpedance(current, side);
+}
 
+// send the last capture again from record first on
+void drainCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1;
+    arg1 = serialCommand.next();
+    if (is_rdatac)
+    {
+        send_response_error();
+        return;
+    }
     send_response_ok();
+    drainCapture((arg1 != NULL) ? strtoul(arg1, NULL, 10) : 0);
 }
 
-void boardLedOffCommand(unsigned char unused1, unsigned char unused2)
+void drainCommandDirect(unsigned char first_high, unsigned char first_low)
 {
-    uint8_t state = adcRreg(ADS129x::ADS_GPIO);
-    ESP_LOGI(TAG, "State after read %#x", state);
-    //state = state & 0x77;
-    state = state & ~(ADS129x::GPIO_bits::GPIOC1 | ADS129x::GPIO_bits::GPIOD1);
-    ESP_LOGI(TAG, "State before write %#x", state);
-    adcWreg(ADS129x::ADS_GPIO, state);
+    if (is_rdatac)
+    {
+        send_response_error();
+        return;
+    }
+    send_response_ok();
+    drainCapture((first_high << 8) | first_low);
+}
 
+// trigger source for the next rdatac: 0 off, 1 TRIGGER_PIN, 2 threshold on channel
+void setTrigger(int source, int channel)
+{
+    if (source < TRIGGER_OFF || source > TRIGGER_THRESHOLD || channel < 1 || channel > 8)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    trigger_source = source;
+    trigger_channel = channel;
     send_response_ok();
 }
 
-void wakeupCommand(unsigned char unused1, unsigned char unused2)
+void triggerCommand(unsigned char unused1, unsigned char unused2)
 {
-    using namespace ADS129x;
-    adcSendCommand(WAKEUP);
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setTrigger((arg1 != NULL) ? atoi(arg1) : TRIGGER_OFF, (arg2 != NULL) ? atoi(arg2) : trigger_channel);
+}
+
+void triggerCommandDirect(unsigned char source, unsigned char channel)
+{
+    setTrigger(source, channel);
+}
+
+void setTriggerWindow(uint32_t pre, uint32_t post)
+{
+    if (post < 1 || pre + post > capture.capacity() || pre > 0xffff || post > 0xffff)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    trigger_pre = pre;
+    trigger_post = post;
     send_response_ok();
 }
 
-void standbyCommand(unsigned char unused1, unsigned char unused2)
+void triggerWindowCommand(unsigned char unused1, unsigned char unused2)
 {
-    using namespace ADS129x;
-    adcSendCommand(STANDBY);
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setTriggerWindow((arg1 != NULL) ? strtoul(arg1, NULL, 10) : 0, (arg2 != NULL) ? strtoul(arg2, NULL, 10) : 0);
+}
+
+void triggerWindowCommandDirect(unsigned char pre, unsigned char post)
+{
+    setTriggerWindow(pre * TRIGGER_WINDOW_UNIT, post * TRIGGER_WINDOW_UNIT);
+}
+
+void setTriggerLevel(long level)
+{
+    if (level < 1 || level > 0x7fffff)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    trigger_level = level;
     send_response_ok();
 }
 
-void resetCommand(unsigned char unused1, unsigned char unused2)
+void triggerLevelCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1;
+    arg1 = serialCommand.next();
+    setTriggerLevel((arg1 != NULL) ? atol(arg1) : 0);
+}
+
+void triggerLevelCommandDirect(unsigned char level_high, unsigned char level_low)
+{
+    setTriggerLevel(((level_high << 8) | level_low) << 8); // upper 16 of the 24 bits
+}
+
+// event marker from the host, stamped when the command is parsed: read_task
+// wakes on the UART RX timeout, a few character times after the line is
+// in, plus its wait for the core; MARKER_PIN is sample accurate
+void setMarker(int code)
+{
+    if (code < 0 || code > 255)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    if (is_rdatac)
+    {
+        MarkerEvent marker;
+        marker_stamp(&marker);
+        marker.code = code;
+        marker.source = MARKER_SOURCE_COMMAND;
+        if (xQueueSend(marker_queue, &marker, 0) == pdTRUE)
+            marker_waiting = true;
+    }
+    send_response_ok();
+}
+
+void markerCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1;
+    arg1 = serialCommand.next();
+    setMarker((arg1 != NULL) ? atoi(arg1) : 0);
+}
+
+void markerCommandDirect(unsigned char code, unsigned char unused1)
+{
+    setMarker(code);
+}
+
+// number of registers a profile holds for this chip
+uint8_t profileRegisters()
 {
     using namespace ADS129x;
-    adcSendCommand(RESET);
-    vTaskDelay(150 / portTICK_PERIOD_MS); //now wait 2^18 tCLK = 128ms
-    adsSetup();
+    if (strncmp(hardware_type, "ADS1299", 7) == 0)
+        return CONFIG4 - PROFILE_FIRST_REG + 1;
+    return WCT2 - PROFILE_FIRST_REG + 1;
+}
+
+void collectProfile(AdsProfile *p)
+{
+    memset(p, 0, sizeof(AdsProfile));
+    p->version = PROFILE_VERSION;
+    p->num_registers = profileRegisters();
+    adcRregBurst(PROFILE_FIRST_REG, p->registers, p->num_registers);
+    p->protocol_mode = protocol_mode;
+    p->base64_mode = base64_mode;
+    detectActiveChannels();
+    for (int i = 0; i < num_active_channels; i++)
+        p->channel_mask |= 1 << (active_list[i] - 1);
+    p->filter_notch_hz = filter_notch_hz;
+    p->filter_highpass = filter_highpass;
+    p->decimate_ratio = decimate_ratio;
+    p->bandpower_mode = bandpower_mode;
+    p->bandpower_rate = bandpower_rate;
+    p->leadoff_events = leadoff_events;
+    p->drop_status = drop_status;
+    p->heartbeat_seconds = heartbeat_seconds;
+    p->stats_mode = stats_mode;
+    p->stats_window_ms = stats_window_ms;
+    p->quantize_enabled = quantize_enabled;
+    p->quantize_shift = quantize_shift;
+    p->artifacts_enabled = artifacts_enabled;
+    p->artifact_step = artifact_step;
+    p->montage_terms = montage_setting.terms();
+    p->montage_shift = montage_setting.shift();
+    p->montage_reference = montage_setting.reference();
+    for (uint8_t i = 0; i < p->montage_terms; i++)
+        p->montage_weight[i] = montage_setting.term(i, &p->montage_out[i], &p->montage_in[i]);
+    p->link_mode = link_mode;
+    p->pipeline_enabled = pipeline_enabled;
+}
+
+// registers in one burst write; the channel mask is implied by the CHnSET
+// power-down bits among them. The montage is rebuilt term by term.
+void applyProfile(const AdsProfile *p)
+{
+    using namespace ADS129x;
+    adcSendCommand(SDATAC);
+    adcWregBurst(PROFILE_FIRST_REG, p->registers, p->num_registers);
+    protocol_mode = p->protocol_mode;
+    base64_mode = p->base64_mode;
+    filter_notch_hz = p->filter_notch_hz;
+    filter_highpass = p->filter_highpass;
+    decimate_ratio = p->decimate_ratio;
+    bandpower_mode = p->bandpower_mode;
+    bandpower_rate = p->bandpower_rate;
+    leadoff_events = p->leadoff_events;
+    drop_status = p->drop_status;
+    heartbeat_seconds = p->heartbeat_seconds;
+    stats_mode = p->stats_mode;
+    stats_window_ms = p->stats_window_ms;
+    quantize_enabled = p->quantize_enabled;
+    quantize_shift = p->quantize_shift;
+    artifacts_enabled = p->artifacts_enabled;
+    artifact_step = p->artifact_step;
+    montage_setting.clear();
+    montage_setting.setShift(p->montage_shift);
+    for (uint8_t i = 0; i < p->montage_terms; i++)
+        montage_setting.addTerm(p->montage_out[i], p->montage_in[i], p->montage_weight[i]);
+    montage_setting.setReference(p->montage_reference);
+    link_mode = p->link_mode;
+    pipeline_enabled = p->pipeline_enabled;
+}
+
+void setProfile(int action, const char *name)
+{
+    AdsProfile p;
+    bool ok = false;
+    if (is_rdatac)
+    {
+        send_response_error();
+        return;
+    }
+    switch (action)
+    {
+    case PROFILE_SAVE:
+        collectProfile(&p);
+        ok = profile_save(name, &p);
+        break;
+    case PROFILE_LOAD:
+        ok = profile_load(name, &p);
+        if (ok)
+            applyProfile(&p);
+        break;
+    case PROFILE_DELETE:
+        ok = profile_erase(name);
+        break;
+    case PROFILE_AUTOSTART:
+        ok = profile_load(name, &p) && profile_set_autostart(name);
+        break;
+    case PROFILE_AUTOSTART_OFF:
+        ok = profile_set_autostart(NULL);
+        break;
+    }
+    if (ok)
+        send_response_ok();
+    else
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+}
+
+void profileCommand(unsigned char unused1, unsigned char unused2)
+{
+    const char *actions[] = {"save", "load", "delete", "autostart", "noautostart"};
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    int action = -1;
+    for (int i = 0; arg1 != NULL && i < 5; i++)
+    {
+        if (strcmp(arg1, actions[i]) == 0)
+            action = i;
+    }
+    if (action < 0 || (arg2 == NULL && action != PROFILE_AUTOSTART_OFF))
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    setProfile(action, arg2);
+}
+
+// JSON Lines can only pass numbers, profile N is the one named "N"
+void profileCommandDirect(unsigned char action, unsigned char number)
+{
+    char name[4];
+    sprintf(name, "%d", number);
+    setProfile(action, name);
+}
+
+// apply the autostart profile and stream without any host command
+void autostart()
+{
+    using namespace ADS129x;
+    char name[PROFILE_NAME_LEN + 1];
+    AdsProfile p;
+    if (!profile_get_autostart(name) || !profile_load(name, &p))
+        return;
+    applyProfile(&p);
+    if (prepareRdatac() != RESPONSE_OK)
+        return;
+    armRdatac();
+    adcSendCommand(START);
+    ESP_LOGI(TAG, "autostart %s", name);
+}
+
+void setHeartbeat(int seconds)
+{
+    if (seconds < 0 || seconds > 255)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    heartbeat_seconds = seconds;
+    send_response_ok();
+}
+
+// 16 bit samples, shift 0..8 fixed or QUANT_AUTO; takes effect with the next rdatac
+void setQuantize(int enable, int shift)
+{
+    if (enable < 0 || enable > 1 || (shift > QUANT_MAX_SHIFT && shift != QUANT_AUTO) || shift < 0)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    quantize_enabled = enable;
+    quantize_shift = shift;
+    send_response_ok();
+}
+
+void quantizeCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setQuantize((arg1 != NULL) ? atoi(arg1) : 1, (arg2 != NULL) ? atoi(arg2) : QUANT_AUTO);
+}
+
+// as the text command: no enable turns it on, no shift is adaptive
+void quantizeCommandDirect(unsigned char enable, unsigned char shift)
+{
+    setQuantize(jsonCommand.parameters() > 0 ? enable : 1, jsonCommand.parameters() > 1 ? shift : QUANT_AUTO);
+}
+
+// flags in the sample frames, step in codes (0 = rails and lead-off only);
+// takes effect with the next rdatac. The flags come from the raw codes, so
+// their channel bits are ADS channels even with a montage.
+void setArtifacts(int enable, long step)
+{
+    if (enable < 0 || enable > 1 || step < 0 || step > 0xffffff)
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    artifacts_enabled = enable;
+    artifact_step = step;
     send_response_ok();
 }
 
-void startCommand(unsigned char unused1, unsigned char unused2)
+void artifactsCommand(unsigned char unused1, unsigned char unused2)
 {
-    using namespace ADS129x;
-    adcSendCommand(START);
-    current_sample = 0;
-    send_response_ok();
+    char *arg1, *arg2;
+    arg1 = serialCommand.next();
+    arg2 = serialCommand.next();
+    setArtifacts((arg1 != NULL) ? atoi(arg1) : 1, (arg2 != NULL) ? atol(arg2) : ARTIFACT_DEFAULT_STEP);
 }
 
-void stopCommand(unsigned char unused1, unsigned char unused2)
+void artifactsCommandDirect(unsigned char enable, unsigned char step)
 {
-    using namespace ADS129x;
-    adcSendCommand(STOP);
-    send_response_ok();
+    setArtifacts(enable, (long)step << 16);
 }
 
-void rdatacCommand(unsigned char unused1, unsigned char unused2)
+// the matrix as set: one line / array entry per term, in 0 = the average;
+// then the ADS channels behind every output, which is what the channel
+// bits of the artifact flags refer to
+void sendMontageReport()
 {
-    using namespace ADS129x;
-    detectActiveChannels();
-    if (num_active_channels > 0)
+    uint8_t out, in;
+    Montage resolved = montage_setting; // the reference as rdatac will take it
+    if (resolved.usesAverage() && !resolved.reference())
+        resolved.setReference(active_mask());
+    if (protocol_mode == TEXT_MODE)
     {
-        adcSendCommand(RDATAC);
         send_response_ok();
-        handling_data = false; //fresh start
-        current_sample = 0;    //here or whe start commad is issued?
-        is_rdatac = true;      //now ISR is armed ...
+        printf("Montage outputs: %d shift: %d reference: %#x\n", montage_setting.outputs(), montage_setting.shift(),
+               montage_setting.reference());
+        for (uint8_t i = 0; i < montage_setting.terms(); i++)
+        {
+            int8_t weight = montage_setting.term(i, &out, &in);
+            if (in == MONTAGE_AVERAGE)
+                printf("out%d %+d x avg\n", out + 1, weight);
+            else
+                printf("out%d %+d x ch%d\n", out + 1, weight, in + 1);
+        }
+        for (uint8_t k = 0; k < resolved.outputs(); k++)
+            printf("out%d ADS channels: %#x\n", k + 1, resolved.inputs(k));
+        printf("\n");
+        return;
     }
-    else
+
+    cJSON *root, *cj_data, *cj_terms, *cj_term, *cj_inputs;
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
+    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
+    cJSON_AddItemToObject(root, DATA_KEY, cj_data = cJSON_CreateObject());
+    cJSON_AddNumberToObject(cj_data, "outputs", montage_setting.outputs());
+    cJSON_AddNumberToObject(cj_data, "shift", montage_setting.shift());
+    cJSON_AddNumberToObject(cj_data, "reference", montage_setting.reference());
+    cJSON_AddItemToObject(cj_data, "terms", cj_terms = cJSON_CreateArray());
+    for (uint8_t i = 0; i < montage_setting.terms(); i++)
     {
-        send_response(RESPONSE_NO_ACTIVE_CHANNELS, STATUS_TEXT_NO_ACTIVE_CHANNELS);
+        int8_t weight = montage_setting.term(i, &out, &in);
+        cJSON_AddItemToArray(cj_terms, cj_term = cJSON_CreateObject());
+        cJSON_AddNumberToObject(cj_term, "out", out + 1);
+        cJSON_AddNumberToObject(cj_term, "in", (in == MONTAGE_AVERAGE) ? 0 : in + 1);
+        cJSON_AddNumberToObject(cj_term, "weight", weight);
     }
+    cJSON_AddItemToObject(cj_data, "inputs", cj_inputs = cJSON_CreateArray());
+    for (uint8_t k = 0; k < resolved.outputs(); k++)
+        cJSON_AddItemToArray(cj_inputs, cJSON_CreateNumber(resolved.inputs(k)));
+    jsonCommand.sendJsonLinesDocResponse(root);
 }
 
-void rdataCommand(unsigned char unused1, unsigned char unused2)
+// takes effect with the next rdatac; mask of ADS channels, 0 = the active ones
+void setMontage(int mode, int mask)
 {
-    using namespace ADS129x;
-    detectActiveChannels();
-    if (num_active_channels > 0)
+    if (mask < 0)
     {
-        send_response_ok();
-        handling_data = false; //fresh start
-        current_sample = 0;    //here or whe start commad is issued?
-        is_rdata = true;       //now ISR is armed ...
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
     }
-    else
+    if (mask == 0)
+        mask = active_mask();
+    bool ok = true;
+    switch (mode)
     {
-        send_response(RESPONSE_NO_ACTIVE_CHANNELS, STATUS_TEXT_NO_ACTIVE_CHANNELS);
+    case MONTAGE_OFF:
+        montage_setting.clear();
+        break;
+    case MONTAGE_CAR:
+        ok = montage_setting.commonAverage(mask);
+        break;
+    case MONTAGE_BIPOLAR: // neighbours in the mask: 1-2, 2-3, ...
+    {
+        montage_setting.clear();
+        int last = -1;
+        for (int ch = 0; ch < 8 && ok; ch++)
+        {
+            if (!(mask & (1 << ch)))
+                continue;
+            if (last >= 0)
+                ok = montage_setting.bipolar(last, ch);
+            last = ch;
+        }
+        ok = ok && montage_setting.outputs() > 0;
+        break;
+    }
+    case MONTAGE_REPORT:
+        sendMontageReport();
+        return;
+    default:
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    if (!ok)
+    {
+        montage_setting.clear();
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
     }
+    send_response_ok();
 }
 
-void sdatacCommand(unsigned char unused1, unsigned char unused2)
+// adds out += weight x in to the matrix as set; channels 1..8, in 0 = the
+// common average, shift < 0 keeps the current one
+void setMontageTerm(int out, int in, int weight, int shift)
 {
-    using namespace ADS129x;
-    is_rdatac = false;
-    adcSendCommand(SDATAC);
-    using namespace ADS129x;
+    if (out < 1 || out > 8 || in < 0 || in > 8 || weight < -128 || weight > 127 ||
+        (shift >= 0 && !montage_setting.setShift(shift)) ||
+        !montage_setting.addTerm(out - 1, in ? in - 1 : MONTAGE_AVERAGE, weight))
+    {
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
     send_response_ok();
 }
 
-/*void rdataCommand(unsigned char unused1, unsigned char unused2) // TBD
+// "1357" -> mask of ADS channels 1, 3, 5 and 7, -1 if not channel digits
+static int parse_channel_digits(const char *s)
 {
-    using namespace ADS129x;
-    while (gpio_get_level(DRDY_PIN) == 1)
-        ; //wdt kicks in ...
-    adcSendCommand(RDATA);
-    if (protocol_mode == TEXT_MODE)
+    int mask = 0;
+    for (; *s; s++)
     {
-        send_response_ok();
+        if (*s < '1' || *s > '8')
+            return -1;
+        mask |= 1 << (*s - '1');
     }
-    //send_sample(); TBD --> not implemented ...
-
+    return mask;
 }
-*/
-void readRegisterCommand(unsigned char unused1, unsigned char unused2)
+
+void montageCommand(unsigned char unused1, unsigned char unused2)
 {
-    using namespace ADS129x;
-    char *arg1;
+    char *arg1, *arg2;
     arg1 = serialCommand.next();
-    if (arg1 != NULL)
+    int mode = (arg1 != NULL) ? atoi(arg1) : MONTAGE_REPORT;
+    if (mode == MONTAGE_TERM)
     {
-        int registerNumber = hex_to_long(arg1);
-        //if (registerNumber >= 0)
-        if (registerNumber >= 0x00 && registerNumber <= 0xff)
+        char *out = serialCommand.next(), *in = serialCommand.next(), *weight = serialCommand.next();
+        char *shift = serialCommand.next();
+        if (out == NULL || in == NULL || weight == NULL)
         {
-            int result = adcRreg(registerNumber);
-            printf("200 Ok (Read Register %#x)\n%#x\n", registerNumber, result);
-        }
-        else
-        {
-            printf("402 Error: expected hexidecimal digits.\n");
+            send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+            return;
         }
+        setMontageTerm(atoi(out), atoi(in), atoi(weight), (shift != NULL) ? atoi(shift) : -1);
+        return;
     }
-    else
-    {
-        printf("403 Error: register argument missing.\n");
-    }
-    printf("\n");
-}
-
-void writeRegisterCommand(unsigned char unused1, unsigned char unused2)
-{
-    char *arg1, *arg2;
-    arg1 = serialCommand.next();
     arg2 = serialCommand.next();
-    if (arg1 != NULL)
+    if (mode == MONTAGE_BIPOLAR && arg2 != NULL) // explicit pairs: 12 34 ...
     {
-        if (arg2 != NULL)
+        montage_setting.clear();
+        for (; arg2 != NULL; arg2 = serialCommand.next())
         {
-            int registerNumber = hex_to_long(arg1);
-            int registerValue = hex_to_long(arg2);
-            if (registerNumber >= 0 && registerValue >= 0)
-            {
-                adcWreg(registerNumber, registerValue);
-                printf("200 Ok (Write Register %#x %#x)\n", registerNumber, registerValue);
-            }
-            else
+            if (strlen(arg2) != 2 || !montage_setting.bipolar(arg2[0] - '1', arg2[1] - '1'))
             {
-                printf("402 Error: expected hexadecimal digits.\n");
+                montage_setting.clear();
+                send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+                return;
             }
         }
-        else
-        {
-            printf("404 Error: value argument missing.\n");
-        }
+        send_response_ok();
+        return;
     }
-    else
+    setMontage(mode, (arg2 != NULL) ? parse_channel_digits(arg2) : 0);
+}
+
+void montageCommandDirect(unsigned char mode, unsigned char mask)
+{
+    setMontage(mode, mask);
+}
+
+// what rdatac does with a stream the UART can not carry
+void setLink(int mode)
+{
+    if (mode < LINK_OFF || mode > LINK_ADJUST)
     {
-        printf("403 Error: register argument missing.\n");
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
     }
-    printf("\n");
+    link_mode = mode;
+    send_response_ok();
 }
 
-void readRegisterCommandDirect(unsigned char register_number, unsigned char unused1)
+void linkCommand(unsigned char unused1, unsigned char unused2)
 {
-    using namespace ADS129x;
-    /*   if (register_number >= 0 and register_number <= 255)
-    // this needs to checked in JSON decoding !!!
-    {
-     */
-    unsigned char result = adcRreg(register_number);
-    cJSON *root;
-    root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, STATUS_CODE_KEY, cJSON_CreateNumber(STATUS_OK));
-    cJSON_AddItemToObject(root, STATUS_TEXT_KEY, cJSON_CreateString(STATUS_TEXT_OK));
-    cJSON_AddItemToObject(root, DATA_KEY, cJSON_CreateNumber(result));
-    jsonCommand.sendJsonLinesDocResponse(root);
-    /* }
-    else
-    {
-        send_response_error();
-    } */
+    char *arg1;
+    arg1 = serialCommand.next();
+    setLink((arg1 != NULL) ? atoi(arg1) : LINK_REFUSE);
 }
 
-void writeRegisterCommandDirect(unsigned char register_number, unsigned char register_value)
+void linkCommandDirect(unsigned char mode, unsigned char unused1)
 {
-    /*    if (register_number >= 0 && register_value >= 0)
-    // this needs to checked in JSON decoding !!!
-    {  */
-    adcWreg(register_number, register_value);
-    send_response_ok();
-    /*}
-    else
+    setLink(mode);
+}
+
+void setPipeline(int enable)
+{
+    if (enable < 0 || enable > 1)
     {
-        send_response_error();
-    }*/
+        send_response(RESPONSE_BAD_REQUEST, STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    pipeline_enabled = enable;
+    send_response_ok();
+}
+
+void pipelineCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1;
+    arg1 = serialCommand.next();
+    setPipeline((arg1 != NULL) ? atoi(arg1) : 1);
+}
+
+void pipelineCommandDirect(unsigned char enable, unsigned char unused1)
+{
+    setPipeline(enable);
+}
+
+void heartbeatCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1;
+    arg1 = serialCommand.next();
+    setHeartbeat((arg1 != NULL) ? atoi(arg1) : 1);
+}
+
+void heartbeatCommandDirect(unsigned char seconds, unsigned char unused1)
+{
+    setHeartbeat(seconds);
+}
+
+void traceCommand(unsigned char unused1, unsigned char unused2)
+{
+    char *arg1;
+    arg1 = serialCommand.next();
+    setTrace((arg1 != NULL) ? atoi(arg1) : TRACE_REPORT);
+}
+
+// no mode reports, as the text command
+void traceCommandDirect(unsigned char mode, unsigned char unused1)
+{
+    setTrace(jsonCommand.parameters() > 0 ? mode : TRACE_REPORT);
 }
 
 void base64ModeOnCommand(unsigned char unused1, unsigned char unused2)
 {
     base64_mode = true;
+    setupFrames();
     send_response(RESPONSE_OK, "Base64 mode on - rdata command will respond with base64 encoded data.");
 }
 
 void hexModeOnCommand(unsigned char unused1, unsigned char unused2)
 {
     base64_mode = false;
+    setupFrames();
     send_response(RESPONSE_OK, "Hex mode on - rdata command will respond with hex encoded data");
 }
 
@@ -675,13 +2777,111 @@ void helpCommand(unsigned char unused1, unsigned char unused2)
     }
 }
 
-static void rdatac_task(void *arg)
+// encode a processed sample with the layout chosen at rdatac start and send it
+static inline void send_sample(uint32_t time, uint32_t sample, uint8_t *data)
+{
+    if (quantize_active)
+    {
+        uint32_t start = cycle_count();
+        if (quantizer.process(data))
+            quant_frame_pending = true;
+        average_cycles(quantize_cycles, start);
+        if (quant_frame_pending)
+        {
+            quant_frame.data_fields.sample = sample;
+            for (int ch = 0; ch < QUANT_MAX_CHANNELS; ch++)
+                quant_frame.data_fields.shift[ch] = quantizer.shift(ch);
+            send_frame(QUANT_FRAME_KEY, quant_frame.bytes, 4 + quantizer.channels());
+            quant_frame_pending = false;
+        }
+    }
+    size_t count = encode_frame(output_buffer, time, sample, data, artifact_bits);
+    artifact_bits = 0;
+    trace.mark(TRACE_ENCODE);
+    uart_write(output_buffer, count); // one write, no torn frames
+    trace.mark(TRACE_QUEUED);
+}
+
+// in-band frames queued up while handling the sample, sent after it
+static inline void send_pending_frames()
+{
+    send_markers();
+    if (resync_pending)
+    {
+        send_frame(RESYNC_FRAME_KEY, resync_event.bytes, sizeof(resync_event.bytes));
+        resync_pending = false;
+    }
+    if (leadoff_event_pending)
+    {
+        send_frame(LEADOFF_FRAME_KEY, leadoff_event.bytes, sizeof(leadoff_event.bytes));
+        leadoff_event_pending = false;
+    }
+    if (stats_frame_pending)
+    {
+        sendStatsFrame();
+        stats_frame_pending = false;
+    }
+    if (feature_frame_ready)
+    {
+        send_frame(BANDPOWER_FRAME_KEY, feature_frame.bytes,
+                   6 + 4 * feature_frame.data_fields.channels * BP_NUM_BANDS);
+        feature_frame_ready = false;
+    }
+    if (heartbeat_samples && current_sample - heartbeat_last >= heartbeat_samples)
+    {
+        heartbeat_last = current_sample;
+        sendHeartbeat();
+    }
+}
+
+// pipeline stage 1: read the sample into the ring, nothing else
+static inline void acquire_to_ring(uint32_t wake)
+{
+    uint32_t start = cycle_count();
+    PipelineRecord *rec = sample_ring.claim();
+    if (rec == NULL)
+    {
+        pipeline_overflows++; // processing core fell behind, sample lost
+        return;
+    }
+    rec->time = esp_timer_get_time();
+    rec->timed = cycle_count();
+    rec->sample = current_sample;
+    rec->drdy = drdy_cycles;
+    rec->wake = wake;
+    acquire(rec->data, rec->sample);
+    rec->spi = cycle_count();
+    rec->valid = validate_status(rec->data);
+    sample_ring.publish();
+    if (__atomic_load_n(&process_idle, __ATOMIC_SEQ_CST))
+        xTaskNotifyGive(process_task_handle);
+    average_cycles(acquire_cycles, start);
+}
+
+// pipeline stage 2: everything from the status word on, then transmit
+static inline void process_record(PipelineRecord *rec)
 {
-    memcpy(mp_transfer.data_fields.header, messagepack_rdatac_header, MP_HEADER_SZ);
-    // setup header bytes
-    mp_transfer.data_fields.size = MP_DATA_SZ + 4 + 4;
-    // setup size (data + counter + time )
+    uint32_t start = cycle_count();
+    trace.begin(rec->sample, rec->drdy);
+    trace.stamp(TRACE_WAKE, rec->wake);
+    trace.stamp(TRACE_SPI, rec->spi);
+    if (trace.enabled()) // this core's CCOUNT is unrelated to core 0's, bridge the gap with esp_timer
+        trace.handover((rec->timed - rec->drdy) + ((uint32_t)esp_timer_get_time() - rec->time) * (CPU_HZ / 1000000));
+    if (!rec->valid)
+        flag_resync(rec->sample);
+    else
+    {
+        track_leadoff(rec->data, rec->sample);
+        if (process_sample(rec->data, rec->sample))
+            send_sample(rec->time, rec->sample, rec->data);
+    }
+    send_pending_frames();
+    trace.commit();
+    average_cycles(process_cycles, start);
+}
 
+static void rdatac_task(void *arg) //acquisition, and in single task mode everything else as well
+{
     while (1)
     {
         // wait for ISR to wake us ...
@@ -691,6 +2891,22 @@ static void rdatac_task(void *arg)
             /*gpio_set_level(LED_PIN, 1);
             ets_delay_us(1); // signal collison on scope
             gpio_set_level(LED_PIN, 0);*/
+            uint32_t wake = cycle_count();
+            uint32_t wake_latency = wake - drdy_cycles;
+            if (wake_latency > wake_latency_max)
+                wake_latency_max = wake_latency;
+            if (first_sample_us == 0)
+                first_sample_us = esp_timer_get_time();
+
+            if (capture_mode != CAPTURE_OFF) // nothing goes out until a capture is complete
+            {
+                if (capture_mode == CAPTURE_IMPEDANCE)
+                    impedance_sample();
+                else
+                    capture_sample();
+                handling_data = false;
+                continue;
+            }
 
             if (is_rdata) //ask for data
             {
@@ -698,77 +2914,69 @@ static void rdatac_task(void *arg)
                 adcSendCommand(RDATA);
                 is_rdata = false; // just one conversion
             }
-            switch (protocol_mode)
-            {
-            case MESSAGEPACK_MODE:
-            {
-                //this should be pretty fast
-                mp_transfer.data_fields.time = esp_timer_get_time(); //cave 64bit
-                mp_transfer.data_fields.sample = current_sample;
-                //now transmit the first chunk
-                uart_write(mp_transfer.pre_post.preSPI, MP_PRE_SZ);
-                spiRec(mp_transfer.data_fields.data, MP_DATA_SZ);
-                //...and second chunk
-                uart_write(mp_transfer.pre_post.postSPI, MP_DATA_SZ);
-
-                //uart_write(mp_transfer.bytes, MP_FULL_SZ); //the whole lot
-                /*gpio_set_level(LED_PIN, 1);
-            ets_delay_us(2); //wait 2us
-            gpio_set_level(LED_PIN, 0);*/
-            }
-            break;
-
-            case JSONLINES_MODE:
-            {
-                spi_transfer.data_fields.time = esp_timer_get_time(); //cave 64bit
-                spi_transfer.data_fields.sample = current_sample;
-                spiRec(spi_transfer.data_fields.data, MP_DATA_SZ);
-
-                b64len = base64_encode(temp_buffer, spi_transfer.bytes, SPI_FULL_SZ);
-                size_t count = 0;
-                memcpy(&output_buffer[count], json_rdatac_header, json_rdatac_header_size);
-                count += json_rdatac_header_size;
-                //memcpy(&output_buffer[count], json_rdatac_header, 14);
-                //count += 14;
-
-                memcpy(&output_buffer[count], temp_buffer, b64len);
-                count += b64len;
-
-                memcpy(&output_buffer[count], json_rdatac_footer, json_rdatac_footer_size);
-                count += json_rdatac_footer_size;
-                //memcpy(&output_buffer[count], json_rdatac_footer, 2);
-                //count += 2;
-                output_buffer[count++] = 0x0a;
-                uart_write((char *)output_buffer, count);
-            }
-            break;
 
-            case TEXT_MODE:
+            if (pipeline_active) // the other core does the rest
             {
-                spi_transfer.data_fields.time = esp_timer_get_time(); //cave 64bit
-                spi_transfer.data_fields.sample = current_sample;
-                spiRec(spi_transfer.data_fields.data, MP_DATA_SZ);
-                if (base64_mode)
-                {
-                    b64len = base64_encode(output_buffer, spi_transfer.bytes, SPI_FULL_SZ);
-                }
-                else
-                {
-                    b64len = encode_hex(output_buffer, spi_transfer.bytes, SPI_FULL_SZ);
-                }
-                output_buffer[b64len++] = 0x0a; //add newline
-                uart_write((char *)output_buffer, b64len);
+                acquire_to_ring(wake);
+                handling_data = false;
+                continue;
             }
-            break;
 
-            default:
-                break;
-            }
+            uint32_t start = wake;
+            trace.begin(current_sample, drdy_cycles);
+            trace.stamp(TRACE_WAKE, wake);
+            uint32_t time = esp_timer_get_time(); //cave 64bit
+            acquire(sample_data, current_sample);
+            trace.mark(TRACE_SPI);
+            if (check_status(sample_data) && process_sample(sample_data, current_sample))
+                send_sample(time, current_sample, sample_data);
+            send_pending_frames();
+            trace.commit();
+            average_cycles(acquire_cycles, start);
             handling_data = false; //we are done
         }
     }
 }
 
+static void process_task(void *arg) //pipeline stage 2, on the core not doing acquisition
+{
+    while (1)
+    {
+        PipelineRecord *rec;
+        while ((rec = sample_ring.peek()) != NULL)
+        {
+            process_record(rec);
+            sample_ring.release();
+        }
+        // announce we are going to sleep, then look once more: a sample
+        // published in between finds process_idle set and notifies us
+        __atomic_store_n(&process_idle, true, __ATOMIC_SEQ_CST);
+        if (sample_ring.peek() == NULL)
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        __atomic_store_n(&process_idle, false, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void feature_task(void *arg) //band power FFTs, runs on the core not doing acquisition
+{
+    while (1)
+    {
+        if (ulTaskNotifyTake(pdTRUE, portMAX_DELAY))
+        {
+            if (feature_frame_ready)
+                continue; // last frame not sent yet, skip this window
+            static float powers[BP_MAX_CHANNELS * BP_NUM_BANDS];
+            uint32_t start = cycle_count();
+            feature_frame.data_fields.sample = band_power.compute(powers);
+            memcpy(feature_frame.data_fields.powers, powers, sizeof(powers)); //frame is packed, floats unaligned
+            feature_frame.data_fields.channels = band_power.channels();
+            feature_frame.data_fields.bands = BP_NUM_BANDS;
+            average_cycles(bandpower_cycles, start);
+            feature_frame_ready = true;
+        }
+    }
+}
+
 static void read_task(void *arg) //task checking the UART for commands
 {
     while (1)
@@ -786,7 +2994,7 @@ static void read_task(void *arg) //task checking the UART for commands
             // do nothing
             ;
         }
-        vTaskDelay(10 / portTICK_PERIOD_MS); //UART input gets handled every 10 ms ...
+        uart_wait_rx(10); //UART input gets handled as it arrives, markers are stamped then
     }
 }
 
@@ -801,19 +3009,22 @@ Log output
 Default log verbosity
 -->No output*/
     //esp_log_level_set("*", ESP_LOG_INFO); //todo change by command
-    vTaskDelay(500 / portTICK_PERIOD_MS); //wait --> see whether this is OK*/
+    //vTaskDelay(500 / portTICK_PERIOD_MS); //not needed, spi_init waits for the ADS power-on reset anyway
     esp_log_level_set("*", ESP_LOG_NONE); //todo change by command
     ESP_LOGI(TAG, "Hi");
     uart_init();
     protocol_mode = TEXT_MODE;
     ESP_LOGI(TAG, "UART initialized");
+    profile_init(); //NVS, done while the ADS is still in power-on reset
     spi_init(); //start SPI, define semaphore, do GPIO stuff
     ESP_LOGI(TAG, "SPI initialized");
     adsSetup();
     ESP_LOGI(TAG, "ADS1299 initialized");
 
     xSemaphore = xSemaphoreCreateBinary();                                                      //not neede anymore
-    xTaskCreatePinnedToCore(rdatac_task, "rdatac_task", 4096, NULL, 5, &rdatac_task_handle, 0); //params?? prio 2 ??
+    xTaskCreatePinnedToCore(rdatac_task, "rdatac_task", 4096, NULL, ACQUIRE_TASK_PRIO, &rdatac_task_handle, ACQUIRE_TASK_CORE); //params?? prio 2 ??
+    xTaskCreatePinnedToCore(process_task, "process_task", 4096, NULL, PROCESS_TASK_PRIO, &process_task_handle, PROCESS_TASK_CORE);
+    xTaskCreatePinnedToCore(feature_task, "feature_task", 6144, NULL, FEATURE_TASK_PRIO, &feature_task_handle, FEATURE_TASK_CORE); //FFT work off the acquisition core
 
     serialCommand.setDefaultHandler(unrecognized);                 //
     serialCommand.addCommand("nop", nopCommand);                   // No operation (does nothing)
@@ -841,6 +3052,27 @@ Default log verbosity
     serialCommand.addCommand("base64", base64ModeOnCommand);       // RDATA commands send base64 encoded data - default
     serialCommand.addCommand("hex", hexModeOnCommand);             // RDATA commands send hex encoded data
     serialCommand.addCommand("test", testCommand);                 // set to square wave enable ch 1 and 3
+    serialCommand.addCommand("filter", filterCommand);             // Notch (0/50/60 Hz) and high-pass (0.1 Hz units) filter, decimal args
+    serialCommand.addCommand("decimate", decimateCommand);         // Decimate the stream by an even ratio 2..64 (0 = off), decimal arg
+    serialCommand.addCommand("bandpower", bandpowerCommand);       // Band power frames: mode 0 off/1 only/2 with raw, frames per second
+    serialCommand.addCommand("stats", statsCommand);               // Channel stats: mode 0 off/1 only/2 with raw/3 report (default), window in ms
+    serialCommand.addCommand("leadoff", leadoffCommand);           // Lead-off change events on/off, drop status word from samples on/off
+    serialCommand.addCommand("trace", traceCommand);               // Latency trace: 0 off, 1 on, 2 report (default), 3 dump records
+    serialCommand.addCommand("heartbeat", heartbeatCommand);       // Health frame period in seconds while streaming, 0 = off
+    serialCommand.addCommand("pipeline", pipelineCommand);         // 1 = acquisition and transmit on separate cores, 0 = single task
+    serialCommand.addCommand("quantize", quantizeCommand);         // 16 bit samples on/off, shift 0..8, no shift = adaptive
+    serialCommand.addCommand("artifacts", artifactsCommand);       // Rail/step/lead-off flags in the sample frames on/off, step in codes (0 = no step flags)
+    serialCommand.addCommand("montage", montageCommand);           // Re-referencing: 0 off/1 average [chans]/2 bipolar [pairs]/3 term out in weight [shift]/4 report
+    serialCommand.addCommand("link", linkCommand);                 // rdatac with a stream over 90% of the UART: 0 start anyway/1 refuse (default)/2 shrink it
+    serialCommand.addCommand("burst", burstCommand);               // Capture N samples into RAM at full rate, then drain them; no N reports the capacity
+    serialCommand.addCommand("drain", drainCommand);               // Send the last capture again, optionally from record N on
+    serialCommand.addCommand("impedance", impedanceCommand);       // Electrode impedance via AC lead-off, current 0..3, side 0 P/1 N; about 1 s
+    serialCommand.addCommand("trigger", triggerCommand);           // Triggered capture on next rdatac: source 0 off/1 GPIO/2 threshold, channel 1..8
+    serialCommand.addCommand("trigwin", triggerWindowCommand);     // Samples sent before and from the trigger on, decimal
+    serialCommand.addCommand("triglevel", triggerLevelCommand);    // Threshold trigger level in codes, decimal
+    serialCommand.addCommand("marker", markerCommand);             // Event marker 0..255 into the stream, stamped with the current sample
+    serialCommand.addCommand("profile", profileCommand);           // save|load|delete|autostart <name>, noautostart: register set and settings in NVS
+    serialCommand.addCommand("bench", benchCommand);               // Synthetic stream: rate in SPS (max 50000), pattern 0 counter/1 PRNG; sdatac stops
     serialCommand.addCommand("help", helpCommand);                 // Print list of commands
     serialCommand.clearBuffer();
 
@@ -867,9 +3099,33 @@ Default log verbosity
     jsonCommand.addCommand("rdata", rdataCommand);               // Read one sample of data from each active channel
     jsonCommand.addCommand("rreg", readRegisterCommandDirect);   // Read ADS129x register, argument in hex, print contents in hex
     jsonCommand.addCommand("wreg", writeRegisterCommandDirect);  // Write ADS129x register, arguments in hex
+    jsonCommand.addCommand("filter", filterCommandDirect);       // Notch (0/50/60 Hz) and high-pass (0.1 Hz units) filter
+    jsonCommand.addCommand("decimate", decimateCommandDirect);   // Decimate the stream by an even ratio 2..64 (0 = off)
+    jsonCommand.addCommand("bandpower", bandpowerCommandDirect); // Band power frames: mode 0 off/1 only/2 with raw, frames per second
+    jsonCommand.addCommand("stats", statsCommandDirect);         // Channel stats: mode 0 off/1 only/2 with raw/3 (or none) report, window in 0.1 s (0 = 1 s)
+    jsonCommand.addCommand("leadoff", leadoffCommandDirect);     // Lead-off change events on/off, drop status word from samples on/off
+    jsonCommand.addCommand("trace", traceCommandDirect);         // Latency trace: 0 off, 1 on, 2 (or none) report, 3 dump records
+    jsonCommand.addCommand("heartbeat", heartbeatCommandDirect); // Health frame period in seconds while streaming, 0 = off
+    jsonCommand.addCommand("pipeline", pipelineCommandDirect);   // 1 = acquisition and transmit on separate cores, 0 = single task
+    jsonCommand.addCommand("quantize", quantizeCommandDirect);   // 16 bit samples on/off, shift 0..8, no shift or 255 = adaptive
+    jsonCommand.addCommand("artifacts", artifactsCommandDirect); // Rail/step/lead-off flags in the sample frames on/off, step in units of 65536 codes
+    jsonCommand.addCommand("montage", montageCommandDirect);     // Re-referencing: 0 off/1 average/2 bipolar chain/4 report, channel mask (0 = active)
+    jsonCommand.addCommand("link", linkCommandDirect);           // rdatac with a stream over 90% of the UART: 0 start anyway/1 refuse/2 shrink it
+    jsonCommand.addCommand("burst", burstCommandDirect);         // Capture N (high byte, low byte) samples into RAM, then drain; 0 reports the capacity
+    jsonCommand.addCommand("drain", drainCommandDirect);         // Send the last capture again from record N (high byte, low byte) on
+    jsonCommand.addCommand("impedance", impedanceCommandDirect); // Electrode impedance via AC lead-off, current 0..3, side 0 P/1 N; about 1 s
+    jsonCommand.addCommand("trigger", triggerCommandDirect);     // Triggered capture on next rdatac: source 0 off/1 GPIO/2 threshold, channel 1..8
+    jsonCommand.addCommand("trigwin", triggerWindowCommandDirect); // Samples before and from the trigger on, in units of 16
+    jsonCommand.addCommand("triglevel", triggerLevelCommandDirect); // Threshold trigger level, upper 16 bits (high byte, low byte)
+    jsonCommand.addCommand("marker", markerCommandDirect);       // Event marker 0..255 into the stream, stamped with the current sample
+    jsonCommand.addCommand("profile", profileCommandDirect);     // 0 save/1 load/2 delete/3 autostart/4 autostart off, profile number
+    jsonCommand.addCommand("bench", benchCommandDirect);         // Synthetic stream: rate in kSPS (max 50), pattern 0 counter/1 PRNG; sdatac stops
     jsonCommand.addCommand("help", helpCommand);                 // Print list of commands
     jsonCommand.clearBuffer();
-    xTaskCreatePinnedToCore(read_task, "read_task", 4096, NULL, 1, &read_task_handle, 1); //params?? prio 2 ??
+    setupCapture(); // after the processing tasks, takes what is left of the heap but CAPTURE_HEAP_RESERVE (which holds read_task's stack); before read_task, which takes burst commands
+    xTaskCreatePinnedToCore(read_task, "read_task", 4096, NULL, READ_TASK_PRIO, &read_task_handle, READ_TASK_CORE); //params?? prio 2 ??
+    autostart();
+    boot_ready_us = esp_timer_get_time();
     /*while (1) //main loop
     {
         switch (protocol_mode)
@@ -885,6 +3141,6 @@ Default log verbosity
             // do nothing
             ;
         }
-        vTaskDelay(10 / portTICK_PERIOD_MS); //UART input gets handled every 10 ms ...
+        uart_wait_rx(10); //UART input gets handled as it arrives, markers are stamped then
     }*/
 }